@@ -108,6 +108,31 @@ int main(int argc, char** argv)
                                 }
                 }
 
+                if (!strcmp(argv[i], "--floppysize")) {
+                        // Round up to whole sectors, so it can also be used as a raw disk
+                        vm.floppy_size = atoi(argv[i+1]);
+                        vm.floppy_size = (vm.floppy_size + 511) / 512 * 512;
+                        if (vm.debug_level >= 3) {
+                                cerr << "NOTICE: Floppy I/O image size: " << vm.floppy_size << endl;
+                        }
+                }
+
+                if (!strcmp(argv[i], "--serial")) {
+                        vm.serial = true;
+                }
+
+                // Run against a scripted hypervisor instead of VirtualBox (See MockDriver)
+                if (!strcmp(argv[i], "--mock")) {
+                        MockDriver *mock = new MockDriver();
+                        if (!mock->load(argv[i+1])) {
+                                cerr << "ERROR: Aborting!" << endl;
+                                return 1;
+                        }
+                        delete vm.driver;
+                        vm.driver = mock;
+                        cerr << "NOTICE: Using the mock hypervisor of " << argv[i+1] << endl;
+                }
+
                 if (!strcmp(argv[i], "--vmname")) {
                         vm.virtual_machine_name = argv[i+1];
                         if (vm.debug_level >= 3) {
@@ -139,10 +164,9 @@ int main(int argc, char** argv)
         #endif
     
         // First print the version of VirtualBox
-        string arg_list = " --version";
-        char version[BUFSIZE];
+        string version = vm.driver->version();
     
-        if (vbm_popen(arg_list, version, sizeof(version))) {
+        if (!version.empty()) {
                 cerr << "VirtualBox version: " << version << endl;
         }
 
@@ -253,6 +277,7 @@ int main(int argc, char** argv)
                 // Report progress to BOINC client
                 if (!status.suspended) {
                         vm.poll();
+                        vm.collect();
                         if (vm.suspended) {
                                 if (vm.debug_level >= 2) {
                                         cerr << "WARNING: VM should be running as the WU is not suspended" << endl;
@@ -41,36 +41,128 @@
 #include "floppyIO.h"
 #include <typeinfo>
 #include <string.h>
-
-// How much (microseconds) should we wait on the waitForSync loop.
-// Lower values increases throughput, but also increases CPU load. 
-// A value around 10,000 is usually OK.
-#define FPIO_TUNE_SLEEP    1000
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <linux/fs.h>
+#endif
 
 // FloppyIO Exception singleton
 static FloppyIOException   __FloppyIOExceptionSingleton;
 
 //
-// An I/O union structure for fpio_ctrlbyte
+// Holds a mutex for the lifetime of a scope
 //
-// This union helps accessing the fpio_ctrlbyte flags without the
-// need of memset.
+// The mutex is released on every way out, including the exceptions
+// raised by setError().
 //
-union fpio_ctlbyte_io {
-    fpio_ctlbyte flags;
-    char         byte;
+class FloppyIOLock {
+public:
+    FloppyIOLock(pthread_mutex_t * mutex) { this->mutex = mutex; pthread_mutex_lock(mutex); }
+    ~FloppyIOLock() { pthread_mutex_unlock(this->mutex); }
+private:
+    pthread_mutex_t * mutex;
 };
 
 //
-// An I/O union structure for the data-length prefix
+// CRC32C (Castagnoli polynomial, reflected)
 //
-// This union helps accessing the size int and it's 4-byte representation
-// without needing any memcpy.
+// The table-driven version is used everywhere; on x86 CPUs with SSE 4.2 the
+// crc32 instruction does the same job 8 bytes at a time. The table and the
+// CPU check are set up once, by the first caller of any thread.
 //
-union fpio_datalen_io {
-    int          size;
-    char         bytes[4];
-};
+static unsigned int fpio_crc32c_table[256];
+static bool         fpio_crc32c_hasHW = false;
+static pthread_once_t fpio_crc32c_once = PTHREAD_ONCE_INIT;
+
+static unsigned int fpio_crc32c_sw(unsigned int crc, const unsigned char * p, size_t len) {
+    while (len--) crc = fpio_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FPIO_CRC32C_HW
+__attribute__((target("sse4.2")))
+static unsigned int fpio_crc32c_hw(unsigned int crc, const unsigned char * p, size_t len) {
+#ifdef __x86_64__
+    unsigned long long crc64 = crc, v;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+    }
+    crc = (unsigned int)crc64;
+#endif
+    unsigned int w;
+    for (; len >= 4; len -= 4, p += 4) {
+        memcpy(&w, p, 4);
+        crc = __builtin_ia32_crc32si(crc, w);
+    }
+    while (len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static void fpio_crc32c_init() {
+    for (unsigned int i=0; i<256; i++) {
+        unsigned int c = i;
+        for (int j=0; j<8; j++) c = (c & 1) ? ((c >> 1) ^ 0x82F63B78) : (c >> 1);
+        fpio_crc32c_table[i] = c;
+    }
+#ifdef FPIO_CRC32C_HW
+    fpio_crc32c_hasHW = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+unsigned int fpio_crc32c(unsigned int crc, const void * data, size_t dataLen) {
+    pthread_once(&fpio_crc32c_once, fpio_crc32c_init);
+#ifdef FPIO_CRC32C_HW
+    if (fpio_crc32c_hasHW) return ~fpio_crc32c_hw(~crc, (const unsigned char *)data, dataLen);
+#endif
+    return ~fpio_crc32c_sw(~crc, (const unsigned char *)data, dataLen);
+}
+
+//
+// The control byte a receiver answers with when a block failed its
+// checksum (FPIO_CHECKSUM): no data present, only bAborted set.
+//
+static char fpio_nak() {
+    fpio_ctlbyte_io cB; cB.byte = 0;
+    cB.flags.bAborted = 1;
+    return cB.byte;
+}
+
+// Current time in microseconds
+static long long fpio_time_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#ifdef __linux__
+// Watch a file for modifications (inotify)
+// @return  The (non-blocking) notification descriptor, or -1
+static int fpio_watch(const char * filename) {
+    int fd = inotify_init();
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (inotify_add_watch(fd, filename, IN_MODIFY) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
 
 // Advanced Floppy file constructor
 // 
@@ -82,76 +174,135 @@ union fpio_datalen_io {
 //                  data are read/written from the guest.
 // FPIO_EXCEPTIONS     Throw exceptions if something goes wrong.
 // FPIO_CLIENT         Swap in/out buffers for use from within the guest.
+// FPIO_MMAP           Map the image in memory instead of using a file stream.
+// FPIO_RING           Stream through a ring of blocks (see sendRing).
+// FPIO_HEADER         Describe the layout with a geometry header (see writeHeader).
+// FPIO_COMPRESS       Compress the stream transfers (see readBlock).
+// FPIO_CHECKSUM       Protect the blocks with a CRC32C (see fpio_crc32c).
+// FPIO_DIRECT         Bypass the page cache (see directRead).
+// FPIO_ADAPTIVE       Acknowledgement timeout from the measured RTT (see waitForAck).
 // 
-// @param filename  The filename of the floppy disk image
-// @param flags     The flags that define how the FloppyIO class should function
+// Images that already carry a geometry header are always opened with the
+// size, topology and framing that the header describes.
+//
+// @param filename      The filename of the floppy disk image
+// @param flags         The flags that define how the FloppyIO class should function
+// @param floppySize    The size of a new image (0 for DEFAULT_FIO_FLOPPY_SIZE)
 //
 
-FloppyIO::FloppyIO(const char * filename, int flags) {
+FloppyIO::FloppyIO(const char * filename, int flags, int floppySize) {
+  // The locks come first, setError() needs them
+  // (Recursive: the public functions call each other)
+  pthread_mutexattr_t lockAttr;
+  pthread_mutexattr_init(&lockAttr);
+  pthread_mutexattr_settype(&lockAttr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&this->sendLock, &lockAttr);
+  pthread_mutex_init(&this->recvLock, &lockAttr);
+  pthread_mutex_init(&this->stateLock, &lockAttr);
+  pthread_mutexattr_destroy(&lockAttr);
+
   // Clear error flag
   this->error = 0;
-  
-  // Prepare open flags and create file stream
-  ios_base::openmode fOpenFlags = fstream::in | fstream::out;
-  if ((flags & FPIO_NOCREATE) == 0) fOpenFlags |= fstream::trunc;
-  if ((flags & FPIO_BINARY) != 0)  fOpenFlags |= fstream::binary;
-  fstream *fIO = new fstream( );
-  this->fIO = fIO;
-  
-  // Enable exceptions on fIO if told so
-  if ((flags & FPIO_EXCEPTIONS) != 0) {
-    fIO->exceptions( ifstream::failbit | ifstream::badbit );
-    this->useExceptions=true;
-  } else {
-    this->useExceptions=false;
-  }
-  
-  // Try to open the file
-  fIO->open(filename, fOpenFlags);
-  this->openName = new char[strlen(filename)];
-  strcpy(this->openName, filename);
-  this->openFlags = fOpenFlags;
+  this->fIO = NULL;
+  this->fIn = NULL;
+  this->streamBuffer = NULL;
+  this->mapBase = NULL;
+  this->mapFd = -1;
+  this->dirtyBegin = 0;
+  this->dirtyEnd = 0;
+  this->notifyFd = -1;
+  this->notifyFdIn = -1;
+  this->ofsInputArea = 0;     // No direction until the topology is known
+  this->szInputArea = 0;
+  this->ofsCtrlByteIn = -1;
+  this->direct = ((flags & FPIO_DIRECT) != 0);
+  this->directAligned = false;
+  this->directBlockDev = false;
+  this->directBuffer = NULL;
+  this->szDirectBuffer = 0;
+  this->sendBuffer = NULL;
+  this->recvBuffer = NULL;
+  this->zSendBuffer = NULL;
+  this->zRecvBuffer = NULL;
+  this->zPending = 0;
+  this->zRatio = 1;
+  this->zEof = false;
+  this->batchBuffer = NULL;
+  this->batchLen = 0;
+  this->batchStart = 0;
+  this->batchDelay = DEFAULT_FIO_BATCH_DELAY;
+  this->recordsSent = 0;
+  this->batchesSent = 0;
+  this->recordBuffer = NULL;
+  this->recordOfs = 0;
+  this->recordLen = 0;
+  this->posted = false;
+  this->canceled = false;
+  memset(&this->syncStats, 0, sizeof(this->syncStats));
+  memset(&this->rttStats, 0, sizeof(this->rttStats));
+  this->adaptiveTimeout = ((flags & FPIO_ADAPTIVE) != 0);
+  this->rttStats.rto = FPIO_RTT_MIN_TIMEOUT;  // As TCP, until the first sample
+  memset(&this->zSendStats, 0, sizeof(this->zSendStats));
+  memset(&this->zRecvStats, 0, sizeof(this->zRecvStats));
 
-  // Check for errors while FPIO_NOCREATE is there
-  if ((flags & FPIO_NOCREATE) != 0) {
-      if ( fIO->fail() ) {
-          
-          // Clear error flags
-          fIO->clear();
-          
-          // Try to create file
-          fOpenFlags |= fstream::trunc;
-          fIO->open(filename, fOpenFlags);
-          this->openFlags = fOpenFlags;
-          
-          // Still errors?
-          if ( fIO->fail() ) {
-            this->setError(-3, "Error while creating floppy I/O file, because it wasn't found even though FPIO_NOCREATE was specified!"); 
-            return;
-          }
-          
-          // Managed to open it? Reset it...
-          flags &= ~FPIO_NOINIT;
-      }
-          
+  // Prepare floppy info
+  this->szFloppy = DEFAULT_FIO_FLOPPY_SIZE;
+  if (floppySize > 0) this->szFloppy = floppySize;
+  this->useExceptions = ((flags & FPIO_EXCEPTIONS) != 0);
+  this->client = ((flags & FPIO_CLIENT) != 0);
+  this->header = ((flags & FPIO_HEADER) != 0);
+  this->compress = ((flags & FPIO_COMPRESS) != 0);
+  this->zLevel = DEFAULT_FIO_ZLEVEL;
+  this->checksum = ((flags & FPIO_CHECKSUM) != 0);
+  this->checksumErrors = 0;
+  this->retransmits = 0;
+  this->binary = this->compress || this->checksum || ((flags & FPIO_BINARY) != 0);
+  this->ring = ((flags & FPIO_RING) != 0);
+  this->ringBlocks = DEFAULT_FIO_RING_BLOCKS;
+
+  // Open the image using the appropriate backend
+  int res;
+  if ((flags & (FPIO_MMAP | FPIO_DIRECT)) != 0) {
+    res = this->openMapped(filename, flags);
   } else {
+    res = this->openStream(filename, flags);
+  }
+  if (res < 0) return;
 
-      // Check for failures on open
-      if ( fIO->fail() ) {
-        this->setError(-3, "Error while creating floppy I/O file!");         
-        return;
-      }
+  // Managed to create it? Reset it...
+  if (res > 0) flags &= ~FPIO_NOINIT;
 
+  // Using an existing image? Its header (if any) defines the topology
+  bool bHeaderFound = false;
+  if ((flags & FPIO_NOINIT) != 0) {
+    res = this->readHeader();
+    if (res < 0) return;
+    bHeaderFound = (res > 0);
   }
-  
-  // Prepare floppy info
-  this->szFloppy = DEFAULT_FIO_FLOPPY_SIZE;
 
-  // Disable buffers
-  this->fIO->rdbuf()->pubsetbuf(0,0);
+  // Now that the size is known, map the image
+  if (this->direct) {
+    if (this->directImage() < 0) return;
+  } else if ((flags & FPIO_MMAP) != 0) {
+    if (this->mapImage() < 0) return;
+  }
   
   // Setup offsets and sizes of the I/O parts
-  if ((flags & FPIO_CLIENT) != 0) {
+  if (bHeaderFound) {
+    // Already set-up by readHeader
+    
+  } else if (this->header) {
+    // Self-describing layout: one sector for the header, then the two areas
+    // sector-aligned, each one starting with its control byte.
+    int szArea = (this->szFloppy - FPIO_SECTOR_SIZE) / 2;
+    szArea -= szArea % FPIO_SECTOR_SIZE;
+    if (szArea < FPIO_SECTOR_SIZE) {
+      this->setError(FPIO_ERR_HEADER, "Floppy I/O size too small for a geometry header!");
+      return;
+    }
+    this->setTopology(FPIO_SECTOR_SIZE, szArea, FPIO_SECTOR_SIZE + szArea, szArea);
+    
+  } else if (this->client) {
     // Guest mode
     this->szOutput = this->szFloppy/2-1;
     this->szInput = this->szOutput;
@@ -160,7 +311,11 @@ FloppyIO::FloppyIO(const char * filename, int flags) {
     this->ofsCtrlByteIn = this->szInput+this->szOutput+1;
     this->ofsCtrlByteOut = 0;
 
-    cerr << "FPIO Started in client mode\n";
+    // Keep the whole areas for the ring layout
+    this->ofsInputArea = this->ofsInput;
+    this->szInputArea = this->szInput;
+    this->ofsOutputArea = this->ofsOutput;
+    this->szOutputArea = this->szOutput;
     
   } else {
     // Hypervisor mode
@@ -171,50 +326,615 @@ FloppyIO::FloppyIO(const char * filename, int flags) {
     this->ofsCtrlByteOut = this->szInput+this->szOutput+1;
     this->ofsCtrlByteIn = 0;
 
+    // Keep the whole areas for the ring layout
+    this->ofsInputArea = this->ofsInput;
+    this->szInputArea = this->szInput;
+    this->ofsOutputArea = this->ofsOutput;
+    this->szOutputArea = this->szOutput;
+  }
+
+  if (this->client) {
+    cerr << "FPIO Started in client mode\n";
+  } else {
     cerr << "FPIO Started in hypervisor mode\n";
   }
-    
+
   // Update synchronization flags
   this->synchronized = false;
   this->syncTimeout = DEFAULT_FIO_SYNC_TIMEOUT;
+  this->syncMaxSleep = DEFAULT_FIO_SYNC_MAXSLEEP;
   if ((flags & FPIO_SYNCHRONIZED) != 0) this->synchronized=true;
 
+#ifdef __linux__
+  // Get notified when the image is modified, so we don't need to poll
+  // (Writes through a memory map do not notify, the back-off covers them)
+  if (this->synchronized) {
+    this->notifyFd = fpio_watch(this->openName);
+    this->notifyFdIn = fpio_watch(this->openName);
+  }
+#endif
+
   // Update binary flags
-  this->binary = false;
-  if ((flags & FPIO_BINARY) != 0) {
+  if (this->binary) {
 
     // Reduce the I/O buffers by 4 bytes (used by the data-length prefix)
     this->szInput -= 3;
     this->szOutput -= 3; // 3 = 4 bytes - 1 null-termination (not used in binary mode)
 
-    // Enable binary transfers
-    this->binary=true;
+    // And by 4 more for the checksum
+    if (this->checksum) {
+      this->szInput -= 4;
+      this->szOutput -= 4;
+    }
     
   }
   
+  // Allocate the I/O buffers once, so the transfers don't need to
+  this->sendBuffer = new char[this->szOutputArea];
+  this->recvBuffer = new char[this->szInputArea];
+
+  // The compression staging buffers are allocated on first use
+  this->zCapacity = FPIO_ZMAX_RATIO * 
+    ((this->szInputArea > this->szOutputArea) ? this->szInputArea : this->szOutputArea);
+  
   // Reset floppy file
   if ((flags & FPIO_NOINIT) == 0) this->reset();
 
 }
 
+//
+// Update the topology from the hypervisor-to-guest and guest-to-hypervisor
+// areas of the self-describing layout. Each area starts with its control
+// byte, followed by the data buffer.
+//
+// @param ofsH2G    Offset of the hypervisor-to-guest area
+// @param szH2G     Size of the hypervisor-to-guest area
+// @param ofsG2H    Offset of the guest-to-hypervisor area
+// @param szG2H     Size of the guest-to-hypervisor area
+//
+void FloppyIO::setTopology(int ofsH2G, int szH2G, int ofsG2H, int szG2H) {
+    if (this->client) {
+        this->ofsInputArea = ofsH2G;    this->szInputArea = szH2G;
+        this->ofsOutputArea = ofsG2H;   this->szOutputArea = szG2H;
+    } else {
+        this->ofsInputArea = ofsG2H;    this->szInputArea = szG2H;
+        this->ofsOutputArea = ofsH2G;   this->szOutputArea = szH2G;
+    }
+    this->ofsCtrlByteIn = this->ofsInputArea;
+    this->ofsInput = this->ofsInputArea + 1;
+    this->szInput = this->szInputArea - 1;
+    this->ofsCtrlByteOut = this->ofsOutputArea;
+    this->ofsOutput = this->ofsOutputArea + 1;
+    this->szOutput = this->szOutputArea - 1;
+}
+
+//
+// Helpers to (de)serialize the little-endian header fields
+//
+static void fpio_put32(char * buffer, unsigned int value) {
+    buffer[0] = value & 0xFF;           buffer[1] = (value >> 8) & 0xFF;
+    buffer[2] = (value >> 16) & 0xFF;   buffer[3] = (value >> 24) & 0xFF;
+}
+static unsigned int fpio_get32(const char * buffer) {
+    const unsigned char * b = (const unsigned char *)buffer;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
+
+//
+// Geometry header
+//
+// Written at offset 0 by the hypervisor when FPIO_HEADER is used, and looked
+// up by both ends when they open an existing image. All numbers are 32-bit
+// little-endian:
+//
+// +--------+--------------------------------------------------------+
+// |  0x00  |  Magic "FPIO"                                          |
+// |  0x04  |  Protocol version (1 byte)                             |
+// |  0x05  |  Framing flags, FPIO_FRAMING_* (1 byte)                |
+// |  0x06  |  Ring blocks per direction (1 byte)                    |
+// |  0x07  |  Reserved (1 byte)                                     |
+// |  0x08  |  Total size of the medium                              |
+// |  0x0C  |  Hypervisor -> Guest area offset                       |
+// |  0x10  |  Hypervisor -> Guest area size                         |
+// |  0x14  |  Guest -> Hypervisor area offset                       |
+// |  0x18  |  Guest -> Hypervisor area size                         |
+// +--------+--------------------------------------------------------+
+//
+// Each area starts with its control byte, followed by the data buffer.
+//
+
+//
+// Write the geometry header at the beginning of the image
+//
+void FloppyIO::writeHeader() {
+    char hdr[FPIO_HEADER_SIZE];
+    int ofsH2G = this->client ? this->ofsInputArea : this->ofsOutputArea;
+    int szH2G = this->client ? this->szInputArea : this->szOutputArea;
+    int ofsG2H = this->client ? this->ofsOutputArea : this->ofsInputArea;
+    int szG2H = this->client ? this->szOutputArea : this->szInputArea;
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, FPIO_HEADER_MAGIC, 4);
+    hdr[4] = FPIO_PROTOCOL_VERSION;
+    hdr[5] = (this->binary ? FPIO_FRAMING_BINARY : 0) | (this->ring ? FPIO_FRAMING_RING : 0) |
+             (this->compress ? FPIO_FRAMING_ZLIB : 0) | (this->checksum ? FPIO_FRAMING_CRC : 0);
+    hdr[6] = this->ringBlocks;
+    fpio_put32(hdr + 0x08, this->szFloppy);
+    fpio_put32(hdr + 0x0C, ofsH2G);
+    fpio_put32(hdr + 0x10, szH2G);
+    fpio_put32(hdr + 0x14, ofsG2H);
+    fpio_put32(hdr + 0x18, szG2H);
+
+    this->ioWrite(0, hdr, sizeof(hdr));
+}
+
+//
+// Look for a geometry header at the beginning of the image and, if there
+// is one, take the size, topology and framing from it.
+//
+// @return  1 if a header was found, 0 if not, or an error code
+//
+int FloppyIO::readHeader() {
+    char hdr[FPIO_HEADER_SIZE];
+    struct stat st;
+
+    // Nothing to read on empty files
+    if ((stat(this->openName, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size < FPIO_HEADER_SIZE))
+        return 0;
+
+    // Read and check the magic
+    this->ioRead(0, hdr, sizeof(hdr));
+    if ((this->fIO != NULL) && this->fIO->fail()) {
+        this->fIO->clear();
+        return 0;
+    }
+    if (memcmp(hdr, FPIO_HEADER_MAGIC, 4) != 0) return 0;
+
+    // Validate
+    int szTotal = fpio_get32(hdr + 0x08);
+    int ofsH2G = fpio_get32(hdr + 0x0C), szH2G = fpio_get32(hdr + 0x10);
+    int ofsG2H = fpio_get32(hdr + 0x14), szG2H = fpio_get32(hdr + 0x18);
+    if (((unsigned char)hdr[4] > FPIO_PROTOCOL_VERSION) || (szTotal < FPIO_HEADER_SIZE) ||
+        (szH2G < 2) || (szG2H < 2) || (ofsH2G < FPIO_HEADER_SIZE) || (ofsG2H < FPIO_HEADER_SIZE) ||
+        (ofsH2G + szH2G > szTotal) || (ofsG2H + szG2H > szTotal))
+        return this->setError(FPIO_ERR_HEADER, "Invalid floppy I/O geometry header!");
+
+    // Take the geometry from the header
+    this->header = true;
+    this->szFloppy = szTotal;
+    this->binary = ((hdr[5] & FPIO_FRAMING_BINARY) != 0);
+    this->ring = ((hdr[5] & FPIO_FRAMING_RING) != 0);
+    this->compress = ((hdr[5] & FPIO_FRAMING_ZLIB) != 0);
+    this->checksum = ((hdr[5] & FPIO_FRAMING_CRC) != 0);
+    if (hdr[6] > 0) this->ringBlocks = (unsigned char)hdr[6];
+    this->setTopology(ofsH2G, szH2G, ofsG2H, szG2H);
+
+    cerr << "Found geometry header. Size: " << szTotal << "\n";
+    return 1;
+}
 
 // FloppyIO Destructor
 // Closes the file descriptor and releases used memory
 
 FloppyIO::~FloppyIO() {
+    // Don't lose the records still waiting (Never throw from here)
+    if ((this->batchLen > 0) && !this->useExceptions && this->ready()) this->flushRecords();
+
+    // Unmap image
+    if (this->mapBase != NULL) {
+        this->flush();
+        munmap(this->mapBase, this->szFloppy);
+    }
+    if (this->mapFd >= 0) close(this->mapFd);
+    if (this->notifyFd >= 0) close(this->notifyFd);
+    if (this->notifyFdIn >= 0) close(this->notifyFdIn);
+    free(this->directBuffer);
+
+    // Release buffers
+    delete[] this->sendBuffer;
+    delete[] this->recvBuffer;
+    delete[] this->zSendBuffer;
+    delete[] this->zRecvBuffer;
+    delete[] this->batchBuffer;
+    delete[] this->recordBuffer;
+
     // Close file
-    this->fIO->close();
+    if (this->fIO != NULL) {
+        this->fIO->close();
     
-    // Release memory
-    delete this->fIO;
+        // Release memory
+        delete this->fIO;
+    }
+    if (this->fIn != NULL) {
+        this->fIn->close();
+        delete this->fIn;
+    }
+    delete[] this->streamBuffer;
+
+    pthread_mutex_destroy(&this->sendLock);
+    pthread_mutex_destroy(&this->recvLock);
+    pthread_mutex_destroy(&this->stateLock);
 }
 
 // Hard-flush.
-// This function closes and opens the file
-void FloppyIO::flush() {
-    this->fIO->flush();
-    this->fIO->close();
-    this->fIO->open(this->openName, this->openFlags);
+// This function closes and opens the file stream of one direction (The
+// stream keeps its buffer, so nothing is allocated). On the memory-mapped
+// backend only the range written since the last flush is synced.
+//
+// @param bInput    Flush the input direction instead of the output one
+//
+void FloppyIO::flush(bool bInput) {
+    if (this->mapBase != NULL) {
+        int ofsBegin, ofsEnd;
+        {
+            FloppyIOLock lock(&this->stateLock);
+            ofsBegin = this->dirtyBegin;
+            ofsEnd = this->dirtyEnd;
+            this->dirtyBegin = this->dirtyEnd = 0;
+        }
+        if (ofsEnd <= ofsBegin) return;
+
+        // msync() needs a page-aligned start address
+        long szPage = sysconf(_SC_PAGESIZE);
+        int ofsStart = ofsBegin - (ofsBegin % szPage);
+        msync(this->mapBase + ofsStart, ofsEnd - ofsStart, MS_ASYNC);
+        return;
+    }
+
+    // Direct I/O: O_DIRECT writes are already on the medium
+    // (Mac OS X has no fdatasync, nor O_DIRECT)
+    if (this->direct) {
+#ifdef __APPLE__
+        if (!this->directAligned) fsync(this->mapFd);
+#else
+        if (!this->directAligned) fdatasync(this->mapFd);
+#endif
+        return;
+    }
+
+    fstream * fStream = (bInput && (this->fIn != NULL)) ? this->fIn : this->fIO;
+    fStream->flush();
+    fStream->close();
+    fStream->open(this->openName, this->openFlags);
+}
+
+// Open the floppy image as a file stream (default backend).
+//
+// @param filename  The filename of the floppy disk image
+// @param flags     The flags passed to the constructor
+// @return          1 if the file was created, 0 if it existed, or an error code.
+//
+int FloppyIO::openStream(const char * filename, int flags) {
+  int created = 0;
+
+  // Prepare open flags and create file stream
+  ios_base::openmode fOpenFlags = fstream::in | fstream::out;
+  if ((flags & FPIO_NOCREATE) == 0) fOpenFlags |= fstream::trunc;
+  if ((flags & FPIO_BINARY) != 0)  fOpenFlags |= fstream::binary;
+  fstream *fIO = new fstream( );
+  this->fIO = fIO;
+
+  // Give both streams buffers of our own before they are opened: they
+  // survive the close() and open() of flush()
+  this->streamBuffer = new char[2 * FPIO_STREAM_BUFFER];
+  fIO->rdbuf()->pubsetbuf(this->streamBuffer, FPIO_STREAM_BUFFER);
+  
+  // Enable exceptions on fIO if told so
+  if (this->useExceptions) {
+    fIO->exceptions( ifstream::failbit | ifstream::badbit );
+  }
+  
+  // Try to open the file
+  fIO->open(filename, fOpenFlags);
+  this->openName = new char[strlen(filename)+1];
+  strcpy(this->openName, filename);
+  this->openFlags = fOpenFlags;
+
+  // Check for errors while FPIO_NOCREATE is there
+  if ((flags & FPIO_NOCREATE) != 0) {
+      if ( fIO->fail() ) {
+          
+          // Clear error flags
+          fIO->clear();
+          
+          // Try to create file
+          fOpenFlags |= fstream::trunc;
+          fIO->open(filename, fOpenFlags);
+          this->openFlags = fOpenFlags;
+          
+          // Still errors?
+          if ( fIO->fail() ) {
+            return this->setError(-3, "Error while creating floppy I/O file, because it wasn't found even though FPIO_NOCREATE was specified!"); 
+          }
+          
+          // Managed to open it? Reset it...
+          created = 1;
+      }
+          
+  } else {
+
+      // Check for failures on open
+      if ( fIO->fail() ) {
+        return this->setError(-3, "Error while creating floppy I/O file!");         
+      }
+
+  }
+
+  // Re-opening on flush() must never truncate the image
+  this->openFlags &= ~fstream::trunc;
+
+  // The input direction gets a stream (and a file position) of its own
+  this->fIn = new fstream( );
+  if (this->useExceptions) {
+    this->fIn->exceptions( ifstream::failbit | ifstream::badbit );
+  }
+  this->fIn->rdbuf()->pubsetbuf(this->streamBuffer + FPIO_STREAM_BUFFER, FPIO_STREAM_BUFFER);
+  this->fIn->open(filename, this->openFlags);
+  if ( this->fIn->fail() ) {
+    return this->setError(-3, "Error while opening floppy I/O file for input!");
+  }
+
+  return created;
+}
+
+// Open the floppy image for the FPIO_MMAP backend.
+// The file is created if needed. It is mapped later, by mapImage().
+//
+// @param filename  The filename of the floppy disk image
+// @param flags     The flags passed to the constructor
+// @return          1 if the file was created, 0 if it existed, or an error code.
+//
+int FloppyIO::openMapped(const char * filename, int flags) {
+    int created = 0;
+    int openFlags = O_RDWR;
+
+    this->openName = new char[strlen(filename)+1];
+    strcpy(this->openName, filename);
+
+#ifdef O_DIRECT
+    // Bypass the page cache if the filesystem allows it
+    if (this->direct) {
+        openFlags |= O_DIRECT;
+        this->directAligned = true;
+    }
+#endif
+
+    // Open the file, creating it if it's missing or FPIO_NOCREATE is not there
+    if ((flags & FPIO_NOCREATE) != 0) {
+        this->mapFd = open(filename, openFlags);
+        if ((this->mapFd < 0) && (errno == EINVAL) && this->directAligned) {
+            // O_DIRECT is refused by this filesystem (ex. tmpfs)
+            this->directAligned = false;
+            this->mapFd = open(filename, O_RDWR);
+        }
+        if (this->mapFd < 0) {
+            this->mapFd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (this->mapFd < 0)
+                return this->setError(-3, "Error while creating floppy I/O file, because it wasn't found even though FPIO_NOCREATE was specified!");
+            created = 1;
+        }
+    } else {
+        this->mapFd = open(filename, openFlags | O_CREAT | O_TRUNC, 0644);
+        if ((this->mapFd < 0) && (errno == EINVAL) && this->directAligned) {
+            this->directAligned = false;
+            this->mapFd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        if (this->mapFd < 0) return this->setError(-3, "Error while creating floppy I/O file!");
+        created = 1;
+    }
+
+    // The first sector is enough to look for a geometry header
+    if (this->direct) {
+        struct stat st;
+        if ((fstat(this->mapFd, &st) == 0) && S_ISBLK(st.st_mode)) this->directBlockDev = true;
+        if (posix_memalign((void **)&this->directBuffer, FPIO_SECTOR_SIZE, FPIO_SECTOR_SIZE) != 0)
+            return this->setError(-3, "Unable to allocate the direct I/O buffer!");
+        this->szDirectBuffer = FPIO_SECTOR_SIZE;
+        cerr << "Direct I/O " << (this->directAligned ? "with O_DIRECT\n" : "by dropping cached pages\n");
+    }
+
+    return created;
+}
+
+// Map the opened image (FPIO_MMAP backend).
+// The file is resized to the floppy size if needed.
+//
+// @return          0 if successful or an error code.
+//
+int FloppyIO::mapImage() {
+    struct stat st;
+
+    // Make sure the whole image is backed by the file
+    if (fstat(this->mapFd, &st) < 0) return this->setError(-3, "Unable to stat floppy I/O file!");
+    if (S_ISREG(st.st_mode) && (st.st_size < this->szFloppy)) {
+        if (ftruncate(this->mapFd, this->szFloppy) < 0)
+            return this->setError(-3, "Unable to resize floppy I/O file!");
+    }
+
+    // Map it
+    void * ptr = mmap(NULL, this->szFloppy, PROT_READ | PROT_WRITE, MAP_SHARED, this->mapFd, 0);
+    if (ptr == MAP_FAILED) return this->setError(-3, "Unable to memory-map floppy I/O file!");
+    this->mapBase = (char *)ptr;
+
+    return 0;
+}
+
+//
+// Prepare the direct I/O backend once the image size is known: make sure
+// the whole image is backed by the file and grow the aligned buffer to
+// mirror all of it.
+//
+int FloppyIO::directImage() {
+    struct stat st;
+    if (fstat(this->mapFd, &st) < 0) return this->setError(-3, "Unable to stat floppy I/O file!");
+    if (S_ISREG(st.st_mode) && (st.st_size < this->szFloppy)) {
+        if (ftruncate(this->mapFd, this->szFloppy) < 0)
+            return this->setError(-3, "Unable to resize floppy I/O file!");
+    }
+
+    int szBuffer = (this->szFloppy + FPIO_SECTOR_SIZE - 1) / FPIO_SECTOR_SIZE * FPIO_SECTOR_SIZE;
+    if (szBuffer > this->szDirectBuffer) {
+        free(this->directBuffer);
+        this->directBuffer = NULL;
+        if (posix_memalign((void **)&this->directBuffer, FPIO_SECTOR_SIZE, szBuffer) != 0)
+            return this->setError(-3, "Unable to allocate the direct I/O buffer!");
+        this->szDirectBuffer = szBuffer;
+    }
+    return 0;
+}
+
+//
+// Drop the cached pages of the image, so the next read hits the medium.
+// Only needed when O_DIRECT is not in effect.
+//
+void FloppyIO::directInvalidate() {
+    if (this->directAligned) return;
+    FloppyIOLock lock(&this->stateLock);
+#ifdef BLKFLSBUF
+    if (this->directBlockDev) {
+        ioctl(this->mapFd, BLKFLSBUF, 0);
+        return;
+    }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(this->mapFd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+//
+// Read from the image with direct I/O
+//
+// With O_DIRECT the sectors covering the range are read in their place of
+// the aligned mirror, then copied out.
+//
+void FloppyIO::directRead(int offset, char * data, int dataLen) {
+    FloppyIOLock lock(&this->stateLock);   // The aligned mirror is shared by both directions
+    if (!this->directAligned) {
+        if (pread(this->mapFd, data, dataLen, offset) != dataLen) memset(data, 0, dataLen);
+        return;
+    }
+
+    int ofsStart = offset - (offset % FPIO_SECTOR_SIZE);
+    int ofsEnd = (offset + dataLen + FPIO_SECTOR_SIZE - 1) / FPIO_SECTOR_SIZE * FPIO_SECTOR_SIZE;
+    if (ofsEnd > this->szDirectBuffer) ofsEnd = this->szDirectBuffer;
+    if (pread(this->mapFd, this->directBuffer + ofsStart, ofsEnd - ofsStart, ofsStart) < offset + dataLen - ofsStart) {
+        memset(data, 0, dataLen);
+        return;
+    }
+    memcpy(data, this->directBuffer + offset, dataLen);
+}
+
+//
+// Write on the image with direct I/O
+//
+// With O_DIRECT the partially covered sectors at both ends of the range
+// are read first, so that whole sectors can be written back.
+//
+void FloppyIO::directWrite(int offset, const char * data, int dataLen) {
+    FloppyIOLock lock(&this->stateLock);   // The sectors we rewrite may hold the other direction
+    if (!this->directAligned) {
+        if (pwrite(this->mapFd, data, dataLen, offset) != dataLen)
+            this->setError(-1, "Unable to write on the floppy I/O file!");
+        return;
+    }
+
+    int ofsStart = offset - (offset % FPIO_SECTOR_SIZE);
+    int ofsEnd = (offset + dataLen + FPIO_SECTOR_SIZE - 1) / FPIO_SECTOR_SIZE * FPIO_SECTOR_SIZE;
+    int ofsTail = ofsEnd - FPIO_SECTOR_SIZE;
+    bool bHead = (ofsStart != offset);
+    bool bTail = (ofsEnd != offset + dataLen) && !(bHead && (ofsTail == ofsStart));
+    if ((bHead && (pread(this->mapFd, this->directBuffer + ofsStart, FPIO_SECTOR_SIZE, ofsStart) != FPIO_SECTOR_SIZE)) ||
+        (bTail && (pread(this->mapFd, this->directBuffer + ofsTail, FPIO_SECTOR_SIZE, ofsTail) != FPIO_SECTOR_SIZE))) {
+        // Writing the sectors back would overwrite their other bytes
+        this->setError(-1, "Unable to read the sectors around a write on the floppy I/O file!");
+        return;
+    }
+    memcpy(this->directBuffer + offset, data, dataLen);
+    if (pwrite(this->mapFd, this->directBuffer + ofsStart, ofsEnd - ofsStart, ofsStart) != ofsEnd - ofsStart)
+        this->setError(-1, "Unable to write on the floppy I/O file!");
+}
+
+// Check whether an offset belongs to the input direction
+// (The input area or its control byte)
+bool FloppyIO::isInput(int offset) {
+    if (offset == this->ofsCtrlByteIn) return true;
+    return (offset >= this->ofsInputArea) && (offset < this->ofsInputArea + this->szInputArea);
+}
+
+// The file stream of the direction an offset belongs to
+fstream * FloppyIO::ioStream(int offset) {
+    if ((this->fIn != NULL) && this->isInput(offset)) return this->fIn;
+    return this->fIO;
+}
+
+// Check the backend state
+bool FloppyIO::ioGood() {
+    if (this->mapBase != NULL) return true;
+    if (this->direct) return (this->mapFd >= 0);
+    if (this->fIO == NULL) return false;
+    if ((this->fIn != NULL) && !this->fIn->good()) return false;
+    return this->fIO->good();
+}
+
+// Read a block of data from the floppy image
+void FloppyIO::ioRead(int offset, char * data, int dataLen) {
+    if (this->mapBase != NULL) {
+        memcpy(data, this->mapBase + offset, dataLen);
+        return;
+    }
+    if (this->direct) {
+        this->directRead(offset, data, dataLen);
+        return;
+    }
+    if (this->fIO == NULL) {
+        // Not mapped yet
+        if (pread(this->mapFd, data, dataLen, offset) != dataLen) memset(data, 0, dataLen);
+        return;
+    }
+    fstream * fStream = this->ioStream(offset);
+    fStream->seekg(offset, ios_base::beg);
+    fStream->read(data, dataLen);
+}
+
+// Write a block of data on the floppy image
+void FloppyIO::ioWrite(int offset, const char * data, int dataLen) {
+    if (this->mapBase != NULL) {
+        // Previous writes (ex. data before control byte) must land first
+        __sync_synchronize();
+        memcpy(this->mapBase + offset, data, dataLen);
+
+        // Extend the dirty range
+        FloppyIOLock lock(&this->stateLock);
+        if (this->dirtyEnd <= this->dirtyBegin) {
+            this->dirtyBegin = offset;
+            this->dirtyEnd = offset + dataLen;
+        } else {
+            if (offset < this->dirtyBegin) this->dirtyBegin = offset;
+            if (offset + dataLen > this->dirtyEnd) this->dirtyEnd = offset + dataLen;
+        }
+        return;
+    }
+    if (this->direct) {
+        this->directWrite(offset, data, dataLen);
+        return;
+    }
+    fstream * fStream = this->ioStream(offset);
+    fStream->seekp(offset);
+    fStream->write(data, dataLen);
+}
+
+// Read a single (control) byte from the floppy image.
+// On the memory-mapped backend this is a plain volatile load.
+char FloppyIO::ioReadByte(int offset) {
+    char cByte = 0;
+    if (this->mapBase != NULL) {
+        cByte = *(volatile char *)(this->mapBase + offset);
+        __sync_synchronize();   // Data after the control byte must be read after it
+        return cByte;
+    }
+    if (this->direct) this->directInvalidate();
+    this->ioRead(offset, &cByte, 1);
+    return cByte;
 }
 
 
@@ -229,60 +949,118 @@ void FloppyIO::reset() {
   }
   
   // Reset to the beginnig of file and fill with zeroes
-  this->fIO->seekp(0);
   char * buffer = new char[this->szFloppy];
   memset(buffer, 0, this->szFloppy);
-  this->fIO->write(buffer, this->szFloppy);
+  this->ioWrite(0, buffer, this->szFloppy);
   delete[] buffer;      
+
+  // Describe the layout to the other end
+  if (this->header) this->writeHeader();
+  this->flush();
+  this->flush(true);
 }
 
 
 // Send data to the floppy image I/O
 //
+// This is a thin adapter over the buffer version. The string contents are
+// sent as they are, without any intermediate copy.
+//
 // @param strData   The string to send
 // @param ctrlByte  The extra parameters you want to write on the control byte
 // @return          The number of bytes sent if successful or -1 if an error occured.
 //
-// TODO: String is time-costly, add also the char*/size version
-//
-int FloppyIO::send(string strData, fpio_ctlbyte * ctrlByte) {
-
-    // Prepare send buffer
-    char * dataToSend = new char[this->szOutput];
-    memset(dataToSend, 0, this->szOutput);
+int FloppyIO::send(const string & strData, fpio_ctlbyte * ctrlByte) {
+    return this->send(strData.data(), strData.length(), ctrlByte);
+}
 
-    // Initialize variables
-    int szData = strData.length();
-    
-    // Copy the first szInput bytes
-    if (szData > this->szOutput-1) { // -1 for the null-termination
-        // Data more than the pad size? Trim...
-        strData.copy(dataToSend, this->szOutput-1, 0);
-        szData = this->szOutput-1;
-        
-    } else {
-        // Else, copy the string to send buffer
-        strData.copy(dataToSend, szData, 0);
-    }
+// Send data to the floppy image I/O using a memory buffer
+//
+// @param data      A pointer to the data buffer to send
+// @param dataLen   The size of the input buffer
+// @param ctrlByte  The extra parameters you want to write on the control byte
+// @return          The number of bytes sent if successful or -1 if an error occured.
+//
+int FloppyIO::send(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte) {
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = dataLen;
+    return this->sendv(&iov, 1, ctrlByte);
+}
 
-    // And send the data
-    this->send(dataToSend, szData, ctrlByte);
+// Send data to the floppy image I/O, gathering them from several buffers
+//
+// The data are written on the image straight from the caller's memory,
+// so no allocation or intermediate copy takes place.
+//
+// @param iov       The buffers to send, in order
+// @param iovcnt    The number of buffers
+// @param ctrlByte  The extra parameters you want to write on the control byte
+// @return          The number of bytes sent if successful or -1 if an error occured.
+//
+int FloppyIO::sendv(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte) {
+    return this->sendBlock(iov, iovcnt, ctrlByte, 0);
 }
 
-// Send data to the floppy image I/O using char buffer
+// Place a block without waiting for the remote end to read it
+//
+// Both ends of a synchronized image may then send at the same time
+// without waiting for each other. The block is only placed if the
+// remote end read the previous one (See writable). Blocks placed this
+// way are not sent again if the remote end rejects their checksum.
 //
 // @param data      A pointer to the data buffer to send
 // @param dataLen   The size of the input buffer
 // @param ctrlByte  The extra parameters you want to write on the control byte
+// @return          The number of bytes sent, FPIO_ERR_BUSY (without setting
+//                  the error) if the previous block is still there, or an error code
+//
+int FloppyIO::post(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte) {
+    FloppyIOLock lock(&this->sendLock);
+    struct iovec iov;
+
+    if (!this->writable()) return FPIO_ERR_BUSY;
+    iov.iov_base = (void *)data;
+    iov.iov_len = dataLen;
+    return this->sendBlock(&iov, 1, ctrlByte, 0, true);
+}
+
+//
+// Check whether the remote end read the last block we sent
+//
+// @return  TRUE if a new block can be placed right away
+//
+bool FloppyIO::writable() {
+    FloppyIOLock lock(&this->sendLock);
+    if (!this->ready()) return false;
+    return (this->ioReadByte(this->ofsCtrlByteOut) & 0x01) == 0;
+}
+
+// Send a block of data to the floppy image I/O
+//
+// @param iov       The buffers to send, in order
+// @param iovcnt    The number of buffers
+// @param ctrlByte  The extra parameters you want to write on the control byte
+// @param lenFlags  FPIO_LEN_* flags to add on the length prefix (Binary mode only)
+// @param bPost     Don't wait for the remote end to read the block (See post)
 // @return          The number of bytes sent if successful or -1 if an error occured.
 //
-int FloppyIO::send(char * dataToSend, int szData, fpio_ctlbyte * ctrlByte) {
+int FloppyIO::sendBlock(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte, int lenFlags, bool bPost) {
+    FloppyIOLock lock(&this->sendLock);
     
     // Check for ready state
     if (!this->ready()) return this->setError(-4, "Stream is not ready!");
 
+    // A posted block may still be there, don't overwrite it
+    if (this->posted && this->synchronized) {
+        int iState = this->waitForAck(this->ofsCtrlByteOut, 0);
+        if (iState<0) return iState;
+    }
+    this->posted = bPost;
+
     // Initialize variables
-    int szPad = 0;
+    int szData = 0;
+    for (int i=0; i<iovcnt; i++) szData += iov[i].iov_len;
     int bytesSent = szData;
 
     // Wrap overflow
@@ -290,45 +1068,93 @@ int FloppyIO::send(char * dataToSend, int szData, fpio_ctlbyte * ctrlByte) {
         szData = this->szOutput-1; // -1 for the null-termination
     
     // Check for stream status
-    if (!this->fIO->good()) return this->setError(-1, "I/O Stream reported no-good state while sending!");
+    if (!this->ioGood()) return this->setError(-1, "I/O Stream reported no-good state while sending!");
 
-    // Prepare control byte
-    fpio_ctlbyte_io cB; cB.byte=1;
+    // Prepare control byte (A plain send is a whole message: channel 0 for
+    // a FloppyIOMux on the other end)
+    fpio_ctlbyte_io cB; cB.byte=0;
+    cB.flags.bDataPresent = 1;
+    cB.flags.bEndOfData = 1;
     if (ctrlByte != NULL) {
         cB.flags=*ctrlByte;
         cB.flags.bDataPresent = 1;
     }
-    
-    // Move pointer to output
-    this->fIO->seekp(this->ofsOutput);
 
-    // Check if we should prefix the data
-    if (this->binary) {
-        fpio_datalen_io dL;
-        cB.flags.bLengthPrefix = 1;    // Update control byte : set 'we have length prefix'
-        dL.size = szData;              // Set the data length int
-        this->fIO->write(dL.bytes, 4); // And send the 4-byte representation
-        cerr << "Binary mode selected. Prefixing: " << dL.size << "\n";
+    // Checksum the data that fit in the buffer
+    unsigned int crc = 0;
+    if (this->checksum) {
+        int szLeft = szData;
+        for (int i=0; (i<iovcnt) && (szLeft>0); i++) {
+            int szPart = iov[i].iov_len;
+            if (szPart > szLeft) szPart = szLeft;
+            crc = fpio_crc32c(crc, iov[i].iov_base, szPart);
+            szLeft -= szPart;
+        }
     }
 
-    // Send the data
-    this->fIO->write(dataToSend, szData);
-    
-    // Check if something went wrong after writing
-    if (!this->fIO->good()) return this->setError(-1, "I/O Stream reported no-good state while sending!");
-    
-    // Notify the client that we placed data (Client should clear this on read)
-    this->fIO->seekp(this->ofsCtrlByteOut);
-    this->fIO->write(&cB.byte, 1);
-    this->flush();
+    // (Re-)Send the block until the receiver accepts it
+    for (int iTry=0; ; iTry++) {
+
+        // Move pointer to output
+        int ofsData = this->ofsOutput;
+
+        // Check if we should prefix the data
+        if (this->binary) {
+            fpio_datalen_io dL;
+            cB.flags.bLengthPrefix = 1;    // Update control byte : set 'we have length prefix'
+            dL.size = szData | lenFlags;   // Set the data length int
+            this->ioWrite(ofsData, dL.bytes, 4); // And send the 4-byte representation
+            ofsData += 4;
+            cerr << "Binary mode selected. Prefixing: " << dL.size << "\n";
+
+            // Followed by the checksum
+            if (this->checksum) {
+                dL.size = crc;
+                this->ioWrite(ofsData, dL.bytes, 4);
+                ofsData += 4;
+            }
+        }
 
-    cerr << "Just sent in sync at " << this->ofsCtrlByteOut << " value= " << (int)cB.byte << "\n";
+        // Send the data
+        int szLeft = szData;
+        for (int i=0; (i<iovcnt) && (szLeft>0); i++) {
+            int szPart = iov[i].iov_len;
+            if (szPart > szLeft) szPart = szLeft;
+            this->ioWrite(ofsData, (const char *)iov[i].iov_base, szPart);
+            ofsData += szPart;
+            szLeft -= szPart;
+        }
+
+        // Terminate the data if the receiver relies on the null-termination
+        if (!this->binary) {
+            char cNull = 0;
+            this->ioWrite(ofsData, &cNull, 1);
+        }
+        
+        // Check if something went wrong after writing
+        if (!this->ioGood()) return this->setError(-1, "I/O Stream reported no-good state while sending!");
+        
+        // Notify the client that we placed data (Client should clear this on read)
+        this->ioWrite(this->ofsCtrlByteOut, &cB.byte, 1);
+        this->flush();
+        long long tSent = fpio_time_us();
+
+        cerr << "Just sent in sync at " << this->ofsCtrlByteOut << " value= " << (int)cB.byte << "\n";
+
+        // Not synchronized (or posted)? We are done
+        if (!this->synchronized || bPost) break;
 
-    // If synchronized, wait for data to be written
-    if (this->synchronized) {
         // Wait for output control byte to become 0
-        int iState = this->waitForSync(this->ofsCtrlByteOut, this->syncTimeout, 0, 0x01);
+        // (Retransmissions don't give RTT samples, the ack could be for either copy)
+        int iState = this->waitForAck(this->ofsCtrlByteOut, (iTry == 0) ? tSent : 0);
         if (iState<0) return iState;
+
+        // Got a NAK? Send the block again
+        if (!this->checksum || (this->ioReadByte(this->ofsCtrlByteOut) != fpio_nak())) break;
+        if (iTry >= FPIO_MAX_RETRANSMITS)
+            return this->setError(FPIO_ERR_DATA, "The remote end kept rejecting a block!");
+        this->retransmits++;
+        cerr << "Got NAK. Sending the block again\n";
     }
 
     // Return number of bytes sent
@@ -350,85 +1176,345 @@ string FloppyIO::receive() {
 //
 // Receive the input buffer contents
 //
+// The data are received in the buffer owned by the FloppyIO object and
+// then assigned to the string, so re-using the same string object does
+// not allocate once it has grown enough.
+//
 // @param string   A pointer to a string object that will receive the data
 // @param ctrlByte The extra parameters received from the control byte
 // @return         Returns the length of the data received or -1 if an error occured.
 //
-// TODO: String is time-costly, add also the char*/size version
-//
 int FloppyIO::receive(string * ansBuffer, fpio_ctlbyte * ctrlByte) {
-    char * dataToReceive = new char[this->szInput];
-    int dataLength = this->szInput;
+    FloppyIOLock lock(&this->recvLock);
     int bLen;
 
-    bLen = this->receive(dataToReceive, dataLength, ctrlByte);
+    bLen = this->receive(this->recvBuffer, this->szInput, ctrlByte);
     if (bLen<0) return bLen;
 
-    ansBuffer->assign(dataToReceive, bLen);
+    ansBuffer->assign(this->recvBuffer, bLen);
     return bLen;
 }
 
 //
-// Receive the input buffer contents using char buffers
+// Queue a record to be sent in a batch
 //
-// @param dataToReceive     A pointer to a char buffer that will receive the data
-// @param szData            The size of the target buffer
-// @param ctrlByte          The extra parameters received from the control byte
-// @return                  Returns the length of the data received or -1 if an error occured.
+// Small records are packed in the same block, each one behind its
+// length, so that dozens of them cost a single round trip. The batch is
+// sent when the next record doesn't fit any more, or when its first record
+// has been waiting for batchDelay milliseconds (checked on every call, see
+// also pumpRecords). flushRecords() sends it right away.
 //
+// In character mode there is no length prefix to flag a batch with, so
+// every record is sent as a block of its own.
 //
-int FloppyIO::receive(char * dataToReceive, int szData, fpio_ctlbyte * ctrlByte) {
-    int dataLength = szData;
+// @param data      The record
+// @param dataLen   Its length (Up to szOutput-4)
+// @return          The length of the record or an error code
+//
+int FloppyIO::sendRecord(const void * data, size_t dataLen) {
+    FloppyIOLock lock(&this->sendLock);
+    fpio_datalen_io dL;
+    int res;
+
+    if (!this->binary) return this->send(data, dataLen);
+    if (dataLen + 4 > (size_t)this->szOutput)
+        return this->setError(FPIO_ERR_INPUT, "Record too big for a block!");
+    if (this->batchBuffer == NULL) this->batchBuffer = new char[this->szOutput];
+
+    // No room left? Send what we have first
+    if (this->batchLen + 4 + (int)dataLen > this->szOutput) {
+        res = this->flushRecords();
+        if (res < 0) return res;
+    }
 
-    // Check for ready state
-    if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+    if (this->batchLen == 0) this->batchStart = fpio_time_us();
+    dL.size = dataLen;
+    memcpy(this->batchBuffer + this->batchLen, dL.bytes, 4);
+    memcpy(this->batchBuffer + this->batchLen + 4, data, dataLen);
+    this->batchLen += 4 + dataLen;
+    this->recordsSent++;
 
-    // If synchronized, wait for input data
-    if (this->synchronized) {
-        // Wait for input control byte to become 1
-        int iState = this->waitForSync(this->ofsCtrlByteIn, this->syncTimeout, 1, 0x01);
-        if (iState<0) return iState;
+    // Full, or waited long enough?
+    if (this->szOutput - this->batchLen <= 4) {
+        res = this->flushRecords();
+    } else {
+        res = this->pumpRecords();
     }
-    
-    // Check for stream status
-    if (!this->fIO->good()) return this->setError(-1, "I/O Stream reported no-good state while receiving!");
+    return (res < 0) ? res : (int)dataLen;
+}
+
+//
+// Queue a record to be sent in a batch (See above)
+//
+// @param record    The record
+// @return          The length of the record or an error code
+//
+int FloppyIO::sendRecord(const string & record) {
+    return this->sendRecord(record.data(), record.length());
+}
+
+//
+// Send the records waiting in the batch
+//
+// If the batch cannot be sent it is kept, so it can be tried again after
+// clear().
+//
+// @return  The number of bytes sent (0 if there was nothing to send) or an error code
+//
+int FloppyIO::flushRecords() {
+    FloppyIOLock lock(&this->sendLock);
+    struct iovec iov;
+    int res;
+
+    if (this->batchLen == 0) return 0;
+    iov.iov_base = this->batchBuffer;
+    iov.iov_len = this->batchLen;
+    res = this->sendBlock(&iov, 1, NULL, FPIO_LEN_RECORDS);
+    if (res < 0) return res;
+
+    this->batchLen = 0;
+    this->batchesSent++;
+    return res;
+}
+
+//
+// Send the records waiting in the batch if the deadline has expired
+//
+// Meant to be called from a control loop, so a batch never waits much
+// longer than batchDelay even if no more records come.
+//
+// @return  The number of bytes sent (0 if there was nothing due) or an error code
+//
+int FloppyIO::pumpRecords() {
+    FloppyIOLock lock(&this->sendLock);
+    if (this->batchLen == 0) return 0;
+    if (fpio_time_us() - this->batchStart < (long long)this->batchDelay * 1000) return 0;
+    return this->flushRecords();
+}
+
+//
+// Receive the next record
+//
+// The records of a batch are returned one at a time, and a new block is
+// received only when they are all consumed. A block sent with plain
+// send() is returned as a single record.
+//
+// @param record    Receives the record
+// @return          The length of the record or an error code
+//
+int FloppyIO::receiveRecord(string * record) {
+    FloppyIOLock lock(&this->recvLock);
+    fpio_datalen_io dL;
+    struct iovec iov;
+    int rd, lenFlags;
+
+    // Get a new batch if this one is consumed (Empty batches are skipped)
+    if (this->recordBuffer == NULL) this->recordBuffer = new char[this->szInput];
+    while (this->recordOfs >= this->recordLen) {
+        iov.iov_base = this->recordBuffer;
+        iov.iov_len = this->szInput;
+        rd = this->receiveBlock(&iov, 1, NULL, &lenFlags);
+        if (rd < 0) return rd;
+
+        if ((lenFlags & FPIO_LEN_RECORDS) == 0) {
+            record->assign(this->recordBuffer, rd);
+            return rd;
+        }
+        this->recordOfs = 0;
+        this->recordLen = rd;
+    }
+
+    // Take the next record out
+    if (this->recordLen - this->recordOfs < 4) {
+        this->recordOfs = this->recordLen;
+        return this->setError(FPIO_ERR_DATA, "Truncated record in a batch!");
+    }
+    memcpy(dL.bytes, this->recordBuffer + this->recordOfs, 4);
+    if ((dL.size < 0) || (dL.size > this->recordLen - this->recordOfs - 4)) {
+        this->recordOfs = this->recordLen;
+        return this->setError(FPIO_ERR_DATA, "Truncated record in a batch!");
+    }
+    record->assign(this->recordBuffer + this->recordOfs + 4, dL.size);
+    this->recordOfs += 4 + dL.size;
+    return dL.size;
+}
+
+//
+// Receive the input buffer contents in a memory buffer
+//
+// @param data      A pointer to the buffer that will receive the data
+// @param dataLen   The size of the target buffer
+// @param ctrlByte  The extra parameters received from the control byte
+// @return          Returns the length of the data received or -1 if an error occured.
+//
+int FloppyIO::receive(void * data, size_t dataLen, fpio_ctlbyte * ctrlByte) {
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = dataLen;
+    return this->receivev(&iov, 1, ctrlByte);
+}
 
-    // Prepare the control byte
+//
+// Receive the input buffer contents, scattering them in several buffers
+//
+// The data are read from the image straight into the caller's memory.
+// Data that do not fit in the buffers are dropped.
+//
+// @param iov       The buffers to fill, in order
+// @param iovcnt    The number of buffers
+// @param ctrlByte  The extra parameters received from the control byte
+// @return          Returns the length of the data received or -1 if an error occured.
+//
+int FloppyIO::receivev(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte) {
+    return this->receiveBlock(iov, iovcnt, ctrlByte, NULL);
+}
+
+//
+// Check whether a block is waiting to be received, without waiting
+//
+// @return  TRUE if the remote end placed a block that we didn't read yet
+//
+bool FloppyIO::available() {
+    FloppyIOLock lock(&this->recvLock);
+    if (!this->ready()) return false;
+    return (this->ioReadByte(this->ofsCtrlByteIn) & 0x01) != 0;
+}
+
+//
+// Receive a block of data from the floppy image I/O
+//
+// @param iov       The buffers to fill, in order
+// @param iovcnt    The number of buffers
+// @param ctrlByte  The extra parameters received from the control byte
+// @param lenFlags  If not NULL, receives the FPIO_LEN_* flags of the length prefix
+// @return          Returns the length of the data received or -1 if an error occured.
+//
+int FloppyIO::receiveBlock(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte, int * lenFlags) {
+    FloppyIOLock lock(&this->recvLock);
+    int szBuffers = 0;
+    for (int i=0; i<iovcnt; i++) szBuffers += iov[i].iov_len;
+    int dataLength = szBuffers;
     fpio_ctlbyte_io cB; cB.byte=0;
-    this->fIO->seekg(this->ofsCtrlByteIn);
-    this->fIO->read(&cB.byte, 1);
 
-    cerr << "Got control byte: " << (int)cB.byte << "\n";
+    // Check for ready state
+    if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+
+    // Receive the block until it passes the checksum
+    for (int iTry=0; ; iTry++) {
+
+        // If synchronized, wait for input data
+        if (this->synchronized) {
+            // Wait for input control byte to become 1
+            int iState = this->waitForSync(this->ofsCtrlByteIn, this->syncTimeout, 1, 0x01);
+            if (iState<0) return iState;
+        }
+        
+        // Check for stream status
+        if (!this->ioGood()) return this->setError(-1, "I/O Stream reported no-good state while receiving!");
+
+        // Prepare the control byte
+        cB.byte = this->ioReadByte(this->ofsCtrlByteIn);
 
-    // Update control byte if we have it specified
-    if (ctrlByte != NULL) *ctrlByte = cB.flags;
+        cerr << "Got control byte: " << (int)cB.byte << "\n";
 
-    cB.flags.bDataPresent = 0;      // We need to say we read the data (when we are done)
-    
-    // Go to the input buffer
-    this->fIO->seekg(this->ofsInput, ios_base::beg);
-
-    // If we are using binary mode and we have data prefix, read it
-    if (this->binary && (cB.flags.bLengthPrefix == 1)) {
-        fpio_datalen_io dL;
-        this->fIO->read(dL.bytes, 4);  // Read the 4-byte representation
-        cerr << "Binary mode detected. Read: " << dL.size << "\n";
-        dataLength = dL.size;
+        // Update control byte if we have it specified
+        if (ctrlByte != NULL) *ctrlByte = cB.flags;
+
+        cB.flags.bDataPresent = 0;      // We need to say we read the data (when we are done)
+        
+        // Go to the input buffer
+        int ofsData = this->ofsInput;
+        int szSent = 0;
+        unsigned int crcSent = 0;
+        bool bPrefixed = (this->binary && (cB.flags.bLengthPrefix == 1));
+        dataLength = szBuffers;
+
+        // If we are using binary mode and we have data prefix, read it
+        if (bPrefixed) {
+            fpio_datalen_io dL;
+            this->ioRead(ofsData, dL.bytes, 4);  // Read the 4-byte representation
+            ofsData += 4;
+            cerr << "Binary mode detected. Read: " << dL.size << "\n";
+            if (lenFlags != NULL) *lenFlags = dL.size & ~FPIO_LEN_MASK;
+            dataLength = dL.size & FPIO_LEN_MASK;
+
+            // Followed by the checksum
+            if (this->checksum) {
+                this->ioRead(ofsData, dL.bytes, 4);
+                ofsData += 4;
+                crcSent = dL.size;
+            }
+
+            if (dataLength > this->szInput) dataLength = this->szInput; // Protect from overflows
+            szSent = dataLength;
+            if (dataLength > szBuffers) dataLength = szBuffers;
+        }
         if (dataLength > this->szInput) 
             dataLength = this->szInput; // Protect from overflows
-    }
+        if (dataLength < 0) dataLength = 0;
+
+        // Now read the appropriate data length    
+        unsigned int crc = 0;
+        int szLeft = dataLength;
+        for (int i=0; (i<iovcnt) && (szLeft>0); i++) {
+            int szPart = iov[i].iov_len;
+            if (szPart > szLeft) szPart = szLeft;
+            this->ioRead(ofsData, (char *)iov[i].iov_base, szPart);
+            if (this->checksum) crc = fpio_crc32c(crc, iov[i].iov_base, szPart);
+            ofsData += szPart;
+            szLeft -= szPart;
+        }
+
+        // Verify the checksum (Including the data that did not fit in the buffers)
+        if (bPrefixed && this->checksum) {
+            char chunk[FPIO_SECTOR_SIZE];
+            for (szLeft = szSent - dataLength; szLeft > 0; ) {
+                int szPart = (szLeft > (int)sizeof(chunk)) ? sizeof(chunk) : szLeft;
+                this->ioRead(ofsData, chunk, szPart);
+                crc = fpio_crc32c(crc, chunk, szPart);
+                ofsData += szPart;
+                szLeft -= szPart;
+            }
 
-    // Now read the appropriate data length    
-    this->fIO->read(dataToReceive, dataLength);
+            if (crc != crcSent) {
+                char cNak = fpio_nak();
+                this->checksumErrors++;
+                cerr << "Block failed the checksum. Sending NAK\n";
+
+                // Ask for the block again
+                this->ioWrite(this->ofsCtrlByteIn, &cNak, 1);
+                this->flush(true);
+                if (!this->synchronized || (iTry >= FPIO_MAX_RETRANSMITS))
+                    return this->setError(FPIO_ERR_DATA, "Received a block that failed its checksum!");
+                continue;
+            }
+        }
+
+        // Locate the end of the char buffer using null-termination if we are not using binary mode
+        if (!bPrefixed) {
+            if (lenFlags != NULL) *lenFlags = 0;
+            int szSeen = 0;
+            szLeft = dataLength;
+            for (int i=0; (i<iovcnt) && (szLeft>0); i++) {
+                int szPart = iov[i].iov_len;
+                if (szPart > szLeft) szPart = szLeft;
+                const char * pNull = (const char *)memchr(iov[i].iov_base, 0, szPart);
+                if (pNull != NULL) {
+                    szSeen += pNull - (const char *)iov[i].iov_base;
+                    break;
+                }
+                szSeen += szPart;
+                szLeft -= szPart;
+            }
+            dataLength = szSeen;
+        }
 
-    // Locate the end of the char buffer using null-termination if we are not using binary mode
-    if (!this->binary || !cB.flags.bLengthPrefix)
-        dataLength = strlen(dataToReceive);
+        break;
+    }
 
     // Notify the client that we have read the data
-    this->fIO->seekp(this->ofsCtrlByteIn);
-    this->fIO->write(&cB.byte, 1);
-    this->flush();
+    this->ioWrite(this->ofsCtrlByteIn, &cB.byte, 1);
+    this->flush(true);
 
     cerr << "Just sent out sync at " << this->ofsCtrlByteIn << " value= " << (int)cB.byte << "\n";
 
@@ -446,9 +1532,16 @@ int FloppyIO::receive(char * dataToReceive, int szData, fpio_ctlbyte * ctrlByte)
 // TODO: Do not rely on null-byte termination: Allow binary file transfer
 //
 int FloppyIO::receive(ostream * stream) {
-    string data;
+    FloppyIOLock lock(&this->recvLock);
     fpio_ctlbyte cB;
-    int readLength, rd;
+    struct iovec iov;
+    int readLength = 0, rd, lenFlags;
+
+    // Using the ring layout? Pipeline the blocks
+    if (this->ring) return this->receiveRing(stream);
+
+    iov.iov_base = this->recvBuffer;
+    iov.iov_len = this->szInput;
 
     // Synchronized? Do proper stream reading..
     if (this->synchronized) {
@@ -458,14 +1551,15 @@ int FloppyIO::receive(ostream * stream) {
         while (cB.bEndOfData==0) {
 
             // Read and check for errors
-            rd = this->receive(&data, &cB);
+            rd = this->receiveBlock(&iov, 1, &cB, &lenFlags);
             if (rd<0) {
                 stream->setstate(ostream::failbit);
                 return rd;
             }
 
             // Write data
-            stream->write(data.c_str(), data.size());
+            rd = this->writeBlock(stream, this->recvBuffer, rd, lenFlags);
+            if (rd<0) return rd;
             readLength+=rd;
             
         }
@@ -481,14 +1575,15 @@ int FloppyIO::receive(ostream * stream) {
     } else {
 
         // Read one block and check for errors
-        rd = this->receive(&data);
+        rd = this->receiveBlock(&iov, 1, NULL, &lenFlags);
         if (rd<0) {
             stream->setstate(ostream::failbit);
             return rd;
         }
 
         // Write data
-        stream->write(data.c_str(), data.size());
+        rd = this->writeBlock(stream, this->recvBuffer, rd, lenFlags);
+        if (rd<0) return rd;
         readLength+=rd;
         
     }
@@ -508,10 +1603,16 @@ int FloppyIO::receive(ostream * stream) {
 // TODO: Do not rely on null-byte termination: Allow binary file transfer
 //
 int FloppyIO::send(istream * stream) {
+    FloppyIOLock lock(&this->sendLock);
     fpio_ctlbyte_io cBIO;
     fpio_ctlbyte * cB;
-    char * inBuffer = new char[this->szOutput+1];
-    int sentLength, rd, res;
+    struct iovec iov;
+    char * inBuffer = this->sendBuffer;
+    int sentLength = 0, rd, raw, res, lenFlags;
+    bool bEnd = false;
+
+    // Using the ring layout? Pipeline the blocks
+    if (this->ring) return this->sendRing(stream);
 
     // Check if stream is not good
     if (!stream->good()) return this->setError(FPIO_ERR_INPUT, "Unable to open input stream!");
@@ -519,23 +1620,21 @@ int FloppyIO::send(istream * stream) {
     // Reset byte and get a reference to (zeroed) flags
     cBIO.byte=0;
     cB = &cBIO.flags;
+    this->zPending = 0;
+    this->zEof = false;
 
-    // While stream is good, start processing
-    while (stream->good()) {
-
-        // Zero the input buffer (Plus one null-termination byte)
-        memset(inBuffer, 0, this->szOutput+1);
+    // Until the stream is over, start processing
+    while (!bEnd) {
 
         // Read data 
-        stream->read(inBuffer, this->szOutput-1);
-        rd = stream->gcount();
+        raw = this->readBlock(stream, inBuffer, this->szOutput-1, &rd, &lenFlags, &bEnd);
 
         // Check status
-        if (stream->eof() || (stream->tellg() < 0)) {
+        if (bEnd) {
             // EOF? Mark end-of-data on the current block
             cB->bEndOfData=1;
 
-        } else if (stream->fail()) {
+        } else if (raw < 0) {
             // Got fail without getting eof? Something went wrong
 
             // Notify the remote end that we failed the transmittion
@@ -549,10 +1648,12 @@ int FloppyIO::send(istream * stream) {
         }
 
         // Count bytes written
-        res = this->send(inBuffer, rd, cB);
+        iov.iov_base = inBuffer;
+        iov.iov_len = rd;
+        res = this->sendBlock(&iov, 1, cB, lenFlags);
         if (res<0) return res; // Error occured
         
-        sentLength+=res;
+        sentLength+=raw;
 
     }
     
@@ -560,10 +1661,398 @@ int FloppyIO::send(istream * stream) {
 }
 
 
+//
+// Read the next block of a stream that is being sent
+//
+// Without compression this reads up to szMax bytes. With compression the
+// input is staged in zSendBuffer and as much of it as fits in szMax bytes
+// once deflated is packed in the block. How much input we try to pack
+// adapts to the compression ratio we get; blocks that do not compress
+// are sent raw.
+//
+// @param stream    The input stream
+// @param data      The buffer that receives the block
+// @param szMax     The maximum size of the block
+// @param dataLen   Receives the size of the block
+// @param lenFlags  Receives the FPIO_LEN_* flags of the block
+// @param bEnd      Set to TRUE when this is the last block of the stream
+// @return          The number of input bytes in the block or -1 if the input stream failed
+//
+int FloppyIO::readBlock(istream * stream, char * data, int szMax, int * dataLen, int * lenFlags, bool * bEnd) {
+    int rd;
+    *lenFlags = 0;
+
+    // Not compressing? Just read the data
+    if (!this->compress) {
+        stream->read(data, szMax);
+        rd = stream->gcount();
+        *dataLen = rd;
+        *bEnd = (stream->eof() || (stream->tellg() < 0));
+        if (!*bEnd && stream->fail()) return -1;
+        return rd;
+    }
+
+    // Top-up the staging buffer
+    if (this->zSendBuffer == NULL) this->zSendBuffer = new char[this->zCapacity];
+    int szTarget = szMax * this->zRatio;
+    if (szTarget > this->zCapacity) szTarget = this->zCapacity;
+    if (!this->zEof && (this->zPending < szTarget)) {
+        stream->read(this->zSendBuffer + this->zPending, szTarget - this->zPending);
+        this->zPending += stream->gcount();
+        if (stream->eof() || (stream->tellg() < 0)) {
+            this->zEof = true;
+        } else if (stream->fail()) {
+            *bEnd = false;
+            return -1;
+        }
+    }
+
+    // Pack as much as possible, halving the input until it fits
+    clock_t tStart = clock();
+    int szRaw = this->zPending;
+    bool bZipped = false;
+    while (szRaw > 0) {
+        uLongf szZip = (szRaw > szMax) ? szMax : szRaw - 1;
+        if (compress2((Bytef *)data, &szZip, (const Bytef *)this->zSendBuffer, szRaw, this->zLevel) == Z_OK) {
+            bZipped = true;
+            *dataLen = szZip;
+            break;
+        }
+        if (szRaw <= szMax) break;
+        szRaw /= 2;
+        if (szRaw < szMax) szRaw = szMax;
+    }
+    double tCPU = (double)(clock() - tStart) / CLOCKS_PER_SEC;
+
+    // Doesn't compress? Send it raw
+    if (!bZipped) {
+        memcpy(data, this->zSendBuffer, szRaw);
+        *dataLen = szRaw;
+    } else {
+        *lenFlags = FPIO_LEN_ZLIB;
+    }
+
+    // Adapt the amount of input for the next block
+    if (szRaw < this->zPending) {
+        this->zRatio = szRaw / szMax;
+        if (this->zRatio < 1) this->zRatio = 1;
+    } else if (bZipped && (*dataLen < szMax / 2) && (this->zRatio < FPIO_ZMAX_RATIO)) {
+        this->zRatio *= 2;
+    }
+
+    // Keep the rest for the next block
+    this->zPending -= szRaw;
+    memmove(this->zSendBuffer, this->zSendBuffer + szRaw, this->zPending);
+    *bEnd = (this->zEof && (this->zPending == 0));
+
+    // Update statistics
+    this->zSendStats.blocks++;
+    if (bZipped) this->zSendStats.compressed++;
+    this->zSendStats.rawBytes += szRaw;
+    this->zSendStats.wireBytes += *dataLen;
+    this->zSendStats.cpuTime += tCPU;
+    if (tCPU > this->zSendStats.maxTime) this->zSendStats.maxTime = tCPU;
+
+    cerr << "Compressed block: " << szRaw << " -> " << *dataLen << " bytes, CPU: " << (tCPU * 1000.0) << " ms\n";
+    return szRaw;
+}
+
+//
+// Write a block of a received stream on the output stream, inflating it
+// if it travelled compressed.
+//
+// @param stream    The output stream
+// @param data      The block data
+// @param dataLen   The size of the block
+// @param lenFlags  The FPIO_LEN_* flags of the block
+// @return          The number of bytes written or an error code
+//
+int FloppyIO::writeBlock(ostream * stream, const char * data, int dataLen, int lenFlags) {
+
+    // Raw block? Write it as it is
+    if ((lenFlags & FPIO_LEN_ZLIB) == 0) {
+        if (this->compress) {
+            this->zRecvStats.blocks++;
+            this->zRecvStats.rawBytes += dataLen;
+            this->zRecvStats.wireBytes += dataLen;
+        }
+        stream->write(data, dataLen);
+        return dataLen;
+    }
+
+    // Inflate
+    if (this->zRecvBuffer == NULL) this->zRecvBuffer = new char[this->zCapacity];
+    clock_t tStart = clock();
+    uLongf szRaw = this->zCapacity;
+    if (uncompress((Bytef *)this->zRecvBuffer, &szRaw, (const Bytef *)data, dataLen) != Z_OK) {
+        stream->setstate(ostream::failbit);
+        return this->setError(FPIO_ERR_DATA, "Unable to inflate a compressed block!");
+    }
+    double tCPU = (double)(clock() - tStart) / CLOCKS_PER_SEC;
+
+    // Update statistics
+    this->zRecvStats.blocks++;
+    this->zRecvStats.compressed++;
+    this->zRecvStats.rawBytes += szRaw;
+    this->zRecvStats.wireBytes += dataLen;
+    this->zRecvStats.cpuTime += tCPU;
+    if (tCPU > this->zRecvStats.maxTime) this->zRecvStats.maxTime = tCPU;
+
+    cerr << "Inflated block: " << dataLen << " -> " << szRaw << " bytes, CPU: " << (tCPU * 1000.0) << " ms\n";
+
+    stream->write(this->zRecvBuffer, szRaw);
+    return szRaw;
+}
+
+//
+// Ring streaming layout (FPIO_RING)
+//
+// Each I/O area is split into ringBlocks equally-sized blocks:
+//
+// +--------+------------------+---------------------------------------+
+// | 1 byte |     4 bytes      |  Block size - 5 bytes                 |
+// +--------+------------------+---------------------------------------+
+// |  Ctl   |  Data length     |  Data                                 |
+// +--------+------------------+---------------------------------------+
+//
+// With FPIO_CHECKSUM the data length is followed by the 4-byte CRC32C of
+// the data. The sender keeps a copy of every block in flight, so a block
+// the receiver answered with a NAK is written again (See waitForSlot).
+//
+// The sender writes block #n at slot (n % ringBlocks) and raises its
+// bDataPresent flag with (n & 0xF) as usID. The receiver drains slots in
+// order and clears the flag when it copied the data out, so the sender
+// only blocks when all the slots are in flight. Each stream starts at
+// slot 0, after the previous one has been completely drained.
+//
+
+//
+// Send the contents of an input stream through the ring of blocks
+//
+// @param stream   A pointer to an input stream that will fetch the data from.
+// @return         Returns the length of the data sent or an error code.
+//
+int FloppyIO::sendRing(istream * stream) {
+    fpio_ctlbyte_io cB;
+    fpio_datalen_io dL;
+    int nBlocks = this->ringBlocks;
+    int szBlock, szPrefix, szPayload, ofsBlock, rd, raw, iState, lenFlags;
+    int sentLength = 0, ringHead = 0;
+    bool bEnd = false;
+
+    // Check for ready state and the layout
+    if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+    if (!stream->good()) return this->setError(FPIO_ERR_INPUT, "Unable to open input stream!");
+    if (nBlocks < 1) nBlocks = 1;
+    if (nBlocks > 16) nBlocks = 16;
+    szBlock = this->szOutputArea / nBlocks;
+    if (this->header && (szBlock > FPIO_SECTOR_SIZE)) szBlock -= szBlock % FPIO_SECTOR_SIZE;
+    szPrefix = this->checksum ? 9 : 5;
+    szPayload = szBlock - szPrefix;
+
+    // The blocks are prepared in a copy of the ring, kept until they are consumed
+    char * inBlock;
+
+    // Wait for the previous stream to be completely drained
+    for (int i=0; i<nBlocks; i++) {
+        iState = this->waitForSlot(this->ofsOutputArea + i*szBlock, this->sendBuffer + i*szBlock);
+        if (iState<0) return iState;
+    }
+
+    this->zPending = 0;
+    this->zEof = false;
+    while (!bEnd) {
+        cB.byte = 0;
+
+        // Wait for the slot to be released by the receiver
+        ofsBlock = this->ofsOutputArea + (ringHead % nBlocks) * szBlock;
+        inBlock = this->sendBuffer + (ringHead % nBlocks) * szBlock;
+        iState = this->waitForSlot(ofsBlock, inBlock);
+        if (iState<0) return iState;
+
+        // Read data
+        raw = this->readBlock(stream, inBlock + szPrefix, szPayload, &rd, &lenFlags, &bEnd);
+
+        // Check status
+        if (bEnd) {
+            // EOF? Mark end-of-data on the current block
+            cB.flags.bEndOfData = 1;
+
+        } else if (raw < 0) {
+            // Got fail without getting eof? Notify the remote end
+            cB.flags.bAborted = 1;
+            cB.flags.bEndOfData = 1;
+            rd = 0;
+            raw = 0;
+            lenFlags = 0;
+            bEnd = true;
+        }
+
+        // Prepare length, checksum and control byte
+        dL.size = rd | lenFlags;
+        memcpy(inBlock+1, dL.bytes, 4);
+        if (this->checksum) {
+            dL.size = fpio_crc32c(0, inBlock + szPrefix, rd);
+            memcpy(inBlock+5, dL.bytes, 4);
+        }
+        cB.flags.bDataPresent = 1;
+        cB.flags.bLengthPrefix = 1;
+        cB.flags.usID = ringHead & 0x0F;
+        inBlock[0] = cB.byte;
+
+        // Place length and data, then hand the block over
+        this->ioWrite(ofsBlock+1, inBlock+1, szPrefix-1+rd);
+        if (!this->ioGood()) return this->setError(-1, "I/O Stream reported no-good state while sending!");
+        this->ioWrite(ofsBlock, inBlock, 1);
+        this->flush();
+
+        ringHead++;
+        sentLength += raw;
+    }
+
+    // Aborted? Report the input error
+    if (cB.flags.bAborted == 1) return this->setError(-5, "Unable to read from input stream");
+
+    // Wait until everything in flight is consumed
+    for (int i=0; i<nBlocks; i++) {
+        iState = this->waitForSlot(this->ofsOutputArea + i*szBlock, this->sendBuffer + i*szBlock);
+        if (iState<0) return iState;
+    }
+
+    return sentLength;
+}
+
+//
+// Wait for a ring slot to be released by the receiver. As long as the
+// receiver answers with a NAK, the block is written again from its copy.
+//
+// @param ofsBlock  The offset of the slot in the image
+// @param block     The copy of the block that was placed in the slot
+// @return          0 if the slot is free, or an error code
+//
+int FloppyIO::waitForSlot(int ofsBlock, const char * block) {
+    fpio_datalen_io dL;
+    int iState;
+
+    for (int iTry=0; ; iTry++) {
+        // No RTT sample: the slot may have waited behind the others
+        iState = this->waitForAck(ofsBlock, 0);
+        if (iState<0) return iState;
+
+        // Released?
+        if (!this->checksum || (this->ioReadByte(ofsBlock) != fpio_nak())) return 0;
+        if (iTry >= FPIO_MAX_RETRANSMITS)
+            return this->setError(FPIO_ERR_DATA, "The remote end kept rejecting a block!");
+
+        // Write the block again
+        this->retransmits++;
+        cerr << "Got NAK. Sending the block again\n";
+        memcpy(dL.bytes, block+1, 4);
+        this->ioWrite(ofsBlock+1, block+1, 8 + (dL.size & FPIO_LEN_MASK)); // 8 = length and checksum
+        this->ioWrite(ofsBlock, block, 1);
+        this->flush();
+    }
+}
+
+//
+// Receive a stream through the ring of blocks and write it on an output stream
+//
+// @param stream   A pointer to an output stream where the data should be placed.
+// @return         Returns the length of the data received or an error code.
+//
+int FloppyIO::receiveRing(ostream * stream) {
+    fpio_ctlbyte_io cB, cBClear;
+    fpio_datalen_io dL;
+    int nBlocks = this->ringBlocks;
+    int szBlock, szPrefix, szPayload, ofsBlock, iState, szData, lenFlags;
+    unsigned int crcSent;
+    int readLength = 0, ringTail = 0, nTries = 0;
+
+    // Check for ready state and the layout
+    if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+    if (nBlocks < 1) nBlocks = 1;
+    if (nBlocks > 16) nBlocks = 16;
+    szBlock = this->szInputArea / nBlocks;
+    if (this->header && (szBlock > FPIO_SECTOR_SIZE)) szBlock -= szBlock % FPIO_SECTOR_SIZE;
+    szPrefix = this->checksum ? 9 : 5;
+    szPayload = szBlock - szPrefix;
+
+    char * outBuffer = this->recvBuffer;
+
+    do {
+        // Wait for the next block in sequence
+        ofsBlock = this->ofsInputArea + (ringTail % nBlocks) * szBlock;
+        iState = this->waitForSync(ofsBlock, this->syncTimeout, 1, 0x01);
+        if (iState<0) {
+            stream->setstate(ostream::failbit);
+            return iState;
+        }
+
+        // Validate the sequence number
+        cB.byte = this->ioReadByte(ofsBlock);
+        if (cB.flags.usID != (ringTail & 0x0F)) {
+            stream->setstate(ostream::failbit);
+            return this->setError(FPIO_ERR_SEQUENCE, "Received a block out of sequence!");
+        }
+
+        // Copy the data out and release the slot
+        this->ioRead(ofsBlock+1, dL.bytes, 4);
+        lenFlags = dL.size & ~FPIO_LEN_MASK;
+        szData = dL.size & FPIO_LEN_MASK;
+        if (szData > szPayload) szData = szPayload; // Protect from overflows
+        if (this->checksum) {
+            this->ioRead(ofsBlock+5, dL.bytes, 4);
+            crcSent = dL.size;
+        }
+        this->ioRead(ofsBlock+szPrefix, outBuffer, szData);
+
+        // Corrupted? Ask for the block again
+        if (this->checksum && (fpio_crc32c(0, outBuffer, szData) != crcSent)) {
+            char cNak = fpio_nak();
+            this->checksumErrors++;
+            cerr << "Block failed the checksum. Sending NAK\n";
+            this->ioWrite(ofsBlock, &cNak, 1);
+            this->flush(true);
+            if (++nTries > FPIO_MAX_RETRANSMITS) {
+                stream->setstate(ostream::failbit);
+                return this->setError(FPIO_ERR_DATA, "Received a block that failed its checksum!");
+            }
+            cB.flags.bEndOfData = 0; // Stay on this block
+            continue;
+        }
+        nTries = 0;
+
+        cBClear.byte = 0;
+        this->ioWrite(ofsBlock, &cBClear.byte, 1);
+        this->flush(true);
+
+        // Write data
+        szData = this->writeBlock(stream, outBuffer, szData, lenFlags);
+        if (szData < 0) return szData;
+        readLength += szData;
+        ringTail++;
+
+    } while (cB.flags.bEndOfData == 0);
+
+    // Did we got a data failure?
+    stream->flush();
+    if (cB.flags.bAborted == 1) {
+        stream->setstate(ostream::failbit);
+        return FPIO_ERR_ABORTED;
+    }
+
+    return readLength;
+}
+
 // Wait for synchronization byte to be cleared.
 // This function blocks until the byte at controlByteOffset has
 // the synchronization bit cleared.
 //
+// The control byte is first checked in a tight loop, then with an
+// exponentially growing sleep up to syncMaxSleep. When the image
+// modifications can be watched (inotify), the sleep is a wait for
+// a modification instead, so a remote write wakes us up immediately.
+//
 // @param controlByteOffset The offset (from the beginning of file) where to look for the control byte
 // @param timeout           The time (in seconds) to wait for a change. 0 Will wait forever
 // @param state             The state the controlByte must be for this function to exit.
@@ -571,31 +2060,174 @@ int FloppyIO::send(istream * stream) {
 // @return                  Returns 0 if everything succeeded, -1 if an error occured, -2 if timed out.
 
 int  FloppyIO::waitForSync(int controlByteOffset, int timeout, char state, char mask) {
-    time_t tExpired = time (NULL) + timeout;
+    int iState = this->waitForState(controlByteOffset, (long long)timeout * 1000000, state, mask);
+    if (iState == FPIO_ERR_TIMEOUT) return this->setError(-2, "Timed-out while waiting for sync!");
+    return iState;
+}
+
+//
+// Wait for the control byte to reach a state (See waitForSync)
+//
+// @param controlByteOffset The offset (from the beginning of file) where to look for the control byte
+// @param timeout           The time (in microseconds) to wait for a change. 0 Will wait forever
+// @param state             The state the controlByte must be for this function to exit.
+// @param mask              The bit mask to apply on control byte before checking the state
+// @return                  Returns 0 if everything succeeded, -1 if an error occured, or
+//                          FPIO_ERR_TIMEOUT (without setting the error) if timed out.
+//
+int  FloppyIO::waitForState(int controlByteOffset, long long timeout, char state, char mask) {
+    long long tStart = fpio_time_us();
+    long long tExpired = tStart + timeout;
+    long long tNow = tStart;
+    int iSleep = FPIO_TUNE_SLEEP;
+    int iSpins = 0;
     char cStatusByte;
+    int iState = FPIO_ERR_TIMEOUT;
+
+    // The other direction may be waiting too: it has its own notifications,
+    // and the statistics are collected here and added once we are done
+    int notifyFd = this->isInput(controlByteOffset) ? this->notifyFdIn : this->notifyFd;
+    fpio_syncstats stats;
+    memset(&stats, 0, sizeof(stats));
 
     cerr << "Waiting for sync at " << controlByteOffset << " waiting for " << (int)state << " (Mask: " << (int)mask << ")\n";
+    stats.waits++;
 
     // Wait until expired or forever.
-    while ((timeout == 0) || ( time(NULL) <= tExpired)) {
+    while ((timeout == 0) || (tNow <= tExpired)) {
+
+        // Are we going away?
+        if (this->canceled) {
+            iState = this->setError(FPIO_ERR_CANCELED, "The wait for sync was canceled!");
+            break;
+        }
 
         // Check for stream status
-        if (!this->fIO->good()) return this->setError(-1, "I/O Stream reported non-good state while waiting for sync!");
+        if (!this->ioGood()) {
+            iState = this->setError(-1, "I/O Stream reported non-good state while waiting for sync!");
+            break;
+        }
         
         // Check the synchronization byte
-        this->fIO->seekg(controlByteOffset, ios_base::beg);
-        this->fIO->read(&cStatusByte, 1);
+        cStatusByte = this->ioReadByte(controlByteOffset);
+        stats.checks++;
 
         // Is the control byte 0? Our job is finished...
-        if (((int)cStatusByte & (int)mask) == (int)state) return 0;
+        if (((int)cStatusByte & (int)mask) == (int)state) {
+            iState = 0;
+            break;
+        }
+
+        // Spin for a while before going to sleep
+        // (Not on direct I/O, where every check reaches the device)
+        if (!this->direct && (iSpins < FPIO_TUNE_SPINS)) {
+            iSpins++;
+            tNow = fpio_time_us();
+            continue;
+        }
+
+        // Never sleep past the deadline
+        if ((timeout != 0) && (tExpired - tNow < iSleep)) 
+            iSleep = (int)(tExpired - tNow) + 1;
+
+        // Sleep to decrease CPU-load, or block until the file is modified
+        stats.sleeps++;
+        if (notifyFd >= 0) {
+            struct pollfd pfd;
+            pfd.fd = notifyFd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, (iSleep + 999) / 1000) > 0) {
+                char evBuffer[1024];
+                while (read(notifyFd, evBuffer, sizeof(evBuffer)) > 0) ;
+                stats.notifies++;
+            }
+        } else {
+            usleep( iSleep );
+        }
+
+        // Back-off
+        iSleep *= 2;
+        if (iSleep > this->syncMaxSleep) iSleep = this->syncMaxSleep;
+        tNow = fpio_time_us();
+    }
+
+    // Update the statistics
+    double tWait = (fpio_time_us() - tStart) / 1000000.0;
+    if (iState == FPIO_ERR_TIMEOUT) stats.timeouts++;
+
+    FloppyIOLock lock(&this->stateLock);
+    this->syncStats.waits += stats.waits;
+    this->syncStats.timeouts += stats.timeouts;
+    this->syncStats.checks += stats.checks;
+    this->syncStats.sleeps += stats.sleeps;
+    this->syncStats.notifies += stats.notifies;
+    this->syncStats.totalTime += tWait;
+    if (tWait > this->syncStats.maxTime) this->syncStats.maxTime = tWait;
+    return iState;
+
+}
 
-        // Sleep for a few milliseconds to decrease CPU-load
-        usleep( FPIO_TUNE_SLEEP );
+//
+// Wait for the remote end to acknowledge a block (Control byte bit 0 cleared)
+//
+// With the adaptive timeout (FPIO_ADAPTIVE) we wait for the current RTO.
+// An acknowledgement that is late doubles the RTO, up to FPIO_RTT_BACKOFFS
+// times, before giving up: a busy guest just gets more time, a dead one is
+// detected after 7 RTOs at most. Otherwise we wait for syncTimeout.
+//
+// @param controlByteOffset The offset of the control byte of the block
+// @param tSent             When the block was placed (fpio_time_us), or 0 to take no RTT sample
+// @return                  Returns 0 if acknowledged, or an error code
+//
+int  FloppyIO::waitForAck(int controlByteOffset, long long tSent) {
+    if (!this->adaptiveTimeout) return this->waitForSync(controlByteOffset, this->syncTimeout, 0, 0x01);
+
+    double rto = this->rttStats.rto;
+    for (int iBackoff=0; ; iBackoff++) {
+        int iState = this->waitForState(controlByteOffset, (long long)(rto * 1000000), 0, 0x01);
+        if (iState == 0) break;
+        if (iState != FPIO_ERR_TIMEOUT) return iState;
+
+        // Late, or gone?
+        rto *= 2;
+        if (rto > FPIO_RTT_MAX_TIMEOUT) rto = FPIO_RTT_MAX_TIMEOUT;
+        if (iBackoff >= FPIO_RTT_BACKOFFS) {
+            this->rttStats.timeouts++;
+            this->rttStats.rto = rto;   // Be patient on the next attempt
+            return this->setError(-2, "Timed-out while waiting for the remote end to acknowledge!");
+        }
+        this->rttStats.backoffs++;
+        cerr << "Late acknowledgement, waiting for " << rto << " more seconds\n";
     }
 
-    // If we reached this point, we timed out
-    return this->setError(-2, "Timed-out while waiting for sync!");
+    if (tSent > 0) this->updateRtt((fpio_time_us() - tSent) / 1000000.0);
+    return 0;
+}
+
+//
+// Feed a round-trip time sample to the estimator (RFC 6298)
+//
+// @param rtt   The round-trip time (seconds)
+//
+void FloppyIO::updateRtt(double rtt) {
+    fpio_rttstats * r = &this->rttStats;
+
+    if (r->samples == 0) {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+        r->minRtt = r->maxRtt = rtt;
+    } else {
+        double delta = (r->srtt > rtt) ? r->srtt - rtt : rtt - r->srtt;
+        r->rttvar = 0.75 * r->rttvar + 0.25 * delta;
+        r->srtt = 0.875 * r->srtt + 0.125 * rtt;
+        if (rtt < r->minRtt) r->minRtt = rtt;
+        if (rtt > r->maxRtt) r->maxRtt = rtt;
+    }
+    r->samples++;
 
+    r->rto = r->srtt + 4 * r->rttvar;
+    if (r->rto < FPIO_RTT_MIN_TIMEOUT) r->rto = FPIO_RTT_MIN_TIMEOUT;
+    if (r->rto > FPIO_RTT_MAX_TIMEOUT) r->rto = FPIO_RTT_MAX_TIMEOUT;
 }
 
 //
@@ -607,6 +2239,7 @@ int  FloppyIO::waitForSync(int controlByteOffset, int timeout, char state, char
 // @return          The error code
 //
 int  FloppyIO::setError(int code, const string message) {
+    FloppyIOLock lock(&this->stateLock);
     this->error = code;
 
     // Chain errors
@@ -629,9 +2262,22 @@ int  FloppyIO::setError(int code, const string message) {
 // Clear error state flags
 //
 void FloppyIO::clear() {
+    FloppyIOLock lock(&this->stateLock);
     this->error = 0;
     this->errorStr = "";
-    this->fIO->clear();
+    if (this->fIO != NULL) this->fIO->clear();
+    if (this->fIn != NULL) this->fIn->clear();
+}
+
+//
+// Cancel the waits for the remote end
+//
+// The waits in progress (in other threads) give up with FPIO_ERR_CANCELED
+// within syncMaxSleep, and so do the ones that start later: there is no
+// way back, this is meant for an object that is about to be deleted.
+//
+void FloppyIO::cancel() {
+    this->canceled = true;
 }
 
 //
@@ -640,7 +2286,7 @@ void FloppyIO::clear() {
 //
 bool FloppyIO::ready() {
     if (this->error!=0) return false;
-    return this->fIO->good();
+    return this->ioGood();
 }
 
 
@@ -36,6 +36,9 @@
 // |     0x7000      |  "Data available for guest" flag byte          |
 // +-----------------+------------------------------------------------+
 //
+//  Images created with FPIO_HEADER start instead with a geometry header
+//  sector that describes where the two buffers are (See FloppyIO.cpp).
+//
 //  Updated at January 5, 2012, 13:06 PM
 //
 
@@ -45,6 +48,8 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <sys/uio.h>
+#include <pthread.h>
 
 using namespace std;
 
@@ -80,6 +85,62 @@ using namespace std;
 // (Flag used by the FloppyIO constructor)
 #define FPIO_BINARY 32
 
+// Use a memory-mapped backend.
+// The floppy image is mapped once at open, control bytes become plain loads
+// and stores and flushing only msync()s the dirty range, instead of closing
+// and re-opening the file stream on every transfer.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_MMAP 64
+
+// Use a ring of blocks for streaming.
+// send(istream*) and receive(ostream*) split each buffer into ringBlocks
+// blocks, each one with its own control byte (sequence number in usID)
+// and length prefix, so several blocks can be in flight at once.
+// Both ends must use the same flag and ringBlocks value.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_RING 128
+
+// Describe the layout with a geometry header.
+// A hypervisor-side FloppyIO writes a versioned header at offset 0 when it
+// resets the image, recording the total size, the buffer offsets/sizes and
+// the framing mode. Every FloppyIO opening an image that carries a header
+// derives its topology from it, so the image size can go up to a full
+// floppy (or a small raw disk) with no recompile on either side.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_HEADER 256
+
+// Compress stream transfers.
+// send(istream*) deflates each block with zlib when it pays off and
+// receive(ostream*) inflates it back, so more data fit in every block.
+// Compressed blocks are flagged in their length prefix (See FPIO_LEN_ZLIB),
+// so this flag implies FPIO_BINARY.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_COMPRESS 512
+
+// Protect the blocks with a checksum.
+// Every block carries the CRC32C of its data after the length prefix. The
+// receiver verifies it and answers a mismatch with a NAK control byte
+// (Only bAborted set), so the sender writes that block again. Implies
+// FPIO_BINARY. Retransmission needs FPIO_SYNCHRONIZED.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_CHECKSUM 1024
+
+// Bypass the page cache.
+// The image is accessed with pread/pwrite on a file descriptor opened with
+// O_DIRECT, through a sector-aligned buffer. When O_DIRECT is refused
+// (ex. tmpfs), the cached pages are dropped before every control byte
+// check instead (BLKFLSBUF on block devices). Meant for the guest side,
+// where the floppy device is otherwise read through a stale page cache.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_DIRECT 2048
+
+// Adaptive acknowledgement timeout.
+// The time we wait for the remote end to acknowledge a block is derived
+// from the round-trip times measured on the previous blocks (See
+// fpio_rttstats), instead of the fixed syncTimeout.
+// (Flag used by the FloppyIO constructor)
+#define FPIO_ADAPTIVE 4096
+
 //
 // Error code constants
 //
@@ -90,6 +151,13 @@ using namespace std;
 #define FPIO_ERR_NOTREADY  -4  // The I/O object is not ready
 #define FPIO_ERR_INPUT     -5  // Error while reading from input (ex. input stream)
 #define FPIO_ERR_ABORTED   -6  // An operation was aborted from the remote end
+#define FPIO_ERR_SEQUENCE  -7  // A block arrived out of sequence
+#define FPIO_ERR_HEADER    -8  // The geometry header is invalid or doesn't fit
+#define FPIO_ERR_DATA      -9  // A block could not be decoded
+#define FPIO_ERR_CHANNEL  -10  // Invalid channel (See FloppyIOMux)
+#define FPIO_ERR_BUSY     -11  // The request queue is full (See FloppyIOAsync) or the remote end didn't read the last block (See FloppyIO::post)
+#define FPIO_ERR_CANCELED -12  // The wait was canceled by this end (See FloppyIO::cancel)
+#define FPIO_ERR_METHOD   -13  // The remote end has no such method (See FloppyIORPC)
 
 //
 // Structure of the synchronization control byte.
@@ -111,6 +179,76 @@ typedef struct fpio_ctlbyte {
     unsigned short usID           : 4;
 };
 
+//
+// An I/O union structure for fpio_ctrlbyte
+//
+// This union helps accessing the fpio_ctrlbyte flags without the
+// need of memset.
+//
+union fpio_ctlbyte_io {
+    fpio_ctlbyte flags;
+    char         byte;
+};
+
+//
+// An I/O union structure for the data-length prefix
+//
+// This union helps accessing the size int and it's 4-byte representation
+// without needing any memcpy.
+//
+union fpio_datalen_io {
+    int          size;
+    char         bytes[4];
+};
+
+//
+// Synchronization wait statistics.
+//
+// Updated by every wait for the remote end (see FloppyIO::waitForSync)
+// and never reset by the class itself.
+//
+struct fpio_syncstats {
+    unsigned long   waits;      // Number of waits
+    unsigned long   timeouts;   // Number of waits that timed out
+    unsigned long   checks;     // Number of control byte checks
+    unsigned long   sleeps;     // Number of times we slept or blocked
+    unsigned long   notifies;   // Number of wake-ups by file change notification
+    double          totalTime;  // Total time spent waiting (seconds)
+    double          maxTime;    // Longest single wait (seconds)
+};
+
+//
+// Round-trip time estimator (See FPIO_ADAPTIVE).
+//
+// Every block we send and the remote end acknowledges without a
+// retransmission gives a sample. The smoothed RTT and its variation are
+// kept as TCP does (RFC 6298) and give the acknowledgement timeout:
+// rto = srtt + 4 * rttvar, within [FPIO_RTT_MIN_TIMEOUT, FPIO_RTT_MAX_TIMEOUT].
+//
+struct fpio_rttstats {
+    unsigned long   samples;    // Round trips measured
+    unsigned long   backoffs;   // Late acknowledgements (Timeout doubled)
+    unsigned long   timeouts;   // Acknowledgements that never came
+    double          srtt;       // Smoothed round-trip time (seconds)
+    double          rttvar;     // Round-trip time variation (seconds)
+    double          rto;        // Current acknowledgement timeout (seconds)
+    double          minRtt;     // Shortest round trip (seconds)
+    double          maxRtt;     // Longest round trip (seconds)
+};
+
+//
+// Block compression statistics (See FPIO_COMPRESS).
+//
+// One instance is kept per direction. Never reset by the class itself.
+//
+struct fpio_zstats {
+    unsigned long   blocks;     // Number of blocks processed
+    unsigned long   compressed; // Number of blocks that travelled compressed
+    double          rawBytes;   // Bytes before compression / after inflation
+    double          wireBytes;  // Bytes that went through the image
+    double          cpuTime;    // CPU time spent (de)compressing (seconds)
+    double          maxTime;    // CPU time of the most expensive block (seconds)
+};
 
 // Default floppy disk size (In bytes)
 // 
@@ -119,31 +257,136 @@ typedef struct fpio_ctlbyte {
 
 #define DEFAULT_FIO_FLOPPY_SIZE 28672
 
+// Size of a full 1.44 Mb floppy disk (In bytes)
+// Bigger media have to be attached as a (raw) hard disk.
+
+#define FPIO_MAX_FLOPPY_SIZE 1474560
+
+//
+// Geometry header definitions (See FPIO_HEADER)
+//
+#define FPIO_HEADER_MAGIC       "FPIO"
+#define FPIO_HEADER_SIZE        64
+#define FPIO_PROTOCOL_VERSION   1
+#define FPIO_SECTOR_SIZE        512     // The areas are aligned to sectors
+
+#define FPIO_FRAMING_BINARY     1       // Data are prefixed by their length
+#define FPIO_FRAMING_RING       2       // Streams use the ring layout
+#define FPIO_FRAMING_ZLIB       4       // Streams are compressed
+#define FPIO_FRAMING_CRC        8       // Blocks carry a CRC32C
+
+// Flags carried by the high bits of a length prefix
+#define FPIO_LEN_ZLIB           0x80000000  // The block is zlib-compressed
+#define FPIO_LEN_RECORDS        0x40000000  // The block packs several records (See sendRecord)
+#define FPIO_LEN_MASK           0x00FFFFFF  // The actual length
+
+// Size of the buffer of each file stream (Default backend). The buffers
+// are owned by the object, so re-opening the streams on flush() doesn't
+// allocate new ones.
+
+#define FPIO_STREAM_BUFFER 8192
+
 // Default synchronization timeout (seconds).
 // This constant defines how long we should wait for synchronization
 // feedback from the guest before aborting.
 
 #define DEFAULT_FIO_SYNC_TIMEOUT 5
 
+// Bounds of the adaptive acknowledgement timeout (FPIO_ADAPTIVE, seconds).
+// A late acknowledgement doubles the timeout (up to FPIO_RTT_BACKOFFS
+// times) before the remote end is considered dead, so a slow guest gets
+// more time while a dead one is detected within seconds.
+
+#define FPIO_RTT_MIN_TIMEOUT 1
+#define FPIO_RTT_MAX_TIMEOUT 60
+#define FPIO_RTT_BACKOFFS 2
+
+// Default ceiling of the synchronization back-off (microseconds).
+// While waiting, the polling interval doubles up to this value. When file
+// change notifications are available this is only a safety net.
+
+#define DEFAULT_FIO_SYNC_MAXSLEEP 20000
+
+// How many times should the waitForSync loop check the control byte
+// before it starts sleeping. Covers peers that answer within microseconds.
+#define FPIO_TUNE_SPINS 200
+
+// How much (microseconds) should we wait on the first waitForSync sleep.
+// Every further sleep doubles, up to syncMaxSleep.
+#define FPIO_TUNE_SLEEP 50
+
+// Default number of blocks per direction in ring streaming mode (FPIO_RING).
+// At most 16 blocks can be used, as the sequence number has 4 bits.
+
+#define DEFAULT_FIO_RING_BLOCKS 4
+
+// How much raw data (in blocks) can be packed in a single compressed block.
+
+#define FPIO_ZMAX_RATIO 8
+
+// zlib compression level used for the stream transfers.
+
+#define DEFAULT_FIO_ZLEVEL 6
+
+// How long (milliseconds) a record may wait in the batch for more records
+// before the batch is sent (See FloppyIO::sendRecord). 0 sends every
+// record as soon as it's queued.
+
+#define DEFAULT_FIO_BATCH_DELAY 20
+
+// How many times a block that failed its checksum is sent again before
+// giving up.
+
+#define FPIO_MAX_RETRANSMITS 3
+
+//
+// CRC32C (Castagnoli) of a buffer, using the SSE 4.2 instruction when the
+// CPU has it. Pass the previous result as crc to chain buffers (0 to start).
+//
+unsigned int fpio_crc32c(unsigned int crc, const void * data, size_t dataLen);
+
 //
 // Floppy I/O Communication class
 //
+// The two directions are independent: one thread may send while another
+// one receives, each with its own file position, synchronization and
+// lock. Several threads sending (or receiving) at the same time take
+// turns block by block.
+//
+// When the image is written by whole sectors (FPIO_DIRECT, or the floppy
+// device of a guest) both ends may only transfer at the same time if the
+// two directions don't share a sector, which is what FPIO_HEADER lays out.
+// The classic layout keeps each control byte next to the data of the
+// other direction.
+//
 class FloppyIO {
 public:
     
     // Construcors
-    FloppyIO(const char * filename, int flags = 0);
+    FloppyIO(const char * filename, int flags = 0, int floppySize = 0);
     virtual ~FloppyIO();
     
     // Functions
     void        reset();
-    int         send(string strData, fpio_ctlbyte * ctrlByte = NULL);
-    int         send(char * data, int dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    int         send(const string & strData, fpio_ctlbyte * ctrlByte = NULL);
+    int         send(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    int         sendv(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte = NULL);
     int         send(istream * stream);
+    int         post(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    bool        writable();
     string      receive();
-    int         receive(char * data, int dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    int         receive(void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    int         receivev(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte = NULL);
     int         receive(string * strBuffer, fpio_ctlbyte * ctrlByte = NULL);
     int         receive(ostream * stream);
+    bool        available();
+
+    // Batched records (Binary mode)
+    int         sendRecord(const void * data, size_t dataLen);
+    int         sendRecord(const string & record);
+    int         flushRecords();
+    int         pumpRecords();
+    int         receiveRecord(string * record);
     
     // Topology info
     int         ofsInput;   // Input buffer offset & size
@@ -157,6 +400,30 @@ public:
     // Synchronization stuff
     bool        synchronized;   // The read/writes are synchronized
     int         syncTimeout;    // For how long should we wait
+    int         syncMaxSleep;   // Back-off ceiling while waiting (microseconds)
+    fpio_syncstats syncStats;   // Wait-time statistics
+    bool        adaptiveTimeout; // Acknowledgement timeout from the measured RTT
+    fpio_rttstats rttStats;     // Round-trip time estimator
+
+    // Ring streaming (FPIO_RING)
+    bool        ring;           // Stream through a ring of blocks
+    int         ringBlocks;     // Number of blocks per direction
+
+    // Stream compression (FPIO_COMPRESS)
+    bool        compress;       // Deflate the blocks of the streams we send
+    int         zLevel;         // zlib compression level
+    fpio_zstats zSendStats;     // Compression statistics of the sent streams
+    fpio_zstats zRecvStats;     // Inflation statistics of the received streams
+
+    // Block checksums (FPIO_CHECKSUM)
+    bool        checksum;       // Blocks carry a CRC32C
+    unsigned long checksumErrors; // Received blocks that failed the check
+    unsigned long retransmits;  // Blocks we had to send again
+
+    // Record batching (See sendRecord)
+    int         batchDelay;     // Deadline of a batch (milliseconds)
+    unsigned long recordsSent;  // Records queued
+    unsigned long batchesSent;  // Blocks they travelled in
 
     // Error reporting and checking
     int         error;
@@ -165,12 +432,68 @@ public:
     
     void        clear();        // Clear errors
     bool        ready();        // Returns TRUE if there are no errors
+    void        cancel();       // Make every wait fail (Before deleting the object)
 
 private:
 
     // Floppy Info
     fstream *   fIO;
     int         szFloppy;
+    bool        client;         // Guest-side end
+    bool        header;         // Layout described by a geometry header
+    volatile bool canceled;     // See cancel()
+
+    // Whole I/O areas (before any prefix is reserved)
+    int         ofsInputArea;
+    int         szInputArea;
+    int         ofsOutputArea;
+    int         szOutputArea;
+
+    // Memory-mapped backend (Used when FPIO_MMAP is specified)
+    char *      mapBase;
+    int         mapFd;
+    int         dirtyBegin;     // Range modified since the last flush
+    int         dirtyEnd;
+
+    // Direct I/O backend (Used when FPIO_DIRECT is specified)
+    bool        direct;
+    bool        directAligned;  // O_DIRECT is in effect
+    bool        directBlockDev; // The image is a block device
+    char *      directBuffer;   // Sector-aligned mirror of the image
+    int         szDirectBuffer;
+
+    // File change notification (inotify) used while waiting for sync
+    // (One per direction, so each waiting thread gets all the events)
+    int         notifyFd;       // Output direction
+    int         notifyFdIn;     // Input direction
+
+    // Full-duplex support. fIO is the stream of the output direction and
+    // fIn the one of the input direction, so they don't share a position.
+    fstream *   fIn;
+    pthread_mutex_t sendLock;   // Held by the send functions (Recursive)
+    pthread_mutex_t recvLock;   // Held by the receive functions (Recursive)
+    pthread_mutex_t stateLock;  // Errors, statistics, dirty range and direct I/O buffer
+
+    // I/O buffers, owned and re-used by the object
+    char *      sendBuffer;
+    char *      recvBuffer;
+    char *      streamBuffer;   // Of fIO and fIn (FPIO_STREAM_BUFFER each)
+
+    // Staging buffers of the stream compression
+    char *      zSendBuffer;    // Raw input waiting to be deflated
+    char *      zRecvBuffer;    // Inflated output
+    int         zCapacity;      // Size of each staging buffer
+    int         zPending;       // Raw input bytes in zSendBuffer
+    int         zRatio;         // Raw data to try to pack per block (in blocks)
+    bool        zEof;           // The input stream has no more data
+
+    // Record batches (Allocated on first use)
+    char *      batchBuffer;    // Records waiting to be sent
+    int         batchLen;
+    long long   batchStart;     // When the first of them was queued
+    char *      recordBuffer;   // Batch being received
+    int         recordOfs;      // Next record in it
+    int         recordLen;
 
     // Re-open information
     char *      openName;
@@ -180,10 +503,41 @@ private:
     // (Cannot be changed during run-time)
     bool        binary;
 
+    // A block was placed by post() and we didn't see it read yet
+    bool        posted;
+
     // Functions
     int         waitForSync(int controlByteOffset, int timeout, char state, char mask = 0xff);
+    int         waitForState(int controlByteOffset, long long timeout, char state, char mask);
+    int         waitForAck(int controlByteOffset, long long tSent);
+    void        updateRtt(double rtt);
     int         setError(int code, string message);
-    void        flush();
+    void        flush(bool bInput = false);
+    int         sendRing(istream * stream);
+    int         receiveRing(ostream * stream);
+    int         sendBlock(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte, int lenFlags, bool bPost = false);
+    int         receiveBlock(const struct iovec * iov, int iovcnt, fpio_ctlbyte * ctrlByte, int * lenFlags);
+    int         readBlock(istream * stream, char * data, int szMax, int * dataLen, int * lenFlags, bool * bEnd);
+    int         writeBlock(ostream * stream, const char * data, int dataLen, int lenFlags);
+    int         waitForSlot(int ofsBlock, const char * block);
+
+    // Backend-independent I/O primitives
+    int         openStream(const char * filename, int flags);
+    int         openMapped(const char * filename, int flags);
+    int         mapImage();
+    int         directImage();
+    void        directInvalidate();
+    void        directRead(int offset, char * data, int dataLen);
+    void        directWrite(int offset, const char * data, int dataLen);
+    int         readHeader();
+    void        writeHeader();
+    void        setTopology(int ofsH2G, int szH2G, int ofsG2H, int szG2H);
+    bool        isInput(int offset);
+    fstream *   ioStream(int offset);
+    bool        ioGood();
+    void        ioRead(int offset, char * data, int dataLen);
+    void        ioWrite(int offset, const char * data, int dataLen);
+    char        ioReadByte(int offset);
     
 };
 
@@ -0,0 +1,214 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIOAsync.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Asynchronous Floppy I/O (See FloppyIOAsync.h)
+//
+
+#include "floppyIOAsync.h"
+
+//
+// Asynchronous I/O constructor
+//
+// Starts the I/O threads. From now on the FloppyIO instance belongs to
+// them and must not be used directly.
+//
+// @param fio       The FloppyIO instance to drive. It is deleted with this object.
+// @param queueSize How many requests can be waiting at the same time
+//
+FloppyIOAsync::FloppyIOAsync(FloppyIO * fio, int queueSize) {
+    this->fio = fio;
+    this->queueSize = queueSize;
+    this->busy = 0;
+    this->stop = false;
+
+    pthread_mutex_init(&this->lock, NULL);
+    pthread_cond_init(&this->wakeUp, NULL);
+    this->sendRunning = (pthread_create(&this->sendThread, NULL, FloppyIOAsync::sendMain, this) == 0);
+    this->receiveRunning = (pthread_create(&this->receiveThread, NULL, FloppyIOAsync::receiveMain, this) == 0);
+    if (!this->sendRunning || !this->receiveRunning) cerr << "Unable to start the floppy I/O threads!\n";
+}
+
+//
+// Asynchronous I/O destructor
+//
+// Cancels the requests in progress (Their waits for the guest end within
+// syncMaxSleep, whatever syncTimeout is) and discards the rest, without
+// invoking their callbacks.
+//
+FloppyIOAsync::~FloppyIOAsync() {
+    pthread_mutex_lock(&this->lock);
+    this->stop = true;
+    pthread_cond_broadcast(&this->wakeUp);
+    pthread_mutex_unlock(&this->lock);
+
+    this->fio->cancel();
+    if (this->sendRunning) pthread_join(this->sendThread, NULL);
+    if (this->receiveRunning) pthread_join(this->receiveThread, NULL);
+    pthread_cond_destroy(&this->wakeUp);
+    pthread_mutex_destroy(&this->lock);
+
+    delete this->fio;
+}
+
+//
+// Queue some data to be sent
+//
+// @param data      The data to send (Copied)
+// @param callback  The function to call on completion (Can be NULL)
+// @param userData  An extra argument for the callback
+// @return          0 if queued, FPIO_ERR_BUSY if the queue is full or FPIO_ERR_NOTREADY
+//
+int FloppyIOAsync::sendAsync(const string & data, fpio_callback callback, void * userData) {
+    fpio_request req;
+    req.bSend = true;
+    req.data = data;
+    req.result = 0;
+    req.callback = callback;
+    req.userData = userData;
+    return this->submit(req);
+}
+
+//
+// Queue a receive
+//
+// @param callback  The function that gets the data on completion
+// @param userData  An extra argument for the callback
+// @return          0 if queued, FPIO_ERR_BUSY if the queue is full or FPIO_ERR_NOTREADY
+//
+int FloppyIOAsync::receiveAsync(fpio_callback callback, void * userData) {
+    fpio_request req;
+    req.bSend = false;
+    req.result = 0;
+    req.callback = callback;
+    req.userData = userData;
+    return this->submit(req);
+}
+
+//
+// Put a request on its queue and wake its I/O thread up
+//
+int FloppyIOAsync::submit(const fpio_request & req) {
+    if (!this->sendRunning || !this->receiveRunning) return FPIO_ERR_NOTREADY;
+
+    pthread_mutex_lock(&this->lock);
+    if ((int)(this->sends.size() + this->receives.size()) >= this->queueSize) {
+        pthread_mutex_unlock(&this->lock);
+        return FPIO_ERR_BUSY;
+    }
+    (req.bSend ? this->sends : this->receives).push_back(req);
+    pthread_cond_broadcast(&this->wakeUp);
+    pthread_mutex_unlock(&this->lock);
+    return 0;
+}
+
+//
+// Deliver the completed requests
+//
+// The callbacks are invoked from the calling thread. Never blocks.
+//
+// @return  The number of callbacks invoked
+//
+int FloppyIOAsync::poll() {
+    deque<fpio_request> done;
+    int count = 0;
+
+    // Take the completions out, so the callbacks run without the lock
+    pthread_mutex_lock(&this->lock);
+    done.swap(this->completions);
+    pthread_mutex_unlock(&this->lock);
+
+    while (!done.empty()) {
+        fpio_request & req = done.front();
+        if (req.callback != NULL) {
+            req.callback(req.result, req.data, req.userData);
+            count++;
+        }
+        done.pop_front();
+    }
+    return count;
+}
+
+//
+// Count the requests that are not completed yet
+//
+int FloppyIOAsync::pending() {
+    pthread_mutex_lock(&this->lock);
+    int count = this->sends.size() + this->receives.size() + this->busy;
+    pthread_mutex_unlock(&this->lock);
+    return count;
+}
+
+//
+// I/O thread entry points
+//
+void * FloppyIOAsync::sendMain(void * self) {
+    ((FloppyIOAsync *)self)->run(&((FloppyIOAsync *)self)->sends);
+    return NULL;
+}
+
+void * FloppyIOAsync::receiveMain(void * self) {
+    ((FloppyIOAsync *)self)->run(&((FloppyIOAsync *)self)->receives);
+    return NULL;
+}
+
+//
+// I/O thread main loop: run the requests of a queue in order
+//
+// @param requests  The queue of the thread
+//
+void FloppyIOAsync::run(deque<fpio_request> * requests) {
+    fpio_request req;
+
+    pthread_mutex_lock(&this->lock);
+    for (;;) {
+        while (requests->empty() && !this->stop)
+            pthread_cond_wait(&this->wakeUp, &this->lock);
+        if (this->stop) break;
+
+        req = requests->front();
+        requests->pop_front();
+        this->busy++;
+        pthread_mutex_unlock(&this->lock);
+
+        // Run the request (Streams, so the data can span several blocks)
+        try {
+            if (req.bSend) {
+                istringstream in(req.data);
+                req.result = this->fio->send(&in);
+                req.data.clear();
+            } else {
+                ostringstream out;
+                req.result = this->fio->receive(&out);
+                req.data = out.str();
+            }
+        } catch (FloppyIOException & e) {
+            req.result = e.code;
+        }
+
+        // Errors should not block the following requests
+        if (req.result < 0) this->fio->clear();
+
+        pthread_mutex_lock(&this->lock);
+        this->busy--;
+        this->completions.push_back(req);
+    }
+    pthread_mutex_unlock(&this->lock);
+}
@@ -0,0 +1,118 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOAsync.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  Asynchronous Floppy I/O.
+//
+//  Two background threads own the FloppyIO instance, one for the sends
+//  and one for the receives (FloppyIO is full-duplex), and run the
+//  requests of a bounded queue each. Submitting never blocks: when the
+//  queues are full the request is refused. The completions are kept
+//  until the owner calls poll(), which invokes the callbacks in the
+//  caller's thread, so a control loop can keep serving its own events
+//  while the guest takes its time.
+//
+//  Sends are executed in order, and so are receives, but a receive that
+//  waits for the guest doesn't hold the sends queued after it.
+//
+
+#ifndef FLOPPYIOASYNC_H
+#define	FLOPPYIOASYNC_H
+
+#include <deque>
+#include <string>
+#include <pthread.h>
+#include "floppyIO.h"
+
+using namespace std;
+
+// Default number of requests that can be waiting in the queue
+
+#define DEFAULT_FIO_ASYNC_QUEUE 32
+
+//
+// Completion callback
+//
+// @param result    The number of bytes transferred or an error code
+// @param data      The data received (Empty for sends)
+// @param userData  The pointer given when the request was submitted
+//
+typedef void (*fpio_callback)(int result, const string & data, void * userData);
+
+//
+// An asynchronous request and, once done, its completion
+//
+struct fpio_request {
+    bool            bSend;      // Send (TRUE) or receive (FALSE)
+    string          data;       // Data to send / data received
+    int             result;     // Bytes transferred or error code
+    fpio_callback   callback;
+    void *          userData;
+};
+
+//
+// Asynchronous Floppy I/O class
+//
+class FloppyIOAsync {
+public:
+
+    // Constructors
+    FloppyIOAsync(FloppyIO * fio, int queueSize = DEFAULT_FIO_ASYNC_QUEUE);
+    virtual ~FloppyIOAsync();
+
+    // Functions
+    int         sendAsync(const string & data, fpio_callback callback = NULL, void * userData = NULL);
+    int         receiveAsync(fpio_callback callback, void * userData = NULL);
+    int         poll();
+    int         pending();
+
+    // The image, owned by the I/O threads (and deleted with this object)
+    FloppyIO *  fio;
+
+    // Queue limit (Sends and receives together)
+    int         queueSize;
+
+private:
+
+    // Requests and completions
+    deque<fpio_request> sends;
+    deque<fpio_request> receives;
+    deque<fpio_request> completions;
+    int         busy;           // Requests the I/O threads are running
+    bool        stop;
+
+    // Threading
+    pthread_t   sendThread;
+    pthread_t   receiveThread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeUp;
+    bool        sendRunning;
+    bool        receiveRunning;
+
+    // Functions
+    int         submit(const fpio_request & req);
+    void        run(deque<fpio_request> * requests);
+    static void * sendMain(void * self);
+    static void * receiveMain(void * self);
+
+};
+
+#endif	// FLOPPYIOASYNC_H
+
@@ -0,0 +1,332 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIOMux.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Logical channels over a single Floppy I/O image (See FloppyIOMux.h)
+//
+
+#include "floppyIOMux.h"
+#include <string.h>
+
+//
+// Multiplexer constructor
+//
+// @param fio   The FloppyIO instance that will carry the channels. It must
+//              stay valid for as long as the multiplexer is used.
+//
+FloppyIOMux::FloppyIOMux(FloppyIO * fio) {
+    this->fio = fio;
+    for (int i=0; i<FPIO_MUX_CHANNELS; i++) {
+        this->outOffset[i] = 0;
+        this->chunksSent[i] = 0;
+        this->chunksReceived[i] = 0;
+        this->chunksDropped[i] = 0;
+        this->inDiscard[i] = false;
+    }
+
+    // Chunk buffer, re-used for every receive
+    this->recvBuffer = new char[fio->szInput + 1];
+}
+
+//
+// Multiplexer destructor
+//
+FloppyIOMux::~FloppyIOMux() {
+    delete[] this->recvBuffer;
+}
+
+//
+// Queue a message on a channel
+//
+// Nothing is written on the image until pump() or flush() is called.
+//
+// @param channel   The channel (0 to FPIO_MUX_CHANNELS-1, lower is more urgent)
+// @param data      The message data
+// @param dataLen   The message length
+// @return          The message length or FPIO_ERR_CHANNEL
+//
+int FloppyIOMux::send(int channel, const void * data, size_t dataLen) {
+    if ((channel < 0) || (channel >= FPIO_MUX_CHANNELS)) return FPIO_ERR_CHANNEL;
+    this->outQueue[channel].push_back(string((const char *)data, dataLen));
+    return dataLen;
+}
+
+//
+// Queue a message on a channel
+//
+// @param channel   The channel (0 to FPIO_MUX_CHANNELS-1, lower is more urgent)
+// @param message   The message
+// @return          The message length or FPIO_ERR_CHANNEL
+//
+int FloppyIOMux::send(int channel, const string & message) {
+    return this->send(channel, message.data(), message.length());
+}
+
+//
+// Send the next chunk
+//
+// The chunk is taken from the most urgent channel that has something to
+// send.
+//
+// @return  The number of bytes sent, 0 if there was nothing to send or an error code
+//
+int FloppyIOMux::pump() {
+    return this->sendChunk(false);
+}
+
+//
+// Send the next chunk without waiting for it to be read (See FloppyIO::post)
+//
+// Ends that both post and collect what is available never wait for each
+// other, so they may exchange messages in both directions at once.
+//
+// @return  The number of bytes sent, 0 if there was nothing to send,
+//          FPIO_ERR_BUSY if the remote end didn't read the previous chunk
+//          yet, or an error code
+//
+int FloppyIOMux::post() {
+    return this->sendChunk(true);
+}
+
+//
+// Send the next chunk of the most urgent channel
+//
+// @param bPost     Don't wait for the remote end to read it
+// @return          The number of bytes sent, 0 if there was nothing to send or an error code
+//
+int FloppyIOMux::sendChunk(bool bPost) {
+    fpio_ctlbyte cB;
+    int szChunk = this->fio->szOutput - 1;
+
+    for (int ch=0; ch<FPIO_MUX_CHANNELS; ch++) {
+        if (this->outQueue[ch].empty()) continue;
+
+        // Cut the next chunk of the first message
+        const string & msg = this->outQueue[ch].front();
+        size_t szLeft = msg.length() - this->outOffset[ch];
+        size_t szSend = szLeft;
+        if (szSend > (size_t)szChunk) szSend = szChunk;
+
+        memset(&cB, 0, sizeof(cB));
+        cB.usID = ch;
+        cB.bEndOfData = (szSend == szLeft) ? 1 : 0;
+
+        int res = bPost ? this->fio->post(msg.data() + this->outOffset[ch], szSend, &cB)
+                        : this->fio->send(msg.data() + this->outOffset[ch], szSend, &cB);
+        if (res < 0) return res;
+        this->chunksSent[ch]++;
+
+        // Move on
+        if (cB.bEndOfData) {
+            this->outQueue[ch].pop_front();
+            this->outOffset[ch] = 0;
+        } else {
+            this->outOffset[ch] += szSend;
+        }
+        return szSend;
+    }
+
+    return 0;
+}
+
+//
+// Send everything that is queued, most urgent channels first
+//
+// @return  The number of bytes sent or an error code
+//
+int FloppyIOMux::flush() {
+    int sent = 0, res;
+    while (this->pending() > 0) {
+        res = this->pump();
+        if (res < 0) return res;
+        sent += res;
+    }
+    return sent;
+}
+
+//
+// Count the bytes waiting to be sent
+//
+// @param channel   The channel to check, or -1 for all of them
+// @return          The number of bytes queued
+//
+int FloppyIOMux::pending(int channel) {
+    int szPending = 0;
+    for (int ch=0; ch<FPIO_MUX_CHANNELS; ch++) {
+        if ((channel >= 0) && (ch != channel)) continue;
+        if (this->outQueue[ch].empty()) continue;
+
+        int szChannel = -this->outOffset[ch];
+        for (size_t i=0; i<this->outQueue[ch].size(); i++)
+            szChannel += this->outQueue[ch][i].length();
+
+        // Empty messages still need a chunk
+        szPending += (szChannel > 0) ? szChannel : 1;
+    }
+    return szPending;
+}
+
+//
+// Receive one chunk and put it on its channel
+//
+// @return  The channel of the chunk or an error code
+//
+int FloppyIOMux::receiveChunk() {
+    fpio_ctlbyte cB;
+    int rd = this->fio->receive(this->recvBuffer, this->fio->szInput, &cB);
+    if (rd < 0) return rd;
+
+    int ch = cB.usID;
+    this->chunksReceived[ch]++;
+
+    // Nobody reads this channel
+    if (this->inDiscard[ch]) {
+        this->chunksDropped[ch]++;
+        return ch;
+    }
+
+    // Aborted by the remote end? Drop what we have of the message
+    if (cB.bAborted) {
+        this->inPartial[ch].clear();
+        return FPIO_ERR_ABORTED;
+    }
+
+    this->inPartial[ch].append(this->recvBuffer, rd);
+    if (cB.bEndOfData) {
+        this->inQueue[ch].push_back(string());
+        this->inQueue[ch].back().swap(this->inPartial[ch]);
+    }
+    return ch;
+}
+
+//
+// Receive the next complete message from any channel
+//
+// Messages that already arrived are returned first, most urgent channels
+// first.
+//
+// @param channel   Receives the channel of the message
+// @param message   Receives the message
+// @return          The message length or an error code
+//
+int FloppyIOMux::receive(int * channel, string * message) {
+    int res;
+    for (;;) {
+        for (int ch=0; ch<FPIO_MUX_CHANNELS; ch++) {
+            if (this->inQueue[ch].empty()) continue;
+            this->take(ch, message);
+            if (channel != NULL) *channel = ch;
+            return message->length();
+        }
+
+        res = this->receiveChunk();
+        if (res < 0) return res;
+    }
+}
+
+//
+// Count the messages that can be received without waiting
+//
+// The chunks the remote end already placed are collected on the way, so
+// this never blocks. A remote end that keeps sending could keep it
+// collecting, unless the chunks are limited by maxChunks.
+//
+// @param channel   The channel to check, or -1 for all of them
+// @param maxChunks If not NULL, collect at most this many chunks. It is
+//                  decreased by the number of chunks collected.
+// @return          The number of complete messages waiting or an error code
+//
+int FloppyIOMux::available(int channel, int * maxChunks) {
+    int res;
+    if (channel >= FPIO_MUX_CHANNELS) return FPIO_ERR_CHANNEL;
+
+    for (;;) {
+        int count = 0;
+        for (int ch=0; ch<FPIO_MUX_CHANNELS; ch++) {
+            if ((channel >= 0) && (ch != channel)) continue;
+            count += this->inQueue[ch].size();
+        }
+        if (count > 0) return count;
+        if (!this->fio->available()) return 0;
+        if ((maxChunks != NULL) && (*maxChunks <= 0)) return 0;
+
+        res = this->receiveChunk();
+        if (maxChunks != NULL) (*maxChunks)--;
+        if ((res < 0) && (res != FPIO_ERR_ABORTED)) return res;
+    }
+}
+
+//
+// Receive the next complete message of a channel
+//
+// Messages of other channels that arrive meanwhile are kept for later.
+//
+// @param channel   The channel to wait on
+// @param message   Receives the message
+// @return          The message length or an error code
+//
+int FloppyIOMux::receive(int channel, string * message) {
+    int res;
+    if ((channel < 0) || (channel >= FPIO_MUX_CHANNELS)) return FPIO_ERR_CHANNEL;
+
+    while (this->inQueue[channel].empty()) {
+        res = this->receiveChunk();
+        if (res < 0) return res;
+    }
+
+    this->take(channel, message);
+    return message->length();
+}
+
+//
+// Drop the messages of a channel instead of keeping them
+//
+// The chunks of the channel are still read from the image (The remote end
+// waits for them to be), but thrown away as they arrive. What the channel
+// already holds is thrown away too.
+//
+// @param channel   The channel
+// @param bDiscard  Drop its messages (true) or keep them again (false)
+// @return          0 or FPIO_ERR_CHANNEL
+//
+int FloppyIOMux::discard(int channel, bool bDiscard) {
+    if ((channel < 0) || (channel >= FPIO_MUX_CHANNELS)) return FPIO_ERR_CHANNEL;
+    this->inDiscard[channel] = bDiscard;
+    if (bDiscard) {
+        this->inQueue[channel].clear();
+        this->inPartial[channel].clear();
+    }
+    return 0;
+}
+
+//
+// Hand the oldest message of a channel to the caller
+//
+// The caller's buffer is not freed: it collects the next message of the
+// channel, so a caller that reuses its string doesn't allocate once the
+// buffers are large enough.
+//
+void FloppyIOMux::take(int channel, string * message) {
+    message->clear();
+    message->swap(this->inQueue[channel].front());
+    if (this->inPartial[channel].empty())
+        this->inPartial[channel].swap(this->inQueue[channel].front());
+    this->inQueue[channel].pop_front();
+}
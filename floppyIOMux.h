@@ -0,0 +1,120 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOMux.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  Logical channels over a single Floppy I/O image.
+//
+//  Every message is split in chunks that fit in the I/O buffer. The
+//  channel of a chunk travels in the usID bits of its control byte and
+//  the last chunk of a message carries bEndOfData, so the receiving end
+//  can put the messages of all the channels back together.
+//
+//  Channels are also priorities: the next chunk to go is always taken
+//  from the lowest-numbered channel that has something to send, so a
+//  short control message overtakes a bulk transfer after at most one
+//  chunk.
+//
+//  Messages go through the single-buffer path of FloppyIO (Not the ring
+//  layout, that uses usID for its sequence numbers). Both ends should be
+//  FPIO_SYNCHRONIZED, otherwise a chunk may be overwritten before it is
+//  read. Messages sent by plain FloppyIO::send() arrive whole on channel 0
+//  (A plain send marks its block with bEndOfData).
+//
+//  The messages of a channel are kept until they are received. A channel
+//  nobody reads should be set to discard (See discard()), so that what
+//  the remote end sends there doesn't pile up.
+//
+
+#ifndef FLOPPYIOMUX_H
+#define	FLOPPYIOMUX_H
+
+#include <deque>
+#include <string>
+#include "floppyIO.h"
+
+using namespace std;
+
+// Number of channels (usID has 4 bits)
+#define FPIO_MUX_CHANNELS       16
+
+//
+// Well-known channels (Lower is more urgent)
+//
+#define FPIO_CHANNEL_CONTROL    0   // Control messages (pause/resume, handshakes)
+#define FPIO_CHANNEL_LOG        1   // Guest log streaming
+#define FPIO_CHANNEL_METRICS    2   // Metric samples
+#define FPIO_CHANNEL_FILE       3   // File transfers
+#define FPIO_CHANNEL_RPC        4   // Requests and answers (See FloppyIORPC)
+
+//
+// Floppy I/O channel multiplexer
+//
+class FloppyIOMux {
+public:
+
+    // Constructors
+    FloppyIOMux(FloppyIO * fio);
+    virtual ~FloppyIOMux();
+
+    // Sending
+    int         send(int channel, const void * data, size_t dataLen);
+    int         send(int channel, const string & message);
+    int         pump();
+    int         post();
+    int         flush();
+    int         pending(int channel = -1);
+
+    // Receiving
+    int         receive(int * channel, string * message);
+    int         receive(int channel, string * message);
+    int         available(int channel = -1, int * maxChunks = NULL);
+    int         discard(int channel, bool bDiscard = true);
+
+    // The image we multiplex
+    FloppyIO *  fio;
+
+    // Statistics
+    unsigned long chunksSent[FPIO_MUX_CHANNELS];
+    unsigned long chunksReceived[FPIO_MUX_CHANNELS];
+    unsigned long chunksDropped[FPIO_MUX_CHANNELS];
+
+private:
+
+    // Outgoing messages and how much of the first one is already sent
+    deque<string> outQueue[FPIO_MUX_CHANNELS];
+    size_t      outOffset[FPIO_MUX_CHANNELS];
+
+    // Incoming messages and the one being reassembled
+    deque<string> inQueue[FPIO_MUX_CHANNELS];
+    string      inPartial[FPIO_MUX_CHANNELS];
+    bool        inDiscard[FPIO_MUX_CHANNELS];
+
+    // Chunk buffer
+    char *      recvBuffer;
+
+    // Functions
+    int         sendChunk(bool bPost);
+    int         receiveChunk();
+    void        take(int channel, string * message);
+
+};
+
+#endif	// FLOPPYIOMUX_H
+
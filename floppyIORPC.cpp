@@ -0,0 +1,342 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIORPC.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Requests and answers over a Floppy I/O channel (See FloppyIORPC.h)
+//
+
+#include "floppyIORPC.h"
+#include <unistd.h>
+#include <sys/time.h>
+
+//
+// Append an unsigned integer to a message (Little endian)
+//
+static void fpio_put(string * message, unsigned long long value, int bytes) {
+    for (int i=0; i<bytes; i++) {
+        message->push_back((char)(value & 0xFF));
+        value >>= 8;
+    }
+}
+
+//
+// Read an unsigned integer from a message (Little endian)
+//
+static unsigned long long fpio_get(const string & message, size_t offset, int bytes) {
+    unsigned long long value = 0;
+    for (int i=bytes-1; i>=0; i--)
+        value = (value << 8) | (unsigned char)message[offset + i];
+    return value;
+}
+
+// Current time in microseconds
+static long long fpio_rpc_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+//
+// RPC constructor
+//
+// @param mux       The channel multiplexer to talk over. It must stay
+//                  valid for as long as this object is used.
+// @param channel   The channel reserved for the requests and answers
+//
+FloppyIORPC::FloppyIORPC(FloppyIOMux * mux, int channel) {
+    this->mux = mux;
+    this->channel = channel;
+    this->nextId = 1;
+    this->callsSent = 0;
+    this->callsAnswered = 0;
+    this->callsExpired = 0;
+    this->callsServed = 0;
+    this->lastRtt = 0;
+}
+
+//
+// RPC destructor
+//
+FloppyIORPC::~FloppyIORPC() {
+}
+
+//
+// Call a method of the other end and wait for its answer
+//
+// @param method    The method
+// @param args      Its arguments
+// @param result    Receives the result
+// @param deadline  How long to wait for the answer (milliseconds)
+// @return          The status of the answer or an error code
+//
+int FloppyIORPC::call(const string & method, const string & args, string * result, int deadline) {
+    int id = this->request(method, args, deadline);
+    if (id < 0) return id;
+    return this->wait(id, result);
+}
+
+//
+// Send a request without waiting for its answer (See wait)
+//
+// The request is queued and goes out while we poll (ex. in wait), so
+// several requests can be in flight.
+//
+// @param method    The method (Up to 255 characters)
+// @param args      Its arguments
+// @param deadline  How long the answer will be waited for (milliseconds)
+// @return          The ID of the request or an error code
+//
+int FloppyIORPC::request(const string & method, const string & args, int deadline) {
+    string message;
+    if (method.length() > 255) return FPIO_ERR_INPUT;
+
+    int id = this->nextId;
+    this->nextId = (this->nextId == 0x7FFFFFFF) ? 1 : this->nextId + 1;
+
+    message.reserve(6 + method.length() + args.length());
+    message.push_back(FPIO_RPC_REQUEST);
+    fpio_put(&message, id, 4);
+    fpio_put(&message, method.length(), 1);
+    message.append(method);
+    message.append(args);
+
+    // Register it first, the answer may come while we are still sending
+    fpio_rpc_call * c = &this->calls[id];
+    c->tSent = fpio_rpc_time();
+    c->tDeadline = c->tSent + (long long)deadline * 1000;
+    c->answered = false;
+    c->status = 0;
+
+    int res = this->mux->send(this->channel, message);
+    if (res >= 0) res = this->poll();
+    if (res < 0) {
+        this->calls.erase(id);
+        return res;
+    }
+
+    this->callsSent++;
+    return id;
+}
+
+//
+// Wait for the answer of a request
+//
+// Requests and answers of other calls that arrive meanwhile are
+// processed too. Once the deadline of the request is over it is
+// forgotten, and its answer will be dropped.
+//
+// @param id        The ID given by request()
+// @param result    Receives the result
+// @return          The status of the answer, FPIO_ERR_TIMEOUT if the deadline
+//                  passed, FPIO_ERR_INPUT for an unknown ID or an error code
+//
+int FloppyIORPC::wait(int id, string * result) {
+    int iSleep = FPIO_TUNE_SLEEP;
+    int res;
+
+    if (this->calls.find(id) == this->calls.end()) return FPIO_ERR_INPUT;
+
+    for (;;) {
+        res = this->poll();
+        if (res < 0) return res;
+
+        // The entry may move while we poll, look it up again
+        map<int, fpio_rpc_call>::iterator it = this->calls.find(id);
+        if (it == this->calls.end()) return FPIO_ERR_INPUT;
+        fpio_rpc_call * c = &it->second;
+
+        if (c->answered) {
+            int status = c->status;
+            result->swap(c->result);
+            this->calls.erase(it);
+            return status;
+        }
+
+        // Something arrived? Check again right away
+        if (res > 0) {
+            iSleep = FPIO_TUNE_SLEEP;
+            continue;
+        }
+
+        // Late?
+        if (fpio_rpc_time() > c->tDeadline) {
+            this->calls.erase(it);
+            this->callsExpired++;
+            return FPIO_ERR_TIMEOUT;
+        }
+
+        usleep(iSleep);
+        iSleep *= 2;
+        if (iSleep > FPIO_RPC_MAXSLEEP) iSleep = FPIO_RPC_MAXSLEEP;
+    }
+}
+
+//
+// Count the requests still waiting for their answer
+//
+// @return  The number of outstanding requests
+//
+int FloppyIORPC::outstanding() {
+    int count = 0;
+    for (map<int, fpio_rpc_call>::iterator it = this->calls.begin(); it != this->calls.end(); it++)
+        if (!it->second.answered) count++;
+    return count;
+}
+
+//
+// Register the handler of a method
+//
+// @param method    The method, or FPIO_RPC_ANY for the methods with no handler
+// @param handler   The handler (NULL to remove it)
+// @param context   Given to the handler on every call
+//
+void FloppyIORPC::handle(const string & method, fpio_rpc_handler handler, void * context) {
+    if (handler == NULL) {
+        this->methods.erase(method);
+        return;
+    }
+    this->methods[method].handler = handler;
+    this->methods[method].context = context;
+}
+
+//
+// Wait for the next message of the channel and process it
+//
+// The answers queued go out meanwhile. When there are none, we simply
+// block on the channel.
+//
+// @return  0 if successful or an error code
+//
+int FloppyIORPC::serve() {
+    string message;
+    int iSleep = FPIO_TUNE_SLEEP;
+    int res;
+
+    for (;;) {
+        res = this->poll();
+        if (res < 0) return res;
+        if (res > 0) return 0;
+
+        if (this->mux->pending() == 0) {
+            res = this->mux->receive(this->channel, &message);
+            if (res < 0) return res;
+            res = this->dispatch(message);
+            if (res < 0) return res;
+            res = this->poll();
+            return (res < 0) ? res : 0;
+        }
+
+        usleep(iSleep);
+        iSleep *= 2;
+        if (iSleep > FPIO_RPC_MAXSLEEP) iSleep = FPIO_RPC_MAXSLEEP;
+    }
+}
+
+//
+// Send what is queued as far as the remote end keeps up, and process the
+// messages that already arrived, without waiting
+//
+// Neither end ever waits for the other to read, so both can poll and
+// send at the same time.
+//
+// @return  The number of messages processed or an error code
+//
+int FloppyIORPC::poll() {
+    string message;
+    int count = 0, res;
+
+    for (;;) {
+        while (this->mux->pending() > 0) {
+            res = this->mux->post();
+            if (res == FPIO_ERR_BUSY) break;
+            if (res < 0) return res;
+        }
+
+        res = this->mux->available(this->channel);
+        if (res < 0) return res;
+        if (res == 0) return count;
+
+        res = this->mux->receive(this->channel, &message);
+        if (res < 0) return res;
+        res = this->dispatch(message);
+        if (res < 0) return res;
+        count++;
+    }
+}
+
+//
+// Process a message received on the channel
+//
+// Requests are given to their handler and their answer is queued (It goes
+// out with the next poll, serve or flush of the multiplexer), answers
+// complete their request.
+//
+// @param message   The message
+// @return          0 if successful or an error code
+//
+int FloppyIORPC::dispatch(const string & message) {
+    if (message.length() < 5) return FPIO_ERR_DATA;
+    int id = (int)fpio_get(message, 1, 4);
+
+    if (message[0] == FPIO_RPC_ANSWER) {
+        if (message.length() < 9) return FPIO_ERR_DATA;
+
+        // Expired (or unknown)? Drop it
+        map<int, fpio_rpc_call>::iterator it = this->calls.find(id);
+        if (it == this->calls.end()) return 0;
+
+        fpio_rpc_call * c = &it->second;
+        c->answered = true;
+        c->status = (int)fpio_get(message, 5, 4);
+        c->result.assign(message, 9, string::npos);
+        this->lastRtt = (fpio_rpc_time() - c->tSent) / 1000000.0;
+        this->callsAnswered++;
+        return 0;
+    }
+
+    if (message[0] != FPIO_RPC_REQUEST) return FPIO_ERR_DATA;
+
+    // Find the handler
+    size_t szMethod = (unsigned char)message[5];
+    if (message.length() < 6 + szMethod) return FPIO_ERR_DATA;
+    string method(message, 6, szMethod);
+    string args(message, 6 + szMethod, string::npos);
+    string result;
+    int status = FPIO_ERR_METHOD;
+
+    map<string, fpio_rpc_method>::iterator it = this->methods.find(method);
+    if (it == this->methods.end()) it = this->methods.find(FPIO_RPC_ANY);
+    if (it != this->methods.end())
+        status = it->second.handler(method, args, &result, it->second.context);
+
+    // Answer
+    string answer;
+    answer.reserve(9 + result.length());
+    answer.push_back(FPIO_RPC_ANSWER);
+    fpio_put(&answer, id, 4);
+    fpio_put(&answer, (unsigned int)status, 4);
+    answer.append(result);
+
+    int res = this->mux->send(this->channel, answer);
+    if (res < 0) return res;
+
+    this->callsServed++;
+    return 0;
+}
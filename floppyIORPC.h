@@ -0,0 +1,146 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIORPC.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  Requests and answers over a Floppy I/O channel.
+//
+//  A request names a method of the other end and carries its arguments.
+//  It is tagged with an ID that the answer repeats, so several requests
+//  can be outstanding at once and their answers can come in any order:
+//
+//    int idLoad = rpc.request("load", "");
+//    int idJob = rpc.request("progress", "job-1");
+//    rpc.wait(idLoad, &load);
+//    rpc.wait(idJob, &progress);
+//
+//  Every request has a deadline (milliseconds). wait() gives up on it
+//  once the deadline is over, and an answer that comes later is dropped.
+//
+//  The serving end registers a handler per method and calls serve() (or
+//  passes the messages it received on the channel to dispatch(), and
+//  flushes the multiplexer). The status returned by the handler travels
+//  back with its result.
+//
+//  The messages are posted (See FloppyIOMux::post): the calling end never
+//  waits for the other one to read, so a request and an answer can cross
+//  on the image without the two ends waiting for each other.
+//
+//  All the messages go through a FloppyIOMux channel (FPIO_CHANNEL_RPC by
+//  default). Integers are little endian.
+//
+
+#ifndef FLOPPYIORPC_H
+#define	FLOPPYIORPC_H
+
+#include <map>
+#include <string>
+#include "floppyIO.h"
+#include "floppyIOMux.h"
+
+using namespace std;
+
+// Default deadline of a request (milliseconds)
+
+#define DEFAULT_FIO_RPC_DEADLINE    1000
+
+// Ceiling of the back-off while waiting for an answer (microseconds)
+
+#define FPIO_RPC_MAXSLEEP           1000
+
+// Method that gets the requests no other handler takes
+
+#define FPIO_RPC_ANY                "*"
+
+//
+// RPC message types (First byte of every message)
+//
+#define FPIO_RPC_REQUEST    'Q'     // id:4, method length:1, method, arguments
+#define FPIO_RPC_ANSWER     'A'     // id:4, status:4, result
+
+//
+// A method handler
+//
+// @param method    The method called (Useful to FPIO_RPC_ANY handlers)
+// @param args      The arguments of the request
+// @param result    Receives the result
+// @param context   The context given when the handler was registered
+// @return          The status sent back (Negative values are errors)
+//
+typedef int (*fpio_rpc_handler)(const string & method, const string & args, string * result, void * context);
+
+//
+// Request/answer class
+//
+class FloppyIORPC {
+public:
+
+    // Constructors
+    FloppyIORPC(FloppyIOMux * mux, int channel = FPIO_CHANNEL_RPC);
+    virtual ~FloppyIORPC();
+
+    // Calling
+    int         call(const string & method, const string & args, string * result, int deadline = DEFAULT_FIO_RPC_DEADLINE);
+    int         request(const string & method, const string & args, int deadline = DEFAULT_FIO_RPC_DEADLINE);
+    int         wait(int id, string * result);
+    int         outstanding();
+
+    // Serving
+    void        handle(const string & method, fpio_rpc_handler handler, void * context = NULL);
+    int         serve();
+    int         dispatch(const string & message);
+
+    // Both
+    int         poll();
+
+    // The channel multiplexer we talk over
+    FloppyIOMux * mux;
+    int         channel;
+
+    // Statistics
+    unsigned long callsSent;        // Requests sent
+    unsigned long callsAnswered;    // Answers received in time
+    unsigned long callsExpired;     // Requests that passed their deadline
+    unsigned long callsServed;      // Requests answered
+    double      lastRtt;            // Round trip of the last answer (seconds)
+
+private:
+
+    // An outstanding request
+    struct fpio_rpc_call {
+        long long   tSent;          // When it was sent (microseconds)
+        long long   tDeadline;      // When we stop waiting
+        bool        answered;
+        int         status;
+        string      result;
+    };
+
+    // A registered handler
+    struct fpio_rpc_method {
+        fpio_rpc_handler handler;
+        void *      context;
+    };
+
+    map<int, fpio_rpc_call> calls;
+    map<string, fpio_rpc_method> methods;
+    int         nextId;
+
+};
+
+#endif	// FLOPPYIORPC_H
@@ -0,0 +1,508 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIOSerial.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Floppy I/O over a serial line (See FloppyIOSerial.h)
+//
+
+#include "floppyIOSerial.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//
+// Serial I/O constructor
+//
+// Opens a serial line. Character devices (ex. /dev/ttyS0 on the guest)
+// are switched to raw mode, anything else is taken for the Unix domain
+// socket of a VirtualBox host pipe and connected to.
+//
+// @param path      The tty device or the socket
+// @param flags     FPIO_EXCEPTIONS is the only flag used
+//
+FloppyIOSerial::FloppyIOSerial(const char * path, int flags) {
+    struct stat st;
+
+    this->fd = -1;
+    this->init(flags);
+
+    if ((stat(path, &st) == 0) && S_ISCHR(st.st_mode)) {
+
+        // A tty: raw bytes, no echo, no line discipline
+        this->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (this->fd < 0) {
+            this->setError(FPIO_ERR_CREATE, "Unable to open the serial device!");
+            return;
+        }
+        struct termios tio;
+        if (tcgetattr(this->fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            cfsetispeed(&tio, DEFAULT_FIO_SERIAL_BAUD);
+            cfsetospeed(&tio, DEFAULT_FIO_SERIAL_BAUD);
+            tio.c_cflag |= CLOCAL | CREAD;
+            tcsetattr(this->fd, TCSANOW, &tio);
+        }
+        cerr << "Serial I/O on tty " << path << "\n";
+
+    } else {
+
+        // The host pipe of the VM
+        struct sockaddr_un addr;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            this->setError(FPIO_ERR_CREATE, "The serial socket path is too long!");
+            return;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        this->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (this->fd < 0) {
+            this->setError(FPIO_ERR_CREATE, "Unable to create the serial socket!");
+            return;
+        }
+        if (connect(this->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(this->fd);
+            this->fd = -1;
+            this->setError(FPIO_ERR_CREATE, "Unable to connect to the serial socket!");
+            return;
+        }
+        this->isSocket = true;
+        fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) | O_NONBLOCK);
+        cerr << "Serial I/O on socket " << path << "\n";
+    }
+
+    this->ownFd = true;
+}
+
+//
+// Serial I/O constructor
+//
+// Uses a line that is already open (ex. one end of a socketpair). The
+// descriptor is switched to non-blocking mode and is not closed by this
+// object.
+//
+// @param fd        The connected file descriptor
+// @param flags     FPIO_EXCEPTIONS is the only flag used
+//
+FloppyIOSerial::FloppyIOSerial(int fd, int flags) {
+    struct stat st;
+
+    this->fd = fd;
+    this->init(flags);
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        this->setError(FPIO_ERR_NOTREADY, "Invalid serial file descriptor!");
+        return;
+    }
+    this->isSocket = ((fstat(fd, &st) == 0) && S_ISSOCK(st.st_mode));
+}
+
+//
+// Common initialization
+//
+void FloppyIOSerial::init(int flags) {
+    this->ownFd = false;
+    this->isSocket = false;
+    this->error = 0;
+    this->useExceptions = ((flags & FPIO_EXCEPTIONS) != 0);
+    this->syncTimeout = DEFAULT_FIO_SYNC_TIMEOUT;
+    this->framesSent = 0;
+    this->framesReceived = 0;
+    this->bytesSkipped = 0;
+    this->inBuffer = new char[FPIO_SERIAL_BLOCK];
+    this->inBegin = 0;
+    this->inEnd = 0;
+}
+
+//
+// Serial I/O destructor
+//
+FloppyIOSerial::~FloppyIOSerial() {
+    if (this->ownFd && (this->fd >= 0)) close(this->fd);
+    delete[] this->inBuffer;
+}
+
+//
+// Send a string as a single frame
+//
+// @param strData   The string to send
+// @param ctrlByte  The extra parameters you want to send in the control byte
+// @return          The number of bytes sent or an error code
+//
+int FloppyIOSerial::send(const string & strData, fpio_ctlbyte * ctrlByte) {
+    return this->send(strData.data(), strData.length(), ctrlByte);
+}
+
+//
+// Send a memory buffer as a single frame
+//
+// @param data      A pointer to the data buffer to send
+// @param dataLen   The size of the buffer
+// @param ctrlByte  The extra parameters you want to send in the control byte
+// @return          The number of bytes sent or an error code
+//
+int FloppyIOSerial::send(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte) {
+    unsigned char header[FPIO_SERIAL_HEADER];
+    unsigned int crc;
+    int res;
+
+    if (!this->ready()) return this->setError(FPIO_ERR_NOTREADY, "Serial I/O is not ready!");
+    if (dataLen > FPIO_SERIAL_MAX_FRAME) return this->setError(FPIO_ERR_INPUT, "Data too big for a serial frame!");
+
+    // Same default as the image: data present, a whole message
+    header[0] = FPIO_SERIAL_MAGIC;
+    header[1] = 3;
+    if (ctrlByte != NULL) {
+        fpio_ctlbyte cB = *ctrlByte;
+        cB.bDataPresent = 1;
+        memcpy(&header[1], &cB, 1);
+    }
+    for (int i=0; i<4; i++) header[2+i] = (dataLen >> (8*i)) & 0xFF;
+    crc = fpio_crc32c(0, header, FPIO_SERIAL_CHECKED);
+    for (int i=0; i<4; i++) header[FPIO_SERIAL_CHECKED+i] = (crc >> (8*i)) & 0xFF;
+
+    res = this->writeAll((const char *)header, sizeof(header));
+    if (res < 0) return res;
+    res = this->writeAll((const char *)data, dataLen);
+    if (res < 0) return res;
+
+    this->framesSent++;
+    return dataLen;
+}
+
+//
+// Send a stream
+//
+// The stream is cut in frames of up to FPIO_SERIAL_BLOCK bytes and the
+// last one carries bEndOfData.
+//
+// @param stream    The stream to send
+// @return          The number of bytes sent or an error code
+//
+int FloppyIOSerial::send(istream * stream) {
+    char * block = new char[FPIO_SERIAL_BLOCK];
+    fpio_ctlbyte cB;
+    int total = 0, res = 0;
+
+    memset(&cB, 0, sizeof(cB));
+    do {
+        stream->read(block, FPIO_SERIAL_BLOCK);
+        int rd = stream->gcount();
+        if (stream->bad()) {
+            res = this->setError(FPIO_ERR_INPUT, "Error while reading from the input stream!");
+            break;
+        }
+
+        // The last block closes the stream
+        cB.bEndOfData = (stream->eof() || (stream->peek() == EOF)) ? 1 : 0;
+        res = this->send(block, rd, &cB);
+        if (res < 0) break;
+        total += rd;
+    } while (!cB.bEndOfData);
+
+    delete[] block;
+    return (res < 0) ? res : total;
+}
+
+//
+// Receive a frame as a string
+//
+// @return  The data received (Empty on errors)
+//
+string FloppyIOSerial::receive() {
+    string data;
+    this->receive(&data);
+    return data;
+}
+
+//
+// Receive a frame into a memory buffer
+//
+// The data that don't fit in the buffer are dropped.
+//
+// @param data      The buffer
+// @param dataLen   The size of the buffer
+// @param ctrlByte  Receives the control byte of the frame
+// @return          The number of bytes placed in the buffer or an error code
+//
+int FloppyIOSerial::receive(void * data, size_t dataLen, fpio_ctlbyte * ctrlByte) {
+    return this->readFrame(ctrlByte, NULL, data, dataLen);
+}
+
+//
+// Receive a frame into a string
+//
+// @param strBuffer The string that receives the data
+// @param ctrlByte  Receives the control byte of the frame
+// @return          The number of bytes received or an error code
+//
+int FloppyIOSerial::receive(string * strBuffer, fpio_ctlbyte * ctrlByte) {
+    return this->readFrame(ctrlByte, strBuffer, NULL, 0);
+}
+
+//
+// Receive a stream
+//
+// Frames are written on the stream up to the one with bEndOfData.
+//
+// @param stream    The stream to write on
+// @return          The number of bytes received or an error code
+//
+int FloppyIOSerial::receive(ostream * stream) {
+    fpio_ctlbyte cB;
+    string data;
+    int total = 0, res;
+
+    do {
+        res = this->readFrame(&cB, &data, NULL, 0);
+        if (res < 0) return res;
+        if (cB.bAborted) return this->setError(FPIO_ERR_ABORTED, "Transfer aborted by the remote end!");
+        stream->write(data.data(), data.length());
+        total += res;
+    } while (!cB.bEndOfData);
+
+    return total;
+}
+
+//
+// Read the next frame
+//
+// @param ctrlByte  Receives the control byte (Can be NULL)
+// @param data      Receives the data (If NULL, the buffer is used)
+// @param buffer    Receives the data that fit in it
+// @param szBuffer  The size of the buffer
+// @return          The size of the data received or an error code
+//
+int FloppyIOSerial::readFrame(fpio_ctlbyte * ctrlByte, string * data, void * buffer, size_t szBuffer) {
+    unsigned char * p;
+    size_t dataLen;
+    unsigned int crc;
+    int res;
+
+    if (!this->ready()) return this->setError(FPIO_ERR_NOTREADY, "Serial I/O is not ready!");
+
+    for (;;) {
+
+        // Look for the start of a frame
+        if (this->inBegin == this->inEnd) {
+            res = this->fill();
+            if (res < 0) return res;
+        }
+        p = (unsigned char *)memchr(this->inBuffer + this->inBegin, FPIO_SERIAL_MAGIC, this->inEnd - this->inBegin);
+        if (p == NULL) {
+            this->bytesSkipped += this->inEnd - this->inBegin;
+            this->inBegin = this->inEnd;
+            continue;
+        }
+        this->bytesSkipped += (char *)p - (this->inBuffer + this->inBegin);
+        this->inBegin = (char *)p - this->inBuffer;
+
+        // Get the whole header
+        while (this->inEnd - this->inBegin < FPIO_SERIAL_HEADER) {
+            res = this->fill();
+            if (res < 0) return res;
+        }
+        p = (unsigned char *)this->inBuffer + this->inBegin;
+        dataLen = p[2] | (p[3] << 8) | (p[4] << 16) | ((size_t)p[5] << 24);
+        crc = p[6] | (p[7] << 8) | (p[8] << 16) | ((unsigned int)p[9] << 24);
+
+        // A real frame? Otherwise the magic byte was noise
+        if (((p[1] & 1) == 0) || (dataLen > FPIO_SERIAL_MAX_FRAME) ||
+            (crc != fpio_crc32c(0, p, FPIO_SERIAL_CHECKED))) {
+            this->bytesSkipped++;
+            this->inBegin++;
+            continue;
+        }
+        break;
+    }
+
+    if (ctrlByte != NULL) memcpy(ctrlByte, &p[1], 1);
+    this->inBegin += FPIO_SERIAL_HEADER;
+
+    // Get the data
+    if (data != NULL) {
+        data->resize(dataLen);
+        res = this->readBytes(dataLen ? &(*data)[0] : NULL, dataLen);
+        if (res < 0) return res;
+    } else {
+        size_t szCopy = (dataLen < szBuffer) ? dataLen : szBuffer;
+        res = this->readBytes((char *)buffer, szCopy);
+        if (res >= 0) res = this->readBytes(NULL, dataLen - szCopy);
+        if (res < 0) return res;
+        dataLen = szCopy;
+    }
+
+    this->framesReceived++;
+    return dataLen;
+}
+
+//
+// Take bytes out of the line
+//
+// @param data      Where to put them (NULL to drop them)
+// @param dataLen   How many
+// @return          0 or an error code
+//
+int FloppyIOSerial::readBytes(char * data, size_t dataLen) {
+    while (dataLen > 0) {
+        if (this->inBegin == this->inEnd) {
+            int res = this->fill();
+            if (res < 0) return res;
+        }
+        size_t szCopy = this->inEnd - this->inBegin;
+        if (szCopy > dataLen) szCopy = dataLen;
+        if (data != NULL) {
+            memcpy(data, this->inBuffer + this->inBegin, szCopy);
+            data += szCopy;
+        }
+        this->inBegin += szCopy;
+        dataLen -= szCopy;
+    }
+    return 0;
+}
+
+//
+// Read what is available on the line into the receive buffer
+//
+// Blocks (in poll) until something arrives or syncTimeout expires.
+//
+// @return  The number of bytes read or an error code
+//
+int FloppyIOSerial::fill() {
+    int res;
+
+    // Make room at the end
+    if (this->inBegin == this->inEnd) {
+        this->inBegin = this->inEnd = 0;
+    } else if (this->inBegin > 0) {
+        memmove(this->inBuffer, this->inBuffer + this->inBegin, this->inEnd - this->inBegin);
+        this->inEnd -= this->inBegin;
+        this->inBegin = 0;
+    }
+
+    for (;;) {
+        ssize_t rd = read(this->fd, this->inBuffer + this->inEnd, FPIO_SERIAL_BLOCK - this->inEnd);
+        if (rd > 0) {
+            this->inEnd += rd;
+            return rd;
+        }
+        if (rd == 0) return this->setError(FPIO_ERR_IO, "The serial line was closed!");
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) return this->setError(FPIO_ERR_IO, "Unable to read from the serial line!");
+
+        res = this->waitFor(POLLIN);
+        if (res < 0) return res;
+    }
+}
+
+//
+// Write a buffer on the line
+//
+// @return  0 or an error code
+//
+int FloppyIOSerial::writeAll(const char * data, size_t dataLen) {
+    ssize_t wr;
+    int res;
+
+    while (dataLen > 0) {
+        if (this->isSocket) {
+            // No SIGPIPE if the VM went away
+            wr = ::send(this->fd, data, dataLen, MSG_NOSIGNAL);
+        } else {
+            wr = write(this->fd, data, dataLen);
+        }
+        if (wr > 0) {
+            data += wr;
+            dataLen -= wr;
+            continue;
+        }
+        if ((wr < 0) && (errno == EINTR)) continue;
+        if ((wr < 0) && (errno != EAGAIN)) return this->setError(FPIO_ERR_IO, "Unable to write on the serial line!");
+
+        res = this->waitFor(POLLOUT);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+//
+// Wait until the line is readable or writable
+//
+// @param events    POLLIN or POLLOUT
+// @return          0 or an error code
+//
+int FloppyIOSerial::waitFor(short events) {
+    struct pollfd pfd;
+    int res;
+
+    pfd.fd = this->fd;
+    pfd.events = events;
+    for (;;) {
+        res = poll(&pfd, 1, (this->syncTimeout > 0) ? this->syncTimeout * 1000 : -1);
+        if (res > 0) return 0;  // Errors and hang-ups show up on the next read/write
+        if (res == 0) return this->setError(FPIO_ERR_TIMEOUT, "Timeout while waiting on the serial line!");
+        if (errno != EINTR) return this->setError(FPIO_ERR_IO, "Unable to wait on the serial line!");
+    }
+}
+
+//
+// Set last error (See FloppyIO::setError)
+//
+int FloppyIOSerial::setError(int code, const string message) {
+    this->error = code;
+
+    // Chain errors
+    if (this->errorStr.empty()) {
+        this->errorStr = message;
+    } else {
+        this->errorStr = message + " (" + this->errorStr + ")";
+    }
+
+    // Should we raise an exception?
+    if (this->useExceptions) {
+        FloppyIOException e;
+        throw *e.set(code, message);
+    }
+    return code;
+}
+
+//
+// Clear error state flags
+//
+void FloppyIOSerial::clear() {
+    this->error = 0;
+    this->errorStr = "";
+}
+
+//
+// Check if everything is in ready state
+// @return Returns true if there are no errors and the line is open
+//
+bool FloppyIOSerial::ready() {
+    if (this->error != 0) return false;
+    return (this->fd >= 0);
+}
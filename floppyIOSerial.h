@@ -0,0 +1,133 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOSerial.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  The Floppy I/O interface over a serial line.
+//
+//  VirtualBox can connect the UART of a guest to a Unix domain socket on
+//  the host (--uartmode1 server <path>). The guest then sees a plain
+//  serial port (/dev/ttyS0), and both ends get a real byte stream instead
+//  of a polled image: nothing is polled, the calls block in poll() until
+//  the other end writes or reads.
+//
+//  FloppyIOSerial offers the send/receive calls of FloppyIO on such a
+//  line. Every block travels as a frame:
+//
+//    [FPIO_SERIAL_MAGIC] [control byte] [length: 4 bytes] [CRC32C: 4 bytes] [data]
+//
+//  (Little endian, the CRC32C is the one of the first 6 bytes.) The
+//  control byte keeps the meaning it has on the image (bEndOfData closes
+//  a stream, usID is free for the caller). The receiver drops the bytes
+//  in front of a magic byte, and a magic byte whose header doesn't check,
+//  so it can join a line in the middle of some noise (ex. a getty or the
+//  kernel console on the guest side).
+//
+//  Any connected file descriptor can be used too (ex. one end of a
+//  socketpair, to test both ends in the same process).
+//
+
+#ifndef FLOPPYIOSERIAL_H
+#define	FLOPPYIOSERIAL_H
+
+#include <string>
+#include "floppyIO.h"
+
+using namespace std;
+
+// First byte of every frame
+
+#define FPIO_SERIAL_MAGIC       0xF5
+
+// Size of the frame header, and of the part of it the CRC covers
+
+#define FPIO_SERIAL_HEADER      10
+#define FPIO_SERIAL_CHECKED     6
+
+// Largest block sent by the stream functions. Larger frames are refused,
+// a corrupted length must not make us wait for gigabytes.
+
+#define FPIO_SERIAL_BLOCK       65536
+#define FPIO_SERIAL_MAX_FRAME   (16*1024*1024)
+
+// Speed used for the tty devices
+
+#define DEFAULT_FIO_SERIAL_BAUD B115200
+
+//
+// Floppy I/O over a serial line
+//
+class FloppyIOSerial {
+public:
+
+    // Constructors
+    FloppyIOSerial(const char * path, int flags = 0);
+    FloppyIOSerial(int fd, int flags = 0);
+    virtual ~FloppyIOSerial();
+
+    // Functions (Same as FloppyIO)
+    int         send(const string & strData, fpio_ctlbyte * ctrlByte = NULL);
+    int         send(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    int         send(istream * stream);
+    string      receive();
+    int         receive(void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL);
+    int         receive(string * strBuffer, fpio_ctlbyte * ctrlByte = NULL);
+    int         receive(ostream * stream);
+
+    // Synchronization stuff
+    int         syncTimeout;    // For how long should we wait (seconds, 0 for ever)
+
+    // Statistics
+    unsigned long framesSent;
+    unsigned long framesReceived;
+    unsigned long bytesSkipped; // Garbage dropped in front of frames
+
+    // Error reporting and checking
+    int         error;
+    string      errorStr;
+    bool        useExceptions;  // If TRUE errors will raise exceptions
+
+    void        clear();        // Clear errors
+    bool        ready();        // Returns TRUE if there are no errors
+
+private:
+
+    // The line
+    int         fd;
+    bool        ownFd;
+    bool        isSocket;
+
+    // Receive buffer (What was read from the line but not consumed yet)
+    char *      inBuffer;
+    int         inBegin;
+    int         inEnd;
+
+    // Functions
+    void        init(int flags);
+    int         setError(int code, string message);
+    int         waitFor(short events);
+    int         writeAll(const char * data, size_t dataLen);
+    int         fill();
+    int         readFrame(fpio_ctlbyte * ctrlByte, string * data, void * buffer, size_t szBuffer);
+    int         readBytes(char * data, size_t dataLen);
+
+};
+
+#endif	// FLOPPYIOSERIAL_H
+
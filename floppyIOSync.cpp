@@ -0,0 +1,809 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIOSync.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Incremental directory synchronization over a Floppy I/O channel (See FloppyIOSync.h)
+//
+
+#include "floppyIOSync.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+//
+// Append an unsigned integer to a message (Little endian)
+//
+static void fpio_put(string * message, unsigned long long value, int bytes) {
+    for (int i=0; i<bytes; i++) {
+        message->push_back((char)(value & 0xFF));
+        value >>= 8;
+    }
+}
+
+//
+// Read an unsigned integer from a message (Little endian)
+//
+static unsigned long long fpio_get(const string & message, size_t offset, int bytes) {
+    unsigned long long value = 0;
+    for (int i=bytes-1; i>=0; i--)
+        value = (value << 8) | (unsigned char)message[offset + i];
+    return value;
+}
+
+//
+// The weak checksum of a block (The one of rsync)
+//
+// It is made of two 16-bit sums, so that it can be rolled: moving the
+// window by one byte only takes the byte that leaves and the one that
+// enters (See fpio_sync_roll).
+//
+static unsigned int fpio_sync_weak(const unsigned char * data, size_t len, unsigned int * a, unsigned int * b) {
+    *a = 0;
+    *b = 0;
+    for (size_t i=0; i<len; i++) {
+        *a += data[i];
+        *b += (len - i) * data[i];
+    }
+    *a &= 0xFFFF;
+    *b &= 0xFFFF;
+    return *a | (*b << 16);
+}
+
+// Move the window of the weak checksum by one byte
+static unsigned int fpio_sync_roll(unsigned char out, unsigned char in, size_t len, unsigned int * a, unsigned int * b) {
+    *a = (*a - out + in) & 0xFFFF;
+    *b = (*b - len * out + *a) & 0xFFFF;
+    return *a | (*b << 16);
+}
+
+// Index of the weak checksum in the table of seen checksums
+static unsigned int fpio_sync_tag(unsigned int weak) {
+    return (weak ^ (weak >> 16)) & 0xFFFF;
+}
+
+//
+// Check that a name received stays within the tree
+//
+static bool fpio_sync_safe(const string & name) {
+    if (name.empty() || (name[0] == '/')) return false;
+    size_t begin = 0, end;
+    for (;;) {
+        end = name.find('/', begin);
+        string part = name.substr(begin, (end == string::npos) ? string::npos : end - begin);
+        if (part.empty() || (part == ".") || (part == "..")) return false;
+        if (end == string::npos) return true;
+        begin = end + 1;
+    }
+}
+
+// Write all the data on a file
+static int fpio_sync_write(int fd, const void * data, size_t len) {
+    const char * p = (const char *)data;
+    while (len > 0) {
+        ssize_t wr = write(fd, p, len);
+        if (wr <= 0) return FPIO_ERR_IO;
+        p += wr;
+        len -= wr;
+    }
+    return 0;
+}
+
+//
+// Sync constructor
+//
+// @param mux       The channel multiplexer to synchronize over. It must
+//                  stay valid for as long as this object is used.
+// @param channel   The channel reserved for the synchronization
+// @param blockSize The size of the signature blocks (Receiver only, 0 to
+//                  choose it per file)
+//
+FloppyIOSync::FloppyIOSync(FloppyIOMux * mux, int channel, int blockSize) {
+    this->mux = mux;
+    this->channel = channel;
+    this->blockSize = blockSize;
+    this->prune = false;
+    this->filesSent = 0;
+    this->filesSkipped = 0;
+    this->filesRemoved = 0;
+    this->bytesLiteral = 0;
+    this->bytesMatched = 0;
+}
+
+//
+// Sync destructor
+//
+FloppyIOSync::~FloppyIOSync() {
+}
+
+//
+// Send a directory tree
+//
+// Only what changed since the receiver last got the tree is sent (See
+// FloppyIOSync.h).
+//
+// @param dir   The root of the tree
+// @return      0 if the receiver has the whole tree or an error code
+//
+int FloppyIOSync::sendTree(const char * dir) {
+    string root(dir), message, reply;
+    int res;
+    bool bFirst = true;
+
+    this->filesSent = 0;
+    this->filesSkipped = 0;
+    this->bytesLiteral = 0;
+    this->bytesMatched = 0;
+
+    // Describe the tree
+    this->entries.clear();
+    res = this->listTree(root, "");
+    if (res < 0) return res;
+
+    message.push_back(FPIO_SYNC_LIST);
+    unsigned long nFiles = 0;
+    for (size_t i=0; i<this->entries.size(); i++) {
+        fpio_sync_entry * e = &this->entries[i];
+        message.push_back(e->type);
+        fpio_put(&message, e->mode, 4);
+        fpio_put(&message, e->size, 8);
+        fpio_put(&message, e->mtime, 8);
+        fpio_put(&message, e->name.length(), 2);
+        message.append(e->name);
+        if (e->type == FPIO_SYNC_TYPE_FILE) nFiles++;
+    }
+
+    // Send the list and get what the receiver needs
+    res = this->mux->send(this->channel, message);
+    if (res >= 0) res = this->mux->flush();
+    if (res >= 0) res = this->receiveMessage(&reply);
+    if ((res >= 0) && (reply[0] != FPIO_SYNC_WANTS)) res = FPIO_ERR_SEQUENCE;
+
+    while (res >= 0) {
+
+        // Send the delta of every file asked for
+        size_t offset = 1;
+        unsigned long nWanted = 0;
+        while ((res >= 0) && (offset < reply.length())) {
+            if (offset + 12 > reply.length()) {
+                res = FPIO_ERR_DATA;
+                break;
+            }
+            unsigned int file = fpio_get(reply, offset, 4);
+            res = this->sendDelta(root, file, reply, &offset);
+            nWanted++;
+        }
+        if (res < 0) break;
+        if (bFirst) this->filesSkipped = nFiles - nWanted;
+        bFirst = false;
+
+        // Done, unless something has to be sent again
+        message.assign(1, FPIO_SYNC_END);
+        res = this->mux->send(this->channel, message);
+        if (res >= 0) res = this->mux->flush();
+        if (res >= 0) res = this->receiveMessage(&reply);
+        if (res < 0) break;
+
+        if (reply[0] == FPIO_SYNC_DONE) {
+            res = (reply.length() < 5) ? FPIO_ERR_DATA : (int)fpio_get(reply, 1, 4);
+            break;
+        }
+        if (reply[0] != FPIO_SYNC_WANTS) res = FPIO_ERR_SEQUENCE;
+    }
+
+    return (res < 0) ? res : 0;
+}
+
+//
+// Receive a directory tree
+//
+// The files that changed are replaced once they are complete, so an
+// interrupted synchronization leaves every file either old or new.
+//
+// @param dir   The root of the tree (Created if missing)
+// @return      0 if the whole tree was received and verified or an error code
+//
+int FloppyIOSync::receiveTree(const char * dir) {
+    string root(dir), message, reply, pathNew;
+    vector<unsigned int> failed;
+    unsigned int crc = 0;
+    int fdOld = -1, fdNew = -1, current = -1, res;
+    bool bRetried = false, bBad = false;
+
+    this->filesSent = 0;
+    this->filesSkipped = 0;
+    this->filesRemoved = 0;
+    this->bytesLiteral = 0;
+    this->bytesMatched = 0;
+
+    if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) return FPIO_ERR_IO;
+
+    // Wait for the list of the sender
+    res = this->receiveMessage(&message);
+    if ((res >= 0) && (message[0] != FPIO_SYNC_LIST)) res = FPIO_ERR_SEQUENCE;
+    if (res >= 0) res = this->buildWants(root, message, &reply);
+
+    while (res >= 0) {
+        res = this->mux->send(this->channel, reply);
+        if (res >= 0) res = this->mux->flush();
+        if (res < 0) break;
+
+        // Apply the deltas until the end of the round
+        for (;;) {
+            res = this->receiveMessage(&message);
+            if (res < 0) break;
+
+            if (message[0] == FPIO_SYNC_END) {
+                break;
+            } else if ((message[0] != FPIO_SYNC_DELTA) && (message[0] != FPIO_SYNC_FILE)) {
+                res = FPIO_ERR_SEQUENCE;
+                break;
+            }
+            if (message.length() < 5) {
+                res = FPIO_ERR_DATA;
+                break;
+            }
+
+            // Start the next file?
+            unsigned int file = fpio_get(message, 1, 4);
+            if ((int)file != current) {
+                if ((fdNew >= 0) || (file >= this->entries.size()) || (this->blockSizes[file] < 0)) {
+                    res = FPIO_ERR_SEQUENCE;
+                    break;
+                }
+                string path = root + "/" + this->entries[file].name;
+                pathNew = path + FPIO_SYNC_TMP_SUFFIX;
+                fdOld = open(path.c_str(), O_RDONLY);
+                fdNew = open(pathNew.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                if (fdNew < 0) {
+                    res = FPIO_ERR_IO;
+                    break;
+                }
+                current = file;
+                crc = 0;
+                bBad = false;
+            }
+            int szBlock = this->blockSizes[file];
+
+            if (message[0] == FPIO_SYNC_DELTA) {
+                size_t offset = 5;
+                char * block = new char[(szBlock > 0) ? szBlock : 1];
+                while ((res >= 0) && (offset < message.length())) {
+                    if (offset + 5 > message.length()) {
+                        res = FPIO_ERR_DATA;
+
+                    } else if (message[offset] == FPIO_SYNC_OP_COPY) {
+                        if (offset + 9 > message.length()) {
+                            res = FPIO_ERR_DATA;
+                            break;
+                        }
+                        unsigned long long first = fpio_get(message, offset + 1, 4);
+                        unsigned int count = fpio_get(message, offset + 5, 4);
+                        offset += 9;
+                        for (unsigned int i=0; (i<count) && (res >= 0); i++) {
+                            if ((fdOld < 0) || (szBlock <= 0) ||
+                                (pread(fdOld, block, szBlock, (first + i) * szBlock) != szBlock)) {
+                                // The old version changed under us, the CRC will tell
+                                bBad = true;
+                                break;
+                            }
+                            res = fpio_sync_write(fdNew, block, szBlock);
+                            crc = fpio_crc32c(crc, block, szBlock);
+                            this->bytesMatched += szBlock;
+                        }
+
+                    } else if (message[offset] == FPIO_SYNC_OP_DATA) {
+                        size_t len = fpio_get(message, offset + 1, 4);
+                        offset += 5;
+                        if (offset + len > message.length()) {
+                            res = FPIO_ERR_DATA;
+                            break;
+                        }
+                        res = fpio_sync_write(fdNew, message.data() + offset, len);
+                        crc = fpio_crc32c(crc, message.data() + offset, len);
+                        this->bytesLiteral += len;
+                        offset += len;
+
+                    } else {
+                        res = FPIO_ERR_DATA;
+                    }
+                }
+                delete[] block;
+                if (res < 0) break;
+                continue;
+            }
+
+            // The file is complete: replace the old version if it is right
+            if (message.length() < 9) {
+                res = FPIO_ERR_DATA;
+                break;
+            }
+            fpio_sync_entry * e = &this->entries[file];
+            string path = root + "/" + e->name;
+            if (fdOld >= 0) close(fdOld);
+            fdOld = -1;
+            if (!bBad && (crc == (unsigned int)fpio_get(message, 5, 4))) {
+                struct timeval tv[2];
+                tv[0].tv_sec = tv[1].tv_sec = e->mtime;
+                tv[0].tv_usec = tv[1].tv_usec = 0;
+                fchmod(fdNew, e->mode);
+                if ((close(fdNew) < 0) || (utimes(pathNew.c_str(), tv) < 0) ||
+                    (rename(pathNew.c_str(), path.c_str()) < 0)) {
+                    fdNew = -1;
+                    unlink(pathNew.c_str());
+                    res = FPIO_ERR_IO;
+                    break;
+                }
+                this->filesSent++;
+            } else {
+                close(fdNew);
+                unlink(pathNew.c_str());
+                failed.push_back(file);
+            }
+            fdNew = -1;
+            current = -1;
+        }
+        if (res < 0) break;
+        if (fdNew >= 0) {
+            res = FPIO_ERR_SEQUENCE;
+            break;
+        }
+
+        // Ask once more, in full, for the files that didn't match
+        if (!failed.empty() && !bRetried) {
+            reply.assign(1, FPIO_SYNC_WANTS);
+            for (size_t i=0; i<failed.size(); i++) {
+                fpio_put(&reply, failed[i], 4);
+                fpio_put(&reply, 0, 4);
+                fpio_put(&reply, 0, 4);
+                this->blockSizes[failed[i]] = 0;
+            }
+            failed.clear();
+            bRetried = true;
+            continue;
+        }
+
+        res = failed.empty() ? 0 : FPIO_ERR_DATA;
+        reply.assign(1, FPIO_SYNC_DONE);
+        fpio_put(&reply, (unsigned int)res, 4);
+        this->mux->send(this->channel, reply);
+        int resSend = this->mux->flush();
+        return (res < 0) ? res : ((resSend < 0) ? resSend : 0);
+    }
+
+    // Interrupted: drop the file we were building
+    if (fdOld >= 0) close(fdOld);
+    if (fdNew >= 0) {
+        close(fdNew);
+        unlink(pathNew.c_str());
+    }
+    return res;
+}
+
+//
+// List the directories and regular files of a tree, parents first
+//
+// @param root      The root of the tree
+// @param prefix    The directory to list, relative to the root
+// @return          0 if successful or FPIO_ERR_INPUT
+//
+int FloppyIOSync::listTree(const string & root, const string & prefix) {
+    vector<string> names;
+    struct dirent * ent;
+    struct stat st;
+
+    DIR * d = opendir(prefix.empty() ? root.c_str() : (root + "/" + prefix).c_str());
+    if (d == NULL) return FPIO_ERR_INPUT;
+    while ((ent = readdir(d)) != NULL) {
+        if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) continue;
+        names.push_back(ent->d_name);
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    for (size_t i=0; i<names.size(); i++) {
+        fpio_sync_entry e;
+        e.name = prefix.empty() ? names[i] : prefix + "/" + names[i];
+        if (lstat((root + "/" + e.name).c_str(), &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            e.type = FPIO_SYNC_TYPE_DIR;
+        } else if (S_ISREG(st.st_mode)) {
+            e.type = FPIO_SYNC_TYPE_FILE;
+        } else {
+            continue;
+        }
+        e.mode = st.st_mode & 07777;
+        e.size = (e.type == FPIO_SYNC_TYPE_FILE) ? st.st_size : 0;
+        e.mtime = st.st_mtime;
+        this->entries.push_back(e);
+
+        if (e.type == FPIO_SYNC_TYPE_DIR) {
+            int res = this->listTree(root, e.name);
+            if (res < 0) return res;
+        }
+    }
+    return 0;
+}
+
+//
+// Send the delta of a file against the signature of the receiver
+//
+// @param root      The root of the tree
+// @param file      The file (Index in the list)
+// @param wants     The wants message of the receiver
+// @param offset    Where the entry of the file starts. Moved after it.
+// @return          0 if successful or an error code
+//
+int FloppyIOSync::sendDelta(const string & root, unsigned int file, const string & wants, size_t * offset) {
+    map<unsigned int, vector<unsigned int> > blocks;
+    vector<char> seen;
+    struct stat st;
+    string ops;
+    int res = 0;
+
+    // The signature of the old version
+    int szBlock = fpio_get(wants, *offset + 4, 4);
+    unsigned int nBlocks = fpio_get(wants, *offset + 8, 4);
+    size_t sigs = *offset + 12;
+    *offset = sigs + (size_t)nBlocks * 8;
+    if ((file >= this->entries.size()) || (this->entries[file].type != FPIO_SYNC_TYPE_FILE) ||
+        (*offset > wants.length()) || ((nBlocks > 0) && (szBlock <= 0)))
+        return FPIO_ERR_DATA;
+
+    if (nBlocks > 0) {
+        seen.assign(65536, 0);
+        for (unsigned int i=0; i<nBlocks; i++) {
+            unsigned int weak = fpio_get(wants, sigs + i * 8, 4);
+            blocks[weak].push_back(i);
+            seen[fpio_sync_tag(weak)] = 1;
+        }
+    }
+
+    // Map the new version
+    int fd = open((root + "/" + this->entries[file].name).c_str(), O_RDONLY);
+    if (fd < 0) return FPIO_ERR_INPUT;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return FPIO_ERR_INPUT;
+    }
+    size_t size = st.st_size;
+    const unsigned char * data = NULL;
+    if (size > 0) {
+        void * addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return FPIO_ERR_INPUT;
+        }
+        data = (const unsigned char *)addr;
+    }
+
+    // Slide the window and look for blocks the receiver has
+    size_t pos = 0, literal = 0;
+    unsigned int a, b, weak = 0;
+    unsigned int copyFirst = 0, copyCount = 0;
+    bool bRolled = false;
+    while ((nBlocks > 0) && (pos + szBlock <= size)) {
+        if (!bRolled) {
+            weak = fpio_sync_weak(data + pos, szBlock, &a, &b);
+            bRolled = true;
+        }
+
+        int match = -1;
+        if (seen[fpio_sync_tag(weak)]) {
+            map<unsigned int, vector<unsigned int> >::iterator it = blocks.find(weak);
+            if (it != blocks.end()) {
+                unsigned int crc = fpio_crc32c(0, data + pos, szBlock);
+                for (size_t i=0; i<it->second.size(); i++) {
+                    unsigned int blk = it->second[i];
+                    if ((unsigned int)fpio_get(wants, sigs + blk * 8 + 4, 4) != crc) continue;
+                    match = blk;
+
+                    // Prefer the block that continues the current copy
+                    if ((copyCount > 0) && (blk == copyFirst + copyCount)) break;
+                }
+            }
+        }
+
+        if (match >= 0) {
+            // Flush the literal data before it, and extend or start a copy
+            if (pos > literal) {
+                if (copyCount > 0) {
+                    ops.push_back(FPIO_SYNC_OP_COPY);
+                    fpio_put(&ops, copyFirst, 4);
+                    fpio_put(&ops, copyCount, 4);
+                    copyCount = 0;
+                }
+                ops.push_back(FPIO_SYNC_OP_DATA);
+                fpio_put(&ops, pos - literal, 4);
+                ops.append((const char *)data + literal, pos - literal);
+                this->bytesLiteral += pos - literal;
+            }
+            if ((copyCount > 0) && ((unsigned int)match != copyFirst + copyCount)) {
+                ops.push_back(FPIO_SYNC_OP_COPY);
+                fpio_put(&ops, copyFirst, 4);
+                fpio_put(&ops, copyCount, 4);
+                copyCount = 0;
+            }
+            if (copyCount == 0) copyFirst = match;
+            copyCount++;
+            this->bytesMatched += szBlock;
+
+            pos += szBlock;
+            literal = pos;
+            bRolled = false;
+
+        } else {
+            if (pos + szBlock < size)
+                weak = fpio_sync_roll(data[pos], data[pos + szBlock], szBlock, &a, &b);
+            pos++;
+
+            // Don't let the literal data grow too much
+            if (pos - literal >= FPIO_SYNC_MESSAGE) {
+                if (copyCount > 0) {
+                    ops.push_back(FPIO_SYNC_OP_COPY);
+                    fpio_put(&ops, copyFirst, 4);
+                    fpio_put(&ops, copyCount, 4);
+                    copyCount = 0;
+                }
+                ops.push_back(FPIO_SYNC_OP_DATA);
+                fpio_put(&ops, pos - literal, 4);
+                ops.append((const char *)data + literal, pos - literal);
+                this->bytesLiteral += pos - literal;
+                literal = pos;
+            }
+        }
+
+        res = this->sendOps(file, &ops, false);
+        if (res < 0) break;
+    }
+
+    // The rest is literal data
+    if ((res >= 0) && (copyCount > 0)) {
+        ops.push_back(FPIO_SYNC_OP_COPY);
+        fpio_put(&ops, copyFirst, 4);
+        fpio_put(&ops, copyCount, 4);
+    }
+    while ((res >= 0) && (literal < size)) {
+        size_t len = size - literal;
+        if (len > FPIO_SYNC_MESSAGE) len = FPIO_SYNC_MESSAGE;
+        ops.push_back(FPIO_SYNC_OP_DATA);
+        fpio_put(&ops, len, 4);
+        ops.append((const char *)data + literal, len);
+        this->bytesLiteral += len;
+        literal += len;
+        res = this->sendOps(file, &ops, false);
+    }
+    if (res >= 0) res = this->sendOps(file, &ops, true);
+
+    // Close the file with its CRC
+    if (res >= 0) {
+        string message(1, FPIO_SYNC_FILE);
+        fpio_put(&message, file, 4);
+        fpio_put(&message, (size > 0) ? fpio_crc32c(0, data, size) : 0, 4);
+        res = this->mux->send(this->channel, message);
+        if (res >= 0) res = this->mux->flush();
+        if (res >= 0) this->filesSent++;
+    }
+
+    if (data != NULL) munmap((void *)data, size);
+    close(fd);
+    return res;
+}
+
+//
+// Send the delta operations collected so far
+//
+// @param file      The file they belong to
+// @param ops       The operations. Cleared once sent.
+// @param bForce    Send them even if they don't fill a message
+// @return          0 if successful or an error code
+//
+int FloppyIOSync::sendOps(unsigned int file, string * ops, bool bForce) {
+    if (ops->empty() || (!bForce && (ops->length() < FPIO_SYNC_MESSAGE))) return 0;
+
+    string message(1, FPIO_SYNC_DELTA);
+    fpio_put(&message, file, 4);
+    message.append(*ops);
+    ops->clear();
+
+    int res = this->mux->send(this->channel, message);
+    if (res >= 0) res = this->mux->flush();
+    return (res < 0) ? res : 0;
+}
+
+//
+// Receive the next message of the sync channel
+//
+int FloppyIOSync::receiveMessage(string * message) {
+    int res = this->mux->receive(this->channel, message);
+    if (res < 0) return res;
+    if (message->empty()) return FPIO_ERR_DATA;
+    return res;
+}
+
+//
+// Create the directories of the list and ask for the files that changed
+//
+// @param root      The root of the tree
+// @param list      The list message of the sender
+// @param wants     Receives the wants message
+// @return          0 if successful or an error code
+//
+int FloppyIOSync::buildWants(const string & root, const string & list, string * wants) {
+    map<string, char> keep;
+    struct stat st;
+    size_t offset = 1;
+
+    this->entries.clear();
+    this->blockSizes.clear();
+    wants->assign(1, FPIO_SYNC_WANTS);
+
+    while (offset < list.length()) {
+        fpio_sync_entry e;
+        if (offset + 23 > list.length()) return FPIO_ERR_DATA;
+        e.type = list[offset];
+        e.mode = fpio_get(list, offset + 1, 4) & 07777;
+        e.size = fpio_get(list, offset + 5, 8);
+        e.mtime = fpio_get(list, offset + 13, 8);
+        size_t szName = fpio_get(list, offset + 21, 2);
+        offset += 23;
+        if (offset + szName > list.length()) return FPIO_ERR_DATA;
+        e.name = list.substr(offset, szName);
+        offset += szName;
+        if (!fpio_sync_safe(e.name)) return FPIO_ERR_DATA;
+
+        unsigned int file = this->entries.size();
+        this->entries.push_back(e);
+        this->blockSizes.push_back(-1);
+        keep[e.name] = e.type;
+
+        string path = root + "/" + e.name;
+        if (e.type == FPIO_SYNC_TYPE_DIR) {
+            if ((mkdir(path.c_str(), e.mode | 0700) < 0) && (errno != EEXIST)) return FPIO_ERR_IO;
+            continue;
+        }
+        if (e.type != FPIO_SYNC_TYPE_FILE) return FPIO_ERR_DATA;
+
+        // Unchanged?
+        bool bExists = (lstat(path.c_str(), &st) == 0) && S_ISREG(st.st_mode);
+        if (bExists && ((unsigned long long)st.st_size == e.size) && (st.st_mtime == e.mtime)) {
+            this->filesSkipped++;
+            continue;
+        }
+
+        // Ask for it, with the signature of the version we have
+        if (bExists && (e.size > 0)) {
+            int res = this->signature(path, file, wants);
+            if (res < 0) return res;
+        } else {
+            fpio_put(wants, file, 4);
+            fpio_put(wants, 0, 4);
+            fpio_put(wants, 0, 4);
+            this->blockSizes[file] = 0;
+        }
+    }
+
+    if (this->prune) return this->pruneTree(root, "", keep);
+    return 0;
+}
+
+//
+// Append the signature of the version of a file we have to the wants
+//
+// @param path      The file
+// @param file      Its index in the list
+// @param wants     The wants message
+// @return          0 if successful or an error code
+//
+int FloppyIOSync::signature(const string & path, unsigned int file, string * wants) {
+    struct stat st;
+    unsigned int a, b;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+        if (fd >= 0) close(fd);
+        return FPIO_ERR_IO;
+    }
+
+    // Around the square root of the file, as rsync
+    int szBlock = this->blockSize;
+    if (szBlock <= 0) {
+        szBlock = ((int)sqrt((double)st.st_size) + 7) & ~7;
+        if (szBlock < FPIO_SYNC_MIN_BLOCK) szBlock = FPIO_SYNC_MIN_BLOCK;
+        if (szBlock > FPIO_SYNC_MAX_BLOCK) szBlock = FPIO_SYNC_MAX_BLOCK;
+    }
+    unsigned int nBlocks = st.st_size / szBlock;
+
+    fpio_put(wants, file, 4);
+    fpio_put(wants, szBlock, 4);
+    size_t count = wants->length();
+    fpio_put(wants, nBlocks, 4);
+
+    unsigned char * block = new unsigned char[szBlock];
+    unsigned int i;
+    for (i=0; i<nBlocks; i++) {
+        if (pread(fd, block, szBlock, (off_t)i * szBlock) != szBlock) break;
+        fpio_put(wants, fpio_sync_weak(block, szBlock, &a, &b), 4);
+        fpio_put(wants, fpio_crc32c(0, block, szBlock), 4);
+    }
+    delete[] block;
+    close(fd);
+
+    // Shrunk while we read it? Offer what we got
+    if (i < nBlocks) {
+        for (int j=0; j<4; j++) (*wants)[count + j] = (char)((i >> (8 * j)) & 0xFF);
+    }
+    this->blockSizes[file] = szBlock;
+    return 0;
+}
+
+//
+// Remove what is not in the list of the sender
+//
+// @param root      The root of the tree
+// @param prefix    The directory to clean, relative to the root
+// @param keep      The entries of the list (Name and type)
+// @return          0 if successful or FPIO_ERR_IO
+//
+int FloppyIOSync::pruneTree(const string & root, const string & prefix, const map<string, char> & keep) {
+    static const map<string, char> none;
+    struct dirent * ent;
+    struct stat st;
+    vector<string> names;
+    int res = 0;
+
+    string dir = prefix.empty() ? root : root + "/" + prefix;
+    DIR * d = opendir(dir.c_str());
+    if (d == NULL) return FPIO_ERR_IO;
+    while ((ent = readdir(d)) != NULL) {
+        if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) continue;
+        names.push_back(ent->d_name);
+    }
+    closedir(d);
+
+    for (size_t i=0; i<names.size(); i++) {
+        string name = prefix.empty() ? names[i] : prefix + "/" + names[i];
+        string path = root + "/" + name;
+        if (lstat(path.c_str(), &st) < 0) continue;
+
+        char type = S_ISDIR(st.st_mode) ? FPIO_SYNC_TYPE_DIR : FPIO_SYNC_TYPE_FILE;
+        map<string, char>::const_iterator it = keep.find(name);
+        bool bKeep = (it != keep.end()) && (it->second == type);
+
+        if (type == FPIO_SYNC_TYPE_DIR) {
+            // Everything below a directory we drop goes too
+            if (this->pruneTree(root, name, bKeep ? keep : none) < 0) res = FPIO_ERR_IO;
+            if (bKeep) continue;
+            if (rmdir(path.c_str()) < 0) res = FPIO_ERR_IO;
+        } else {
+            if (bKeep) continue;
+            if (unlink(path.c_str()) < 0) res = FPIO_ERR_IO;
+        }
+        this->filesRemoved++;
+    }
+    return res;
+}
@@ -0,0 +1,149 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOSync.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  Incremental directory synchronization over a Floppy I/O channel, in
+//  the way of rsync.
+//
+//  The sender lists its tree (directories and regular files, with their
+//  mode, size and modification time). The receiver skips the files it
+//  has with the same size and time, and asks for the others. For a file
+//  it has an older version of, it sends the signature of that version:
+//  a weak, rolling checksum and a CRC32C per block. The sender slides a
+//  window over its file, finds the blocks the receiver already has where
+//  the weak and the strong checksum match, and sends only copy
+//  instructions for them and the literal data in between:
+//
+//    [List] ->
+//           <- [Wants: file, block size, signature...]
+//    [Delta: file, copy/literal...] [File: file, CRC] ... [End] ->
+//           <- [Done: result]
+//
+//  The receiver builds the new version next to the old one and replaces
+//  it once the CRC of the whole file matches. A file that doesn't is
+//  asked for again, in full. Symbolic links and special files are not
+//  synchronized.
+//
+//  All the messages go through a FloppyIOMux channel (FPIO_CHANNEL_FILE by
+//  default). Integers are little endian.
+//
+
+#ifndef FLOPPYIOSYNC_H
+#define	FLOPPYIOSYNC_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "floppyIO.h"
+#include "floppyIOMux.h"
+
+using namespace std;
+
+// Size of the signature blocks. By default it grows with the square root
+// of the file, within these limits.
+
+#define FPIO_SYNC_MIN_BLOCK     512
+#define FPIO_SYNC_MAX_BLOCK     65536
+
+// Largest delta message (Bigger deltas are split)
+
+#define FPIO_SYNC_MESSAGE       65536
+
+// Suffix of the files being built by the receiver
+
+#define FPIO_SYNC_TMP_SUFFIX    ".fpio-sync"
+
+//
+// Sync message types (First byte of every message)
+//
+#define FPIO_SYNC_LIST      'L'     // Entries: type:1, mode:4, size:8, mtime:8, name length:2, name
+#define FPIO_SYNC_WANTS     'W'     // Entries: file:4, block size:4, blocks:4, (weak:4, crc:4) per block
+#define FPIO_SYNC_DELTA     'T'     // file:4, operations
+#define FPIO_SYNC_FILE      'F'     // file:4, crc:4 (No more operations for the file)
+#define FPIO_SYNC_END       'E'     // No more files
+#define FPIO_SYNC_DONE      'D'     // result:4
+
+//
+// Delta operations
+//
+#define FPIO_SYNC_OP_COPY   'C'     // block:4, blocks:4 (From the old version)
+#define FPIO_SYNC_OP_DATA   'L'     // length:4, data
+
+//
+// Entry types
+//
+#define FPIO_SYNC_TYPE_DIR  'd'
+#define FPIO_SYNC_TYPE_FILE 'f'
+
+//
+// Directory synchronization class
+//
+class FloppyIOSync {
+public:
+
+    // Constructors
+    FloppyIOSync(FloppyIOMux * mux, int channel = FPIO_CHANNEL_FILE, int blockSize = 0);
+    virtual ~FloppyIOSync();
+
+    // Functions
+    int         sendTree(const char * dir);
+    int         receiveTree(const char * dir);
+
+    // The channel multiplexer we synchronize over
+    FloppyIOMux * mux;
+
+    // Configuration
+    int         channel;
+    int         blockSize;      // Signature block size (Receiver only, 0 for automatic)
+    bool        prune;          // Remove what the sender doesn't have (Receiver only)
+
+    // Statistics of the last synchronization
+    unsigned long filesSent;        // Files sent or received
+    unsigned long filesSkipped;     // Files that had not changed
+    unsigned long filesRemoved;     // Files and directories pruned
+    unsigned long long bytesLiteral;    // Data sent as it is
+    unsigned long long bytesMatched;    // Data found in the old versions
+
+private:
+
+    // An entry of the tree
+    struct fpio_sync_entry {
+        char        type;
+        unsigned int mode;
+        unsigned long long size;
+        long long   mtime;
+        string      name;           // Relative to the root of the tree
+    };
+
+    vector<fpio_sync_entry> entries;
+    vector<int> blockSizes;         // Signature block size of every file asked for
+
+    // Functions
+    int         listTree(const string & root, const string & prefix);
+    int         sendDelta(const string & root, unsigned int file, const string & wants, size_t * offset);
+    int         sendOps(unsigned int file, string * ops, bool bForce);
+    int         receiveMessage(string * message);
+    int         buildWants(const string & root, const string & list, string * wants);
+    int         signature(const string & path, unsigned int file, string * wants);
+    int         pruneTree(const string & root, const string & prefix, const map<string, char> & keep);
+
+};
+
+#endif	// FLOPPYIOSYNC_H
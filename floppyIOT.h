@@ -0,0 +1,450 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOT.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  A compile-time specialised Floppy I/O.
+//
+//  FloppyIO decides on every call which end it is, how the data are
+//  framed and where they go, from its flags and topology fields.
+//  FloppyIOT<Role, Framing, Size> fixes all of that at compile time:
+//
+//    Role      0 (Hypervisor) or FPIO_CLIENT
+//    Framing   0 (Null-terminated) or FPIO_FRAMING_BINARY (Length prefix)
+//    Size      The size of the image (DEFAULT_FIO_FLOPPY_SIZE)
+//    Debug     Keep the cerr trace of FloppyIO (false)
+//
+//  The offsets and sizes are enum constants derived from Size, with the
+//  layout FloppyIO uses on an image without a geometry header, and the
+//  role, framing and trace branches are folded away by the compiler.
+//  The image is always memory-mapped and the transfers always
+//  synchronized, so the hot path is a handful of loads and stores.
+//
+//  The blocks are the ones of a FloppyIO with FPIO_SYNCHRONIZED (plus
+//  FPIO_BINARY for the binary framing), so either end can be a plain
+//  FloppyIO. Ring, compression, checksums and geometry headers are left
+//  to FloppyIO.
+//
+//  Example:
+//
+//    FloppyIOT<FPIO_CLIENT, FPIO_FRAMING_BINARY> fio("/tmp/image", FPIO_NOINIT | FPIO_NOCREATE);
+//    fio.send("hello");
+//
+
+#ifndef FLOPPYIOT_H
+#define	FLOPPYIOT_H
+
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "floppyIO.h"
+
+using namespace std;
+
+//
+// Floppy I/O with the role, the framing and the size fixed at compile time
+//
+template <int Role, int Framing, int Size = DEFAULT_FIO_FLOPPY_SIZE, bool Debug = false>
+class FloppyIOT {
+public:
+
+    // Layout (See FloppyIO.h)
+    enum {
+        client          = ((Role & FPIO_CLIENT) != 0),
+        binary          = ((Framing & FPIO_FRAMING_BINARY) != 0),
+        szFloppy        = Size,
+        szInput         = Size/2 - 1,
+        szOutput        = Size/2 - 1,
+        ofsInput        = client ? 1 : szOutput + 1,
+        ofsOutput       = client ? szInput + 1 : 1,
+        ofsCtrlByteIn   = client ? szInput + szOutput + 1 : 0,
+        ofsCtrlByteOut  = client ? 0 : szInput + szOutput + 1,
+        szBlock         = binary ? szOutput - 4 : szOutput - 1  // Largest block of data
+    };
+
+    //
+    // Open the image
+    //
+    // @param filename  The filename of the floppy disk image
+    // @param flags     FPIO_NOINIT, FPIO_NOCREATE and FPIO_EXCEPTIONS (The rest is fixed)
+    //
+    FloppyIOT(const char * filename, int flags = 0) {
+        this->error = 0;
+        this->useExceptions = ((flags & FPIO_EXCEPTIONS) != 0);
+        this->syncTimeout = DEFAULT_FIO_SYNC_TIMEOUT;
+        this->syncMaxSleep = DEFAULT_FIO_SYNC_MAXSLEEP;
+        this->mapBase = NULL;
+
+        // Open the file, creating it if it's missing or FPIO_NOCREATE is not there
+        bool bCreated = false;
+        this->mapFd = open(filename, O_RDWR);
+        if ((this->mapFd < 0) || ((flags & FPIO_NOCREATE) == 0)) {
+            if (this->mapFd >= 0) close(this->mapFd);
+            this->mapFd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (this->mapFd < 0) {
+                this->setError(-3, "Error while creating floppy I/O file!");
+                return;
+            }
+            bCreated = true;
+        }
+
+        // Make sure the whole image is backed by the file and map it
+        struct stat st;
+        if (fstat(this->mapFd, &st) < 0) {
+            this->setError(-3, "Unable to stat floppy I/O file!");
+            return;
+        }
+        if (S_ISREG(st.st_mode) && (st.st_size < Size) && (ftruncate(this->mapFd, Size) < 0)) {
+            this->setError(-3, "Unable to resize floppy I/O file!");
+            return;
+        }
+        void * ptr = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, this->mapFd, 0);
+        if (ptr == MAP_FAILED) {
+            this->setError(-3, "Unable to memory-map floppy I/O file!");
+            return;
+        }
+        this->mapBase = (char *)ptr;
+
+        // Reset the image unless told otherwise
+        if (bCreated || ((flags & FPIO_NOINIT) == 0)) {
+            memset(this->mapBase, 0, Size);
+            this->flush();
+        }
+
+        if (Debug) cerr << "FPIO Started in " << (client ? "client" : "hypervisor") << " mode\n";
+    }
+
+    virtual ~FloppyIOT() {
+        if (this->mapBase != NULL) munmap(this->mapBase, Size);
+        if (this->mapFd >= 0) close(this->mapFd);
+    }
+
+    //
+    // Send a block (See FloppyIO::send)
+    //
+    // @param data      A pointer to the data buffer to send
+    // @param dataLen   The size of the buffer (Truncated to szBlock)
+    // @param ctrlByte  The extra parameters you want to write on the control byte
+    // @return          The number of bytes sent if successful or an error code.
+    //
+    int send(const void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL) {
+        if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+
+        int szData = (dataLen > (size_t)szBlock) ? szBlock : (int)dataLen;
+        memcpy(this->outputData(), data, szData);
+
+        int iState = this->sendPlaced(szData, ctrlByte);
+        if (iState < 0) return iState;
+        return (int)dataLen;
+    }
+
+    int send(const string & strData, fpio_ctlbyte * ctrlByte = NULL) {
+        return this->send(strData.data(), strData.length(), ctrlByte);
+    }
+
+    //
+    // Receive a block (See FloppyIO::receive)
+    //
+    // @param data      The buffer to fill
+    // @param dataLen   Its size (Data that don't fit are dropped)
+    // @param ctrlByte  The extra parameters received from the control byte
+    // @return          The length of the data received or an error code.
+    //
+    int receive(void * data, size_t dataLen, fpio_ctlbyte * ctrlByte = NULL) {
+        const char * pData;
+        int szData = this->receivePlaced(&pData, ctrlByte);
+        if (szData < 0) return szData;
+
+        if (szData > (int)dataLen) szData = (int)dataLen;
+        memcpy(data, pData, szData);
+        this->release();
+        return szData;
+    }
+
+    int receive(string * strBuffer, fpio_ctlbyte * ctrlByte = NULL) {
+        const char * pData;
+        int szData = this->receivePlaced(&pData, ctrlByte);
+        if (szData < 0) return szData;
+
+        strBuffer->assign(pData, szData);
+        this->release();
+        return szData;
+    }
+
+    //
+    // Send the contents of an input stream, block by block (See FloppyIO::send)
+    //
+    // The blocks are read straight into the output area of the image.
+    //
+    // @param stream    The input stream
+    // @return          The number of bytes sent if successful or an error code.
+    //
+    int send(istream * stream) {
+        fpio_ctlbyte_io cB; cB.byte = 0;
+        int sentLength = 0, res;
+
+        if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+        if (!stream->good()) return this->setError(FPIO_ERR_INPUT, "Unable to open input stream!");
+
+        while (cB.flags.bEndOfData == 0) {
+            stream->read(this->outputData(), szBlock);
+            int rd = stream->gcount();
+            if (stream->eof()) {
+                cB.flags.bEndOfData = 1;
+            } else if (stream->fail()) {
+                // Notify the remote end that we failed the transmission
+                cB.flags.bAborted = 1;
+                cB.flags.bEndOfData = 1;
+                this->sendPlaced(0, &cB.flags);
+                return this->setError(-5, "Unable to read from input stream");
+            }
+
+            res = this->sendPlaced(rd, &cB.flags);
+            if (res < 0) return res;
+            sentLength += rd;
+        }
+
+        return sentLength;
+    }
+
+    //
+    // Receive a stream and write it on an output stream (See FloppyIO::receive)
+    //
+    // The blocks are written straight from the input area of the image.
+    //
+    // @param stream    The output stream
+    // @return          The length of the data received or an error code.
+    //
+    int receive(ostream * stream) {
+        const char * pData;
+        fpio_ctlbyte cB;
+        int readLength = 0, rd;
+
+        cB.bEndOfData = 0;
+        while (cB.bEndOfData == 0) {
+            rd = this->receivePlaced(&pData, &cB);
+            if (rd < 0) {
+                stream->setstate(ostream::failbit);
+                return rd;
+            }
+            stream->write(pData, rd);
+            this->release();
+            readLength += rd;
+        }
+
+        stream->flush();
+        if (cB.bAborted == 1) {
+            stream->setstate(ostream::failbit);
+            return FPIO_ERR_ABORTED;
+        }
+        return readLength;
+    }
+
+    // Synchronization stuff
+    int         syncTimeout;    // For how long should we wait (seconds, 0 for ever)
+    int         syncMaxSleep;   // Ceiling of the polling back-off (microseconds)
+
+    // Error reporting and checking
+    int         error;
+    string      errorStr;
+    bool        useExceptions;  // If TRUE errors will raise exceptions
+
+    // Clear errors
+    void clear() {
+        this->error = 0;
+        this->errorStr = "";
+    }
+
+    // Returns TRUE if there are no errors
+    bool ready() {
+        return (this->error == 0) && (this->mapBase != NULL);
+    }
+
+private:
+
+    // The mapped image
+    int         mapFd;
+    char *      mapBase;
+
+    //
+    // Where the data of the next block we send go (After the length prefix)
+    //
+    char * outputData() {
+        return this->mapBase + ofsOutput + (binary ? 4 : 0);
+    }
+
+    //
+    // Send the block whose data are already in place (See outputData)
+    //
+    // @param szData    The size of the data (At most szBlock)
+    // @param ctrlByte  The extra parameters you want to write on the control byte
+    // @return          0 if the remote end read the block or an error code.
+    //
+    int sendPlaced(int szData, fpio_ctlbyte * ctrlByte) {
+        char * pData = this->mapBase + ofsOutput;
+
+        // Prepare control byte (A plain send is a whole message)
+        fpio_ctlbyte_io cB; cB.byte = 0;
+        cB.flags.bDataPresent = 1;
+        cB.flags.bEndOfData = 1;
+        if (ctrlByte != NULL) {
+            cB.flags = *ctrlByte;
+            cB.flags.bDataPresent = 1;
+        }
+
+        // Frame the data
+        if (binary) {
+            fpio_datalen_io dL;
+            cB.flags.bLengthPrefix = 1;
+            dL.size = szData;
+            memcpy(pData, dL.bytes, 4);
+            if (Debug) cerr << "Binary mode selected. Prefixing: " << dL.size << "\n";
+        } else {
+            pData[szData] = 0;
+        }
+
+        // Notify the remote end and wait for it to clear the flag
+        // (The data must be in place before the flag is seen)
+        __sync_synchronize();
+        this->mapBase[ofsCtrlByteOut] = cB.byte;
+        this->flush();
+        if (Debug) cerr << "Just sent in sync at " << (int)ofsCtrlByteOut << " value= " << (int)cB.byte << "\n";
+
+        return this->waitForSync(ofsCtrlByteOut, 0, 0x01);
+    }
+
+    //
+    // Wait for a block and locate its data in the image. They stay there
+    // until release() is called.
+    //
+    // @param pData     Receives the address of the data
+    // @param ctrlByte  The extra parameters received from the control byte
+    // @return          The length of the data or an error code.
+    //
+    int receivePlaced(const char ** pData, fpio_ctlbyte * ctrlByte) {
+        if (!this->ready()) return this->setError(-4, "Stream is not ready!");
+
+        int iState = this->waitForSync(ofsCtrlByteIn, 1, 0x01);
+        if (iState < 0) return iState;
+        __sync_synchronize();
+
+        fpio_ctlbyte_io cB;
+        cB.byte = this->mapBase[ofsCtrlByteIn];
+        if (Debug) cerr << "Got control byte: " << (int)cB.byte << "\n";
+        if (ctrlByte != NULL) *ctrlByte = cB.flags;
+
+        // Locate the data
+        *pData = this->mapBase + ofsInput;
+        int szData;
+        if (binary && (cB.flags.bLengthPrefix == 1)) {
+            fpio_datalen_io dL;
+            memcpy(dL.bytes, *pData, 4);
+            if (Debug) cerr << "Binary mode detected. Read: " << dL.size << "\n";
+            szData = dL.size & FPIO_LEN_MASK;
+            if (szData > szInput - 4) szData = szInput - 4;    // Protect from overflows
+            *pData += 4;
+        } else {
+            const char * pNull = (const char *)memchr(*pData, 0, szInput);
+            szData = (pNull != NULL) ? (int)(pNull - *pData) : szInput;
+        }
+        return szData;
+    }
+
+    //
+    // Notify the remote end that we have read the block
+    //
+    void release() {
+        fpio_ctlbyte_io cB;
+        cB.byte = this->mapBase[ofsCtrlByteIn];
+        __sync_synchronize();
+        cB.flags.bDataPresent = 0;
+        this->mapBase[ofsCtrlByteIn] = cB.byte;
+        this->flush();
+        if (Debug) cerr << "Just sent out sync at " << (int)ofsCtrlByteIn << " value= " << (int)cB.byte << "\n";
+    }
+
+    //
+    // Push the writes to the file (The areas and control bytes span the
+    // whole image, and with MS_ASYNC the size costs nothing)
+    //
+    void flush() {
+        msync(this->mapBase, Size, MS_ASYNC);
+    }
+
+    //
+    // Wait for the control byte to reach a state (See FloppyIO::waitForSync)
+    //
+    // The byte is checked in a tight loop first, and the clock is only read
+    // once we start sleeping, with a back-off up to syncMaxSleep.
+    //
+    // @param controlByteOffset The offset of the control byte
+    // @param state             The state the control byte must be for this function to exit
+    // @param mask              The bit mask to apply on control byte before checking the state
+    // @return                  Returns 0 if everything succeeded or an error code.
+    //
+    int waitForSync(int controlByteOffset, char state, char mask) {
+        volatile const char * pCtl = this->mapBase + controlByteOffset;
+        long long tExpired = 0;
+        int iSleep = FPIO_TUNE_SLEEP;
+
+        if (Debug) cerr << "Waiting for sync at " << controlByteOffset << " waiting for " << (int)state << " (Mask: " << (int)mask << ")\n";
+
+        for (int iSpins = 0; ; iSpins++) {
+            if ((*pCtl & mask) == state) return 0;
+            if (iSpins < FPIO_TUNE_SPINS) continue;
+
+            // Check the deadline
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            long long tNow = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+            if (tExpired == 0) tExpired = tNow + (long long)this->syncTimeout * 1000000;
+            if ((this->syncTimeout != 0) && (tNow > tExpired))
+                return this->setError(-2, "Timed-out while waiting for sync!");
+
+            // Sleep to decrease CPU-load
+            usleep(iSleep);
+            iSleep *= 2;
+            if (iSleep > this->syncMaxSleep) iSleep = this->syncMaxSleep;
+        }
+    }
+
+    //
+    // Set an error (See FloppyIO::setError)
+    //
+    int setError(int code, const string message) {
+        this->error = code;
+        if (this->errorStr.empty()) {
+            this->errorStr = message;
+        } else {
+            this->errorStr = message + " (" + this->errorStr + ")";
+        }
+        if (this->useExceptions) {
+            FloppyIOException e;
+            throw *e.set(code, message);
+        }
+        return code;
+    }
+
+};
+
+#endif	// FLOPPYIOT_H
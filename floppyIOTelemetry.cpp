@@ -0,0 +1,179 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIOTelemetry.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Binary telemetry records over a Floppy I/O channel (See FloppyIOTelemetry.h)
+//
+
+#include "floppyIOTelemetry.h"
+#include <sys/time.h>
+
+//
+// Writer constructor
+//
+FloppyIOTelemetryWriter::FloppyIOTelemetryWriter() {
+}
+
+//
+// Writer destructor
+//
+FloppyIOTelemetryWriter::~FloppyIOTelemetryWriter() {
+}
+
+//
+// Stamp the samples that follow
+//
+// @param ms    The time in milliseconds since the epoch (0 for now)
+//
+void FloppyIOTelemetryWriter::time(long long ms) {
+    if (ms == 0) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        ms = (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+    this->put(FPIO_TLM_TIME, (unsigned long long)ms);
+}
+
+//
+// Add a numeric sample
+//
+// @param tag   The tag of the value
+// @param value The value (Takes as few bytes as possible)
+//
+void FloppyIOTelemetryWriter::put(int tag, unsigned long long value) {
+    unsigned char bytes[8];
+    int len = 0;
+    do {
+        bytes[len++] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    } while (value != 0);
+    this->put(tag, bytes, len);
+}
+
+//
+// Add a record
+//
+// @param tag       The tag of the value
+// @param value     The value
+// @param length    Its length (Cut at FPIO_TLM_MAX_VALUE)
+//
+void FloppyIOTelemetryWriter::put(int tag, const void * value, size_t length) {
+    if (length > FPIO_TLM_MAX_VALUE) length = FPIO_TLM_MAX_VALUE;
+    this->buffer.push_back((char)tag);
+    this->buffer.push_back((char)length);
+    this->buffer.append((const char *)value, length);
+}
+
+//
+// Add an event
+//
+// @param text  The description of the event (Cut at FPIO_TLM_MAX_VALUE)
+//
+void FloppyIOTelemetryWriter::event(const string & text) {
+    this->put(FPIO_TLM_EVENT, text.data(), text.length());
+}
+
+// The message built so far
+const string & FloppyIOTelemetryWriter::data() {
+    return this->buffer;
+}
+
+// The length of the message built so far
+size_t FloppyIOTelemetryWriter::length() {
+    return this->buffer.length();
+}
+
+// Start a new message
+void FloppyIOTelemetryWriter::clear() {
+    this->buffer.clear();
+}
+
+//
+// Queue the message on a channel and start a new one
+//
+// The message goes out with the next flush (or pump) of the multiplexer.
+//
+// @param mux       The channel multiplexer
+// @param channel   The channel
+// @return          0 if successful or an error code
+//
+int FloppyIOTelemetryWriter::send(FloppyIOMux * mux, int channel) {
+    int res = mux->send(channel, this->buffer);
+    if (res < 0) return res;
+    this->buffer.clear();
+    return 0;
+}
+
+//
+// Reader constructor
+//
+// @param data      The message
+// @param length    Its length
+//
+FloppyIOTelemetryReader::FloppyIOTelemetryReader(const void * data, size_t length) {
+    this->pos = (const unsigned char *)data;
+    this->end = this->pos + length;
+    this->time = 0;
+    this->truncated = false;
+}
+
+//
+// Reader constructor
+//
+// @param message   The message. It must not change while it is walked.
+//
+FloppyIOTelemetryReader::FloppyIOTelemetryReader(const string & message) {
+    this->pos = (const unsigned char *)message.data();
+    this->end = this->pos + message.length();
+    this->time = 0;
+    this->truncated = false;
+}
+
+//
+// Get the next record
+//
+// The FPIO_TLM_TIME records are not returned, they stamp the records that
+// follow them.
+//
+// @param record    Receives the record
+// @return          TRUE if there was one, FALSE at the end of the message
+//
+bool FloppyIOTelemetryReader::next(fpio_tlm_record * record) {
+    while (this->pos < this->end) {
+        if ((this->end - this->pos < 2) || (this->end - this->pos - 2 < this->pos[1])) {
+            this->truncated = true;
+            this->pos = this->end;
+            return false;
+        }
+
+        record->tag = this->pos[0];
+        record->length = this->pos[1];
+        record->value = this->pos + 2;
+        this->pos += 2 + record->length;
+
+        if (record->tag == FPIO_TLM_TIME) {
+            this->time = record->integer();
+            continue;
+        }
+        record->time = this->time;
+        return true;
+    }
+    return false;
+}
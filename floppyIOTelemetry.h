@@ -0,0 +1,216 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOTelemetry.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  Binary telemetry records over a Floppy I/O channel.
+//
+//  A telemetry message is a sequence of records:
+//
+//    [tag: 1 byte] [length: 1 byte] [value: length bytes]
+//
+//  Numeric values are unsigned little endian integers of 1 to 8 bytes (The
+//  writer uses the fewest bytes that hold the value), text values are raw
+//  bytes. A FPIO_TLM_TIME record stamps the samples that follow it.
+//
+//  The guest builds a message with FloppyIOTelemetryWriter and sends it on
+//  the metrics channel. The host walks it with FloppyIOTelemetryReader,
+//  which points into the message instead of copying the values, and keeps
+//  the samples in FloppyIOTelemetryRing buffers of fixed size.
+//
+
+#ifndef FLOPPYIOTELEMETRY_H
+#define	FLOPPYIOTELEMETRY_H
+
+#include <string>
+#include "floppyIO.h"
+#include "floppyIOMux.h"
+
+using namespace std;
+
+//
+// Record tags
+//
+#define FPIO_TLM_TIME       0x01    // Time of the samples that follow (Milliseconds since the epoch)
+#define FPIO_TLM_LOAD1      0x02    // Load average over 1 minute (x100)
+#define FPIO_TLM_LOAD5      0x03    // Load average over 5 minutes (x100)
+#define FPIO_TLM_LOAD15     0x04    // Load average over 15 minutes (x100)
+#define FPIO_TLM_MEM_TOTAL  0x05    // Memory (kB)
+#define FPIO_TLM_MEM_FREE   0x06    // Memory available (kB)
+#define FPIO_TLM_UPTIME     0x07    // Uptime (Seconds)
+#define FPIO_TLM_PROCS      0x08    // Processes running
+#define FPIO_TLM_COUNTER    0x10    // First of the application counters (Up to 0x3F)
+#define FPIO_TLM_EVENT      0x40    // Text of an event
+
+// Tags below this one carry numbers
+
+#define FPIO_TLM_NUMERIC    0x40
+
+// Largest value of a record
+
+#define FPIO_TLM_MAX_VALUE  255
+
+//
+// A record found by FloppyIOTelemetryReader
+//
+// The value points into the message walked, it is valid as long as the
+// message is.
+//
+struct fpio_tlm_record {
+    int         tag;
+    int         length;
+    const unsigned char * value;
+    long long   time;           // The last FPIO_TLM_TIME seen, or 0
+
+    // The value as an integer
+    unsigned long long integer() const {
+        unsigned long long v = 0;
+        for (int i=((length > 8) ? 8 : length)-1; i>=0; i--)
+            v = (v << 8) | value[i];
+        return v;
+    }
+};
+
+//
+// Telemetry message builder
+//
+class FloppyIOTelemetryWriter {
+public:
+
+    // Constructors
+    FloppyIOTelemetryWriter();
+    virtual ~FloppyIOTelemetryWriter();
+
+    // Records
+    void        time(long long ms = 0);
+    void        put(int tag, unsigned long long value);
+    void        put(int tag, const void * value, size_t length);
+    void        event(const string & text);
+
+    // The message
+    const string & data();
+    size_t      length();
+    void        clear();
+    int         send(FloppyIOMux * mux, int channel = FPIO_CHANNEL_METRICS);
+
+private:
+
+    string      buffer;
+
+};
+
+//
+// Telemetry message walker
+//
+// Doesn't copy or allocate anything: the records point into the message.
+//
+class FloppyIOTelemetryReader {
+public:
+
+    // Constructors
+    FloppyIOTelemetryReader(const void * data, size_t length);
+    FloppyIOTelemetryReader(const string & message);
+
+    // Functions
+    bool        next(fpio_tlm_record * record);
+
+    // TRUE if the message ended in the middle of a record
+    bool        truncated;
+
+private:
+
+    const unsigned char * pos;
+    const unsigned char * end;
+    long long   time;
+
+};
+
+//
+// The last samples of a value
+//
+// Keeps the last Size samples in a fixed array: older samples are
+// overwritten and nothing is allocated.
+//
+template <int Size>
+class FloppyIOTelemetryRing {
+public:
+
+    FloppyIOTelemetryRing() {
+        this->head = 0;
+        this->count = 0;
+        for (int i=0; i<Size; i++) {
+            this->samples[i].time = 0;
+            this->samples[i].value = 0;
+        }
+    }
+
+    // Add a sample
+    void push(long long time, unsigned long long value) {
+        this->samples[this->head].time = time;
+        this->samples[this->head].value = value;
+        this->head = (this->head + 1) % Size;
+        if (this->count < Size) this->count++;
+    }
+
+    // The number of samples kept
+    int size() {
+        return this->count;
+    }
+
+    // A sample (0 is the last one, 0 if there is none)
+    unsigned long long value(int age) {
+        return this->samples[(this->head + Size - 1 - age) % Size].value;
+    }
+    long long time(int age) {
+        return this->samples[(this->head + Size - 1 - age) % Size].time;
+    }
+
+    // Statistics of the samples kept
+    unsigned long long minimum() {
+        unsigned long long v = 0;
+        for (int i=0; i<this->count; i++)
+            if ((i == 0) || (this->samples[i].value < v)) v = this->samples[i].value;
+        return v;
+    }
+    unsigned long long maximum() {
+        unsigned long long v = 0;
+        for (int i=0; i<this->count; i++)
+            if (this->samples[i].value > v) v = this->samples[i].value;
+        return v;
+    }
+    double mean() {
+        double sum = 0;
+        for (int i=0; i<this->count; i++)
+            sum += this->samples[i].value;
+        return (this->count > 0) ? sum / this->count : 0;
+    }
+
+private:
+
+    struct {
+        long long   time;
+        unsigned long long value;
+    } samples[Size];
+
+    int         head;
+    int         count;
+
+};
+
+#endif	// FLOPPYIOTELEMETRY_H
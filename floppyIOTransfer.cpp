@@ -0,0 +1,412 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   FloppyIOTransfer.cpp
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Resumable file transfers over a Floppy I/O channel (See FloppyIOTransfer.h)
+//
+
+#include "floppyIOTransfer.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//
+// Append an unsigned integer to a message (Little endian)
+//
+static void fpio_put(string * message, unsigned long long value, int bytes) {
+    for (int i=0; i<bytes; i++) {
+        message->push_back((char)(value & 0xFF));
+        value >>= 8;
+    }
+}
+
+//
+// Read an unsigned integer from a message (Little endian)
+//
+static unsigned long long fpio_get(const string & message, size_t offset, int bytes) {
+    unsigned long long value = 0;
+    for (int i=bytes-1; i>=0; i--)
+        value = (value << 8) | (unsigned char)message[offset + i];
+    return value;
+}
+
+//
+// Transfer constructor
+//
+// @param mux       The channel multiplexer to transfer over. It must stay
+//                  valid for as long as this object is used.
+// @param channel   The channel reserved for the transfers
+// @param blockSize The size of the blocks the file is sent in (Sender only,
+//                  the receiver uses the one of the manifest)
+//
+FloppyIOTransfer::FloppyIOTransfer(FloppyIOMux * mux, int channel, int blockSize) {
+    this->mux = mux;
+    this->channel = channel;
+    this->blockSize = blockSize;
+    this->blocksSent = 0;
+    this->blocksSkipped = 0;
+    this->blocksReceived = 0;
+    this->szFile = 0;
+    this->crcFile = 0;
+    this->szBlock = blockSize;
+}
+
+//
+// Transfer destructor
+//
+FloppyIOTransfer::~FloppyIOTransfer() {
+}
+
+//
+// Send a file
+//
+// If the receiver already has some blocks of the same file (same size and
+// CRC) from an earlier attempt, they are not sent again.
+//
+// @param filename  The file to send
+// @param name      The name to announce to the receiver (Default: filename)
+// @return          0 if the receiver got the whole file or an error code
+//
+int FloppyIOTransfer::sendFile(const char * filename, const char * name) {
+    struct stat st;
+    string message, reply;
+    int fd, res;
+    bool bFirst = true;
+
+    this->blocksSent = 0;
+    this->blocksSkipped = 0;
+
+    // Describe the file
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return FPIO_ERR_INPUT;
+    if ((fstat(fd, &st) < 0) || (this->fileCRC(fd, st.st_size, &this->crcFile) < 0)) {
+        close(fd);
+        return FPIO_ERR_INPUT;
+    }
+    this->szFile = st.st_size;
+    this->szBlock = this->blockSize;
+
+    message.push_back(FPIO_XFER_MANIFEST);
+    fpio_put(&message, this->szFile, 8);
+    fpio_put(&message, this->crcFile, 4);
+    fpio_put(&message, this->szBlock, 4);
+    message.append((name != NULL) ? name : filename);
+
+    // Send the manifest and get what the receiver already has
+    res = this->mux->send(this->channel, message);
+    if (res >= 0) res = this->mux->flush();
+    if (res >= 0) res = this->receiveMessage(&reply);
+    if ((res >= 0) && (reply[0] != FPIO_XFER_STATE)) res = FPIO_ERR_SEQUENCE;
+
+    char * data = new char[this->szBlock];
+    unsigned long nBlocks = this->blockCount();
+    while (res >= 0) {
+        this->bitmap.assign(reply.begin() + 1, reply.end());
+        this->bitmap.resize((nBlocks + 7) / 8, 0);
+
+        // Send the missing blocks
+        for (unsigned long i=0; i<nBlocks; i++) {
+            if (this->blockPresent(i)) {
+                if (bFirst) this->blocksSkipped++;
+                continue;
+            }
+
+            unsigned long long offset = (unsigned long long)i * this->szBlock;
+            int szData = this->szBlock;
+            if (offset + szData > this->szFile) szData = this->szFile - offset;
+            if (pread(fd, data, szData, offset) != szData) {
+                res = FPIO_ERR_INPUT;
+                break;
+            }
+
+            message.clear();
+            message.push_back(FPIO_XFER_BLOCK);
+            fpio_put(&message, offset, 8);
+            message.append(data, szData);
+            res = this->mux->send(this->channel, message);
+            if (res >= 0) res = this->mux->flush();
+            if (res < 0) break;
+            this->blocksSent++;
+        }
+        if (res < 0) break;
+        bFirst = false;
+
+        // Done, unless the receiver is still missing something
+        message.assign(1, FPIO_XFER_END);
+        res = this->mux->send(this->channel, message);
+        if (res >= 0) res = this->mux->flush();
+        if (res >= 0) res = this->receiveMessage(&reply);
+        if (res < 0) break;
+
+        if (reply[0] == FPIO_XFER_DONE) {
+            res = (reply.length() < 5) ? FPIO_ERR_DATA : (int)fpio_get(reply, 1, 4);
+            break;
+        }
+        if (reply[0] != FPIO_XFER_STATE) res = FPIO_ERR_SEQUENCE;
+    }
+
+    delete[] data;
+    close(fd);
+    return (res < 0) ? res : 0;
+}
+
+//
+// Receive a file
+//
+// Waits for the manifest of the sender and resumes from the state file of
+// an earlier attempt if it describes the same file. If the transfer is
+// interrupted, the state is saved so that the next attempt can resume it.
+// A sender that restarts in the middle of the transfer is served again
+// without losing the blocks already received.
+//
+// @param filename  Where to store the file
+// @return          0 if the whole file was received and verified or an error code
+//
+int FloppyIOTransfer::receiveFile(const char * filename) {
+    string statePath = string(filename) + FPIO_TRANSFER_STATE_SUFFIX;
+    string message, reply;
+    int fd = -1, res;
+    int sinceSave = 0;
+
+    this->blocksReceived = 0;
+
+    for (;;) {
+        res = this->receiveMessage(&message);
+        if (res < 0) break;
+
+        if (message[0] == FPIO_XFER_MANIFEST) {
+            if (message.length() < 17) {
+                res = FPIO_ERR_DATA;
+                break;
+            }
+            unsigned long long szFile = fpio_get(message, 1, 8);
+            unsigned int crcFile = fpio_get(message, 9, 4);
+            int szBlock = fpio_get(message, 13, 4);
+            if (szBlock <= 0) {
+                res = FPIO_ERR_DATA;
+                break;
+            }
+
+            // A new file, or the sender restarted the one we are receiving?
+            if ((fd < 0) || (szFile != this->szFile) || (crcFile != this->crcFile) || (szBlock != this->szBlock)) {
+                if (fd >= 0) close(fd);
+                this->szFile = szFile;
+                this->crcFile = crcFile;
+                this->szBlock = szBlock;
+                this->remoteName = message.substr(17);
+
+                // Resume if we have the state of the same file
+                int openFlags = O_RDWR | O_CREAT;
+                if (this->loadState(filename) < 0) {
+                    this->bitmap.assign((this->blockCount() + 7) / 8, 0);
+                    openFlags |= O_TRUNC;
+                } else {
+                    cerr << "Resuming the transfer of " << filename << "\n";
+                }
+                fd = open(filename, openFlags, 0644);
+                if ((fd < 0) || (ftruncate(fd, this->szFile) < 0)) {
+                    res = FPIO_ERR_IO;
+                    break;
+                }
+            }
+
+            reply.assign(1, FPIO_XFER_STATE);
+            reply.append(this->bitmap.begin(), this->bitmap.end());
+
+        } else if (message[0] == FPIO_XFER_BLOCK) {
+            if (fd < 0) {
+                res = FPIO_ERR_SEQUENCE;
+                break;
+            }
+
+            // The block must be where a block starts and have the right size
+            unsigned long long offset = (message.length() < 9) ? this->szFile : fpio_get(message, 1, 8);
+            unsigned long long szData = this->szBlock;
+            if (offset + szData > this->szFile) szData = this->szFile - offset;
+            if ((offset >= this->szFile) || (offset % this->szBlock != 0) || (message.length() - 9 != szData)) {
+                res = FPIO_ERR_DATA;
+                break;
+            }
+
+            if (pwrite(fd, message.data() + 9, szData, offset) != (ssize_t)szData) {
+                res = FPIO_ERR_IO;
+                break;
+            }
+            unsigned long block = offset / this->szBlock;
+            this->bitmap[block / 8] |= (1 << (block % 8));
+            this->blocksReceived++;
+
+            if (++sinceSave >= FPIO_TRANSFER_SYNC_BLOCKS) {
+                this->saveState(filename, fd);
+                sinceSave = 0;
+            }
+            continue;
+
+        } else if (message[0] == FPIO_XFER_END) {
+            if (fd < 0) {
+                res = FPIO_ERR_SEQUENCE;
+                break;
+            }
+
+            // Ask again for whatever is still missing
+            unsigned long nBlocks = this->blockCount(), i;
+            for (i=0; i<nBlocks; i++)
+                if (!this->blockPresent(i)) break;
+            if (i < nBlocks) {
+                this->saveState(filename, fd);
+                reply.assign(1, FPIO_XFER_STATE);
+                reply.append(this->bitmap.begin(), this->bitmap.end());
+            } else {
+
+                // Complete: verify it. A corrupted file starts over next time
+                unsigned int crc;
+                res = this->fileCRC(fd, this->szFile, &crc);
+                if ((res == 0) && (crc != this->crcFile)) res = FPIO_ERR_DATA;
+                unlink(statePath.c_str());
+                close(fd);
+                fd = -1;
+
+                reply.assign(1, FPIO_XFER_DONE);
+                fpio_put(&reply, (unsigned int)res, 4);
+                this->mux->send(this->channel, reply);
+                int resSend = this->mux->flush();
+                return (res < 0) ? res : ((resSend < 0) ? resSend : 0);
+            }
+
+        } else {
+            res = FPIO_ERR_SEQUENCE;
+            break;
+        }
+
+        res = this->mux->send(this->channel, reply);
+        if (res >= 0) res = this->mux->flush();
+        if (res < 0) break;
+    }
+
+    // Interrupted: keep what we have for the next attempt
+    if (fd >= 0) {
+        this->saveState(filename, fd);
+        close(fd);
+    }
+    return res;
+}
+
+//
+// Receive the next message of the transfer channel
+//
+int FloppyIOTransfer::receiveMessage(string * message) {
+    int res = this->mux->receive(this->channel, message);
+    if (res < 0) return res;
+    if (message->empty()) return FPIO_ERR_DATA;
+    return res;
+}
+
+//
+// Load the receive bitmap of a file
+//
+// @return  0 if the state file describes the file of the current manifest, -1 otherwise
+//
+int FloppyIOTransfer::loadState(const char * filename) {
+    string statePath = string(filename) + FPIO_TRANSFER_STATE_SUFFIX;
+    unsigned long long szFile;
+    unsigned int crcFile;
+    int szBlock;
+
+    FILE * f = fopen(statePath.c_str(), "rb");
+    if (f == NULL) return -1;
+
+    // A text line describing the file, then the bitmap
+    if ((fscanf(f, "%llu %u %i\n", &szFile, &crcFile, &szBlock) != 3) ||
+        (szFile != this->szFile) || (crcFile != this->crcFile) || (szBlock != this->szBlock)) {
+        fclose(f);
+        return -1;
+    }
+
+    this->bitmap.assign((this->blockCount() + 7) / 8, 0);
+    size_t rd = this->bitmap.empty() ? 0 : fread(&this->bitmap[0], 1, this->bitmap.size(), f);
+    fclose(f);
+    return (rd == this->bitmap.size()) ? 0 : -1;
+}
+
+//
+// Save the receive bitmap of a file
+//
+// The data of the file is flushed first and the state file is replaced
+// atomically, so the bitmap on disk never claims more than what is there.
+//
+// @param filename  The file being received
+// @param fd        Its file descriptor
+// @return          0 on success or -1
+//
+int FloppyIOTransfer::saveState(const char * filename, int fd) {
+    string statePath = string(filename) + FPIO_TRANSFER_STATE_SUFFIX;
+    string tmpPath = statePath + ".tmp";
+
+    // Mac OS X has no fdatasync, and its fsync leaves the data in the
+    // cache of the drive
+#ifdef __APPLE__
+    if ((fcntl(fd, F_FULLFSYNC) < 0) && (fsync(fd) < 0)) return -1;
+#else
+    if (fdatasync(fd) < 0) return -1;
+#endif
+
+    FILE * f = fopen(tmpPath.c_str(), "wb");
+    if (f == NULL) return -1;
+    fprintf(f, "%llu %u %i\n", this->szFile, this->crcFile, this->szBlock);
+    if (!this->bitmap.empty()) fwrite(&this->bitmap[0], 1, this->bitmap.size(), f);
+    if ((fflush(f) != 0) || (fsync(fileno(f)) < 0)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return rename(tmpPath.c_str(), statePath.c_str());
+}
+
+//
+// Calculate the CRC32C of a file
+//
+// @return  0 on success or FPIO_ERR_INPUT
+//
+int FloppyIOTransfer::fileCRC(int fd, unsigned long long size, unsigned int * crc) {
+    char buf[65536];
+    unsigned long long offset = 0;
+    ssize_t rd;
+
+    *crc = 0;
+    while (offset < size) {
+        rd = pread(fd, buf, (size - offset < sizeof(buf)) ? size - offset : sizeof(buf), offset);
+        if (rd <= 0) return FPIO_ERR_INPUT;
+        *crc = fpio_crc32c(*crc, buf, rd);
+        offset += rd;
+    }
+    return 0;
+}
+
+// Check if a block was received
+bool FloppyIOTransfer::blockPresent(unsigned long block) {
+    return (this->bitmap[block / 8] & (1 << (block % 8))) != 0;
+}
+
+// The number of blocks of the current file
+unsigned long FloppyIOTransfer::blockCount() {
+    return (this->szFile + this->szBlock - 1) / this->szBlock;
+}
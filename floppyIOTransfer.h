@@ -0,0 +1,120 @@
+//  This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+//  Copyright (C) 2011 Ioannis Charalampidis
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+//  File:   FloppyIOTransfer.h
+//  License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+//  Resumable file transfers over a Floppy I/O channel.
+//
+//  The sender starts with a manifest (size, CRC32C of the whole file,
+//  block size and name). The receiver answers with the bitmap of the
+//  blocks it already has from an earlier, interrupted attempt of the same
+//  file, and the sender only sends the blocks that are missing, each one
+//  tagged with its offset. When the sender is done, the receiver checks
+//  the CRC of the file and reports the outcome, or asks again for the
+//  blocks that are still missing.
+//
+//  The receiver keeps the bitmap in <filename>.fpio-state, next to the
+//  file being received, and removes it once the file is complete. The
+//  bitmap is saved every few blocks, after the data it describes reached
+//  the disk, so it never claims a block that was not written.
+//
+//  All the messages go through a FloppyIOMux channel (FPIO_CHANNEL_FILE by
+//  default), so the other channels keep flowing during a transfer.
+//
+
+#ifndef FLOPPYIOTRANSFER_H
+#define	FLOPPYIOTRANSFER_H
+
+#include <string>
+#include <vector>
+#include "floppyIO.h"
+#include "floppyIOMux.h"
+
+using namespace std;
+
+// Default size of a transfer block (The unit of resumption)
+
+#define DEFAULT_FIO_TRANSFER_BLOCK  65536
+
+// Save the receive bitmap every that many blocks
+
+#define FPIO_TRANSFER_SYNC_BLOCKS   16
+
+// Suffix of the receive state file
+
+#define FPIO_TRANSFER_STATE_SUFFIX  ".fpio-state"
+
+//
+// Transfer message types (First byte of every message)
+//
+#define FPIO_XFER_MANIFEST  'M'     // size:8, crc:4, blockSize:4, name
+#define FPIO_XFER_STATE     'S'     // bitmap of the blocks already received
+#define FPIO_XFER_BLOCK     'B'     // offset:8, data
+#define FPIO_XFER_END       'E'     // No more blocks
+#define FPIO_XFER_DONE      'D'     // result:4
+
+//
+// Resumable file transfer class
+//
+class FloppyIOTransfer {
+public:
+
+    // Constructors
+    FloppyIOTransfer(FloppyIOMux * mux, int channel = FPIO_CHANNEL_FILE, int blockSize = DEFAULT_FIO_TRANSFER_BLOCK);
+    virtual ~FloppyIOTransfer();
+
+    // Functions
+    int         sendFile(const char * filename, const char * name = NULL);
+    int         receiveFile(const char * filename);
+
+    // The channel multiplexer we transfer over
+    FloppyIOMux * mux;
+
+    // Transfer configuration
+    int         channel;
+    int         blockSize;
+
+    // The name given by the sender of the last file received
+    string      remoteName;
+
+    // Statistics of the last transfer
+    unsigned long blocksSent;       // Blocks sent
+    unsigned long blocksSkipped;    // Blocks the receiver already had
+    unsigned long blocksReceived;   // Blocks written on the file
+
+private:
+
+    // Receive state
+    vector<unsigned char> bitmap;
+    unsigned long long szFile;
+    unsigned int crcFile;
+    int         szBlock;
+
+    // Functions
+    int         receiveMessage(string * message);
+    int         loadState(const char * filename);
+    int         saveState(const char * filename, int fd);
+    int         fileCRC(int fd, unsigned long long size, unsigned int * crc);
+    bool        blockPresent(unsigned long block);
+    unsigned long blockCount();
+
+};
+
+#endif	// FLOPPYIOTRANSFER_H
+
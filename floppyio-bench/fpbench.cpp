@@ -0,0 +1,327 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   fpbench.cpp
+// License: GNU General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Loopback benchmark for the FloppyIO library.
+//
+// A hypervisor-mode FloppyIO and an FPIO_CLIENT instance play ping-pong
+// over an image on tmpfs, either from two threads or from two processes.
+// The message size, the framing (binary or character) and the sync
+// back-off ceiling are swept, both with FloppyIO and with its compile-time
+// specialised FloppyIOT variant, and for every combination the throughput,
+// the p50/p99 round-trip latency and the CPU time per MB moved are
+// reported. Every echo is verified, so the exit code can gate
+// regressions. No hypervisor is needed.
+//
+//   fpbench [-q] [-v] [-d dir]
+//
+//   -q       Quick run (Fewer round trips per combination)
+//   -v       Keep the debug output of the library
+//   -d dir   Where to create the image (Default: /dev/shm)
+//
+// -------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+
+#include "../floppyIO.h"
+#include "../floppyIOT.h"
+
+using namespace std;
+
+#define  RUN_THREADS    1
+#define  RUN_PROCESSES  2
+
+#define  IMPL_RUNTIME   1   // FloppyIO
+#define  IMPL_TEMPLATE  2   // FloppyIOT
+
+// Data moved per combination (Both directions), before the quick factor
+#define  BENCH_BYTES    (8*1024*1024)
+#define  BENCH_MIN_ITER 20
+#define  BENCH_MAX_ITER 2000
+
+//
+// One benchmark combination
+//
+struct bench_case {
+    int         flags;      // Extra FloppyIO flags (ex. FPIO_BINARY)
+    int         maxSleep;   // syncMaxSleep of both ends
+    int         runner;     // RUN_THREADS or RUN_PROCESSES
+    int         impl;       // IMPL_RUNTIME or IMPL_TEMPLATE
+    int         size;       // Message size
+    int         iterations; // Round trips
+};
+
+//
+// The outcome of a combination
+//
+struct bench_result {
+    double      mbps;       // Throughput (MB/s, both directions)
+    double      p50;        // Round-trip latency (microseconds)
+    double      p99;
+    double      cpuPerMB;   // CPU seconds per MB moved (Both ends)
+    bool        ok;
+};
+
+static const char * imageFile;
+
+// Current time in microseconds
+static double now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+// CPU time used so far (seconds)
+static double cpu_time(int who) {
+    struct rusage ru;
+    getrusage(who, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+//
+// Open one end of the image (The FloppyIOT ends have everything else
+// built in)
+//
+template <class F> static F * bench_open(int flags) {
+    return new F(imageFile, flags & (FPIO_NOINIT | FPIO_NOCREATE));
+}
+
+template <> FloppyIO * bench_open<FloppyIO>(int flags) {
+    return new FloppyIO(imageFile, FPIO_SYNCHRONIZED | flags);
+}
+
+//
+// Move one message (The stream API is used when it doesn't fit in a block)
+//
+template <class F> static bool bench_send(F * fio, const string & data) {
+    if ((int)data.length() <= fio->szOutput)
+        return fio->send(data.data(), data.length()) == (int)data.length();
+    istringstream in(data);
+    return fio->send(&in) == (int)data.length();
+}
+
+template <class F> static bool bench_receive(F * fio, string * data, int size) {
+    if (size <= fio->szInput) {
+        data->resize(size);
+        return fio->receive(&(*data)[0], size) == size;
+    }
+    ostringstream out;
+    fio->receive(&out);
+    *data = out.str();
+    return (int)data->length() == size;
+}
+
+//
+// The client end: echo every message back
+//
+template <class C> static bool bench_client(const bench_case * bc) {
+    C * fio = bench_open<C>(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE | bc->flags);
+    bool ok = fio->ready();
+    fio->syncMaxSleep = bc->maxSleep;
+
+    string data;
+    for (int i=0; (i<bc->iterations) && ok; i++) {
+        ok = bench_receive(fio, &data, bc->size) && bench_send(fio, data);
+    }
+    delete fio;
+    return ok;
+}
+
+template <class C> static void * bench_client_thread(void * arg) {
+    return bench_client<C>((const bench_case *)arg) ? (void *)1 : NULL;
+}
+
+//
+// Run a combination between a hypervisor end H and a client end C
+//
+template <class H, class C> static bench_result bench_run(const bench_case * bc) {
+    bench_result res;
+    vector<double> rtt;
+    string data(bc->size, 0), echo;
+    pthread_t thread;
+    pid_t pid = 0;
+    bool clientOk = false;
+
+    res.ok = false;
+    res.mbps = res.p50 = res.p99 = res.cpuPerMB = 0;
+
+    // Printable data, so the character framing can carry it
+    for (int i=0; i<bc->size; i++) data[i] = 'a' + (rand() % 26);
+
+    unlink(imageFile);
+    H * fio = bench_open<H>(bc->flags);
+    if (!fio->ready()) {
+        delete fio;
+        return res;
+    }
+    fio->syncMaxSleep = bc->maxSleep;
+
+    double cpuStart = cpu_time(RUSAGE_SELF);
+    double cpuChildStart = cpu_time(RUSAGE_CHILDREN);
+    double tStart = now_us();
+
+    // Start the client end
+    if (bc->runner == RUN_THREADS) {
+        if (pthread_create(&thread, NULL, bench_client_thread<C>, (void *)bc) != 0) {
+            delete fio;
+            return res;
+        }
+    } else {
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            delete fio;
+            return res;
+        }
+        if (pid == 0) _exit(bench_client<C>(bc) ? 0 : 1);
+    }
+
+    // Ping-pong
+    bool ok = true;
+    rtt.reserve(bc->iterations);
+    for (int i=0; (i<bc->iterations) && ok; i++) {
+        double t0 = now_us();
+        ok = bench_send(fio, data) && bench_receive(fio, &echo, bc->size) && (echo == data);
+        rtt.push_back(now_us() - t0);
+    }
+
+    // Wait for the client end
+    if (bc->runner == RUN_THREADS) {
+        void * ret;
+        if (!ok) fio->send("");  // Unblock the client, it will fail on its own
+        pthread_join(thread, &ret);
+        clientOk = (ret != NULL);
+    } else {
+        int status;
+        if (!ok) kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        clientOk = WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+    }
+    delete fio;
+
+    double tElapsed = (now_us() - tStart) / 1e6;
+    double cpu = (cpu_time(RUSAGE_SELF) - cpuStart) + (cpu_time(RUSAGE_CHILDREN) - cpuChildStart);
+    double mb = 2.0 * bc->size * bc->iterations / (1024.0 * 1024.0);
+
+    sort(rtt.begin(), rtt.end());
+    res.ok = ok && clientOk;
+    res.mbps = mb / tElapsed;
+    res.p50 = rtt.empty() ? 0 : rtt[rtt.size() * 50 / 100];
+    res.p99 = rtt.empty() ? 0 : rtt[rtt.size() * 99 / 100];
+    res.cpuPerMB = cpu / mb;
+    return res;
+}
+
+//
+// Run a combination with the implementation it asks for
+//
+static bench_result bench_dispatch(const bench_case * bc) {
+    if (bc->impl == IMPL_RUNTIME)
+        return bench_run<FloppyIO, FloppyIO>(bc);
+    if ((bc->flags & FPIO_BINARY) != 0)
+        return bench_run< FloppyIOT<0, FPIO_FRAMING_BINARY>, FloppyIOT<FPIO_CLIENT, FPIO_FRAMING_BINARY> >(bc);
+    return bench_run< FloppyIOT<0, 0>, FloppyIOT<FPIO_CLIENT, 0> >(bc);
+}
+
+//
+// Main application
+//
+int main(int argc, char **argv) {
+    const char * dir = "/dev/shm";
+    bool verbose = false;
+    int quick = 1, failed = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "qvd:")) != -1)
+        switch (c) {
+            case 'q':
+                quick = 8;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: fpbench [-q] [-v] [-d dir]\n");
+                return 2;
+        }
+
+    string image = string(dir) + "/fpbench.img";
+    imageFile = image.c_str();
+
+    // The library is chatty, that would be measured too
+    if (!verbose) cerr.rdbuf(NULL);
+
+    const int sizes[] = { 16, 512, 4096, 16384, 262144 };
+    const int sleeps[] = { 1000, DEFAULT_FIO_SYNC_MAXSLEEP };
+    const int framings[] = { 0, FPIO_BINARY };
+    const int runners[] = { RUN_THREADS, RUN_PROCESSES };
+    const int impls[] = { IMPL_RUNTIME, IMPL_TEMPLATE };
+
+    printf("%-9s %-9s %-9s %6s %8s %10s %10s %10s %10s\n",
+           "class", "runner", "framing", "sleep", "size", "MB/s", "p50(us)", "p99(us)", "CPU s/MB");
+
+    for (unsigned i=0; i<sizeof(impls)/sizeof(int); i++)
+    for (unsigned r=0; r<sizeof(runners)/sizeof(int); r++)
+    for (unsigned f=0; f<sizeof(framings)/sizeof(int); f++)
+    for (unsigned s=0; s<sizeof(sleeps)/sizeof(int); s++)
+    for (unsigned z=0; z<sizeof(sizes)/sizeof(int); z++) {
+        bench_case bc;
+        bc.flags = framings[f];
+        bc.maxSleep = sleeps[s];
+        bc.runner = runners[r];
+        bc.impl = impls[i];
+        bc.size = sizes[z];
+        bc.iterations = BENCH_BYTES / quick / (2 * bc.size);
+        if (bc.iterations < BENCH_MIN_ITER) bc.iterations = BENCH_MIN_ITER;
+        if (bc.iterations > BENCH_MAX_ITER / quick) bc.iterations = BENCH_MAX_ITER / quick;
+
+        bench_result res = bench_dispatch(&bc);
+        printf("%-9s %-9s %-9s %6i %8i %10.2f %10.0f %10.0f %10.4f%s\n",
+               (bc.impl == IMPL_RUNTIME) ? "FloppyIO" : "FloppyIOT",
+               (bc.runner == RUN_THREADS) ? "threads" : "processes",
+               (bc.flags & FPIO_BINARY) ? "binary" : "character",
+               bc.maxSleep, bc.size, res.mbps, res.p50, res.p99, res.cpuPerMB,
+               res.ok ? "" : "  FAILED");
+        fflush(stdout);
+        if (!res.ok) failed++;
+    }
+
+    unlink(imageFile);
+    if (failed > 0) {
+        printf("%i combinations FAILED\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -44,28 +44,90 @@
 //   Hypervisor:  fpclient -H -r /var/vmware/myvm/floppy.img > (data)
 //        Guest:  fpclient -S (filename) /dev/fd1
 //
+// 5) Create a full 1.44Mb floppy image with a geometry header. The guest
+//    picks the layout up from the header, without any extra option.
+//
+//   Hypervisor:  fpclient -zH -m 1474560 /var/vmware/myvm/floppy.img
+//
+// 6) Keep serving the hypervisor from the guest: every message is given
+//    to a handler as STDIN and whatever it prints is sent back on the
+//    same channel (or, with -P, written on the named pipe of its channel)
+//
+//        Guest:  fpclient -D -x /usr/bin/handle-message
+//        Guest:  fpclient -D -P /var/run/fpio
+//
+// 7) Send a large file in a resumable way. If the transfer is interrupted,
+//    running the same commands again only transfers what is missing
+//
+//   Hypervisor:  fpclient -H -T -R (filename) /var/vmware/myvm/floppy.img
+//        Guest:  fpclient -T -S (filename)
+//
+// 8) Use the serial port instead of the floppy (The VM UART is connected
+//    to a host pipe, see FloppyIOSerial)
+//
+//        Guest:  fpclient -u /dev/ttyS0 -S (filename)
+//
+// 9) Query the guest daemon (It answers "ping", "load" and "uptime", and
+//    gives the other methods to its -x handler). The queries are sent
+//    together and each one prints "method status result"
+//
+//   Hypervisor:  fpclient -H -Q load -Q progress:job-1 -w 500 /var/vmware/myvm/floppy.img
+//        Guest:  fpclient -D -x /usr/bin/handle-message
+//
+// 10) Keep a directory of the guest in sync with one of the hypervisor. Only
+//     the parts of the files that changed are sent (With -p, what was
+//     removed on the hypervisor is removed from the guest too)
+//
+//   Hypervisor:  fpclient -H -Y -S (directory) /var/vmware/myvm/floppy.img
+//        Guest:  fpclient -Y -p -R (directory)
+//
+// 11) Report the load and the memory of the guest to the hypervisor every
+//     10 seconds (See FloppyIOTelemetry)
+//
+//        Guest:  fpclient -M 10
+//
 // -------------------------------------------------------------------
 // 
 // Created at January 9, 2012, 17:26 PM
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <iostream>
+#include <vector>
 
 #include "../floppyIO.h";
+#include "../floppyIOMux.h"
+#include "../floppyIOTransfer.h"
+#include "../floppyIOSync.h"
+#include "../floppyIOSerial.h"
+#include "../floppyIORPC.h"
+#include "../floppyIOTelemetry.h"
 
 using namespace std;
 
 #define  MODE_SEND      1
 #define  MODE_RECEIVE   2
 #define  MODE_ZEROONLY  3
+#define  MODE_DAEMON    4
+#define  MODE_CALL      5
+#define  MODE_TELEMETRY 6
+
+// How long (microseconds) the daemon waits before it posts again a reply
+// the hypervisor didn't take yet
+#define  DAEMON_RETRY   10000
 
 //
 // Help screen
 //
 void help() {
     printf("FloppyIO Hypervisor-Guest Communication System - Library version: %i.%i\n", FPIO_VERSION);
-    printf("Usage: fpio [-hsrcH] [-z] [-R [filename] | -S [filename]] [-t timeout] [floppy]\n");
+    printf("Usage: fpio [-hsrcdHZC] [-z] [-m size] [-R [filename] | -S [filename] | -D [-x command | -P dir] | -Q method[:args] [-w ms] | -M interval] [-T | -Y [-p]] [-n channel] [-u serial] [-t timeout] [floppy]\n");
     printf("Description:\n");
     printf("  floppy        The block device to use for FloppyIO (Default: /dev/fd0).\n");
     printf("  -c            Use character instead of binary mode (Compatible with the older\n");
@@ -73,10 +135,46 @@ void help() {
     printf("  -H            Hypervisor mode. Use this option if you run FloppyIO from the\n");
     printf("                hypervisor.\n");
     printf("  -z            Zero-out (reset) floppy file.\n");
+    printf("  -Z            Compress the data sent (Both ends must agree, unless the\n");
+    printf("                floppy file was created with -m).\n");
+    printf("  -C            Protect the data with checksums and re-send corrupted blocks\n");
+    printf("                (Both ends must agree, unless the floppy file was created\n");
+    printf("                with -m).\n");
+    printf("  -m size       Size of the floppy file to create. The layout is then\n");
+    printf("                described by a geometry header (Use with -zH).\n");
     printf("  -s            Read data from STDIN and send them.\n");
     printf("  -S filename   Read data from the specified file and send them.\n");
     printf("  -r            Receive data and write them on STDOUT.\n");
     printf("  -R filename   Receive data and save them to the specified file.\n");
+    printf("  -D            Daemon mode. Keep the floppy open and dispatch every message\n");
+    printf("                received (Implies -d). Without -x or -P the messages are\n");
+    printf("                written on STDOUT.\n");
+    printf("  -x command    Run the command for every message, with the message on its\n");
+    printf("                STDIN and the channel in FPIO_CHANNEL. Its output is sent\n");
+    printf("                back on the same channel.\n");
+    printf("  -P dir        Write every message on the named pipe dir/channel-N of its\n");
+    printf("                channel. Messages without a reader are dropped.\n");
+    printf("  -Q method[:args]  Call a method of the daemon on the other end and print\n");
+    printf("                \"method status result\". Can be repeated, the calls are sent\n");
+    printf("                without waiting for each other. The daemon answers \"ping\",\n");
+    printf("                \"load\" and \"uptime\", and runs its -x command for the rest\n");
+    printf("                (With the method in FPIO_METHOD).\n");
+    printf("  -w ms         How long to wait for the answer of a call (Default: %i).\n", DEFAULT_FIO_RPC_DEADLINE);
+    printf("  -M interval   Send the load and the memory of the system on the metrics\n");
+    printf("                channel every interval seconds, for ever.\n");
+    printf("  -T            Resumable file transfer (Use with -S or -R). An interrupted\n");
+    printf("                transfer continues where it stopped when run again. Uses\n");
+    printf("                channel 3, unless -n is given.\n");
+    printf("  -Y            Directory synchronization (Use with -S or -R, giving a\n");
+    printf("                directory). Only the files and the parts of files that\n");
+    printf("                changed are sent. Uses channel 3, unless -n is given.\n");
+    printf("  -p            Remove what the sender doesn't have (Use with -Y -R).\n");
+    printf("  -u serial     Send or receive over the serial line (ex. /dev/ttyS0) instead\n");
+    printf("                of the floppy (Use with -S/-s or -R/-r).\n");
+    printf("  -d            Bypass the page cache when accessing the floppy.\n");
+    printf("  -n channel    Send the data as one message on the given channel, or receive\n");
+    printf("                the next message of that channel (0 = control, 1 = log,\n");
+    printf("                2 = metrics, 3 = files).\n");
     printf("  -t timeout    The time to wait for synchronization. If not specified, waits\n");
     printf("                for ever.\n");
     printf("  -h            Show this help screen.\n");
@@ -93,6 +191,179 @@ void error(const char * message, int code) {
     exit(code);
 };
 
+//
+// Run a handler for a message (Daemon mode)
+//
+// The message is given to the command on its STDIN and the channel in the
+// FPIO_CHANNEL environment variable (And the method called, for requests,
+// in FPIO_METHOD).
+//
+// @param command   The command to run (Through /bin/sh)
+// @param channel   The channel the message arrived on
+// @param message   The message
+// @param reply     Receives the output of the command
+// @param method    The method called or NULL
+// @return          The exit code of the command or -1 if it could not run
+//
+int dispatchCommand(const char * command, int channel, const string & message, string * reply, const char * method = NULL) {
+    char tmpName[] = "/tmp/fpio-XXXXXX";
+    char buf[4096];
+    int fdIn, fdOut[2], status, rd;
+    pid_t pid;
+
+    // Keep the message in a temporary file, so a handler that doesn't read
+    // it all cannot block us
+    fdIn = mkstemp(tmpName);
+    if (fdIn < 0) return -1;
+    unlink(tmpName);
+    if (write(fdIn, message.data(), message.length()) != (ssize_t)message.length()) {
+        close(fdIn);
+        return -1;
+    }
+    lseek(fdIn, 0, SEEK_SET);
+
+    if (pipe(fdOut) < 0) {
+        close(fdIn);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        snprintf(buf, sizeof(buf), "%i", channel);
+        setenv("FPIO_CHANNEL", buf, 1);
+        if (method != NULL) setenv("FPIO_METHOD", method, 1);
+        dup2(fdIn, STDIN_FILENO);
+        dup2(fdOut[1], STDOUT_FILENO);
+        close(fdIn);
+        close(fdOut[0]);
+        close(fdOut[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    close(fdIn);
+    close(fdOut[1]);
+    if (pid < 0) {
+        close(fdOut[0]);
+        return -1;
+    }
+
+    // Collect the reply
+    reply->clear();
+    while ((rd = read(fdOut[0], buf, sizeof(buf))) != 0) {
+        if (rd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        reply->append(buf, rd);
+    }
+    close(fdOut[0]);
+
+    if (waitpid(pid, &status, 0) < 0) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//
+// Write a message on the named pipe of its channel (Daemon mode)
+//
+// The pipe is created if missing. Nothing blocks: when nobody reads the
+// pipe the message is dropped.
+//
+// @param dir       The directory of the pipes
+// @param channel   The channel the message arrived on
+// @param message   The message
+// @return          0 on success or -1 if the message was dropped
+//
+int dispatchPipe(const char * dir, int channel, const string & message) {
+    char name[1024];
+    size_t ofs = 0;
+    int fd, wr;
+
+    snprintf(name, sizeof(name), "%s/channel-%i", dir, channel);
+    if ((mkfifo(name, 0600) < 0) && (errno != EEXIST)) return -1;
+
+    fd = open(name, O_WRONLY | O_NONBLOCK);
+    if (fd < 0) return -1;
+
+    // Blocking from now on, the reader is there
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    while (ofs < message.length()) {
+        wr = write(fd, message.data() + ofs, message.length() - ofs);
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        ofs += wr;
+    }
+    close(fd);
+    return (ofs == message.length()) ? 0 : -1;
+}
+
+//
+// Built-in methods of the daemon (See FloppyIORPC)
+//
+// "ping" answers an empty result, "load" and "uptime" the first line of
+// /proc/loadavg and /proc/uptime.
+//
+int rpcBuiltin(const string & method, const string & args, string * result, void * context) {
+    if (method == "ping") return 0;
+
+    ifstream fIn( (method == "load") ? "/proc/loadavg" : "/proc/uptime" );
+    if (!getline(fIn, *result)) return FPIO_ERR_IO;
+    return 0;
+}
+
+//
+// Give the other methods to the handler command (See dispatchCommand)
+//
+// The arguments are given on its STDIN and its output is the result. The
+// exit code of the command is the status.
+//
+int rpcCommand(const string & method, const string & args, string * result, void * context) {
+    int res = dispatchCommand((const char *)context, FPIO_CHANNEL_RPC, args, result, method.c_str());
+    return (res < 0) ? FPIO_ERR_IO : res;
+}
+
+//
+// Sample the load and the memory of the system (Telemetry mode)
+//
+// @param tlm   Receives the samples
+//
+void sampleSystem(FloppyIOTelemetryWriter * tlm) {
+    double load1, load5, load15, uptime;
+    unsigned long long value;
+    int running, total;
+    char key[64];
+    string line;
+
+    tlm->time();
+
+    FILE * f = fopen("/proc/loadavg", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lf %lf %lf %i/%i", &load1, &load5, &load15, &running, &total) == 5) {
+            tlm->put(FPIO_TLM_LOAD1, (unsigned long long)(load1 * 100 + 0.5));
+            tlm->put(FPIO_TLM_LOAD5, (unsigned long long)(load5 * 100 + 0.5));
+            tlm->put(FPIO_TLM_LOAD15, (unsigned long long)(load15 * 100 + 0.5));
+            tlm->put(FPIO_TLM_PROCS, running);
+        }
+        fclose(f);
+    }
+
+    f = fopen("/proc/meminfo", "r");
+    if (f != NULL) {
+        while (fscanf(f, "%63s %llu kB\n", key, &value) == 2) {
+            if (strcmp(key, "MemTotal:") == 0) tlm->put(FPIO_TLM_MEM_TOTAL, value);
+            if (strcmp(key, "MemAvailable:") == 0) tlm->put(FPIO_TLM_MEM_FREE, value);
+        }
+        fclose(f);
+    }
+
+    f = fopen("/proc/uptime", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lf", &uptime) == 1) tlm->put(FPIO_TLM_UPTIME, (unsigned long long)uptime);
+        fclose(f);
+    }
+}
+
 //
 // Main application
 //
@@ -100,13 +371,19 @@ int main(int argc, char **argv) {
     char c;
     char * file = (char *)"/dev/fd0";
     char * iofile = NULL;
+    char * command = NULL;
+    char * pipeDir = NULL;
+    char * serialDev = NULL;
     int flags = FPIO_SYNCHRONIZED | FPIO_BINARY | FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE;
-    int mode = 0, timeout = 0, res;
+    int mode = 0, timeout = 0, size = 0, channel = -1, res;
+    int deadline = DEFAULT_FIO_RPC_DEADLINE, interval = 0;
+    bool transfer = false, sync = false, prune = false;
+    vector<string> calls;
 
     //
     // Parse the command-line arguments
     //
-    while ((c = getopt (argc, argv, "zhcHsrS:R:f:t:")) != -1)
+    while ((c = getopt (argc, argv, "zZCdDThcHsrpYS:R:f:t:m:n:x:P:u:Q:w:M:")) != -1)
         switch (c) {
             case 'c':
                 flags &= ~FPIO_BINARY;
@@ -118,6 +395,61 @@ int main(int argc, char **argv) {
                 if (mode == 0) mode=MODE_ZEROONLY;
                 break;
                 
+            case 'Z':
+                flags |= FPIO_COMPRESS;
+                break;
+                
+            case 'C':
+                flags |= FPIO_CHECKSUM;
+                break;
+
+            case 'd':
+                flags |= FPIO_DIRECT;
+                break;
+
+            case 'D':
+                flags |= FPIO_DIRECT;
+                mode = MODE_DAEMON;
+                break;
+
+            case 'u':
+                serialDev = optarg;
+                break;
+
+            case 'T':
+                transfer = true;
+                break;
+
+            case 'Y':
+                sync = true;
+                break;
+
+            case 'p':
+                prune = true;
+                break;
+
+            case 'x':
+                command = optarg;
+                break;
+
+            case 'P':
+                pipeDir = optarg;
+                break;
+
+            case 'Q':
+                calls.push_back(optarg);
+                mode = MODE_CALL;
+                break;
+
+            case 'w':
+                deadline = atoi(optarg);
+                break;
+
+            case 'M':
+                interval = atoi(optarg);
+                mode = MODE_TELEMETRY;
+                break;
+                
             case 'h':
                 help();
                 return 2;
@@ -150,6 +482,15 @@ int main(int argc, char **argv) {
             case 't':
                 timeout = atoi(optarg);
                 break;
+
+            case 'n':
+                channel = atoi(optarg);
+                break;
+
+            case 'm':
+                size = atoi(optarg);
+                flags |= FPIO_HEADER;
+                break;
                 
             case '?':
                 if (isprint (optopt))
@@ -165,7 +506,7 @@ int main(int argc, char **argv) {
         }
 
     if (mode == 0) {
-        fprintf (stderr, "No mode specified! Please specify one of the -S/-s, the -R/-r or the -z option!\n", optopt);
+        fprintf (stderr, "No mode specified! Please specify one of the -S/-s, the -R/-r, the -D, the -Q, the -M or the -z option!\n", optopt);
         return 1;
     }
 
@@ -176,20 +517,96 @@ int main(int argc, char **argv) {
         return 1;        
     }
 
+    if (transfer && ((iofile == NULL) || ((mode != MODE_SEND) && (mode != MODE_RECEIVE)))) {
+        fprintf (stderr, "The -T option needs a file to send (-S) or receive (-R)!\n");
+        return 1;
+    }
+
+    if (sync && ((iofile == NULL) || ((mode != MODE_SEND) && (mode != MODE_RECEIVE)) || transfer)) {
+        fprintf (stderr, "The -Y option needs a directory to send (-S) or receive (-R)!\n");
+        return 1;
+    }
+
+    // Use the serial line instead of the floppy
+    if (serialDev != NULL) {
+        if (((mode != MODE_SEND) && (mode != MODE_RECEIVE)) || transfer || sync || (channel >= 0)) {
+            fprintf (stderr, "The -u option can only be used to send (-S/-s) or receive (-R/-r)!\n");
+            return 1;
+        }
+
+        FloppyIOSerial sio ( serialDev );
+        if (!sio.ready()) error(sio.errorStr.c_str(), sio.error);
+        sio.syncTimeout=timeout;
+
+        if (mode == MODE_SEND) {
+            istream * ins = &cin;
+            if (iofile != NULL) ins = new ifstream( iofile, ifstream::in );
+            sio.send(ins);
+            if (iofile != NULL) ((ifstream*)ins)->close();
+        } else {
+            ostream * outs = &cout;
+            if (iofile != NULL) outs = new ofstream( iofile, ofstream::out | ofstream::trunc );
+            sio.receive(outs);
+            if (iofile != NULL) ((ofstream*)outs)->close();
+        }
+        if (!sio.ready()) error(sio.errorStr.c_str(), sio.error);
+        return 0;
+    }
+
     // Create a FloppyIO class with the specified floppy device and flags
-    FloppyIO fio ( file, flags );
+    FloppyIO fio ( file, flags, size );
     if (!fio.ready()) error(fio.errorStr.c_str(), fio.error);
 
     // Set synchronization timeout
     fio.syncTimeout=timeout;
 
     // Build the appropriate streams for each mode
-    if (mode == MODE_SEND) {
+    if (transfer) {
+        FloppyIOMux mux(&fio);
+        FloppyIOTransfer xfer(&mux, (channel >= 0) ? channel : FPIO_CHANNEL_FILE);
+
+        if (mode == MODE_SEND) {
+            res = xfer.sendFile(iofile);
+            if (res < 0) error("Unable to send the file", res);
+            fprintf(stderr, "Sent %lu blocks, %lu already there\n", xfer.blocksSent, xfer.blocksSkipped);
+        } else {
+            res = xfer.receiveFile(iofile);
+            if (res < 0) error("Unable to receive the file (Run again to resume)", res);
+            fprintf(stderr, "Received %lu blocks\n", xfer.blocksReceived);
+        }
+
+    } else if (sync) {
+        FloppyIOMux mux(&fio);
+        FloppyIOSync dsync(&mux, (channel >= 0) ? channel : FPIO_CHANNEL_FILE);
+        dsync.prune = prune;
+
+        if (mode == MODE_SEND) {
+            res = dsync.sendTree(iofile);
+            if (res < 0) error("Unable to synchronize the directory", res);
+        } else {
+            res = dsync.receiveTree(iofile);
+            if (res < 0) error("Unable to synchronize the directory", res);
+            if (prune) fprintf(stderr, "Removed %lu files\n", dsync.filesRemoved);
+        }
+        fprintf(stderr, "Synchronized %lu files (%llu bytes sent, %llu already there), %lu unchanged\n",
+            dsync.filesSent, dsync.bytesLiteral, dsync.bytesMatched, dsync.filesSkipped);
+
+    } else if (mode == MODE_SEND) {
         istream * ins = &cin;
         if (iofile != NULL) ins = new ifstream( iofile, ifstream::in );
 
         // Send stream
-        fio.send(ins);
+        if (channel >= 0) {
+            // As a single message on the channel
+            FloppyIOMux mux(&fio);
+            ostringstream data;
+            data << ins->rdbuf();
+            res = mux.send(channel, data.str());
+            if (res >= 0) res = mux.flush();
+            if (res < 0) error("Unable to send on the channel", res);
+        } else {
+            fio.send(ins);
+        }
         if (!fio.ready()) error(fio.errorStr.c_str(), fio.error);
 
         // Close stream
@@ -199,13 +616,140 @@ int main(int argc, char **argv) {
         ostream * outs = &cout;
         if (iofile != NULL) outs = new ofstream( iofile, ofstream::out | ofstream::trunc );
 
-        // Send stream
-        fio.receive(outs);
+        // Receive stream
+        if (channel >= 0) {
+            // The next message of the channel
+            FloppyIOMux mux(&fio);
+            string data;
+            res = mux.receive(channel, &data);
+            if (res < 0) error("Unable to receive from the channel", res);
+            outs->write(data.data(), data.length());
+        } else {
+            fio.receive(outs);
+        }
         if (!fio.ready()) error(fio.errorStr.c_str(), fio.error);
 
         // Close stream
         if (iofile != NULL) ((ofstream*)outs)->close();
         
+    } else if (mode == MODE_CALL) {
+        FloppyIOMux mux(&fio);
+        FloppyIORPC rpc(&mux);
+        vector<int> ids;
+        string result;
+        size_t sep;
+
+        // Send them all, then collect the answers
+        for (size_t i=0; i<calls.size(); i++) {
+            sep = calls[i].find(':');
+            if (sep == string::npos) {
+                ids.push_back(rpc.request(calls[i], "", deadline));
+            } else {
+                ids.push_back(rpc.request(calls[i].substr(0, sep), calls[i].substr(sep + 1), deadline));
+                calls[i].erase(sep);
+            }
+        }
+        for (size_t i=0; i<calls.size(); i++) {
+            res = (ids[i] < 0) ? ids[i] : rpc.wait(ids[i], &result);
+            if (res < 0) result.clear();
+            printf("%s %i %s\n", calls[i].c_str(), res, result.c_str());
+        }
+
+        // Some were not answered in time
+        if (rpc.callsExpired > 0) return 1;
+
+    } else if (mode == MODE_TELEMETRY) {
+        FloppyIOMux mux(&fio);
+        FloppyIOTelemetryWriter tlm;
+
+        // Report for ever, without waiting for the hypervisor: while it
+        // didn't take the last sample, the new ones are dropped
+        for (;;) {
+            if (mux.pending(FPIO_CHANNEL_METRICS) == 0) {
+                sampleSystem(&tlm);
+                tlm.send(&mux);
+            }
+            while (mux.pending() > 0) {
+                res = mux.post();
+                if (res == FPIO_ERR_BUSY) break;
+                if (res == FPIO_ERR_NOTREADY) error(fio.errorStr.c_str(), res);
+                if (res < 0) {
+                    fprintf(stderr, "fpio: Unable to send the telemetry (%i)\n", res);
+                    fio.clear();
+                    break;
+                }
+            }
+            sleep((interval > 0) ? interval : 1);
+        }
+
+    } else if (mode == MODE_DAEMON) {
+        FloppyIOMux mux(&fio);
+        FloppyIORPC rpc(&mux);
+        string data, reply;
+        int ch;
+
+        rpc.handle("ping", rpcBuiltin);
+        rpc.handle("load", rpcBuiltin);
+        rpc.handle("uptime", rpcBuiltin);
+        if (command != NULL) rpc.handle(FPIO_RPC_ANY, rpcCommand, command);
+
+        // Serve for ever. Errors are logged and the device stays open
+        for (;;) {
+
+            // Post the replies, as far as the hypervisor takes them. Never
+            // wait on it: it may be waiting for us to read
+            while (mux.pending() > 0) {
+                res = mux.post();
+                if (res == FPIO_ERR_BUSY) break;
+                if (res == FPIO_ERR_NOTREADY) error(fio.errorStr.c_str(), res);
+                if (res < 0) {
+                    fprintf(stderr, "fpio: Unable to reply (%i): %s\n", res, fio.errorStr.c_str());
+                    fio.clear();
+                    break;
+                }
+            }
+
+            // Replies left? Only take what already arrived, then try again
+            if (mux.pending() > 0) {
+                res = mux.available();
+                if (res == 0) {
+                    usleep(DAEMON_RETRY);
+                    continue;
+                }
+                if (res < 0) {
+                    fprintf(stderr, "fpio: Receive failed (%i): %s\n", res, fio.errorStr.c_str());
+                    fio.clear();
+                    usleep(DAEMON_RETRY);
+                    continue;
+                }
+            }
+
+            res = mux.receive(&ch, &data);
+            if (res == FPIO_ERR_NOTREADY) error(fio.errorStr.c_str(), res);
+            if (res < 0) {
+                if (res != FPIO_ERR_TIMEOUT)
+                    fprintf(stderr, "fpio: Receive failed (%i): %s\n", res, fio.errorStr.c_str());
+                fio.clear();
+                continue;
+            }
+
+            if (ch == FPIO_CHANNEL_RPC) {
+                // The answer is queued, it goes out at the top of the loop
+                res = rpc.dispatch(data);
+                if (res < 0) fprintf(stderr, "fpio: Unable to answer a request (%i)\n", res);
+            } else if (command != NULL) {
+                res = dispatchCommand(command, ch, data, &reply);
+                if (res != 0) fprintf(stderr, "fpio: Handler exited with %i on channel %i\n", res, ch);
+                if (!reply.empty()) mux.send(ch, reply);
+            } else if (pipeDir != NULL) {
+                if (dispatchPipe(pipeDir, ch, data) < 0)
+                    fprintf(stderr, "fpio: No reader on channel %i, message dropped\n", ch);
+            } else {
+                cout.write(data.data(), data.length());
+                cout.flush();
+            }
+        }
+
     }
 
     return 0;
@@ -60,31 +60,54 @@ my $FLOPPY_SIZE = 28672;
 # =======================================
 
 # Calculate buffer positions
-my $IN_OFS=0; my $IN_SIZE=$FLOPPY_SIZE/2-1;
+my $IN_OFS=0; my $IN_SIZE=$FLOPPY_SIZE/2-1; my $IN_CTL=$FLOPPY_SIZE-2;
 
 # Try to open file for input
 open FD, "+<$FLOPPY" or die $!;
 binmode FD;
 
+# If the image starts with a geometry header, take the positions from there
+# (magic, version, framing, ring blocks, reserved, size, H2G ofs/size, G2H ofs/size)
+my $hdr;
+if ((read FD, $hdr, 64) == 64) {
+    my ($magic, $ver, $framing, $blocks, $rsvd, $size, $h2gOfs, $h2gSize) = unpack("a4 C C C C V V V", $hdr);
+    if ($magic eq "FPIO") {
+        $IN_CTL=$h2gOfs; $IN_OFS=$h2gOfs+1; $IN_SIZE=$h2gSize-1;
+    }
+}
+
+# Check if the data are prefixed by their length (bLengthPrefix)
+my $ctl;
+seek FD, $IN_CTL, 0;
+read FD, $ctl, 1;
+my $prefixed = (ord($ctl) & 0x04);
+
 # The following serves for 2 purposes:
 # 1) Force the OS to actually read the floppy device 
 #    (Because there is the case that the first 12K are just cached)
 # 2) Notifies the server that the client has read the data
-seek FD, $FLOPPY_SIZE-2,0; # -2=out (client), -1=in (server) (Control bytes)
+seek FD, $IN_CTL,0; # Control byte of the input buffer
 print FD "\x00";
 
 # Go back to the input position
 seek FD, $IN_OFS, 0;
 
-# Read everything, stop at first null byte
+# Read everything, stop at first null byte (or at the data length)
 my ($buf, $data, $n);
-while (($n = read FD, $data, 1) != 0) {
-    if ($data eq "\0") {
+my $left = $IN_SIZE;
+if ($prefixed) {
+    read FD, $buf, 4;
+    $left = unpack("V", $buf);
+    $left = $IN_SIZE-4 if ($left > $IN_SIZE-4);
+}
+while (($left > 0) && (($n = read FD, $data, 1) != 0)) {
+    if (!$prefixed && ($data eq "\0")) {
         last;
     }
 
     # Echo each byte as it arrives
     print $data;
+    $left--;
 }
 
 # Close FD when done
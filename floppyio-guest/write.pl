@@ -60,11 +60,21 @@ my $FLOPPY_SIZE = 28672;
 # =======================================
 
 # Calculate buffer positions
-my $OUT_SIZE=$FLOPPY_SIZE/2-1; my $OUT_OFS=$OUT_SIZE;
+my $OUT_SIZE=$FLOPPY_SIZE/2-1; my $OUT_OFS=$OUT_SIZE; my $OUT_CTL=$FLOPPY_SIZE-1;
 
 # Try to open file for input
 open FD, "+<$FLOPPY" or die $!;
 binmode FD;
+
+# If the image starts with a geometry header, take the positions from there
+# (magic, version, framing, ring blocks, reserved, size, H2G ofs/size, G2H ofs/size)
+my $hdr;
+if ((read FD, $hdr, 64) == 64) {
+    my ($magic, $ver, $framing, $blocks, $rsvd, $size, $h2gOfs, $h2gSize, $g2hOfs, $g2hSize) = unpack("a4 C C C C V V V V V", $hdr);
+    if ($magic eq "FPIO") {
+        $OUT_CTL=$g2hOfs; $OUT_OFS=$g2hOfs+1; $OUT_SIZE=$g2hSize-1;
+    }
+}
 seek FD, $OUT_OFS, 0;
 
 # Process STDIN
@@ -87,10 +97,10 @@ while (<STDIN>) {
 # When done write zero
 print FD "\0";
 
-# Notify server that are data in buffer
+# Notify server that are data in buffer, all of them (bDataPresent|bEndOfData)
 # (Server should then clear this byte when it's read)
-seek FD, $FLOPPY_SIZE-1,0; # -2=out (client), -1=in (server) (Control bytes)
-print FD "\x01";
+seek FD, $OUT_CTL,0; # Control byte of the output buffer
+print FD "\x03";
 
 # Close FD when done
 close FD;
@@ -0,0 +1,985 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   fptest.cpp
+// License: GNU General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Loopback tests for the FloppyIO library.
+//
+// Every test opens both ends of an image on tmpfs (the hypervisor one
+// and an FPIO_CLIENT one, on two threads), or of a socketpair for
+// FloppyIOSerial, and checks what arrives on the other side. No
+// hypervisor is needed. The exit code is the number of tests that
+// failed.
+//
+//   fptest [-v] [-d dir] [test...]
+//
+//   -v       Keep the debug output of the library
+//   -d dir   Where to create the image (Default: /dev/shm)
+//   test     Run only these tests (Default: all of them)
+//
+// -------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <new>
+#include <string>
+#include <sstream>
+#include <iostream>
+
+#include "../floppyIO.h"
+#include "../floppyIOMux.h"
+#include "../floppyIOTransfer.h"
+#include "../floppyIOSync.h"
+#include "../floppyIOAsync.h"
+#include "../floppyIOT.h"
+#include "../floppyIOSerial.h"
+
+using namespace std;
+
+// Seconds a test waits for the other end before giving up
+#define  TEST_TIMEOUT   5
+
+// Fail the current test if cond doesn't hold
+#define  CHECK(cond) \
+    do { if (!(cond)) { printf("\n    %s:%i: %s\n", __FILE__, __LINE__, #cond); return false; } } while (0)
+
+// Round trips of the allocation test
+#define  TEST_ROUNDS    100
+
+static const char * imageFile;
+
+//
+// Every allocation of the process is counted
+//
+static volatile long allocations = 0;
+
+void * operator new(size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    void * ptr = malloc(size ? size : 1);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void * ptr) throw() {
+    free(ptr);
+}
+
+void * operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete[](void * ptr) throw() {
+    operator delete(ptr);
+}
+
+//
+// Open one end of the image
+//
+static FloppyIO * test_open(int flags) {
+    if ((flags & FPIO_CLIENT) == 0) unlink(imageFile);
+    FloppyIO * fio = new FloppyIO(imageFile, FPIO_SYNCHRONIZED | flags);
+    fio->syncTimeout = TEST_TIMEOUT;
+    return fio;
+}
+
+//
+// Seconds since the epoch
+//
+static double now_s() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//
+// Write a whole file
+//
+static bool test_write(const string & path, const string & data) {
+    FILE * f = fopen(path.c_str(), "wb");
+    if (f == NULL) return false;
+    bool ok = (fwrite(data.data(), 1, data.length(), f) == data.length());
+    return (fclose(f) == 0) && ok;
+}
+
+//
+// Read a whole file (Empty if it can't be read)
+//
+static string test_read(const string & path) {
+    string data;
+    char buf[4096];
+    size_t rd;
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f == NULL) return data;
+    while ((rd = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, rd);
+    fclose(f);
+    return data;
+}
+
+//
+// The first CRCs are computed by several threads at once, while the
+// tables are set up (This test runs first so that they are not yet)
+//
+#define  TEST_THREADS   8
+
+static void * crc_worker(void * arg) {
+    bool ok = true;
+    for (int i=0; (i<1000) && ok; i++)
+        ok = (fpio_crc32c(0, "123456789", 9) == 0xE3069283);
+    return ok ? arg : NULL;
+}
+
+static bool test_crc_threads() {
+    pthread_t threads[TEST_THREADS];
+    void * ret;
+    int failed = 0;
+    for (int i=0; i<TEST_THREADS; i++)
+        CHECK(pthread_create(&threads[i], NULL, crc_worker, threads) == 0);
+    for (int i=0; i<TEST_THREADS; i++) {
+        pthread_join(threads[i], &ret);
+        if (ret == NULL) failed++;
+    }
+    CHECK(failed == 0);
+    return true;
+}
+
+//
+// Plain FloppyIO::send() calls, the way the wrapper passes the BOINC
+// credentials, and a multi-chunk message of the multiplexer after them
+//
+static void * plain_sender(void * arg) {
+    FloppyIO * fio = (FloppyIO *)arg;
+    FloppyIOMux mux(fio);
+    bool ok = (fio->send(string("BOINC_USERNAME=tester")) > 0) &&
+              (fio->send(string("BOINC_AUTHENTICATOR=abc")) > 0) &&
+              (mux.send(FPIO_CHANNEL_CONTROL, string(fio->szOutput * 3, 'x')) > 0) &&
+              (mux.flush() >= 0);
+    return ok ? arg : NULL;
+}
+
+static bool test_mux_plain_send() {
+    FloppyIO * host = test_open(0);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE);
+    CHECK(host->ready() && guest->ready());
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, plain_sender, host) == 0);
+
+    FloppyIOMux mux(guest);
+    string msg;
+    int ch = -1;
+    int res1 = mux.receive(&ch, &msg);
+    bool first = (res1 > 0) && (ch == 0) && (msg == "BOINC_USERNAME=tester");
+    int res2 = mux.receive(FPIO_CHANNEL_CONTROL, &msg);
+    bool second = (res2 > 0) && (msg == "BOINC_AUTHENTICATOR=abc");
+    int res3 = mux.receive(&ch, &msg);
+    bool third = (res3 == host->szOutput * 3) && (ch == 0);
+
+    pthread_join(thread, &ret);
+    delete guest;
+    delete host;
+    CHECK(first);
+    CHECK(second);
+    CHECK(third);
+    CHECK(ret != NULL);
+    return true;
+}
+
+//
+// Reading one channel keeps the messages of the others, the way the
+// wrapper reads the telemetry of the guest
+//
+static void * channel_sender(void * arg) {
+    FloppyIO * fio = (FloppyIO *)arg;
+    FloppyIOMux mux(fio);
+    bool ok = (mux.send(FPIO_CHANNEL_LOG, string("log line")) > 0) &&
+              (mux.send(FPIO_CHANNEL_METRICS, string("sample 1")) > 0) &&
+              (mux.send(FPIO_CHANNEL_METRICS, string(fio->szOutput * 2, 'm')) > 0) &&
+              (mux.flush() >= 0);
+    return ok ? arg : NULL;
+}
+
+static bool test_mux_channel() {
+    FloppyIO * host = test_open(0);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE);
+    CHECK(host->ready() && guest->ready());
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, channel_sender, host) == 0);
+
+    FloppyIOMux mux(guest);
+    string msg;
+    int res1 = mux.receive(FPIO_CHANNEL_METRICS, &msg);
+    bool first = (res1 > 0) && (msg == "sample 1");
+    int res2 = mux.receive(FPIO_CHANNEL_METRICS, &msg);
+    bool second = (res2 == host->szOutput * 2);
+    pthread_join(thread, &ret);
+
+    bool kept = (mux.available(FPIO_CHANNEL_METRICS) == 0) && (mux.available(FPIO_CHANNEL_LOG) == 1);
+    int res3 = mux.receive(FPIO_CHANNEL_LOG, &msg);
+    bool third = (res3 > 0) && (msg == "log line");
+
+    delete guest;
+    delete host;
+    CHECK(first);
+    CHECK(second);
+    CHECK(kept);
+    CHECK(third);
+    CHECK(ret != NULL);
+    return true;
+}
+
+//
+// The guest streams its log while the host only collects the metrics, as
+// VM::collect() does: the log is dropped as it arrives and no call
+// collects more chunks than it was allowed to
+//
+#define  TEST_LOG_LINES 200
+#define  TEST_CHUNKS    8
+
+static void * log_sender(void * arg) {
+    FloppyIO * fio = (FloppyIO *)arg;
+    FloppyIOMux mux(fio);
+    bool ok = true;
+    for (int i=0; (i<TEST_LOG_LINES) && ok; i++)
+        ok = (mux.send(FPIO_CHANNEL_LOG, string("kernel: log line")) > 0);
+    ok = ok && (mux.send(FPIO_CHANNEL_METRICS, string("sample 1")) > 0) &&
+         (mux.flush() >= 0);
+    return ok ? arg : NULL;
+}
+
+static bool test_mux_discard() {
+    FloppyIO * host = test_open(0);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE);
+    CHECK(host->ready() && guest->ready());
+
+    FloppyIOMux mux(host);
+    for (int ch=0; ch<FPIO_MUX_CHANNELS; ch++)
+        if (ch != FPIO_CHANNEL_METRICS) CHECK(mux.discard(ch) == 0);
+    CHECK(mux.discard(FPIO_MUX_CHANNELS) == FPIO_ERR_CHANNEL);
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, log_sender, guest) == 0);
+
+    // Poll the way the wrapper does, until the metrics arrive
+    int res = 0, calls = 0, mostChunks = 0;
+    double tEnd = now_s() + TEST_TIMEOUT;
+    while ((res == 0) && (now_s() < tEnd)) {
+        int chunks = TEST_CHUNKS;
+        res = mux.available(FPIO_CHANNEL_METRICS, &chunks);
+        if (TEST_CHUNKS - chunks > mostChunks) mostChunks = TEST_CHUNKS - chunks;
+        calls++;
+    }
+    string msg;
+    int res2 = mux.receive(FPIO_CHANNEL_METRICS, &msg);
+    pthread_join(thread, &ret);
+    int logs = mux.available(FPIO_CHANNEL_LOG);
+
+    delete guest;
+    delete host;
+    CHECK(ret != NULL);
+    CHECK(res == 1);
+    CHECK((res2 > 0) && (msg == "sample 1"));
+    CHECK(mostChunks <= TEST_CHUNKS);
+    CHECK(calls >= (TEST_LOG_LINES + 1) / TEST_CHUNKS);
+    CHECK(mux.chunksDropped[FPIO_CHANNEL_LOG] == TEST_LOG_LINES);
+    CHECK(logs == 0);
+    return true;
+}
+
+//
+// A transfer is canceled on both ends once the receiver saved its state,
+// then both ends start over: only the blocks that are missing are sent
+// again, the file passes its CRC and the state file is removed
+//
+#define  TEST_XFER_BLOCK    1024
+#define  TEST_XFER_BLOCKS   256
+
+struct xfer_end {
+    FloppyIOTransfer * xfer;
+    string file;
+    int result;
+    unsigned long blocks;       // Sent or received
+    unsigned long skipped;      // The receiver already had them (Sender)
+};
+
+static void * xfer_sender(void * arg) {
+    xfer_end * end = (xfer_end *)arg;
+    end->result = end->xfer->sendFile(end->file.c_str(), "payload");
+    end->blocks = end->xfer->blocksSent;
+    end->skipped = end->xfer->blocksSkipped;
+    return arg;
+}
+
+static void * xfer_receiver(void * arg) {
+    xfer_end * end = (xfer_end *)arg;
+    end->result = end->xfer->receiveFile(end->file.c_str());
+    end->blocks = end->xfer->blocksReceived;
+    end->skipped = 0;
+    return arg;
+}
+
+//
+// Run a transfer between two fresh ends of the image
+//
+// @param sender    The file to send (Its result stored there)
+// @param receiver  Where to receive it (Its result stored there)
+// @param bCancel   Cancel both ends once the receiver saved its state
+// @return          False if the ends could not be opened or the threads started
+//
+static bool test_transfer(xfer_end * sender, xfer_end * receiver, bool bCancel) {
+    FloppyIO * host = test_open(FPIO_BINARY);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE | FPIO_BINARY);
+    FloppyIOMux hostMux(host), guestMux(guest);
+    FloppyIOTransfer hostXfer(&hostMux, FPIO_CHANNEL_FILE, TEST_XFER_BLOCK), guestXfer(&guestMux);
+    sender->xfer = &hostXfer;
+    receiver->xfer = &guestXfer;
+
+    pthread_t threads[2];
+    bool ok = host->ready() && guest->ready() &&
+              (pthread_create(&threads[0], NULL, xfer_receiver, receiver) == 0);
+    if (ok && (pthread_create(&threads[1], NULL, xfer_sender, sender) != 0)) {
+        guest->cancel();
+        pthread_join(threads[0], NULL);
+        ok = false;
+    }
+
+    if (ok) {
+        if (bCancel) {
+            string statePath = receiver->file + FPIO_TRANSFER_STATE_SUFFIX;
+            struct stat st;
+            double tEnd = now_s() + TEST_TIMEOUT;
+            while ((stat(statePath.c_str(), &st) != 0) && (now_s() < tEnd))
+                usleep(100);
+            guest->cancel();
+            host->cancel();
+        }
+        pthread_join(threads[0], NULL);
+        pthread_join(threads[1], NULL);
+    }
+
+    sender->xfer = receiver->xfer = NULL;
+    delete guest;
+    delete host;
+    return ok;
+}
+
+static bool test_transfer_resume() {
+    xfer_end sender, receiver;
+    sender.file = string(imageFile) + ".src";
+    receiver.file = string(imageFile) + ".dst";
+    string statePath = receiver.file + FPIO_TRANSFER_STATE_SUFFIX;
+    unlink(receiver.file.c_str());
+    unlink(statePath.c_str());
+
+    string data(TEST_XFER_BLOCK * TEST_XFER_BLOCKS - 100, 0);
+    for (size_t i=0; i<data.length(); i++) data[i] = (char)(i * 31 + (i >> 10));
+    CHECK(test_write(sender.file, data));
+
+    // First attempt, canceled partway
+    CHECK(test_transfer(&sender, &receiver, true));
+    CHECK(sender.result < 0);
+    CHECK(receiver.result < 0);
+    CHECK(receiver.blocks < TEST_XFER_BLOCKS);
+    unsigned long blocksKept = receiver.blocks;
+    struct stat st;
+    CHECK(stat(statePath.c_str(), &st) == 0);
+
+    // Both ends start over
+    CHECK(test_transfer(&sender, &receiver, false));
+    CHECK(sender.result == 0);
+    CHECK(receiver.result == 0);
+    CHECK((sender.skipped > 0) && (sender.skipped == blocksKept));
+    CHECK(sender.blocks + sender.skipped == TEST_XFER_BLOCKS);
+    CHECK(receiver.blocks == sender.blocks);
+    CHECK(stat(statePath.c_str(), &st) != 0);
+
+    string received = test_read(receiver.file);
+    unlink(sender.file.c_str());
+    unlink(receiver.file.c_str());
+    CHECK(received == data);
+    return true;
+}
+
+//
+// A tree is synchronized, a file in the middle of it is modified and the
+// tree is synchronized again: the file travels as a delta, mostly made
+// of the blocks the receiver already has. A list with a name that leaves
+// the tree is refused.
+//
+#define  TEST_SYNC_SIZE     (256 * 1024)
+
+struct sync_end {
+    FloppyIOSync * sync;
+    string dir;
+    int result;
+    unsigned long long bytesLiteral;
+    unsigned long long bytesMatched;
+};
+
+static void * sync_receiver(void * arg) {
+    sync_end * end = (sync_end *)arg;
+    end->result = end->sync->receiveTree(end->dir.c_str());
+    end->bytesLiteral = end->sync->bytesLiteral;
+    end->bytesMatched = end->sync->bytesMatched;
+    return arg;
+}
+
+//
+// Synchronize a tree between two fresh ends of the image
+//
+// @param sender    The tree to send (Its result stored there)
+// @param receiver  Where to receive it (Its result stored there)
+// @return          False if the ends could not be opened or the thread started
+//
+static bool test_sync(sync_end * sender, sync_end * receiver) {
+    FloppyIO * host = test_open(FPIO_BINARY);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE | FPIO_BINARY);
+    FloppyIOMux hostMux(host), guestMux(guest);
+    FloppyIOSync hostSync(&hostMux), guestSync(&guestMux);
+    receiver->sync = &guestSync;
+
+    pthread_t thread;
+    bool ok = host->ready() && guest->ready() &&
+              (pthread_create(&thread, NULL, sync_receiver, receiver) == 0);
+    if (ok) {
+        sender->result = hostSync.sendTree(sender->dir.c_str());
+        sender->bytesLiteral = hostSync.bytesLiteral;
+        sender->bytesMatched = hostSync.bytesMatched;
+        pthread_join(thread, NULL);
+    }
+
+    receiver->sync = NULL;
+    delete guest;
+    delete host;
+    return ok;
+}
+
+static bool test_sync_delta() {
+    sync_end sender, receiver;
+    sender.dir = string(imageFile) + ".tree";
+    receiver.dir = string(imageFile) + ".copy";
+    string big = "/data.bin", small = "/sub/notes.txt";
+    system(("rm -rf " + sender.dir + " " + receiver.dir).c_str());
+    CHECK(mkdir(sender.dir.c_str(), 0755) == 0);
+    CHECK(mkdir((sender.dir + "/sub").c_str(), 0755) == 0);
+
+    string data(TEST_SYNC_SIZE, 0);
+    for (size_t i=0; i<data.length(); i++) data[i] = (char)((i * 2654435761u) >> 13);
+    CHECK(test_write(sender.dir + big, data));
+    CHECK(test_write(sender.dir + small, "first version\n"));
+
+    // The whole tree
+    CHECK(test_sync(&sender, &receiver));
+    CHECK((sender.result == 0) && (receiver.result == 0));
+    CHECK(test_read(receiver.dir + big) == data);
+    CHECK(test_read(receiver.dir + small) == "first version\n");
+
+    // A few bytes change in the middle of the big file (The time too, the
+    // size and time would say it did not change within the same second)
+    for (int i=0; i<100; i++) data[TEST_SYNC_SIZE / 2 + i] ^= 0x5A;
+    CHECK(test_write(sender.dir + big, data));
+    struct timeval times[2];
+    gettimeofday(&times[0], NULL);
+    times[0].tv_sec -= 3600;
+    times[1] = times[0];
+    CHECK(utimes((sender.dir + big).c_str(), times) == 0);
+
+    CHECK(test_sync(&sender, &receiver));
+    CHECK((sender.result == 0) && (receiver.result == 0));
+    CHECK(receiver.bytesMatched == sender.bytesMatched);
+    CHECK(receiver.bytesLiteral == sender.bytesLiteral);
+    CHECK((receiver.bytesLiteral > 0) && (receiver.bytesMatched > 10 * receiver.bytesLiteral));
+    CHECK(receiver.bytesMatched + receiver.bytesLiteral == TEST_SYNC_SIZE);
+    CHECK(test_read(receiver.dir + big) == data);
+    CHECK(test_read(receiver.dir + small) == "first version\n");
+
+    system(("rm -rf " + sender.dir + " " + receiver.dir).c_str());
+    return true;
+}
+
+//
+// A list with an empty file whose name climbs out of the tree
+//
+static void * unsafe_sender(void * arg) {
+    FloppyIO * fio = (FloppyIO *)arg;
+    FloppyIOMux mux(fio);
+    string name = "sub/../../escape", message(1, FPIO_SYNC_LIST);
+    message.push_back(FPIO_SYNC_TYPE_FILE);
+    message.append(4 + 8 + 8, 0);          // Mode, size and time
+    message.push_back((char)name.length());
+    message.push_back(0);
+    message.append(name);
+    bool ok = (mux.send(FPIO_CHANNEL_FILE, message) > 0) && (mux.flush() >= 0);
+    return ok ? arg : NULL;
+}
+
+static bool test_sync_unsafe() {
+    FloppyIO * host = test_open(FPIO_BINARY);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE | FPIO_BINARY);
+    CHECK(host->ready() && guest->ready());
+    string dir = string(imageFile) + ".copy";
+    string escape = dir + "/../escape";
+    system(("rm -rf " + dir).c_str());
+    unlink(escape.c_str());
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, unsafe_sender, host) == 0);
+    FloppyIOMux mux(guest);
+    FloppyIOSync sync(&mux);
+    int res = sync.receiveTree(dir.c_str());
+    pthread_join(thread, &ret);
+
+    struct stat st;
+    bool escaped = (stat(escape.c_str(), &st) == 0);
+    delete guest;
+    delete host;
+    rmdir(dir.c_str());
+    CHECK(ret != NULL);
+    CHECK(res == FPIO_ERR_DATA);
+    CHECK(!escaped);
+    return true;
+}
+
+//
+// Echo TEST_ROUNDS+1 messages back with the buffer API
+//
+static void * echo_client(void * arg) {
+    FloppyIO * fio = (FloppyIO *)arg;
+    char buffer[512];
+    for (int i=0; i<TEST_ROUNDS+1; i++) {
+        int rd = fio->receive(buffer, sizeof(buffer));
+        if ((rd <= 0) || (fio->send(buffer, rd) != rd)) return NULL;
+    }
+    return arg;
+}
+
+//
+// The buffer API allocates nothing once both ends are open, on every
+// backend
+//
+static bool test_no_alloc(int flags) {
+    FloppyIO * host = test_open(FPIO_BINARY | flags);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE | FPIO_BINARY | flags);
+    CHECK(host->ready() && guest->ready());
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, echo_client, guest) == 0);
+
+    // The first round trip is not counted (Both ends have started then)
+    char data[512], echo[512];
+    memset(data, 'a', sizeof(data));
+    bool ok = (host->send(data, sizeof(data)) == (int)sizeof(data)) &&
+              (host->receive(echo, sizeof(echo)) == (int)sizeof(echo));
+    long before = allocations;
+    for (int i=0; (i<TEST_ROUNDS) && ok; i++) {
+        data[0] = 'a' + (i % 26);
+        ok = (host->send(data, sizeof(data)) == (int)sizeof(data)) &&
+             (host->receive(echo, sizeof(echo)) == (int)sizeof(echo)) &&
+             (memcmp(data, echo, sizeof(data)) == 0);
+    }
+    long count = allocations - before;
+
+    pthread_join(thread, &ret);
+    delete guest;
+    delete host;
+    CHECK(ok && (ret != NULL));
+    if (count != 0) printf("\n    %li allocations in %i round trips", count, TEST_ROUNDS);
+    CHECK(count == 0);
+    return true;
+}
+
+static bool test_no_alloc_stream() {
+    return test_no_alloc(0);
+}
+
+static bool test_no_alloc_mmap() {
+    return test_no_alloc(FPIO_MMAP);
+}
+
+static bool test_no_alloc_direct() {
+    return test_no_alloc(FPIO_DIRECT);
+}
+
+//
+// A byte of the first block of a stream flips on the image between the
+// write and the read: the receiver answers with a NAK, the sender writes
+// that block (and only that one) again and the stream arrives intact
+//
+static string nak_data(int szBlock) {
+    string data(szBlock * 3, 0);
+    for (size_t i=0; i<data.length(); i++) data[i] = (char)(i * 7);
+    return data;
+}
+
+static void * nak_sender(void * arg) {
+    FloppyIO * fio = (FloppyIO *)arg;
+    string data = nak_data(fio->szOutput);
+    istringstream in(data);
+    return (fio->send(&in) == (int)data.length()) ? arg : NULL;
+}
+
+static bool test_checksum_nak() {
+    FloppyIO * host = test_open(FPIO_CHECKSUM);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE | FPIO_CHECKSUM);
+    CHECK(host->ready() && guest->ready());
+    int fd = open(imageFile, O_RDWR);
+    CHECK(fd >= 0);
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, nak_sender, host) == 0);
+
+    // Wait for the first block, then flip a byte of its data (After the
+    // length and the checksum)
+    fpio_ctlbyte_io cB; cB.byte = 0;
+    double tEnd = now_s() + TEST_TIMEOUT;
+    while ((cB.flags.bDataPresent == 0) && (now_s() < tEnd)) {
+        if (pread(fd, &cB.byte, 1, guest->ofsCtrlByteIn) != 1) break;
+        if (cB.flags.bDataPresent == 0) usleep(1000);
+    }
+    char c = 0;
+    bool flipped = (cB.flags.bDataPresent == 1) &&
+                   (pread(fd, &c, 1, guest->ofsInput + 8 + 100) == 1);
+    c ^= 0x10;
+    flipped = flipped && (pwrite(fd, &c, 1, guest->ofsInput + 8 + 100) == 1);
+    close(fd);
+
+    ostringstream out;
+    int res = guest->receive(&out);
+    pthread_join(thread, &ret);
+    string data = nak_data(host->szOutput);
+    unsigned long naks = guest->checksumErrors;
+    unsigned long resent = host->retransmits;
+
+    delete guest;
+    delete host;
+    CHECK(flipped);
+    CHECK(ret != NULL);
+    CHECK(naks == 1);
+    CHECK(resent == 1);
+    CHECK((res == (int)data.length()) && (out.str() == data));
+    return true;
+}
+
+//
+// A pending receive doesn't hold the sends queued after it, and deleting
+// the object doesn't wait for it, even with no timeout
+//
+static int asyncSends = 0;
+static int asyncReceives = 0;
+
+static void async_done(int result, const string & data, void * userData) {
+    if (userData != NULL) asyncSends += (result >= 0) ? 1 : 0;
+    else asyncReceives++;
+}
+
+static bool test_async_duplex() {
+    FloppyIO * host = test_open(0);
+    FloppyIO * guest = test_open(FPIO_CLIENT | FPIO_NOINIT | FPIO_NOCREATE);
+    CHECK(host->ready() && guest->ready());
+    host->syncTimeout = 0;
+
+    FloppyIOAsync * async = new FloppyIOAsync(host);
+    asyncSends = asyncReceives = 0;
+    CHECK(async->receiveAsync(async_done) == 0);
+    CHECK(async->sendAsync("hello", async_done, async) == 0);
+
+    string msg;
+    int res = guest->receive(&msg);
+    double tEnd = now_s() + TEST_TIMEOUT;
+    while ((asyncSends == 0) && (now_s() < tEnd)) {
+        async->poll();
+        usleep(1000);
+    }
+    int pending = async->pending();
+
+    double tDelete = now_s();
+    delete async;
+    tDelete = now_s() - tDelete;
+    delete guest;
+
+    CHECK((res == 5) && (msg == "hello"));
+    CHECK(asyncSends == 1);
+    CHECK((asyncReceives == 0) && (pending == 1));
+    CHECK(tDelete < 1.0);
+    return true;
+}
+
+//
+// FloppyIOT on a full 1.44 MB image, from threads with a 256 KB stack:
+// the blocks (~720 KB) must not go through the stack
+//
+typedef FloppyIOT<0, FPIO_FRAMING_BINARY, FPIO_MAX_FLOPPY_SIZE> big_host;
+typedef FloppyIOT<FPIO_CLIENT, FPIO_FRAMING_BINARY, FPIO_MAX_FLOPPY_SIZE> big_guest;
+
+static string big_data() {
+    string data(big_host::szBlock * 2 + 1000, 0);
+    for (size_t i=0; i<data.length(); i++) data[i] = (char)(i * 13);
+    return data;
+}
+
+static void * big_sender(void * arg) {
+    big_host * fio = (big_host *)arg;
+    string data = big_data();
+    istringstream in(data);
+    bool ok = (fio->send(&in) == (int)data.length()) &&
+              (fio->send(data.data(), 100) == 100);
+    return ok ? arg : NULL;
+}
+
+static void * big_receiver(void * arg) {
+    big_guest * fio = (big_guest *)arg;
+    ostringstream out;
+    string tail;
+    bool ok = (fio->receive(&out) == (int)big_data().length()) && (out.str() == big_data()) &&
+              (fio->receive(&tail) == 100) && (tail == big_data().substr(0, 100));
+    return ok ? arg : NULL;
+}
+
+static bool test_template_big() {
+    unlink(imageFile);
+    big_host * host = new big_host(imageFile);
+    big_guest * guest = new big_guest(imageFile, FPIO_NOINIT | FPIO_NOCREATE);
+    host->syncTimeout = guest->syncTimeout = TEST_TIMEOUT;
+    CHECK(host->ready() && guest->ready());
+
+    pthread_attr_t attr;
+    pthread_t sender, receiver;
+    void * sent, * received;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    CHECK(pthread_create(&receiver, &attr, big_receiver, guest) == 0);
+    CHECK(pthread_create(&sender, &attr, big_sender, host) == 0);
+    pthread_join(sender, &sent);
+    pthread_join(receiver, &received);
+    pthread_attr_destroy(&attr);
+
+    delete guest;
+    delete host;
+    CHECK(sent != NULL);
+    CHECK(received != NULL);
+    return true;
+}
+
+//
+// Frames between the two ends of a socketpair, with noise in front of
+// them that looks like the start of a frame
+//
+static bool test_serial_frames() {
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    FloppyIOSerial * a = new FloppyIOSerial(sv[0]);
+    FloppyIOSerial * b = new FloppyIOSerial(sv[1]);
+    a->syncTimeout = b->syncTimeout = TEST_TIMEOUT;
+    CHECK(a->ready() && b->ready());
+
+    // A console line, then a stray magic byte with a valid control byte
+    // and a length of 1 MB (The data would never come)
+    const char noise[] = "login: \xF5\x01\x00\x00\x10\x00 \xF5\xF5";
+    bool sentNoise = (write(sv[0], noise, sizeof(noise) - 1) == (ssize_t)(sizeof(noise) - 1));
+
+    fpio_ctlbyte cB;
+    memset(&cB, 0, sizeof(cB));
+    cB.usID = 5;
+    bool sent = (a->send(string("first")) == 5) && (a->send("second", 6, &cB) == 6) &&
+                (a->send(string()) == 0);
+
+    string msg;
+    char buffer[3];
+    fpio_ctlbyte got;
+    int res1 = b->receive(&msg, &got);
+    bool first = (res1 == 5) && (msg == "first") && got.bEndOfData;
+    int res2 = b->receive(buffer, sizeof(buffer), &got);
+    bool second = (res2 == 3) && (memcmp(buffer, "sec", 3) == 0) && (got.usID == 5);
+    int res3 = b->receive(&msg);
+    bool third = (res3 == 0) && msg.empty();
+    unsigned long skipped = b->bytesSkipped;
+
+    delete a;
+    delete b;
+    close(sv[0]);
+    close(sv[1]);
+    CHECK(sentNoise && sent);
+    CHECK(first);
+    CHECK(second);
+    CHECK(third);
+    CHECK(skipped == sizeof(noise) - 1);
+    return true;
+}
+
+//
+// A stream of several frames, from another thread
+//
+static void * serial_stream_sender(void * arg) {
+    FloppyIOSerial * sio = (FloppyIOSerial *)arg;
+    string data(FPIO_SERIAL_BLOCK * 3 + 100, 0);
+    for (size_t i=0; i<data.length(); i++) data[i] = (char)(i * 7);
+    istringstream in(data);
+    return (sio->send(&in) == (int)data.length()) ? arg : NULL;
+}
+
+static bool test_serial_stream() {
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    FloppyIOSerial * a = new FloppyIOSerial(sv[0]);
+    FloppyIOSerial * b = new FloppyIOSerial(sv[1]);
+    a->syncTimeout = b->syncTimeout = TEST_TIMEOUT;
+
+    pthread_t thread;
+    void * ret;
+    CHECK(pthread_create(&thread, NULL, serial_stream_sender, a) == 0);
+
+    ostringstream out;
+    int res = b->receive(&out);
+    pthread_join(thread, &ret);
+    string data = out.str();
+    bool same = (data.length() == FPIO_SERIAL_BLOCK * 3 + 100);
+    for (size_t i=0; same && (i<data.length()); i++) same = (data[i] == (char)(i * 7));
+    unsigned long frames = b->framesReceived;
+
+    delete a;
+    delete b;
+    close(sv[0]);
+    close(sv[1]);
+    CHECK(ret != NULL);
+    CHECK(res == FPIO_SERIAL_BLOCK * 3 + 100);
+    CHECK(same);
+    CHECK(frames == 4);
+    return true;
+}
+
+//
+// Nothing on the line: the receive gives up after syncTimeout, and a
+// line that can't be connected to is reported
+//
+static bool test_serial_timeout() {
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    FloppyIOSerial * b = new FloppyIOSerial(sv[1]);
+    b->syncTimeout = 1;
+
+    string msg;
+    int res = b->receive(&msg);
+    int error = b->error;
+    delete b;
+    close(sv[0]);
+    close(sv[1]);
+    CHECK(res == FPIO_ERR_TIMEOUT);
+    CHECK(error == FPIO_ERR_TIMEOUT);
+
+    // (The lowest free descriptor tells if the socket was left open)
+    string path = string(imageFile) + ".sock";
+    unlink(path.c_str());
+    int fdBefore = dup(0);
+    close(fdBefore);
+    FloppyIOSerial * c = new FloppyIOSerial(path.c_str());
+    bool refused = !c->ready() && (c->error == FPIO_ERR_CREATE);
+    delete c;
+    int fdAfter = dup(0);
+    close(fdAfter);
+    CHECK(refused);
+    CHECK(fdAfter == fdBefore);
+    return true;
+}
+
+//
+// The tests
+//
+struct test_case {
+    const char * name;
+    bool (*run)();
+};
+
+static const test_case tests[] = {
+    { "crc_threads",        test_crc_threads },
+    { "mux_plain_send",     test_mux_plain_send },
+    { "mux_channel",        test_mux_channel },
+    { "mux_discard",        test_mux_discard },
+    { "transfer_resume",    test_transfer_resume },
+    { "sync_delta",         test_sync_delta },
+    { "sync_unsafe",        test_sync_unsafe },
+    { "no_alloc_stream",    test_no_alloc_stream },
+    { "no_alloc_mmap",      test_no_alloc_mmap },
+    { "no_alloc_direct",    test_no_alloc_direct },
+    { "checksum_nak",       test_checksum_nak },
+    { "async_duplex",       test_async_duplex },
+    { "template_big",       test_template_big },
+    { "serial_frames",      test_serial_frames },
+    { "serial_stream",      test_serial_stream },
+    { "serial_timeout",     test_serial_timeout },
+};
+
+//
+// Main application
+//
+int main(int argc, char **argv) {
+    const char * dir = "/dev/shm";
+    bool verbose = false;
+    int failed = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "vd:")) != -1)
+        switch (c) {
+            case 'v':
+                verbose = true;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: fptest [-v] [-d dir] [test...]\n");
+                return 2;
+        }
+
+    string image = string(dir) + "/fptest.img";
+    imageFile = image.c_str();
+
+    // The errors the tests provoke would clutter the output
+    if (!verbose) cerr.rdbuf(NULL);
+
+    for (unsigned i=0; i<sizeof(tests)/sizeof(test_case); i++) {
+        bool wanted = (optind >= argc);
+        for (int a=optind; a<argc; a++)
+            if (strcmp(argv[a], tests[i].name) == 0) wanted = true;
+        if (!wanted) continue;
+
+        printf("%-24s ", tests[i].name);
+        fflush(stdout);
+        bool ok = tests[i].run();
+        printf("%s\n", ok ? "ok" : "FAILED");
+        fflush(stdout);
+        if (!ok) failed++;
+    }
+
+    unlink(imageFile);
+    if (failed > 0) printf("%i tests FAILED\n", failed);
+    return failed;
+}
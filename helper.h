@@ -99,6 +99,37 @@ namespace Helper
 
         #endif
 
+        // Write a VMDK descriptor that exposes a raw (flat) image as a hard disk.
+        // The size of the image has to be a multiple of 512 bytes. Without a
+        // UUID, VirtualBox adds one the first time it opens the image.
+        bool write_flat_vmdk(const char *descriptor, const char *image, long size, const char *uuid = NULL)
+        {
+                long sectors = size / 512;
+                long cylinders = sectors / (16 * 63);
+                if (cylinders < 1) cylinders = 1;
+
+                std::ofstream f(descriptor);
+                if (!f.is_open()) return false;
+                f << "# Disk DescriptorFile" << endl;
+                f << "version=1" << endl;
+                f << "CID=fffffffe" << endl;
+                f << "parentCID=ffffffff" << endl;
+                f << "createType=\"monolithicFlat\"" << endl << endl;
+                f << "# Extent description" << endl;
+                f << "RW " << sectors << " FLAT \"" << image << "\" 0" << endl << endl;
+                f << "# The disk Data Base" << endl;
+                f << "ddb.virtualHWVersion = \"4\"" << endl;
+                f << "ddb.adapterType=\"ide\"" << endl;
+                f << "ddb.geometry.cylinders=\"" << cylinders << "\"" << endl;
+                f << "ddb.geometry.heads=\"16\"" << endl;
+                f << "ddb.geometry.sectors=\"63\"" << endl;
+                if (uuid != NULL) {
+                        f << "ddb.uuid.image=\"" << uuid << "\"" << endl;
+                }
+                f.close();
+                return true;
+        }
+
         void write_progress(double secs)
         {
                 std::ofstream f(PROGRESS_FN);
@@ -1,5 +1,17 @@
 #include <iostream>
 #include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <spawn.h>
+#include <ctype.h>
+#include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+extern char **environ;
+#endif
 
 #ifdef APP_GRAPHICS
 #include "boincShare.h" // provided by CernVM-Graphics
@@ -8,6 +20,10 @@ Share::SharedData* Share::data;
 
 #include "helper.h"
 #include "floppyIO.h"
+#include "floppyIOMux.h"
+#include "floppyIOTelemetry.h"
+#include "vmdriver.h"
+#include "vmtracker.h"
 
 #define VM_NAME "VMName"
 #define CPU_TIME "CpuTime"
@@ -17,6 +33,8 @@ Share::SharedData* Share::data;
 #define MESSAGE "CPUTIME"
 #define YEAR_SECS 365*24*60*60
 #define BUFSIZE 4096
+#define TELEMETRY_SAMPLES 60
+#define TELEMETRY_CHUNKS 64
 
 using std::string;
 
@@ -41,6 +59,27 @@ struct VM {
         int  start_err_number;
         int  debug_level;
         int  n_cpus;
+        int  floppy_size;
+
+        // Serial line to the guest (UART1 connected to a host pipe)
+        bool serial;
+        string serial_path;
+
+        // Telemetry sent by the guest (See FloppyIOTelemetry), the last
+        // samples of every numeric tag
+        FloppyIO * telemetry_fio;
+        FloppyIOMux * telemetry_mux;
+        FloppyIOTelemetryRing<TELEMETRY_SAMPLES> telemetry[FPIO_TLM_NUMERIC];
+        unsigned long telemetry_events;
+        string telemetry_message;           // Reused for every message
+
+        // The hypervisor (VirtualBox unless replaced, see VMDriver) and
+        // what it told of the VM at the last poll
+        VMDriver * driver;
+        VMInfo info;
+
+        // When the state has to be read again (See VMStateTracker)
+        VMStateTracker tracker;
         
         VM();
         void create();
@@ -55,18 +94,117 @@ struct VM {
         void remove();
         void release(); 
         void poll();
+        void collect();
 };
 
 //void write_cputime(double);
 
 APP_INIT_DATA aid;
 
+// The outcome of a command run by vbm_exec
+struct vbm_result {
+        int status;         // Exit code, or -1 if it could not run or was killed
+        string out;         // What it wrote on stdout
+        string err;         // What it wrote on stderr
+        double wall;        // How long it took (seconds)
+};
+
+#ifndef _WIN32
+// Run a command without a shell. Its stdout and stderr are collected
+// separately, whatever their size, and its stdin is /dev/null.
+// Returns true if it ran and exited with 0.
+bool vbm_exec(const std::vector<string>& args, vbm_result* result)
+{
+        posix_spawn_file_actions_t actions;
+        struct timeval start, end;
+        int fd_out[2], fd_err[2], status;
+        char buffer[BUFSIZE];
+        pid_t pid;
+
+        result->status = -1;
+        result->out.clear();
+        result->err.clear();
+        result->wall = 0;
+        if (args.empty()) return false;
+        gettimeofday(&start, NULL);
+
+        if (pipe(fd_out) < 0) {
+                cerr << "ERROR: vbm_exec failed to create a pipe" << endl;
+                return false;
+        }
+        if (pipe(fd_err) < 0) {
+                cerr << "ERROR: vbm_exec failed to create a pipe" << endl;
+                close(fd_out[0]);
+                close(fd_out[1]);
+                return false;
+        }
+
+        std::vector<char*> argv;
+        for (size_t i = 0; i < args.size(); i++) argv.push_back((char*)args[i].c_str());
+        argv.push_back(NULL);
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, fd_out[1], 1);
+        posix_spawn_file_actions_adddup2(&actions, fd_err[1], 2);
+        posix_spawn_file_actions_addclose(&actions, fd_out[0]);
+        posix_spawn_file_actions_addclose(&actions, fd_err[0]);
+        posix_spawn_file_actions_addclose(&actions, fd_out[1]);
+        posix_spawn_file_actions_addclose(&actions, fd_err[1]);
+        int res = posix_spawnp(&pid, argv[0], &actions, NULL, &argv[0], environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fd_out[1]);
+        close(fd_err[1]);
+        if (res != 0) {
+                cerr << "ERROR: vbm_exec failed to run " << args[0] << ": " << strerror(res) << endl;
+                close(fd_out[0]);
+                close(fd_err[0]);
+                return false;
+        }
+
+        // Collect both outputs until the command closes them
+        struct pollfd fds[2];
+        fds[0].fd = fd_out[0];
+        fds[1].fd = fd_err[0];
+        int open_fds = 2;
+        while (open_fds > 0) {
+                fds[0].events = fds[1].events = POLLIN;
+                if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR) continue;
+                        break;
+                }
+                for (int i = 0; i < 2; i++) {
+                        if ((fds[i].fd < 0) || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                        ssize_t rd = read(fds[i].fd, buffer, sizeof(buffer));
+                        if ((rd < 0) && (errno == EINTR)) continue;
+                        if (rd <= 0) {
+                                close(fds[i].fd);
+                                fds[i].fd = -1;
+                                open_fds--;
+                                continue;
+                        }
+                        (i == 0 ? result->out : result->err).append(buffer, rd);
+                }
+        }
+        for (int i = 0; i < 2; i++) if (fds[i].fd >= 0) close(fds[i].fd);
+
+        while (waitpid(pid, &status, 0) < 0) {
+                if (errno != EINTR) return false;
+        }
+        gettimeofday(&end, NULL);
+        result->wall = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+        result->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        return result->status == 0;
+}
+#endif
+
+#ifdef _WIN32
 // Run VBoxManage commands to interact with the virtual machine.
 // When buffer is NULL, this function will not return the input of new process.
 // Otherwise, it will not redirect the input of new process to buffer
+// (Truncated to nSize). Elsewhere commands are run by vbm_run.
 bool vbm_popen(string arg_list, char * buffer=NULL, int nSize=1024, 
                                             string command="VBoxManage -q ") {
-#ifdef _WIN32
         STARTUPINFO si;
         SECURITY_ATTRIBUTES sa;
         SECURITY_DESCRIPTOR sd; //security information for pipes
@@ -142,379 +280,647 @@ bool vbm_popen(string arg_list, char * buffer=NULL, int nSize=1024,
             return true;
         else
             return false;
-// GNU/Linux and Mac OS X code
-#else     
-        FILE *fp;
-        char temp[256];
-        string strTemp = "";
-        command += arg_list;
-        if (buffer == NULL) {
-                if(!system(command.c_str()))
-                        return true;
-                else return false;
-        }
-    
-        fp = popen(command.c_str(), "r");
-        if (fp == NULL) {
-                cerr << "ERROR: vbm_popen failed" << endl;
-                return false;
+}
+
+// Quote an argument for the command line of CreateProcess
+string vbm_quote(const string& arg)
+{
+        if (!arg.empty() && (arg.find_first_of(" \t\"") == string::npos)) return arg;
+        string quoted = "\"";
+        size_t slashes = 0;
+        for (size_t i = 0; i < arg.length(); i++) {
+                if (arg[i] == '\\') {
+                        slashes++;
+                }
+                else {
+                        // Backslashes only escape when a quote follows
+                        if (arg[i] == '"') quoted.append(slashes + 1, '\\');
+                        slashes = 0;
+                }
+                quoted += arg[i];
         }
+        quoted.append(slashes, '\\');
+        return quoted + "\"";
+}
+#endif
 
-        memset(buffer, 0, nSize);
-        while (fgets(temp,256,fp) != NULL) {
-            strTemp += temp;
+// The arguments of a VBoxManage command, given one by one so that names
+// and paths need no quoting:
+//
+//   vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "pause");
+//
+struct vbm_args : public std::vector<string> {
+        vbm_args& operator<<(const string& arg) {
+                push_back(arg);
+                return *this;
+        }
+        vbm_args& operator<<(int arg) {
+                std::ostringstream out;
+                out << arg;
+                push_back(out.str());
+                return *this;
         }
+};
 
-        pclose(fp);
-        strncpy(buffer, strTemp.c_str(), nSize-1);
-        return true;
+// Run VBoxManage with these arguments. Its output goes to output, whatever
+// its size, or to our stdout if output is NULL, and what it writes on
+// stderr ends in our log. On GNU/Linux and Mac OS X it runs without a
+// shell (See vbm_exec).
+// Returns true if it ran and exited with 0.
+bool vbm_run(const std::vector<string>& args, string* output = NULL)
+{
+#ifdef _WIN32
+        string arg_list;
+        for (size_t i = 0; i < args.size(); i++) arg_list += " " + vbm_quote(args[i]);
+        if (output == NULL) return vbm_popen(arg_list);
+        std::vector<char> buffer(BUFSIZE * 16);
+        bool ok = vbm_popen(arg_list, &buffer[0], buffer.size());
+        output->assign(&buffer[0]);
+        return ok;
+#else
+        std::vector<string> argv;
+        argv.push_back("VBoxManage");
+        argv.push_back("-q");
+        argv.insert(argv.end(), args.begin(), args.end());
+
+        vbm_result result;
+        bool ok = vbm_exec(argv, &result);
+        cerr << result.err;
+        if (output != NULL) output->swap(result.out);
+        else cout << result.out;
+        return ok;
 #endif
 }
 
-VM::VM() {
+// A random UUID (Version 4), for the machine and the media we register
+string vbm_uuid()
+{
+        static bool seeded = false;
+        unsigned char b[16];
+        bool ok = false;
+        char uuid[40];
+
+        #ifndef _WIN32
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd >= 0) {
+                ok = (read(fd, b, sizeof(b)) == sizeof(b));
+                close(fd);
+        }
+        #endif
+        if (!ok) {
+                if (!seeded) srand((unsigned int)time(NULL) ^ (unsigned int)clock());
+                seeded = true;
+                for (int i = 0; i < 16; i++) b[i] = rand() & 0xFF;
+        }
+        b[6] = (b[6] & 0x0F) | 0x40;
+        b[8] = (b[8] & 0x3F) | 0x80;
+        sprintf(uuid, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+                b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+        return uuid;
+}
+
+// The UUID of a VMDK image (ddb.uuid.image in its descriptor, which a
+// sparse image keeps in its first sectors), or "" if it has none yet
+string vbm_vmdk_uuid(const string& path)
+{
+        std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+        if (!f.is_open()) return "";
+        std::vector<char> head(65536);
+        f.read(&head[0], head.size());
+        string text(&head[0], f.gcount());
+
+        size_t pos = text.find("ddb.uuid.image");
+        if (pos == string::npos) return "";
+        size_t start = text.find('"', pos);
+        size_t end = (start == string::npos) ? string::npos : text.find('"', start + 1);
+        if ((end == string::npos) || (end - start - 1 != 36)) return "";
+        string uuid = text.substr(start + 1, 36);
+        if (uuid == "00000000-0000-0000-0000-000000000000") return "";
+        return uuid;
+}
+
+// Is [key, key + length) the given name?
+static bool vbm_key(const char* key, size_t length, const char* name)
+{
+        return (strlen(name) == length) && (memcmp(key, name, length) == 0);
+}
+
+// Seconds since the epoch of a UTC time written as YYYY-MM-DDTHH:MM:SS
+// (0 if it is not)
+time_t vbm_utc(const char* text)
+{
+        int y, m, d, hh, mm, ss;
+        if (sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d", &y, &m, &d, &hh, &mm, &ss) != 6) return 0;
+
+        // Days since 1970-01-01 of the proleptic Gregorian calendar
+        y -= (m <= 2);
+        long era = (y >= 0 ? y : y - 399) / 400;
+        long yoe = y - era * 400;
+        long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        long days = era * 146097 + doe - 719468;
+        return (time_t)(days * 86400 + hh * 3600 + mm * 60 + ss);
+}
+
+// Read the output of showvminfo --machinereadable into info, in one pass.
+// Lines are key=value, where the key and the value can be quoted; only
+// what is kept gets copied. The media are listed under the keys
+// "<controller>-<port>-<device>" (Their UUIDs under
+// "<controller>-ImageUUID-<port>-<device>"), once the controllers have
+// been named by storagecontrollername<N>.
+// Returns false if the output has no VMState.
+bool vbm_parse_vminfo(const string& text, VMInfo* info)
+{
+        std::vector<string> controllers;
+        const char* p = text.c_str();
+        const char* end = p + text.length();
+
+        info->clear();
+        while (p < end) {
+                const char* eol = (const char*)memchr(p, '\n', end - p);
+                if (eol == NULL) eol = end;
+                const char* line_end = ((eol > p) && (eol[-1] == '\r')) ? eol - 1 : eol;
+
+                // The key
+                const char *key, *key_end, *eq;
+                if (*p == '"') {
+                        key = p + 1;
+                        key_end = (const char*)memchr(key, '"', line_end - key);
+                        eq = (key_end == NULL) ? NULL : key_end + 1;
+                }
+                else {
+                        key = p;
+                        key_end = eq = (const char*)memchr(p, '=', line_end - p);
+                }
+                if ((eq == NULL) || (eq >= line_end) || (*eq != '=')) {
+                        p = eol + 1;
+                        continue;
+                }
+
+                // The value
+                const char* value = eq + 1;
+                const char* value_end = line_end;
+                if ((value < value_end) && (*value == '"')) {
+                        value++;
+                        if ((value_end > value) && (value_end[-1] == '"')) value_end--;
+                }
+                size_t key_len = key_end - key, value_len = value_end - value;
+
+                if (vbm_key(key, key_len, "VMState")) {
+                        info->state_name.assign(value, value_len);
+                        if (info->state_name == "running") info->state = VMSTATE_RUNNING;
+                        else if (info->state_name == "paused") info->state = VMSTATE_PAUSED;
+                        else if (info->state_name == "poweroff") info->state = VMSTATE_POWEROFF;
+                        else if (info->state_name == "saved") info->state = VMSTATE_SAVED;
+                        else if (info->state_name == "aborted") info->state = VMSTATE_ABORTED;
+                        else info->state = VMSTATE_OTHER;
+                }
+                else if (vbm_key(key, key_len, "VMStateChangeTime")) {
+                        info->state_change = vbm_utc(value);
+                }
+                else if (vbm_key(key, key_len, "cpus")) {
+                        info->cpus = atoi(value);
+                }
+                else if (vbm_key(key, key_len, "memory")) {
+                        info->memory = atoi(value);
+                }
+                else if (vbm_key(key, key_len, "cpuexecutioncap")) {
+                        info->cpu_cap = atoi(value);
+                }
+                else if (vbm_key(key, key_len, "CfgFile")) {
+                        info->settings.assign(value, value_len);
+                }
+                else if (vbm_key(key, key_len, "SnapFldr")) {
+                        info->snapshots.assign(value, value_len);
+                }
+                else if (vbm_key(key, key_len, "LogFldr")) {
+                        info->logs.assign(value, value_len);
+                }
+                else if ((key_len > 21) && (memcmp(key, "storagecontrollername", 21) == 0)) {
+                        controllers.push_back(string(value, value_len));
+                }
+                else if ((*p == '"') && !controllers.empty()) {
+                        for (size_t i = 0; i < controllers.size(); i++) {
+                                const string& name = controllers[i];
+                                if ((key_len <= name.length() + 1) || (memcmp(key, name.c_str(), name.length()) != 0) ||
+                                    (key[name.length()] != '-')) continue;
+
+                                const char* rest = key + name.length() + 1;
+                                bool is_uuid = (key_end - rest > 10) && (memcmp(rest, "ImageUUID-", 10) == 0);
+                                if (is_uuid) rest += 10;
+                                int port, device;
+                                char dash;
+                                if ((sscanf(rest, "%d%c%d", &port, &dash, &device) != 3) || (dash != '-')) continue;
+
+                                // The UUID follows the location of its medium
+                                if (is_uuid) {
+                                        for (size_t j = info->media.size(); j > 0; j--) {
+                                                vminfo_medium& m = info->media[j-1];
+                                                if ((m.controller == name) && (m.port == port) && (m.device == device)) {
+                                                        m.uuid.assign(value, value_len);
+                                                        break;
+                                                }
+                                        }
+                                }
+                                else if (!vbm_key(value, value_len, "none") && !vbm_key(value, value_len, "emptydrive")) {
+                                        vminfo_medium m;
+                                        m.controller = name;
+                                        m.port = port;
+                                        m.device = device;
+                                        m.location.assign(value, value_len);
+                                        info->media.push_back(m);
+                                }
+                                break;
+                        }
+                }
+                p = eol + 1;
+        }
+        return (info->state != VMSTATE_ERROR);
+}
+
+// Escape a value for an XML attribute
+string vbm_xml(const string& text)
+{
+        string out;
+        for (size_t i = 0; i < text.length(); i++) {
+                switch (text[i]) {
+                        case '&': out += "&amp;"; break;
+                        case '<': out += "&lt;"; break;
+                        case '>': out += "&gt;"; break;
+                        case '"': out += "&quot;"; break;
+                        case '\'': out += "&apos;"; break;
+                        default: out += text[i];
+                }
+        }
+        return out;
+}
+
+// The VirtualBox driver: every operation is a VBoxManage command
+class VBoxManageDriver : public VMDriver {
+public:
+        string version();
+        bool create(VM& vm);
+        bool start(VM& vm, bool vrde, bool headless);
+        bool pause(VM& vm);
+        bool resume(VM& vm);
+        bool savestate(VM& vm);
+        bool poweroff(VM& vm);
+        bool poll(VM& vm, VMInfo* info);
+        void remove(VM& vm);
+        bool throttle(VM& vm, int cpu_pct);
+        bool release(VM& vm);
+
+private:
+        bool define(VM& vm, const string& floppy_uuid);
+        bool configure(VM& vm);
+};
+
+string VBoxManageDriver::version()
+{
+        string version;
+        if (!vbm_run(vbm_args() << "--version", &version)) return "";
+        return version;
+}
+
+bool VBoxManageDriver::create(VM& vm)
+{
+        string floppy_uuid = vbm_uuid();
+
+        if (vm.floppy_size > FPIO_MAX_FLOPPY_SIZE) {
+                // Too big for a floppy drive: attach it as a raw hard disk
+                if (vm.debug_level >= 3) {
+                        cerr << "NOTICE: Attaching the " << vm.floppy_size << " bytes floppy image as a hard disk" << endl;
+                }
+                Helper::write_flat_vmdk("floppy.vmdk", "floppy.img", vm.floppy_size, floppy_uuid.c_str());
+        }
+
+        if (define(vm, floppy_uuid)) return true;
+        if (vm.debug_level >= 3) {
+                cerr << "NOTICE: Creating the VM with one VBoxManage command per setting" << endl;
+        }
+        return configure(vm);
+}
+
+// Write the machine definition (.vbox) and register it with a single
+// VBoxManage command. VirtualBox only accepts the disk with the UUID it
+// has in its descriptor, so an image that has none yet (It was never
+// opened by VirtualBox) is left to configure().
+// Returns false, leaving nothing behind, if the VM was not registered.
+bool VBoxManageDriver::define(VM& vm, const string& floppy_uuid)
+{
         char buffer[256];
-    
-        virtual_machine_name = "";
-        current_period = 0;
-        suspended = false;
-        last_poll_point = 0;
-        poll_err_number = 0;
-        poweroff_err_number = 0;
-        start_err_number = 0;
-        debug_level = 3;
-        n_cpus = 2;
-        
+        string vmfolder, settings, platform;
+        char *env;
+
         boinc_getcwd(buffer);
-        disk_name = "cernvm.vmdk";
-        disk_path = "cernvm.vmdk";
-        disk_path = "/"+disk_path;
-        disk_path = buffer+disk_path;
-        disk_path = "\""+disk_path+"\"";
+        string disk = vm.disk_path;
+        string disk_uuid = vbm_vmdk_uuid(disk);
+        if (disk_uuid.empty()) {
+                if (vm.debug_level >= 3) {
+                        cerr << "NOTICE: " << vm.disk_name << " has no UUID yet" << endl;
+                }
+                return false;
+        }
+        bool floppy_disk = (vm.floppy_size > FPIO_MAX_FLOPPY_SIZE);
+        string floppy = string(buffer) + (floppy_disk ? "/floppy.vmdk" : "/floppy.img");
 
-        name_path = "";
-        name_path += VM_NAME;
-}   
+        // Same place as createvm: the default machine folder
+        #ifdef _WIN32
+        env = getenv("HOMEDRIVE");
+        if (env == NULL) return false;
+        vmfolder = string(env);
+        env = getenv("HOMEPATH");
+        if (env == NULL) return false;
+        vmfolder = vmfolder + string(env) + "\\VirtualBox VMs";
+        platform = "windows";
+        #else
+        env = getenv("HOME");
+        if (env == NULL) return false;
+        vmfolder = string(env) + "/VirtualBox VMs";
+        #ifdef __APPLE__
+        platform = "macosx";
+        #else
+        platform = "linux";
+        #endif
+        #endif
+        boinc_mkdir(vmfolder.c_str());
+        vmfolder = vmfolder + "/" + vm.virtual_machine_name;
+        boinc_mkdir(vmfolder.c_str());
+        settings = vmfolder + "/" + vm.virtual_machine_name + ".vbox";
 
-void VM::create() 
+        // VirtualBox MAC addresses start with 08:00:27
+        string mac = "080027" + vbm_uuid().substr(30);
+        for (size_t i = 0; i < mac.length(); i++) mac[i] = toupper(mac[i]);
+
+        std::ofstream f(settings.c_str());
+        if (!f.is_open()) {
+                cerr << "WARNING: Writing " << settings << " failed" << endl;
+                boinc_rmdir(vmfolder.c_str());
+                return false;
+        }
+        f << "<?xml version=\"1.0\"?>" << endl;
+        f << "<VirtualBox xmlns=\"http://www.innotek.de/VirtualBox-settings\" version=\"1.11-" << platform << "\">" << endl;
+        f << "  <Machine uuid=\"{" << vbm_uuid() << "}\" name=\"" << vbm_xml(vm.virtual_machine_name) << "\" OSType=\"Linux26\" snapshotFolder=\"Snapshots\">" << endl;
+        f << "    <MediaRegistry>" << endl;
+        f << "      <HardDisks>" << endl;
+        f << "        <HardDisk uuid=\"{" << disk_uuid << "}\" location=\"" << vbm_xml(disk) << "\" format=\"VMDK\" type=\"Normal\"/>" << endl;
+        if (floppy_disk) {
+                f << "        <HardDisk uuid=\"{" << floppy_uuid << "}\" location=\"" << vbm_xml(floppy) << "\" format=\"VMDK\" type=\"Normal\"/>" << endl;
+        }
+        f << "      </HardDisks>" << endl;
+        if (!floppy_disk) {
+                f << "      <FloppyImages>" << endl;
+                f << "        <Image uuid=\"{" << floppy_uuid << "}\" location=\"" << vbm_xml(floppy) << "\"/>" << endl;
+                f << "      </FloppyImages>" << endl;
+        }
+        f << "    </MediaRegistry>" << endl;
+        f << "    <Hardware version=\"2\">" << endl;
+        f << "      <CPU count=\"" << vm.n_cpus << "\"/>" << endl;
+        f << "      <Memory RAMSize=\"256\"/>" << endl;
+        f << "      <Boot>" << endl;
+        f << "        <Order position=\"1\" device=\"HardDisk\"/>" << endl;
+        f << "        <Order position=\"2\" device=\"None\"/>" << endl;
+        f << "        <Order position=\"3\" device=\"None\"/>" << endl;
+        f << "        <Order position=\"4\" device=\"None\"/>" << endl;
+        f << "      </Boot>" << endl;
+        f << "      <BIOS>" << endl;
+        f << "        <ACPI enabled=\"true\"/>" << endl;
+        f << "        <IOAPIC enabled=\"true\"/>" << endl;
+        f << "      </BIOS>" << endl;
+        f << "      <Network>" << endl;
+        f << "        <Adapter slot=\"0\" enabled=\"true\" MACAddress=\"" << mac << "\" cable=\"true\" type=\"Am79C973\">" << endl;
+        f << "          <NAT>" << endl;
+        f << "            <DNS pass-domain=\"true\" use-proxy=\"true\" use-host-resolver=\"false\"/>" << endl;
+        // Port-forwarding for t4t-webapp
+        f << "            <Forwarding name=\"graphicsvm\" proto=\"1\" hostip=\"127.0.0.1\" hostport=\"7859\" guestport=\"80\"/>" << endl;
+        f << "          </NAT>" << endl;
+        f << "        </Adapter>" << endl;
+        f << "      </Network>" << endl;
+        if (vm.serial) {
+                f << "      <UART>" << endl;
+                f << "        <Port slot=\"0\" enabled=\"true\" IOBase=\"0x3f8\" IRQ=\"4\" hostMode=\"HostPipe\" path=\"" << vbm_xml(vm.serial_path) << "\" server=\"true\"/>" << endl;
+                f << "      </UART>" << endl;
+        }
+        f << "    </Hardware>" << endl;
+        f << "    <StorageControllers>" << endl;
+        f << "      <StorageController name=\"IDE Controller\" type=\"PIIX4\" PortCount=\"2\" useHostIOCache=\"true\" Bootable=\"true\">" << endl;
+        f << "        <AttachedDevice type=\"HardDisk\" port=\"0\" device=\"0\">" << endl;
+        f << "          <Image uuid=\"{" << disk_uuid << "}\"/>" << endl;
+        f << "        </AttachedDevice>" << endl;
+        if (floppy_disk) {
+                f << "        <AttachedDevice type=\"HardDisk\" port=\"1\" device=\"0\">" << endl;
+                f << "          <Image uuid=\"{" << floppy_uuid << "}\"/>" << endl;
+                f << "        </AttachedDevice>" << endl;
+        }
+        f << "      </StorageController>" << endl;
+        if (!floppy_disk) {
+                f << "      <StorageController name=\"Floppy Controller\" type=\"I82078\" PortCount=\"1\" useHostIOCache=\"true\" Bootable=\"true\">" << endl;
+                f << "        <AttachedDevice type=\"Floppy\" port=\"0\" device=\"0\">" << endl;
+                f << "          <Image uuid=\"{" << floppy_uuid << "}\"/>" << endl;
+                f << "        </AttachedDevice>" << endl;
+                f << "      </StorageController>" << endl;
+        }
+        f << "    </StorageControllers>" << endl;
+        f << "  </Machine>" << endl;
+        f << "</VirtualBox>" << endl;
+        f.close();
+
+        if (!vbm_run(vbm_args() << "registervm" << settings)) {
+                cerr << "WARNING: Registering " << settings << " failed" << endl;
+                boinc_delete_file(settings.c_str());
+                boinc_rmdir(vmfolder.c_str());
+                return false;
+        }
+        if (vm.debug_level >= 3) {
+                cerr << "NOTICE: VM registered from " << settings << endl;
+        }
+        return true;
+}
+
+// Build the VM with one VBoxManage command per setting
+bool VBoxManageDriver::configure(VM& vm)
 {
-        time_t rawtime;
-        string arg_list;
+        const string& name = vm.virtual_machine_name;
 
         //createvm
-        arg_list = "createvm --name " + virtual_machine_name + " --ostype Linux26 --register";
-        if (!vbm_popen(arg_list)) {
+        if (!vbm_run(vbm_args() << "createvm" << "--name" << name << "--ostype" << "Linux26" << "--register")) {
                 cerr << "ERROR: Create VM method -> createvm failed! Aborting" << endl;
-                cerr << "ERROR: " << arg_list << endl;
-                if (debug_level >= 3) {
-                        cerr << "NOTICE: Removing registered VM because to clean the system" << endl; 
-                }
-                remove();
-                boinc_finish(1);
+                return false;
         }
     
         //modifyvm
-        arg_list.clear();
-        std::stringstream tmp;
-        tmp << n_cpus;
-        arg_list = "modifyvm " + virtual_machine_name + \
-                " --cpus " + tmp.str() + " --memory 256 --acpi on --ioapic on \
-                  --boot1 disk --boot2 none --boot3 none --boot4 none \
-                  --nic1 nat \
-                  --natdnsproxy1 on";
-    
-        vbm_popen(arg_list);
+        vbm_run(vbm_args() << "modifyvm" << name << "--cpus" << vm.n_cpus << "--memory" << 256 <<
+                "--acpi" << "on" << "--ioapic" << "on" <<
+                "--boot1" << "disk" << "--boot2" << "none" << "--boot3" << "none" << "--boot4" << "none" <<
+                "--nic1" << "nat" << "--natdnsproxy1" << "on");
 
         // Enable port-forwarding for t4t-webapp
-        if (debug_level >= 4) {
+        if (vm.debug_level >= 4) {
                 cerr << "INFO: Enabling Port Forwarding in the Virtual Machine" << endl;
         }
-        arg_list.clear();
-        arg_list = " modifyvm " + virtual_machine_name + \
-                   " --natpf1  \"graphicsvm,tcp,127.0.0.1,7859,,80\"";
-        vbm_popen(arg_list);
+        vbm_run(vbm_args() << "modifyvm" << name << "--natpf1" << "graphicsvm,tcp,127.0.0.1,7859,,80");
     
         // Create the controller for the virtual hard disk
-        arg_list.clear();
-        arg_list = "storagectl " + virtual_machine_name + \
-                   " --name \"IDE Controller\" --add ide --controller PIIX4";
-        vbm_popen(arg_list);
+        vbm_run(vbm_args() << "storagectl" << name << "--name" << "IDE Controller" << "--add" << "ide" << "--controller" << "PIIX4");
     
         // Attach Virtual hard disk to the VM
-        arg_list.clear();
-        arg_list = "storageattach " + virtual_machine_name + \
-                   " --storagectl \"IDE Controller\" \
-                     --port 0 --device 0 --type hdd --medium " \
-                   + disk_path;
-
-        if (!vbm_popen(arg_list)) {
+        if (!vbm_run(vbm_args() << "storageattach" << name << "--storagectl" << "IDE Controller" <<
+                     "--port" << 0 << "--device" << 0 << "--type" << "hdd" << "--medium" << vm.disk_path)) {
                 cerr << "ERROR: Create storageattach failed! Aborting" << endl;
-                cerr << "ERROR: " << arg_list << endl;
-                remove();
-                boinc_finish(1);
+                return false;
         }
 
-        // Create the controller for the virtual floppy image
-        FloppyIO floppy("floppy.img");
-        arg_list.clear();
-        arg_list = "storagectl " + virtual_machine_name + \
-                   " --name \"Floppy Controller\" --add floppy";
-        vbm_popen(arg_list);
-
-        // Attach the virtual foppy image
-        arg_list.clear();
-        arg_list = "storageattach " + virtual_machine_name + \
-                   " --storagectl \"Floppy Controller\" \
-                     --port 0 --device 0 --medium floppy.img";
-
-        if (!vbm_popen(arg_list)) {
-                cerr << "ERROR: Adding the Floppy image failed! Aborting" << endl;
-                cerr << "ERROR: " << arg_list << endl;
-                remove();
-                boinc_finish(1);
-        }
-
-        floppy.send("BOINC_USERNAME=" + boinc_username + "\nBOINC_USER_TOTAL_CREDIT=" + boinc_user_total_credit + "\nBOINC_HOST_TOTAL_CREDIT=" + boinc_host_total_credit + "\nBOINC_AUTHENTICATOR=" + boinc_authenticator);
-
-        // Create VM
-        std::ofstream f(name_path.c_str());
-        if (f.is_open()) {
-                if (f.good()) {
-                    f << virtual_machine_name;
-                }
-                f.close();
+        vbm_args attach;
+        if (vm.floppy_size > FPIO_MAX_FLOPPY_SIZE) {
+                // Too big for a floppy drive: attach it as a raw hard disk
+                attach << "storageattach" << name << "--storagectl" << "IDE Controller" <<
+                          "--port" << 1 << "--device" << 0 << "--type" << "hdd" << "--medium" << "floppy.vmdk";
         }
         else {
-                cerr << "ERROR: Saving VM name failed! Details -> ofstream failed! Aborting" << endl;
-                boinc_finish(1);
+                // Create the controller for the virtual floppy image
+                vbm_run(vbm_args() << "storagectl" << name << "--name" << "Floppy Controller" << "--add" << "floppy");
+
+                // Attach the virtual foppy image
+                attach << "storageattach" << name << "--storagectl" << "Floppy Controller" <<
+                          "--port" << 0 << "--device" << 0 << "--medium" << "floppy.img";
         }
-}
 
-bool VM::exists()
-{
-        std::ifstream f("VMName");
-        if (f.is_open()) {
-                f.close();
-                return true;
-        } 
-        else {
+        if (!vbm_run(attach)) {
+                cerr << "ERROR: Adding the Floppy image failed! Aborting" << endl;
                 return false;
         }
-}
-
-void VM::throttle()
-{
-        // Check the BOINC CPU preferences for running the VM accordingly
-        string arg_list;
-        boinc_get_init_data(aid);
 
-        cerr << "INFO: Number of cores: " << n_cpus << endl;
-
-        if (aid.project_preferences) {
-                if (!aid.project_preferences) return;
-                double max_vm_cpu_pct = 100.0;
-                if (parse_double(aid.project_preferences, "<max_vm_cpu_pct>", 
-                                                                    max_vm_cpu_pct)) {
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: Maximum usage of CPU: " << max_vm_cpu_pct << endl;
-                                cerr << "NOTICE: Setting how much CPU time the virtual CPU can use: " << max_vm_cpu_pct << endl;
-                        }
-
-                        std::stringstream out;
-                        out << int(max_vm_cpu_pct);
-    
-                        arg_list = " controlvm " + virtual_machine_name + " cpuexecutioncap " + out.str();
-                        if (!vbm_popen(arg_list)) {
-                                cerr << "ERROR: Impossible to set up CPU percentage usage limit" << endl;
-                        }
-                        else {
-                            if (debug_level >= 3) {
-                                    cerr << "NOTICE: Success!" << endl;
-                            }
-                        }
+        // Connect the first UART to a host pipe (See FloppyIOSerial). The
+        // guest sees it as /dev/ttyS0.
+        if (vm.serial) {
+                if (!vbm_run(vbm_args() << "modifyvm" << name << "--uart1" << "0x3F8" << 4 <<
+                             "--uartmode1" << "server" << vm.serial_path)) {
+                        cerr << "ERROR: Connecting the serial port failed! Continuing without it" << endl;
+                        vm.serial = false;
+                }
+                else if (vm.debug_level >= 3) {
+                        cerr << "NOTICE: Serial port connected to " << vm.serial_path << endl;
                 }
         }
+        return true;
 }
 
-void VM::start(bool vrde=false, bool headless=false) 
+bool VBoxManageDriver::start(VM& vm, bool vrde, bool headless)
 {
-        // Start the VM in headless mode
-        boinc_begin_critical_section();
-        string arg_list="";
-        char buffer[1024];
-    
-        if (headless) arg_list = " startvm " + virtual_machine_name + " --type headless";
-        else arg_list = " startvm " + virtual_machine_name;
-        if (!vbm_popen(arg_list, buffer, sizeof(buffer))) {
-                start_err_number += 1;
-                cerr << "ERROR: Impossible to start the VM, seems to be locked " << start_err_number << " time" << endl;
+        vbm_args startvm;
+        string output;
 
-                if (debug_level >= 3 ) {
-                        cerr << "NOTICE: Waiting 2 seconds to unlock the VM" << endl;
+        startvm << "startvm" << vm.virtual_machine_name;
+        if (headless) startvm << "--type" << "headless";
+        if (!vbm_run(startvm, &output)) return false;
+
+        // Check if two or more cores can be used as Virtualization Extensions are required
+        if (vm.n_cpus > 1) {
+                #ifdef _WIN32
+                if (vm.debug_level >= 3) {
+                        cerr << "NOTICE: I'm running in a Windows system..." << endl;
                 }
-                boinc_sleep(2);
+                string vmlog = getenv("HOMEDRIVE");
+                vmlog += getenv("HOMEPATH");
+                vmlog +=  "\\VirtualBox VMs\\" + vm.virtual_machine_name + "\\Logs\\VBox.log";
+                #else 
+                // *nix systems
+                string env = getenv("HOME");
     
-                if (start_err_number > 4) {
-                        cerr << "ERROR: Impossible to start the VM after " << start_err_number << " times" << endl;
-                        cerr << "ERROR: Removing the VM" << endl;
-                        remove();
-                        boinc_end_critical_section();
-                        boinc_finish(1);
+                string vmlog = env + "/VirtualBox VMs/" + vm.virtual_machine_name + "/Logs/VBox.log";
+                if (vm.debug_level >= 3) {
+                        cerr << "NOTICE: I'm running in a *nix system..." << endl;
                 }
-        }
-        else {
-                // Check if two or more cores can be used as Virtualization Extensions are required
-                if (n_cpus > 1) {
-                        #ifdef _WIN32
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: I'm running in a Windows system..." << endl;
-                        }
-                        string vmlog = getenv("HOMEDRIVE");
-                        vmlog += getenv("HOMEPATH");
-                        vmlog +=  "\\VirtualBox VMs\\" + virtual_machine_name + "\\Logs\\VBox.log";
-                        #else 
-                        // *nix systems
-                        string env = getenv("HOME");
-    
-                        string vmlog = env + "/VirtualBox VMs/" + virtual_machine_name + "/Logs/VBox.log";
-                        if (debug_level >= 3) {
-                                cerr << "NOTICE: I'm running in a *nix system..." << endl;
-                        }
-                        #endif
-                        // Give time to VBoxManage to report if Virtualization Extensions are enabled
-                        boinc_sleep(2);
-                        // Read the error file
-                        std::ifstream errors(vmlog.c_str());
-                        if (errors.is_open()) {
-                                string line;
-                                cerr << "INFO: Checking if it is possible to use two or more cores in the VM..." << endl;
-                                while (!errors.eof()) {
-                                        std::getline(errors,line);
-                                        if ((line.find("VERR_VMX_MSR_LOCKED_OR_DISABLED") != string::npos) || (line.find("VERR_SVM_DISABLED") != string::npos)) {
-                                                cerr << "ERROR: Virtualization extensions are not supported, so multi-core extension has to be disabled!" << endl;
-                                                // Disabling the number of cores
-                                                string tmp;
-                                                boinc_sleep(5);
-                                                tmp = "modifyvm " + virtual_machine_name + " --cpus 1";
-                                                if (!vbm_popen(tmp)) {
-                                                        cerr << "ERROR: Disabling multi-core feature failed!" << endl;
-                                                        cerr << "ERROR: Aborting work unit" << endl;
-                                                        boinc_finish(1);
-                                                }       
-                                                else {
-                                                        n_cpus = 1;
-                                                        cerr << "INFO: Disabling multi-core feature worked! Re-starting VM..." << endl;
-                                                        vbm_popen(arg_list);
-                                                }
-                                                break;
+                #endif
+                // Give time to VBoxManage to report if Virtualization Extensions are enabled
+                boinc_sleep(2);
+                // Read the error file
+                std::ifstream errors(vmlog.c_str());
+                if (errors.is_open()) {
+                        string line;
+                        cerr << "INFO: Checking if it is possible to use two or more cores in the VM..." << endl;
+                        while (!errors.eof()) {
+                                std::getline(errors,line);
+                                if ((line.find("VERR_VMX_MSR_LOCKED_OR_DISABLED") != string::npos) || (line.find("VERR_SVM_DISABLED") != string::npos)) {
+                                        cerr << "ERROR: Virtualization extensions are not supported, so multi-core extension has to be disabled!" << endl;
+                                        // Disabling the number of cores
+                                        boinc_sleep(5);
+                                        if (!vbm_run(vbm_args() << "modifyvm" << vm.virtual_machine_name << "--cpus" << 1)) {
+                                                cerr << "ERROR: Disabling multi-core feature failed!" << endl;
+                                                cerr << "ERROR: Aborting work unit" << endl;
+                                                boinc_finish(1);
+                                        }       
+                                        else {
+                                                vm.n_cpus = 1;
+                                                cerr << "INFO: Disabling multi-core feature worked! Re-starting VM..." << endl;
+                                                vbm_run(startvm);
                                         }
+                                        break;
                                 }
-                                errors.close();
-                        }
-                        else {
-                                cerr << "ERROR: Impossible to read the VBox.log file!" << endl;
                         }
-                }
-
-                // Resetting the error counter
-                start_err_number = 0;
-                if (debug_level >=3) cerr << "NOTICE: VM has been started!" << endl;
-    
-                // Enable or disable VRDP for the VM: (by default is disabled)
-                if (vrde) {
-                        arg_list.clear();
-                        arg_list = " controlvm " + virtual_machine_name + " vrde on";
+                        errors.close();
                 }
                 else {
-                        arg_list.clear(); 
-                        arg_list = " controlvm " + virtual_machine_name + " vrde off";
+                        cerr << "ERROR: Impossible to read the VBox.log file!" << endl;
                 }
-
-                vbm_popen(arg_list);
-    
-                // If not running in Headless mode, don't allow the user to save, shutdown, power off or restore the VM
-                if (!headless) {
-                        arg_list.clear();
-                        // Don't allow the user to save, shutdown, power off or restore the VM
-                        arg_list = " setextradata " + virtual_machine_name + " GUI/RestrictedCloseActions SaveState,Shutdown,PowerOff,Restore";
-                        vbm_popen(arg_list);
-                }
-    
-                throttle();
         }
-        boinc_end_critical_section();
-}
-
-void VM::kill() 
-{
-        boinc_begin_critical_section();
-        string arg_list("controlvm " + virtual_machine_name + " poweroff");
-        vbm_popen(arg_list);
-        boinc_end_critical_section();
-}
 
-void VM::pause() 
-{
-        boinc_begin_critical_section();
-        string arg_list("controlvm " + virtual_machine_name + " pause");
-        if (vbm_popen(arg_list)) {
-                suspended = true;
-                time_t current_time = time(NULL);
-                current_period += difftime (current_time, last_poll_point);
-        }
+        // Enable or disable VRDP for the VM: (by default is disabled)
+        vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "vrde" << (vrde ? "on" : "off"));
     
-        boinc_end_critical_section();
+        // If not running in Headless mode, don't allow the user to save, shutdown, power off or restore the VM
+        if (!headless) {
+                vbm_run(vbm_args() << "setextradata" << vm.virtual_machine_name <<
+                        "GUI/RestrictedCloseActions" << "SaveState,Shutdown,PowerOff,Restore");
+        }
+        return true;
 }
 
-void VM::resume() 
+bool VBoxManageDriver::pause(VM& vm)
 {
-        boinc_begin_critical_section();
-        string arg_list("controlvm " + virtual_machine_name + " resume");
-        if (vbm_popen(arg_list)) {
-                suspended = false;
-                last_poll_point = time(NULL);
-        }
+        return vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "pause");
+}
 
-        boinc_end_critical_section();
+bool VBoxManageDriver::resume(VM& vm)
+{
+        return vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "resume");
 }
 
-void VM::Check()
+bool VBoxManageDriver::savestate(VM& vm)
 {
-        boinc_begin_critical_section();
-        string arg_list;
-        if (suspended) {
-                arg_list= "controlvm " + virtual_machine_name + " resume";
-                vbm_popen(arg_list);
-        }
-        arg_list = "controlvm " + virtual_machine_name + " savestate";
-        vbm_popen(arg_list);
-        boinc_end_critical_section();
+        return vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "savestate");
 }
 
-void VM::savestate()
+bool VBoxManageDriver::poweroff(VM& vm)
 {
-        boinc_begin_critical_section();
-        string arg_list("controlvm " + virtual_machine_name + " savestate");
-        if (!vbm_popen(arg_list)) {
-                cerr << "ERROR: The VM could not be saved" << endl;
+        return vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "poweroff");
+}
+
+bool VBoxManageDriver::poll(VM& vm, VMInfo* info)
+{
+        string status;
+
+        if (!vbm_run(vbm_args() << "showvminfo" << vm.virtual_machine_name << "--machinereadable", &status)) {
+                info->clear();
+                return false;
         }
-        boinc_end_critical_section();
+        return vbm_parse_vminfo(status, info);
 }
 
-void VM::remove() 
+void VBoxManageDriver::remove(VM& vm)
 {
-        boinc_begin_critical_section();
-        string arg_list, vminfo, vboxfolder, vboxXML, vboxXMLNew, vmfolder, vmdisk;
+        string vminfo, vboxfolder, vboxXML, vboxXMLNew, vmfolder, vmdisk;
         char *env;
         bool vmRegistered = false;
     
-        arg_list = " discardstate " + virtual_machine_name;
-        if (vbm_popen(arg_list)) {
-                if (debug_level >= 3) {
+        if (vbm_run(vbm_args() << "discardstate" << vm.virtual_machine_name)) {
+                if (vm.debug_level >= 3) {
                         cerr << "NOTICE: VM state discarded!" << endl;
                 }
         }
         else {
-                if (debug_level >= 2) {
+                if (vm.debug_level >= 2) {
                         cerr << "WARNING: it was not possible to discard the state of the VM" << endl;
                 }
         }
@@ -523,15 +929,13 @@ void VM::remove()
         boinc_sleep(2);
     
         // Unregistervm command with --delete option. VBox 4.1 should work well
-        arg_list.clear();
-        arg_list = " unregistervm " + virtual_machine_name + " --delete";
-        if (vbm_popen(arg_list)) {
-                if (debug_level >= 3) {
+        if (vbm_run(vbm_args() << "unregistervm" << vm.virtual_machine_name << "--delete")) {
+                if (vm.debug_level >= 3) {
                         cerr << "NOTICE: VM removed via VBoxManage" << endl;
                 }
         }
         else {
-            if (debug_level >= 2) {
+            if (vm.debug_level >= 2) {
                     cerr << "WARNING: The VM could not be removed via VBoxManage" << endl;
             }
         }
@@ -539,22 +943,20 @@ void VM::remove()
         // We test if we can remove the hard disk controller. If the command works, the cernvm.vmdk virtual disk will be also
         // removed automatically
     
-        arg_list.clear();
-        arg_list = " storagectl  " + virtual_machine_name + " --name \"IDE Controller\" --remove";
-        if (vbm_popen(arg_list)) {
-            if (debug_level >= 3) {
+        if (vbm_run(vbm_args() << "storagectl" << vm.virtual_machine_name << "--name" << "IDE Controller" << "--remove")) {
+            if (vm.debug_level >= 3) {
                     cerr << "NOTICE: Hard disk removed!" << endl;
             }
         }
         else {
-                if (debug_level >= 2) {
+                if (vm.debug_level >= 2) {
                         cerr << "WARNING: it was not possible to remove the IDE controller" << endl;
                 }
         } 
     
         #ifdef _WIN32
     	env = getenv("HOMEDRIVE");
-    	if (debug_level >= 3) {
+    	if (vm.debug_level >= 3) {
                 cerr << "NOTICE: I'm running in a Windows system..." << endl;
         }
     	vboxXML = string(env);
@@ -571,7 +973,7 @@ void VM::remove()
             // GNU/Linux
             vboxXML = vboxXML + "/.VirtualBox/VirtualBox.xml";
             vboxfolder = string(env) + "/.VirtualBox/";
-            if (debug_level >= 3) {
+            if (vm.debug_level >= 3) {
                     cerr << "NOTICE: I'm running in a GNU/Linux system..." << endl;
             }
         }
@@ -579,7 +981,7 @@ void VM::remove()
             // Mac OS X
             vboxXML = vboxXML + "/Library/VirtualBox/VirtualBox.xml";
             vboxfolder = string(env) + "/Library/VirtualBox/";
-            if (debug_level >= 3) {
+            if (vm.debug_level >= 3) {
                     cerr << "NOTICE: I'm running in a Mac OS X system..." << endl;
             }
         }
@@ -600,17 +1002,17 @@ void VM::remove()
                                 out << line + "\n";
                         else {
                                 vmRegistered = true; 
-                                if (debug_level >= 3) {
+                                if (vm.debug_level >= 3) {
                                         cerr << "NOTICE: Obtaining the VM folder..." << endl;
                                 }
                                 found_init = line.find("src=");
-                                found_end = line.find(virtual_machine_name + ".vbox");
+                                found_end = line.find(vm.virtual_machine_name + ".vbox");
                                 if (found_end != string::npos)
-                                    if (debug_level >= 3) {
+                                    if (vm.debug_level >= 3) {
                                             cerr << "NOTICE: .vbox found at line: " << line_n << " in the VirtualBox.xml file" << endl;
                                     }
                                 vmfolder = line.substr(found_init + 5, found_end - (found_init+5));
-                                if (debug_level >= 3) {
+                                if (vm.debug_level >= 3) {
                                         cerr << "NOTICE: Done!" << endl;
                                 }
                         }
@@ -621,14 +1023,13 @@ void VM::remove()
         }
     
         // When the project is reset, we have to first unregister the VM, else we will have an error.
-        arg_list = "unregistervm " + virtual_machine_name;
-        if (!vbm_popen(arg_list)) {
-                if (debug_level >= 3) {
+        if (!vbm_run(vbm_args() << "unregistervm" << vm.virtual_machine_name)) {
+                if (vm.debug_level >= 3) {
                         cerr << "NOTICE: CernVM does not exist, so it is not necessary to unregister it" << endl;
                 }
         }
         else {
-            if (debug_level >= 3) {
+            if (vm.debug_level >= 3) {
                     cerr << "NOTICE: Successfully unregistered the CernVM" << endl;
             }
         }
@@ -642,28 +1043,28 @@ void VM::remove()
     	if (vmRegistered) {
     	        vmfolder = "RMDIR \"" + vmfolder + "\" /s /q";
     	        if (system(vmfolder.c_str()) == 0) {
-    			if (debug_level >= 3) {
+    			if (vm.debug_level >= 3) {
                                 cerr << "NOTICE: VM folder deleted!" << endl;
                         }
                 }
     		else {
-                        if (debug_level >= 3) {
+                        if (vm.debug_level >= 3) {
                                 cerr << "NOTICE: System was clean, nothing to delete" << endl;
                         }
                 }
     	}
         else {
-                if (debug_level >= 3) {
+                if (vm.debug_level >= 3) {
                         cerr << "NOTICE: VM was not registered, deleting old VM folders..." << endl;
                 }
-                vmfolder = "RMDIR \"" + vboxfolder + virtual_machine_name + "\" /s /q";
+                vmfolder = "RMDIR \"" + vboxfolder + vm.virtual_machine_name + "\" /s /q";
                 if (system(vmfolder.c_str()) == 0) {
-                        if (debug_level >= 3) {
+                        if (vm.debug_level >= 3) {
                                 cerr << "NOTICE: VM folder deleted!" << endl;
                         }
                 }
                 else {
-                        if (debug_level >= 3) {
+                        if (vm.debug_level >= 3) {
                                 cerr << "NOTICE: System was clean, nothing to delete" << endl;
                         }
                 }
@@ -674,41 +1075,261 @@ void VM::remove()
         if (vmRegistered) {
                 vmfolder = "rm -rf \"" + vmfolder + "\"";
                 if (system(vmfolder.c_str()) == 0) {
-                    if (debug_level >= 3) {
+                    if (vm.debug_level >= 3) {
                             cerr << "NOTICE: VM folder deleted!" << endl;
                     }
                 }
                 else {
-                    if (debug_level >= 3) {
+                    if (vm.debug_level >= 3) {
                             cerr << "NOTICE: System was clean, nothing to delete" << endl;
                     }
                 }
         }
         else {
-                if (debug_level >= 3) {
+                if (vm.debug_level >= 3) {
                         cerr << "NOTICE: VM was not registered, deleting old VM folders..." << endl;
                 }
-                vmfolder = "rm -rf \"" + string(env) + "/VirtualBox VMs/" + virtual_machine_name + "\" ";
+                vmfolder = "rm -rf \"" + string(env) + "/VirtualBox VMs/" + vm.virtual_machine_name + "\" ";
                 if ( system(vmfolder.c_str()) == 0 ) {
-                        if (debug_level >= 3) {
+                        if (vm.debug_level >= 3) {
                                 cerr << "NOTICE: VM folder deleted!" << endl; 
                         }
                 }
                 else {
-                        if (debug_level >= 3) {
+                        if (vm.debug_level >= 3) {
                                 cerr << "NOTICE: System was clean, nothing to delete" << endl;
                         }
                 }
         }
         #endif
+}
+    
+bool VBoxManageDriver::throttle(VM& vm, int cpu_pct)
+{
+        return vbm_run(vbm_args() << "controlvm" << vm.virtual_machine_name << "cpuexecutioncap" << cpu_pct);
+}
+
+bool VBoxManageDriver::release(VM& vm)
+{
+        return vbm_run(vbm_args() << "closemedium" << "disk" << vm.disk_path);
+}
+
+VM::VM() {
+        char buffer[256];
+    
+        virtual_machine_name = "";
+        current_period = 0;
+        suspended = false;
+        last_poll_point = 0;
+        poll_err_number = 0;
+        poweroff_err_number = 0;
+        start_err_number = 0;
+        debug_level = 3;
+        n_cpus = 2;
+        floppy_size = 0;
+        serial = false;
+        telemetry_fio = NULL;
+        telemetry_mux = NULL;
+        telemetry_events = 0;
+        driver = new VBoxManageDriver();
+        
+        boinc_getcwd(buffer);
+        disk_name = "cernvm.vmdk";
+        disk_path = "cernvm.vmdk";
+        disk_path = "/"+disk_path;
+        disk_path = buffer+disk_path;
+
+        name_path = "";
+        name_path += VM_NAME;
+
+        // VirtualBox creates the socket when the VM starts
+        serial_path = buffer;
+        serial_path += "/serial.sock";
+}   
+
+void VM::create() 
+{
+        // Create the floppy image. A custom size gets a geometry header,
+        // so the guest can find the buffers without knowing the size.
+        FloppyIO floppy("floppy.img", (floppy_size > 0) ? FPIO_HEADER : 0, floppy_size);
+
+        #ifdef _WIN32
+        // A named pipe instead of a socket
+        serial_path = "\\\\.\\pipe\\" + virtual_machine_name + "_serial";
+        #endif
+
+        if (!driver->create(*this)) {
+                cerr << "ERROR: Creating the VM failed! Aborting" << endl;
+                if (debug_level >= 3) {
+                        cerr << "NOTICE: Removing registered VM because to clean the system" << endl; 
+                }
+                remove();
+                boinc_finish(1);
+        }
+
+        floppy.send("BOINC_USERNAME=" + boinc_username + "\nBOINC_USER_TOTAL_CREDIT=" + boinc_user_total_credit + "\nBOINC_HOST_TOTAL_CREDIT=" + boinc_host_total_credit + "\nBOINC_AUTHENTICATOR=" + boinc_authenticator);
+
+        // Create VM
+        std::ofstream f(name_path.c_str());
+        if (f.is_open()) {
+                if (f.good()) {
+                    f << virtual_machine_name;
+                }
+                f.close();
+        }
+        else {
+                cerr << "ERROR: Saving VM name failed! Details -> ofstream failed! Aborting" << endl;
+                boinc_finish(1);
+        }
+}
+
+bool VM::exists()
+{
+        std::ifstream f("VMName");
+        if (f.is_open()) {
+                f.close();
+                return true;
+        } 
+        else {
+                return false;
+        }
+}
+
+void VM::throttle()
+{
+        // Check the BOINC CPU preferences for running the VM accordingly
+        boinc_get_init_data(aid);
+
+        cerr << "INFO: Number of cores: " << n_cpus << endl;
+
+        if (aid.project_preferences) {
+                if (!aid.project_preferences) return;
+                double max_vm_cpu_pct = 100.0;
+                if (parse_double(aid.project_preferences, "<max_vm_cpu_pct>", 
+                                                                    max_vm_cpu_pct)) {
+                        if (debug_level >= 3) {
+                                cerr << "NOTICE: Maximum usage of CPU: " << max_vm_cpu_pct << endl;
+                                cerr << "NOTICE: Setting how much CPU time the virtual CPU can use: " << max_vm_cpu_pct << endl;
+                        }
+
+                        if (!driver->throttle(*this, int(max_vm_cpu_pct))) {
+                                cerr << "ERROR: Impossible to set up CPU percentage usage limit" << endl;
+                        }
+                        else {
+                            if (debug_level >= 3) {
+                                    cerr << "NOTICE: Success!" << endl;
+                            }
+                        }
+                }
+        }
+}
+
+void VM::start(bool vrde=false, bool headless=false) 
+{
+        // Start the VM in headless mode
+        boinc_begin_critical_section();
+    
+        tracker.reset();
+        if (!driver->start(*this, vrde, headless)) {
+                start_err_number += 1;
+                cerr << "ERROR: Impossible to start the VM, seems to be locked " << start_err_number << " time" << endl;
+
+                if (debug_level >= 3 ) {
+                        cerr << "NOTICE: Waiting 2 seconds to unlock the VM" << endl;
+                }
+                boinc_sleep(2);
+    
+                if (start_err_number > 4) {
+                        cerr << "ERROR: Impossible to start the VM after " << start_err_number << " times" << endl;
+                        cerr << "ERROR: Removing the VM" << endl;
+                        remove();
+                        boinc_end_critical_section();
+                        boinc_finish(1);
+                }
+        }
+        else {
+                // Resetting the error counter
+                start_err_number = 0;
+                if (debug_level >=3) cerr << "NOTICE: VM has been started!" << endl;
+    
+                throttle();
+        }
+        boinc_end_critical_section();
+}
+
+void VM::kill() 
+{
+        boinc_begin_critical_section();
+        tracker.reset();
+        driver->poweroff(*this);
+        boinc_end_critical_section();
+}
+
+void VM::pause() 
+{
+        boinc_begin_critical_section();
+        tracker.reset();
+        if (driver->pause(*this)) {
+                suspended = true;
+                time_t current_time = time(NULL);
+                current_period += difftime (current_time, last_poll_point);
+        }
+    
+        boinc_end_critical_section();
+}
+
+void VM::resume() 
+{
+        boinc_begin_critical_section();
+        tracker.reset();
+        if (driver->resume(*this)) {
+                suspended = false;
+                last_poll_point = time(NULL);
+        }
+
+        boinc_end_critical_section();
+}
+
+void VM::Check()
+{
+        boinc_begin_critical_section();
+        tracker.reset();
+        if (suspended) {
+                driver->resume(*this);
+        }
+        driver->savestate(*this);
+        boinc_end_critical_section();
+}
+
+void VM::savestate()
+{
+        boinc_begin_critical_section();
+        tracker.reset();
+        if (!driver->savestate(*this)) {
+                cerr << "ERROR: The VM could not be saved" << endl;
+        }
+        boinc_end_critical_section();
+}
+
+void VM::remove() 
+{
+        boinc_begin_critical_section();
+
+        // Let go of the floppy
+        delete telemetry_mux;
+        delete telemetry_fio;
+        telemetry_mux = NULL;
+        telemetry_fio = NULL;
+
+        driver->remove(*this);
+        tracker.reset();
         boinc_end_critical_section();
 }
     
 void VM::release()
 {
     boinc_begin_critical_section();
-    string arg_list("closemedium disk " + disk_path);
-    if(!vbm_popen(arg_list)) {
+    if(!driver->release(*this)) {
             cerr << "ERROR: It was impossible to release the virtual hard disk" << endl;
     }
     else {
@@ -722,12 +1343,18 @@ void VM::release()
 void VM::poll() 
 {
     boinc_begin_critical_section();
-    string arg_list, status;
-    char buffer[1024];
     time_t current_time;
+    bool ok = true;
     
-    arg_list = "showvminfo " + virtual_machine_name + " --machinereadable";
-    if (!vbm_popen(arg_list, buffer, sizeof(buffer))) {
+    // Ask the hypervisor only if the state may have changed
+    if (tracker.due()) {
+            ok = driver->poll(*this, &info);
+            tracker.update(info, ok);
+            if (ok && (debug_level >= 4)) {
+                    cerr << "INFO: VM state read (" << info.state_name << "), next read in " << tracker.interval << " seconds at most" << endl;
+            }
+    }
+    if (!ok) {
             // Increase the number of errors
             double wait_time = 5.0;
             poll_err_number += 1;
@@ -751,8 +1378,7 @@ void VM::poll()
             // Each time we read the status we reset the counter of errors
             poll_err_number = 0;
 
-            status = buffer;
-            if (status.find("VMState=\"running\"") != string::npos) {
+            if (info.state == VMSTATE_RUNNING) {
                     if (suspended) {
                             suspended=false;
                             last_poll_point=time(NULL);
@@ -778,7 +1404,7 @@ void VM::poll()
                     return;
             }
 
-            if (status.find("VMState=\"paused\"") != string::npos) {
+            if (info.state == VMSTATE_PAUSED) {
                     if (!suspended) {
                             suspended=true;
                             time_t current_time=time(NULL);
@@ -792,7 +1418,7 @@ void VM::poll()
                     return;
             }
 
-            if (status.find("VMState=\"poweroff\"") != string::npos) {
+            if (info.state == VMSTATE_POWEROFF) {
                     poweroff_err_number += 1;
                     if (debug_level >= 3) {
                             cerr << "WARNING: VM is powered off and it shouldn't (" << poweroff_err_number << " times!)" << endl;
@@ -810,6 +1436,72 @@ void VM::poll()
     }
 }
 
+void VM::collect()
+{
+        fpio_tlm_record record;
+        int res;
+
+        // Open the floppy the first time (Its layout is already there)
+        if (telemetry_fio == NULL) {
+                telemetry_fio = new FloppyIO("floppy.img", FPIO_SYNCHRONIZED | FPIO_BINARY | FPIO_NOINIT | FPIO_NOCREATE |
+                                             ((floppy_size > 0) ? FPIO_HEADER : 0), floppy_size);
+                if (!telemetry_fio->ready()) {
+                        if (debug_level >= 2) {
+                                cerr << "WARNING: Unable to open the floppy for the guest telemetry: " << telemetry_fio->errorStr << endl;
+                        }
+                        delete telemetry_fio;
+                        telemetry_fio = NULL;
+                        return;
+                }
+                telemetry_fio->syncTimeout = 1;
+                telemetry_mux = new FloppyIOMux(telemetry_fio);
+
+                // Nothing reads the other channels on this side: drop what
+                // the guest sends there instead of keeping it
+                for (int ch = 0; ch < FPIO_MUX_CHANNELS; ch++) {
+                        if (ch != FPIO_CHANNEL_METRICS) telemetry_mux->discard(ch);
+                }
+        }
+
+        // Take what the guest sent on the metrics channel, without waiting
+        // for more. A guest that keeps sending doesn't hold the poll: at most
+        // TELEMETRY_CHUNKS chunks are collected per call.
+        int chunks = TELEMETRY_CHUNKS;
+        while ((res = telemetry_mux->available(FPIO_CHANNEL_METRICS, &chunks)) > 0) {
+                res = telemetry_mux->receive(FPIO_CHANNEL_METRICS, &telemetry_message);
+                if (res < 0) break;
+
+                FloppyIOTelemetryReader reader(telemetry_message);
+                while (reader.next(&record)) {
+                        if (record.tag < FPIO_TLM_NUMERIC) {
+                                telemetry[record.tag].push(record.time ? record.time : time(NULL) * 1000LL, record.integer());
+                        }
+                        else if (record.tag == FPIO_TLM_EVENT) {
+                                telemetry_events++;
+                                if (debug_level >= 3) {
+                                        cerr << "NOTICE: Guest event: " << string((const char *)record.value, record.length) << endl;
+                                }
+                        }
+                }
+                if (reader.truncated && (debug_level >= 2)) {
+                        cerr << "WARNING: Truncated telemetry message from the guest" << endl;
+                }
+        }
+        if (res < 0) {
+                if (debug_level >= 2) {
+                        cerr << "WARNING: Receiving the guest telemetry failed: " << telemetry_fio->errorStr << endl;
+                }
+                telemetry_fio->clear();
+        }
+
+        if ((debug_level >= 4) && (telemetry[FPIO_TLM_LOAD1].size() > 0)) {
+                cerr << "INFO: Guest load " << telemetry[FPIO_TLM_LOAD1].value(0) / 100.0
+                     << " (mean " << telemetry[FPIO_TLM_LOAD1].mean() / 100.0 << " over "
+                     << telemetry[FPIO_TLM_LOAD1].size() << " samples), memory available "
+                     << telemetry[FPIO_TLM_MEM_FREE].value(0) << " kB" << endl;
+        }
+}
+
 void poll_boinc_messages(VM& vm, BOINC_STATUS &status) 
 {
         if (status.reread_init_data_file) {
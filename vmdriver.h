@@ -0,0 +1,250 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+using std::string;
+
+// Operations of a driver
+#define VMOP_CREATE     0
+#define VMOP_START      1
+#define VMOP_PAUSE      2
+#define VMOP_RESUME     3
+#define VMOP_SAVESTATE  4
+#define VMOP_POWEROFF   5
+#define VMOP_POLL       6
+#define VMOP_REMOVE     7
+#define VMOP_THROTTLE   8
+#define VMOP_RELEASE    9
+#define VMOP_COUNT      10
+
+// States of the VM (VMInfo::state)
+#define VMSTATE_ERROR   -1      // The state could not be read
+#define VMSTATE_NONE    0       // No such VM
+#define VMSTATE_POWEROFF 1
+#define VMSTATE_RUNNING 2
+#define VMSTATE_PAUSED  3
+#define VMSTATE_SAVED   4
+#define VMSTATE_ABORTED 5
+#define VMSTATE_OTHER   6       // Starting, saving, restoring...
+
+// A step of a MockDriver script that leaves the state as it is
+#define MOCK_KEEP       -2
+
+// A medium attached to the VM
+struct vminfo_medium {
+        string controller;
+        int port;
+        int device;
+        string location;
+        string uuid;
+};
+
+// What the driver found out about the VM at the last poll
+struct VMInfo {
+        int state;                  // VMSTATE_*
+        string state_name;          // As the hypervisor calls it
+        time_t state_change;        // When the VM got in that state (0 if unknown)
+        int cpus;                   // 0 if unknown, as the rest
+        int memory;                 // MB
+        int cpu_cap;                // Execution cap (%)
+        std::vector<vminfo_medium> media;
+
+        // Where the hypervisor keeps the VM (See VMStateTracker)
+        string settings;            // Its definition
+        string snapshots;           // Folder of the snapshots and saved states
+        string logs;                // Folder of the logs
+
+        VMInfo() {
+                clear();
+        }
+
+        void clear() {
+                state = VMSTATE_ERROR;
+                state_name.clear();
+                state_change = 0;
+                cpus = 0;
+                memory = 0;
+                cpu_cap = 0;
+                media.clear();
+                settings.clear();
+                snapshots.clear();
+                logs.clear();
+        }
+};
+
+struct VM;
+
+// The hypervisor under a VM. The VM keeps the bookkeeping (error counts,
+// run time, when to give up) and the driver does the work, so the control
+// loop can run against a hypervisor other than VirtualBox, or none at all
+// (See MockDriver).
+class VMDriver {
+public:
+        virtual ~VMDriver() {}
+
+        virtual string version() = 0;
+        virtual bool create(VM& vm) = 0;
+        virtual bool start(VM& vm, bool vrde, bool headless) = 0;
+        virtual bool pause(VM& vm) = 0;
+        virtual bool resume(VM& vm) = 0;
+        virtual bool savestate(VM& vm) = 0;
+        virtual bool poweroff(VM& vm) = 0;
+        virtual bool poll(VM& vm, VMInfo* info) = 0;
+        virtual void remove(VM& vm) = 0;
+        virtual bool throttle(VM& vm, int cpu_pct) = 0;
+        virtual bool release(VM& vm) = 0;
+};
+
+const char* vmop_names[VMOP_COUNT] = { "create", "start", "pause", "resume", "savestate",
+                                       "poweroff", "poll", "remove", "throttle", "release" };
+const char* vmstate_names[VMSTATE_OTHER + 1] = { "none", "poweroff", "running", "paused",
+                                                 "saved", "aborted", "other" };
+
+// A hypervisor that only keeps a state. Every operation succeeds at once
+// and moves the VM to the state it would have in VirtualBox, unless the
+// script says otherwise: the steps of the script are taken in order, per
+// operation, and each one decides whether the call fails, the state it
+// leaves and how long it takes. Nothing is random, so a run can be
+// repeated exactly.
+//
+// Script files have one step per line:
+//
+//   poll fail                    The next poll fails
+//   poll ok poweroff             The next poll finds the VM powered off
+//   start ok - 1500              The next start works, after 1.5 seconds
+//   latency poll 20              Every poll takes 20 ms (* for all calls)
+//
+class MockDriver : public VMDriver {
+public:
+        int state;
+        double latency[VMOP_COUNT];         // Of the calls not scripted (seconds)
+        unsigned long calls[VMOP_COUNT];
+        unsigned long failures[VMOP_COUNT];
+        double delayed;                     // Latency injected so far (seconds)
+
+        MockDriver() {
+                state = VMSTATE_NONE;
+                delayed = 0;
+                cap = 100;
+                changed = 0;
+                for (int i = 0; i < VMOP_COUNT; i++) {
+                        latency[i] = 0;
+                        calls[i] = 0;
+                        failures[i] = 0;
+                }
+        }
+
+        // Add a step for an operation
+        void script(int op, bool ok, int next_state = MOCK_KEEP, double seconds = -1) {
+                mock_step s;
+                s.ok = ok;
+                s.state = next_state;
+                s.latency = seconds;
+                steps[op].push_back(s);
+        }
+
+        // Add the steps of a script file
+        bool load(const char* path) {
+                std::ifstream f(path);
+                if (!f.is_open()) {
+                        cerr << "ERROR: Cannot read the mock script " << path << endl;
+                        return false;
+                }
+                string line;
+                int line_n = 0;
+                while (std::getline(f, line)) {
+                        line_n += 1;
+                        if (line.find('#') != string::npos) line.erase(line.find('#'));
+                        std::istringstream in(line);
+                        string op, result, next_state, ms;
+                        if (!(in >> op)) continue;
+                        in >> result >> next_state >> ms;
+
+                        if (op == "latency") {
+                                double seconds = atof(next_state.c_str()) / 1000.0;
+                                for (int i = 0; i < VMOP_COUNT; i++)
+                                        if ((result == "*") || (result == vmop_names[i])) latency[i] = seconds;
+                                continue;
+                        }
+                        int i = find(vmop_names, VMOP_COUNT, op);
+                        int s = (next_state.empty() || (next_state == "-")) ? MOCK_KEEP :
+                                find(vmstate_names, VMSTATE_OTHER + 1, next_state);
+                        if ((i < 0) || (s == -1) || ((result != "ok") && (result != "fail"))) {
+                                cerr << "ERROR: " << path << ":" << line_n << ": bad step: " << line << endl;
+                                return false;
+                        }
+                        script(i, result == "ok", s, ms.empty() ? -1 : atof(ms.c_str()) / 1000.0);
+                }
+                return true;
+        }
+
+        string version() { return "mock"; }
+        bool create(VM& vm) { return step(VMOP_CREATE, VMSTATE_POWEROFF); }
+        bool start(VM& vm, bool vrde, bool headless) { return step(VMOP_START, VMSTATE_RUNNING); }
+        bool pause(VM& vm) { return step(VMOP_PAUSE, VMSTATE_PAUSED); }
+        bool resume(VM& vm) { return step(VMOP_RESUME, VMSTATE_RUNNING); }
+        bool savestate(VM& vm) { return step(VMOP_SAVESTATE, VMSTATE_SAVED); }
+        bool poweroff(VM& vm) { return step(VMOP_POWEROFF, VMSTATE_POWEROFF); }
+        bool poll(VM& vm, VMInfo* info) {
+                info->clear();
+                if (!step(VMOP_POLL, MOCK_KEEP)) return false;
+                info->state = state;
+                info->state_name = vmstate_names[state];
+                info->state_change = changed;
+                info->cpu_cap = cap;
+                return true;
+        }
+        void remove(VM& vm) { step(VMOP_REMOVE, VMSTATE_NONE); }
+        bool throttle(VM& vm, int cpu_pct) {
+                if (!step(VMOP_THROTTLE, MOCK_KEEP)) return false;
+                cap = cpu_pct;
+                return true;
+        }
+        bool release(VM& vm) { return step(VMOP_RELEASE, MOCK_KEEP); }
+
+private:
+        struct mock_step {
+                bool ok;
+                int state;          // Or MOCK_KEEP
+                double latency;     // Seconds, or -1 for the default one
+        };
+        std::deque<mock_step> steps[VMOP_COUNT];
+        int cap;
+        time_t changed;
+
+        // Run a call: the next step of the script or, if there is none, a
+        // successful one that moves to next_state
+        bool step(int op, int next_state) {
+                mock_step s;
+                s.ok = true;
+                s.state = next_state;
+                s.latency = -1;
+                if (!steps[op].empty()) {
+                        s = steps[op].front();
+                        steps[op].pop_front();
+                        if (s.ok && (s.state == MOCK_KEEP)) s.state = next_state;
+                }
+                double seconds = (s.latency < 0) ? latency[op] : s.latency;
+                if (seconds > 0) {
+                        boinc_sleep(seconds);
+                        delayed += seconds;
+                }
+                calls[op] += 1;
+                if (!s.ok) failures[op] += 1;
+                if ((s.state != MOCK_KEEP) && (s.state != state)) {
+                        state = s.state;
+                        changed = time(NULL);
+                }
+                return s.ok;
+        }
+
+        static int find(const char** names, int count, const string& name) {
+                for (int i = 0; i < count; i++)
+                        if (name == names[i]) return i;
+                return -1;
+        }
+};
+
@@ -0,0 +1,245 @@
+#include <string>
+#include <fstream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <fcntl.h>
+#endif
+
+using std::string;
+
+// Bounds of the time between two reads of a stable state (seconds)
+#define VMTRACKER_MIN_INTERVAL  1.0
+#define VMTRACKER_MAX_INTERVAL  60.0
+
+// Where VBox.log says which process runs the VM
+#define VMTRACKER_PID_TAG       "Process ID: "
+
+// Decides when the state of the VM has to be read from the hypervisor
+// (A showvminfo, a VBoxManage process and a round trip through VBoxSVC).
+//
+// While the VM is running or paused, the state is read again only when
+// something hints at a change: the files of the VM change (the .vbox,
+// the .sav of a saved state, Logs/VBox.log; inotify on GNU/Linux, their
+// times elsewhere), the process of the VM is gone, or the wrapper did
+// something to the VM (reset). Without hints the state is read anyway,
+// at an interval that doubles every time it is found the same, up to
+// max_interval.
+//
+// The places to watch come from the VMInfo of the reads. A driver that
+// doesn't give them (MockDriver) gets every poll read.
+class VMStateTracker {
+public:
+        double min_interval;
+        double max_interval;
+        double interval;                    // Current one
+
+        // Statistics
+        unsigned long reads;                // Polls that read the state
+        unsigned long skipped;              // Polls that kept the last one
+        unsigned long hints;                // Reads caused by a hint
+
+        VMStateTracker() {
+                min_interval = VMTRACKER_MIN_INTERVAL;
+                max_interval = VMTRACKER_MAX_INTERVAL;
+                interval = min_interval;
+                reads = 0;
+                skipped = 0;
+                hints = 0;
+                state = VMSTATE_ERROR;
+                next = 0;
+                forced = true;
+                hinted_since_read = false;
+                pid = 0;
+                inotify_fd = -1;
+        }
+
+        ~VMStateTracker() {
+                unwatch();
+        }
+
+        // Must the state be read now? If not, the last one still holds.
+        bool due() {
+                bool hinted = changed();
+                if (hinted) hints += 1;
+                if (forced || hinted || (paths.empty()) ||
+                    ((state != VMSTATE_RUNNING) && (state != VMSTATE_PAUSED)) ||
+                    (dtime() >= next)) {
+                        reads += 1;
+                        return true;
+                }
+                skipped += 1;
+                return false;
+        }
+
+        // The state was read. ok is false if that failed.
+        void update(const VMInfo& info, bool ok) {
+                forced = false;
+                if (!ok) {
+                        interval = min_interval;
+                        state = VMSTATE_ERROR;
+                        return;
+                }
+
+                // Back off while nothing changes (Other states are read
+                // at every poll)
+                bool stable = (info.state == VMSTATE_RUNNING) || (info.state == VMSTATE_PAUSED);
+                if (stable && (info.state == state) && !hinted_since_read) {
+                        interval = interval * 2;
+                        if (interval > max_interval) interval = max_interval;
+                }
+                else {
+                        interval = min_interval;
+                }
+                hinted_since_read = false;
+                state = info.state;
+                next = dtime() + interval;
+
+                watch(info);
+                pid = 0;
+                if (stable && !log.empty()) pid = read_pid(log);
+        }
+
+        // The wrapper acted on the VM: read the state at the next poll
+        void reset() {
+                forced = true;
+                interval = min_interval;
+        }
+
+private:
+        int state;                          // Last read
+        double next;                        // When to read it anyway
+        bool forced;
+        bool hinted_since_read;
+        long pid;                           // Of the VM process, 0 if unknown
+        string log;                         // VBox.log
+
+        // What is watched, and its times where inotify is not used
+        std::vector<string> folders;
+        std::vector<string> paths;
+        std::vector<time_t> mtimes;
+        std::vector<off_t> sizes;
+        int inotify_fd;
+
+        // Watch the files of the VM given by info, if they are not yet
+        void watch(const VMInfo& info) {
+                std::vector<string> wanted;
+                if (!info.settings.empty()) {
+                        size_t slash = info.settings.find_last_of("/\\");
+                        wanted.push_back((slash == string::npos) ? "." : info.settings.substr(0, slash));
+                }
+                if (!info.snapshots.empty()) wanted.push_back(info.snapshots);
+                if (!info.logs.empty()) wanted.push_back(info.logs);
+                if (wanted == folders) return;
+
+                unwatch();
+                folders = wanted;
+                paths = wanted;
+                log = info.logs.empty() ? "" : info.logs + "/VBox.log";
+
+                #ifdef __linux__
+                inotify_fd = inotify_init();
+                if (inotify_fd >= 0) {
+                        fcntl(inotify_fd, F_SETFL, O_NONBLOCK);
+                        fcntl(inotify_fd, F_SETFD, FD_CLOEXEC);
+                        for (size_t i = 0; i < paths.size(); i++) {
+                                inotify_add_watch(inotify_fd, paths[i].c_str(),
+                                                  IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                                  IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+                        }
+                        return;
+                }
+                #endif
+
+                // Directories change time when their entries do, the log
+                // when it is written
+                if (!log.empty()) paths.push_back(log);
+                if (!info.settings.empty()) paths.push_back(info.settings);
+                mtimes.resize(paths.size());
+                sizes.resize(paths.size());
+                for (size_t i = 0; i < paths.size(); i++) stamp(paths[i], &mtimes[i], &sizes[i]);
+        }
+
+        void unwatch() {
+                #ifdef __linux__
+                if (inotify_fd >= 0) close(inotify_fd);
+                #endif
+                inotify_fd = -1;
+                folders.clear();
+                paths.clear();
+                mtimes.clear();
+                sizes.clear();
+        }
+
+        // Did something hint at a change since the last call?
+        bool changed() {
+                bool hinted = false;
+
+                #ifdef __linux__
+                if (inotify_fd >= 0) {
+                        char buffer[4096];
+                        while (read(inotify_fd, buffer, sizeof(buffer)) > 0) hinted = true;
+                }
+                #endif
+                for (size_t i = 0; i < mtimes.size(); i++) {
+                        time_t mtime;
+                        off_t size;
+                        stamp(paths[i], &mtime, &size);
+                        if ((mtime != mtimes[i]) || (size != sizes[i])) hinted = true;
+                        mtimes[i] = mtime;
+                        sizes[i] = size;
+                }
+                if ((pid > 0) && !alive(pid)) {
+                        pid = 0;
+                        hinted = true;
+                }
+                if (hinted) hinted_since_read = true;
+                return hinted;
+        }
+
+        static void stamp(const string& path, time_t* mtime, off_t* size) {
+                struct stat st;
+                if (stat(path.c_str(), &st) != 0) {
+                        *mtime = 0;
+                        *size = -1;
+                        return;
+                }
+                *mtime = st.st_mtime;
+                *size = st.st_size;
+        }
+
+        // The process that runs the VM, from the head of its log
+        static long read_pid(const string& path) {
+                std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+                if (!f.is_open()) return 0;
+                char head[16384];
+                f.read(head, sizeof(head) - 1);
+                head[f.gcount()] = 0;
+                const char* tag = strstr(head, VMTRACKER_PID_TAG);
+                if (tag == NULL) return 0;
+                return atol(tag + strlen(VMTRACKER_PID_TAG));
+        }
+
+        static bool alive(long pid) {
+                #ifdef _WIN32
+                HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+                if (process == NULL) return (GetLastError() == ERROR_ACCESS_DENIED);
+                bool running = (WaitForSingleObject(process, 0) == WAIT_TIMEOUT);
+                CloseHandle(process);
+                return running;
+                #else
+                return (kill((pid_t)pid, 0) == 0) || (errno == EPERM);
+                #endif
+        }
+};
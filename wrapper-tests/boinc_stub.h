@@ -0,0 +1,89 @@
+// This file is part of the CernVM wrapper, a BOINC wrapper for VirtualBox.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   boinc_stub.h
+// License: GNU General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// The part of the BOINC API that vbox.h uses, so that the VM can be
+// driven without the BOINC libraries.
+//
+// Time is simulated: dtime() returns a clock that only boinc_sleep()
+// moves, so the waits of the wrapper cost nothing. boinc_finish() throws
+// a vmtest_finish instead of leaving the process.
+//
+// -------------------------------------------------------------------
+
+#ifndef BOINC_STUB_H
+#define BOINC_STUB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <zlib.h>
+
+using namespace std;
+
+#define EXIT_ABORTED_BY_CLIENT  203
+
+struct APP_INIT_DATA {
+    char * project_preferences;
+    double fraction_done_start;
+    APP_INIT_DATA() : project_preferences(NULL), fraction_done_start(0) {}
+};
+
+struct BOINC_STATUS {
+    int no_heartbeat;
+    int suspended;
+    int quit_request;
+    int reread_init_data_file;
+    int abort_request;
+};
+
+// What boinc_finish() throws
+struct vmtest_finish {
+    int status;
+    vmtest_finish(int s) : status(s) {}
+};
+
+// The simulated clock (seconds)
+static double vmtest_clock = 1000.0;
+
+inline double dtime() { return vmtest_clock; }
+inline void boinc_sleep(double seconds) { vmtest_clock += seconds; }
+inline void boinc_finish(int status) { throw vmtest_finish(status); }
+inline void boinc_temporary_exit(int, const char * = NULL) { throw vmtest_finish(0); }
+
+inline void boinc_begin_critical_section() {}
+inline void boinc_end_critical_section() {}
+inline int  boinc_get_init_data(APP_INIT_DATA &) { return 0; }
+
+inline int  boinc_getcwd(char * path) { return (getcwd(path, 256) == NULL) ? -1 : 0; }
+inline int  boinc_mkdir(const char * path) { return mkdir(path, 0777); }
+inline int  boinc_rmdir(const char * path) { return rmdir(path); }
+inline int  boinc_delete_file(const char * path) { return unlink(path); }
+
+inline bool parse_double(const char *, const char *, double &) { return false; }
+
+#endif // BOINC_STUB_H
@@ -0,0 +1,291 @@
+// This file is part of the CernVM wrapper, a BOINC wrapper for VirtualBox.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   vmtest.cpp
+// License: GNU General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Tests of the control loop of the wrapper on the mock hypervisor.
+//
+// Every test creates and starts a VM on a MockDriver that runs a script
+// (One of this folder, see MockDriver::load, or steps added in code),
+// polls it the way the wrapper does and checks when and how the wrapper
+// gives up. BOINC is replaced by boinc_stub.h, so neither BOINC nor
+// VirtualBox is needed. The exit code is the number of tests that
+// failed.
+//
+//   vmtest [-v] [-s dir] [test...]
+//
+//   -v       Keep the output of the wrapper
+//   -s dir   Where the scripts are (Default: wrapper-tests)
+//   test     Run only these tests (Default: all of them)
+//
+// -------------------------------------------------------------------
+
+#include "boinc_stub.h"
+#include "../vbox.h"
+
+#include <limits.h>
+#include <math.h>
+
+// Fail the current test if cond doesn't hold
+#define  CHECK(cond) \
+    do { if (!(cond)) { printf("\n    %s:%i: %s\n", __FILE__, __LINE__, #cond); return false; } } while (0)
+
+// Polls after which a test gives up waiting for the wrapper to
+#define  TEST_POLLS     20
+
+static string scriptDir;
+
+//
+// The outcome of a run
+//
+struct vm_run {
+    int finished;           // Status of boinc_finish(), -1 if not called
+    int polls;              // Polls until then
+    double waited;          // Simulated seconds the wrapper slept
+};
+
+//
+// Create and start a VM on a mock hypervisor, then poll it until the
+// wrapper gives up or TEST_POLLS polls went by
+//
+// @param mock      The hypervisor (Its script already loaded)
+// @return          What happened
+//
+static vm_run test_run(MockDriver * mock) {
+    vm_run run;
+    run.finished = -1;
+    run.polls = 0;
+
+    VM vm;
+    vm.virtual_machine_name = "BOINC_VM";
+    delete vm.driver;
+    vm.driver = mock;
+
+    double start = dtime();
+    try {
+        vm.create();
+        vm.start(false, true);
+        while (run.polls < TEST_POLLS) {
+            run.polls++;
+            vm.poll();
+        }
+    }
+    catch (vmtest_finish & f) {
+        run.finished = f.status;
+    }
+    run.waited = dtime() - start;
+
+    unlink("floppy.img");
+    unlink(VM_NAME);
+    return run;
+}
+
+//
+// Load a script of this folder
+//
+static bool test_load(MockDriver * mock, const char * script) {
+    return mock->load((scriptDir + "/" + script).c_str());
+}
+
+//
+// The VM is found powered off at every poll: the wrapper retries every
+// 2 seconds and gives up at the fifth poll
+//
+static bool test_poweroff_loop() {
+    MockDriver * mock = new MockDriver();
+    CHECK(test_load(mock, "poweroff-loop.mock"));
+
+    vm_run run = test_run(mock);
+    CHECK(run.finished == 1);
+    CHECK(run.polls == 5);
+    CHECK(mock->calls[VMOP_POLL] == 5);
+    CHECK(mock->failures[VMOP_POLL] == 0);
+    CHECK(mock->state == VMSTATE_POWEROFF);
+    CHECK(run.waited == 1.5 + 5 * 2);
+    return true;
+}
+
+//
+// Five polls fail in a row: the wrapper waits 5 seconds after each one,
+// then removes the VM and gives up
+//
+static bool test_poll_failures() {
+    MockDriver * mock = new MockDriver();
+    CHECK(test_load(mock, "poll-failures.mock"));
+
+    vm_run run = test_run(mock);
+    CHECK(run.finished == 1);
+    CHECK(run.polls == 5);
+    CHECK(mock->failures[VMOP_POLL] == 5);
+    CHECK(mock->calls[VMOP_REMOVE] == 1);
+    CHECK(mock->state == VMSTATE_NONE);
+    CHECK(fabs(run.waited - 5 * (5 + 0.02)) < 1e-6);
+    return true;
+}
+
+//
+// Four polls fail, then the VM is found running: the errors are
+// forgiven and the wrapper keeps going
+//
+static bool test_poll_recovery() {
+    MockDriver * mock = new MockDriver();
+    for (int i=0; i<4; i++) mock->script(VMOP_POLL, false);
+
+    vm_run run = test_run(mock);
+    CHECK(run.finished == -1);
+    CHECK(run.polls == TEST_POLLS);
+    CHECK(mock->failures[VMOP_POLL] == 4);
+    CHECK(mock->calls[VMOP_REMOVE] == 0);
+    CHECK(mock->state == VMSTATE_RUNNING);
+    return true;
+}
+
+//
+// Check what vbm_parse_vminfo found in showvminfo.txt
+//
+static bool test_vminfo(const VMInfo& info) {
+    CHECK(info.state == VMSTATE_RUNNING);
+    CHECK(info.state_name == "running");
+    CHECK(info.state_change == 1308044487);    // 2011-06-14T09:41:27 UTC
+    CHECK(info.cpus == 1);
+    CHECK(info.memory == 256);
+    CHECK(info.cpu_cap == 60);
+    CHECK(info.settings == "/var/lib/boinc-client/slots/3/VirtualBox VMs/BOINC_VM/BOINC_VM.vbox");
+    CHECK(info.snapshots == "/var/lib/boinc-client/slots/3/VirtualBox VMs/BOINC_VM/Snapshots");
+    CHECK(info.logs == "/var/lib/boinc-client/slots/3/VirtualBox VMs/BOINC_VM/Logs");
+
+    // The empty drives and "IsEjected" are not media
+    CHECK(info.media.size() == 3);
+    CHECK(info.media[0].controller == "IDE Controller");
+    CHECK((info.media[0].port == 0) && (info.media[0].device == 0));
+    CHECK(info.media[0].location == "/var/lib/boinc-client/projects/boinc.example.org/cernvm-2.4.0.vmdk");
+    CHECK(info.media[0].uuid == "6a0e2d9b-1f57-4c3a-8e64-0b9d7a2f5c18");
+    CHECK(info.media[1].controller == "Floppy Controller");
+    CHECK((info.media[1].port == 0) && (info.media[1].device == 0));
+    CHECK(info.media[1].location == "/var/lib/boinc-client/slots/3/floppy.img");
+    CHECK(info.media[1].uuid == "d4c81a07-3e92-4b5f-a6d0-71e2c9f84b36");
+    CHECK(info.media[2].controller == "SATA Controller");
+    CHECK(info.media[2].location == "/var/lib/boinc-client/slots/3/scratch.vdi");
+    CHECK(info.media[2].uuid == "93f7b5e1-c2a4-4d68-b01e-5a8c6d3f2e79");
+    return true;
+}
+
+//
+// The output of showvminfo --machinereadable of a running VM (Captured
+// in showvminfo.txt), as it is and with Windows line endings; without
+// its VMState, it is not the output of a VM
+//
+static bool test_parse_vminfo() {
+    std::ifstream f((scriptDir + "/showvminfo.txt").c_str(), std::ios::in | std::ios::binary);
+    CHECK(f.is_open());
+    string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    CHECK(!text.empty());
+
+    VMInfo info;
+    CHECK(vbm_parse_vminfo(text, &info));
+    CHECK(test_vminfo(info));
+
+    string crlf;
+    for (size_t i=0; i<text.length(); i++) {
+        if (text[i] == '\n') crlf += '\r';
+        crlf += text[i];
+    }
+    CHECK(vbm_parse_vminfo(crlf, &info));
+    CHECK(test_vminfo(info));
+
+    size_t pos = text.find("VMState=");
+    CHECK(pos != string::npos);
+    text.erase(pos, text.find('\n', pos) + 1 - pos);
+    CHECK(!vbm_parse_vminfo(text, &info));
+    CHECK(info.state == VMSTATE_ERROR);
+    CHECK(!vbm_parse_vminfo("", &info));
+    return true;
+}
+
+//
+// The tests
+//
+struct test_case {
+    const char * name;
+    bool (*run)();
+};
+
+static const test_case tests[] = {
+    { "poweroff_loop",      test_poweroff_loop },
+    { "poll_failures",      test_poll_failures },
+    { "poll_recovery",      test_poll_recovery },
+    { "parse_vminfo",       test_parse_vminfo },
+};
+
+//
+// Main application
+//
+int main(int argc, char **argv) {
+    const char * dir = "wrapper-tests";
+    bool verbose = false;
+    int failed = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "vs:")) != -1)
+        switch (c) {
+            case 'v':
+                verbose = true;
+                break;
+            case 's':
+                dir = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: vmtest [-v] [-s dir] [test...]\n");
+                return 2;
+        }
+
+    // The VM leaves its files in the working folder: use one of our own
+    char path[PATH_MAX];
+    if (realpath(dir, path) == NULL) {
+        fprintf(stderr, "ERROR: No scripts in %s\n", dir);
+        return 2;
+    }
+    scriptDir = path;
+    char work[] = "/tmp/vmtest.XXXXXX";
+    if ((mkdtemp(work) == NULL) || (chdir(work) != 0)) {
+        fprintf(stderr, "ERROR: Unable to create a working folder\n");
+        return 2;
+    }
+
+    // The errors the tests provoke would clutter the output
+    if (!verbose) cerr.rdbuf(NULL);
+
+    for (unsigned i=0; i<sizeof(tests)/sizeof(test_case); i++) {
+        bool wanted = (optind >= argc);
+        for (int a=optind; a<argc; a++)
+            if (strcmp(argv[a], tests[i].name) == 0) wanted = true;
+        if (!wanted) continue;
+
+        printf("%-24s ", tests[i].name);
+        fflush(stdout);
+        bool ok = tests[i].run();
+        printf("%s\n", ok ? "ok" : "FAILED");
+        fflush(stdout);
+        if (!ok) failed++;
+    }
+
+    if ((chdir("/") != 0) || (rmdir(work) != 0))
+        fprintf(stderr, "WARNING: %s was left behind\n", work);
+    if (failed > 0) printf("%i tests FAILED\n", failed);
+    return failed;
+}